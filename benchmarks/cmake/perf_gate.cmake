@@ -0,0 +1,194 @@
+# Performance regression gate, run with cmake -P
+#
+# Runs the benchmark executable and compares timings against a baseline JSON file.
+# The fastest repetition is compared by default, it is much less sensitive to
+# interference from other processes than the median.
+#
+#   -DBENCH=<exe>           benchmark executable (bench_cpu)
+#   -DRESULT=<file>         JSON result file written by the benchmark
+#   -DBASELINE=<file>       baseline JSON file
+#   -DFILTER=<regex>        benchmark name filter (default all)
+#   -DTOLERANCE=<fraction>  allowed slowdown, default .25 (25%)
+#   -DSTAT=min|median       compared statistic, default min
+#   -DMIN_TIME=<seconds>    minimal time per repetition, default .2
+#   -DREPS=<n>              timed repetitions, default 5
+#   -DMODE=compare|record   compare against or record the baseline, default compare
+#
+# Benchmarks in the baseline but not in the result are regressions, new benchmarks
+# not in the baseline are reported only. Without a baseline file the comparison is
+# skipped with a message matching "perf_gate: skipped".
+
+cmake_minimum_required(VERSION 3.21)
+
+foreach(var BENCH RESULT BASELINE)
+    if(NOT DEFINED ${var})
+        message(FATAL_ERROR "perf_gate: ${var} not defined")
+    endif()
+endforeach()
+if(NOT DEFINED FILTER OR FILTER STREQUAL "")
+    set(FILTER ".*")
+endif()
+if(NOT DEFINED TOLERANCE)
+    set(TOLERANCE .25)
+endif()
+if(NOT DEFINED STAT)
+    set(STAT min)
+elseif(NOT STAT MATCHES "^(min|median)$")
+    message(FATAL_ERROR "perf_gate: STAT must be min or median, not ${STAT}")
+endif()
+if(NOT DEFINED MIN_TIME)
+    set(MIN_TIME .2)
+endif()
+if(NOT DEFINED REPS)
+    set(REPS 5)
+endif()
+if(NOT DEFINED MODE)
+    set(MODE compare)
+endif()
+
+if(MODE STREQUAL "compare" AND NOT EXISTS ${BASELINE})
+    message("perf_gate: skipped, no baseline ${BASELINE}, record one on this machine with MODE=record (target benchmark_baseline)")
+    return()
+elseif(NOT MODE MATCHES "^(compare|record)$")
+    message(FATAL_ERROR "perf_gate: MODE must be compare or record, not ${MODE}")
+endif()
+
+execute_process(
+    COMMAND ${BENCH} --filter=${FILTER} --min-time=${MIN_TIME} --reps=${REPS} --json=${RESULT}
+    RESULT_VARIABLE bench_status)
+if(NOT bench_status EQUAL 0)
+    message(FATAL_ERROR "perf_gate: ${BENCH} failed (${bench_status})")
+endif()
+
+if(MODE STREQUAL "record")
+    configure_file(${RESULT} ${BASELINE} COPYONLY)
+    message(STATUS "perf_gate: recorded new baseline ${BASELINE}")
+    return()
+endif()
+
+file(READ ${RESULT} result_json)
+file(READ ${BASELINE} baseline_json)
+
+# name -> STAT for all benchmarks in json, as variables <prefix>_<index> and <prefix>_names
+function(read_times json prefix)
+    string(JSON n LENGTH "${json}" benchmarks)
+    set(names "")
+    if(n GREATER 0)
+        math(EXPR last "${n} - 1")
+        foreach(i RANGE ${last})
+            string(JSON name GET "${json}" benchmarks ${i} name)
+            string(JSON t GET "${json}" benchmarks ${i} ${STAT})
+            list(APPEND names "${name}")
+            set(${prefix}_${i} "${t}" PARENT_SCOPE)
+        endforeach()
+    endif()
+    set(${prefix}_names "${names}" PARENT_SCOPE)
+endfunction()
+
+# Number string v, possibly with exponent, as integer millionths, cmake math has integers only
+function(to_micro v out)
+    string(REGEX REPLACE "[eE].*" "" mant "${v}")
+    set(exp 0)
+    if("${v}" MATCHES "[eE]([-+]?[0-9]+)$")
+        set(exp ${CMAKE_MATCH_1})
+    endif()
+    if(NOT "${mant}" MATCHES "^([0-9]*)(\\.([0-9]*))?$")
+        message(FATAL_ERROR "perf_gate: can't parse number ${v}")
+    endif()
+    set(int "${CMAKE_MATCH_1}")
+    set(frac "${CMAKE_MATCH_3}000000")
+    string(SUBSTRING "${frac}" 0 6 frac)
+    if(int STREQUAL "")
+        set(int 0)
+    endif()
+    string(REGEX REPLACE "^0+([0-9])" "\\1" frac "${frac}")
+    math(EXPR micro "${int} * 1000000 + ${frac}")
+    while(exp GREATER 0)
+        math(EXPR micro "${micro} * 10")
+        math(EXPR exp "${exp} - 1")
+    endwhile()
+    while(exp LESS 0)
+        math(EXPR micro "${micro} / 10")
+        math(EXPR exp "${exp} + 1")
+    endwhile()
+    set(${out} ${micro} PARENT_SCOPE)
+endfunction()
+
+# Integer thousandths as decimal string with 3 fractional digits
+function(milli_string milli out)
+    math(EXPR i "${milli} / 1000")
+    math(EXPR f "${milli} % 1000 + 1000")
+    string(SUBSTRING "${f}" 1 3 f)
+    set(${out} "${i}.${f}" PARENT_SCOPE)
+endfunction()
+
+# Time in ns rounded to one fractional digit
+function(format_ns v out)
+    to_micro(${v} micro)
+    math(EXPR tenths "(${micro} + 50000) / 100000")
+    math(EXPR i "${tenths} / 10")
+    math(EXPR f "${tenths} % 10")
+    set(${out} "${i}.${f}" PARENT_SCOPE)
+endfunction()
+
+# a / b as decimal string with 3 fractional digits, and as integer thousandths in <out>_milli
+function(ratio a b out)
+    to_micro(${a} a_micro)
+    to_micro(${b} b_micro)
+    if(b_micro EQUAL 0)
+        set(b_micro 1)
+    endif()
+    math(EXPR r "${a_micro} * 1000 / ${b_micro}")
+    milli_string(${r} r_string)
+    set(${out} "${r_string}" PARENT_SCOPE)
+    set(${out}_milli ${r} PARENT_SCOPE)
+endfunction()
+
+read_times("${result_json}" res)
+read_times("${baseline_json}" base)
+
+ratio(${TOLERANCE} 1 tol)
+math(EXPR limit "1000 + ${tol_milli}")
+math(EXPR faster "1000000 / ${limit}")
+
+set(report "")
+set(regressions 0)
+set(i 0)
+foreach(name IN LISTS base_names)
+    set(base_time ${base_${i}})
+    math(EXPR i "${i} + 1")
+    if(NOT name MATCHES "${FILTER}")
+        continue()
+    endif()
+    list(FIND res_names "${name}" j)
+    if(j LESS 0)
+        string(APPEND report "  MISSING     ${name}\n")
+        math(EXPR regressions "${regressions} + 1")
+        continue()
+    endif()
+    set(res_time ${res_${j}})
+    ratio(${res_time} ${base_time} r)
+    if(r_milli GREATER limit)
+        set(verdict "REGRESSION ")
+        math(EXPR regressions "${regressions} + 1")
+    elseif(r_milli LESS faster)
+        set(verdict "faster     ")
+    else()
+        set(verdict "ok         ")
+    endif()
+    format_ns(${res_time} res_ns)
+    format_ns(${base_time} base_ns)
+    string(APPEND report "  ${verdict} ${name}: ${res_ns} ns (baseline ${base_ns} ns, ratio ${r})\n")
+endforeach()
+foreach(name IN LISTS res_names)
+    list(FIND base_names "${name}" j)
+    if(j LESS 0)
+        string(APPEND report "  new         ${name}\n")
+    endif()
+endforeach()
+
+message("perf_gate: ${STAT} time per iteration against ${BASELINE}, tolerance ${tol}:\n${report}")
+if(regressions GREATER 0)
+    message(FATAL_ERROR "perf_gate: ${regressions} performance regression(s)")
+endif()
+message("perf_gate: no performance regressions")
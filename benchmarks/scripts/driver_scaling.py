@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+# Copyright 2022 Paul Scherrer Institute
+# BSD 3-Clause License, see LICENSE.md at the top level
+# Author: hans-christian.stadler@psi.ch
+
+"""Measure thread scaling of the simple data bulk indexer
+
+Runs the bulk indexer driver for all combinations of worker threads (--ths),
+refinement blocks (--rblks) and indexer objects per gpu (--ipg), and writes
+frames/s, speedup, parallel efficiency and worker idle/spin fractions as CSV.
+
+Strong scaling indexes the same frames for every thread count. Weak scaling
+multiplies the repetitions by the thread count relative to the smallest one,
+so every thread gets the same amount of work. Speedup and efficiency are
+relative to the smallest thread count with equal blocks and indexer objects.
+
+The machine topology is written as JSON next to the CSV file.
+"""
+
+import argparse
+import csv
+import json
+import os
+import platform
+import shlex
+import shutil
+import subprocess
+import sys
+import tempfile
+from pathlib import Path
+
+FIELDS = ["mode", "threads", "rblks", "ipg", "repetitions", "frames", "elapsed",
+          "frames_per_second", "speedup", "efficiency", "busy", "idle", "parked", "spin"]
+
+
+def int_list(text):
+    return [int(v) for v in text.split(",") if v]
+
+
+def read(path, default=""):
+    try:
+        return Path(path).read_text().strip()
+    except OSError:
+        return default
+
+
+def cpu_list(text):
+    """Expand a kernel cpu list like 0-3,8 into a list of cpus"""
+    cpus = []
+    for part in (p for p in text.split(",") if p):
+        lo, _, hi = part.partition("-")
+        cpus.extend(range(int(lo), int(hi or lo) + 1))
+    return cpus
+
+
+def topology():
+    """Machine topology from /proc and /sys, and gpus if nvidia-smi is there"""
+    model = ""
+    for line in read("/proc/cpuinfo").splitlines():
+        if line.startswith("model name"):
+            model = line.partition(":")[2].strip()
+            break
+    cpus = sorted(os.sched_getaffinity(0)) if hasattr(os, "sched_getaffinity") else list(range(os.cpu_count() or 1))
+    cores, packages = set(), set()
+    for cpu in cpus:
+        base = f"/sys/devices/system/cpu/cpu{cpu}/topology"
+        package = read(f"{base}/physical_package_id", "0")
+        cores.add((package, read(f"{base}/core_id", str(cpu))))
+        packages.add(package)
+    nodes = {}
+    for node in sorted(Path("/sys/devices/system/node").glob("node[0-9]*")):
+        nodes[node.name] = cpu_list(read(node / "cpulist"))
+    gpus = []
+    if shutil.which("nvidia-smi"):
+        res = subprocess.run(["nvidia-smi", "--query-gpu=name,pci.bus_id", "--format=csv,noheader"],
+                             capture_output=True, text=True)
+        if res.returncode == 0:
+            gpus = [line.strip() for line in res.stdout.splitlines() if line.strip()]
+    return {
+        "host": platform.node(),
+        "kernel": platform.release(),
+        "cpu_model": model,
+        "online_cpus": os.cpu_count(),
+        "usable_cpus": cpus,
+        "cores": len(cores),
+        "packages": len(packages),
+        "numa_nodes": nodes,
+        "gpus": gpus,
+    }
+
+
+def run_driver(args, threads, rblks, ipg, repetitions):
+    """Run the driver once and return the statistics from its --hist JSON file"""
+    with tempfile.TemporaryDirectory() as tmp:
+        hist = Path(tmp) / "hist.json"
+        cmd = [args.driver, "--quiet", f"--ths={threads}", f"--rblks={rblks}", f"--ipg={ipg}",
+               f"--rep={repetitions}", f"--hist={hist}"] + shlex.split(args.driver_args) + args.files
+        res = subprocess.run(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+        if res.returncode != 0 or not hist.exists():
+            sys.exit(f"driver failed: {' '.join(cmd)}\n{res.stderr}")
+        return json.loads(hist.read_text())
+
+
+def measure(args, mode, threads, rblks, ipg):
+    """Median of several driver runs by frames/s"""
+    repetitions = args.rep
+    if mode == "weak":
+        repetitions = args.rep * threads // min(args.threads)
+    runs = [run_driver(args, threads, rblks, ipg, repetitions) for _ in range(args.samples)]
+    stats = sorted(runs, key=lambda r: r["frames_per_second"])[len(runs) // 2]
+    return {
+        "mode": mode, "threads": threads, "rblks": rblks, "ipg": ipg, "repetitions": repetitions,
+        "frames": stats["frames"], "elapsed": stats["elapsed"],
+        "frames_per_second": stats["frames_per_second"],
+        **{k: stats["workers"][k] for k in ("busy", "idle", "parked", "spin")},
+    }
+
+
+def plot(rows, file_name):
+    """Plot frames/s and efficiency over threads, one line per mode, blocks and indexer objects"""
+    import matplotlib
+    matplotlib.use("Agg")
+    import matplotlib.pyplot as plt
+
+    fig, (ax_rate, ax_eff) = plt.subplots(1, 2, figsize=(12, 5))
+    for key in sorted({(r["mode"], r["rblks"], r["ipg"]) for r in rows}):
+        line = [r for r in rows if (r["mode"], r["rblks"], r["ipg"]) == key]
+        label = f"{key[0]} rblks={key[1]} ipg={key[2]}"
+        ax_rate.plot([r["threads"] for r in line], [r["frames_per_second"] for r in line], "o-", label=label)
+        ax_eff.plot([r["threads"] for r in line], [r["efficiency"] for r in line], "o-", label=label)
+    ax_rate.set(xlabel="worker threads", ylabel="frames/s", xscale="log", yscale="log")
+    ax_eff.set(xlabel="worker threads", ylabel="parallel efficiency", xscale="log", ylim=(0, 1.1))
+    ax_rate.legend(fontsize="small")
+    fig.tight_layout()
+    fig.savefig(file_name)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("files", nargs="+", help="simple data files")
+    parser.add_argument("--driver", default="simple-data-bulk-indexer", help="bulk indexer driver executable")
+    parser.add_argument("--driver-args", default="--method=ifss", help="additional driver arguments")
+    parser.add_argument("--threads", type=int_list, default="1,2,4,8", help="comma separated worker thread counts")
+    parser.add_argument("--rblks", type=int_list, default="1", help="comma separated refinement block counts")
+    parser.add_argument("--ipg", type=int_list, default="1", help="comma separated indexer objects per gpu")
+    parser.add_argument("--rep", type=int, default=10, help="repetitions of the files for the smallest thread count")
+    parser.add_argument("--mode", choices=["strong", "weak", "both"], default="both", help="scaling mode")
+    parser.add_argument("--samples", type=int, default=3, help="driver runs per configuration, the median is reported")
+    parser.add_argument("--csv", default="scaling.csv", help="CSV output file")
+    parser.add_argument("--plot", help="also plot to this image file (needs matplotlib)")
+    args = parser.parse_args()
+    if args.plot:
+        try:
+            import matplotlib  # noqa: F401
+        except ImportError:
+            sys.exit("--plot needs matplotlib")
+
+    topo = topology()
+    topo_file = Path(args.csv).with_suffix(".topology.json")
+    topo_file.write_text(json.dumps(topo, indent=1) + "\n")
+
+    rows = []
+    modes = ["strong", "weak"] if args.mode == "both" else [args.mode]
+    print(f"{'mode':>6} {'ths':>4} {'rblks':>5} {'ipg':>4} {'frames/s':>10} {'speedup':>8} {'eff':>6} {'idle':>6} {'spin':>6}")
+    for mode in modes:
+        for ipg in args.ipg:
+            for rblks in args.rblks:
+                base = None
+                for threads in sorted(args.threads):
+                    if rblks > threads:
+                        continue    # the driver needs at least one thread per refinement block
+                    row = measure(args, mode, threads, rblks, ipg)
+                    base = base or (threads, row["frames_per_second"])
+                    row["speedup"] = round(row["frames_per_second"] / base[1], 4)
+                    row["efficiency"] = round(row["speedup"] * base[0] / threads, 4)
+                    rows.append(row)
+                    print(f"{mode:>6} {threads:>4} {rblks:>5} {ipg:>4} {row['frames_per_second']:>10.1f} "
+                          f"{row['speedup']:>8.2f} {row['efficiency']:>6.2f} {row['idle']:>6.2f} {row['spin']:>6.3f}", flush=True)
+
+    with open(args.csv, "w", newline="") as out:
+        writer = csv.DictWriter(out, fieldnames=FIELDS)
+        writer.writeheader()
+        writer.writerows(rows)
+    print(f"results in {args.csv}, topology in {topo_file}")
+
+    if args.plot:
+        plot(rows, args.plot)
+        print(f"plot in {args.plot}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,453 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+// CPU hot path microbenchmarks
+//
+// Covers simple data parsing, ifss/ifse refinement, crystal separation, cell viability,
+// cell similarity, candidate vector groups, the bulk indexer scheduler queues and
+// the logger. Refinement and crystal benchmarks run on synthetic frames with a known
+// lattice, parsing and candidate groups also on the simple data files.
+
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+#include <Eigen/Dense>
+#include "ffbidx/refine.h"
+#include "ffbidx/cand_groups.h"
+#include "ffbidx/mpmc_queue.h"
+#include "ffbidx/scheduler.h"
+#include "ffbidx/log.h"
+#include "ffbidx/simple_data.h"
+#include "harness.h"
+
+#ifndef BENCH_DATA_DIR
+    #define BENCH_DATA_DIR "data/simple/files"
+#endif
+
+namespace {
+    using M3 = Eigen::Matrix3<float>;
+    using Mx3 = Eigen::MatrixX3<float>;
+    using Vx = Eigen::VectorX<float>;
+    using SimpleData = simple_data::SimpleData<float, simple_data::raise>;
+    namespace refine = fast_feedback::refine;
+    namespace logger = fast_feedback::logger;
+
+    std::string data_dir{BENCH_DATA_DIR};   // simple data files directory
+    std::string json_file{};                // JSON output file
+    bool hw_counters = false;               // read hardware performance counters
+
+    constexpr const char* data_files[] = { "image0_local.txt", "image0_peakfinder8.txt", "image0_radial.txt" };
+
+    // Synthetic frame: lattice spots with gaussian noise and a fraction of random outliers
+    // The cell has real space vectors of length 40, 60, 80 as rows in a random orientation.
+    struct frame final {
+        M3 cell;
+        Mx3 spots;
+    };
+
+    frame synthetic_frame (unsigned n_spots, std::mt19937& rng, float noise=.001f, float outliers=.1f)
+    {
+        std::uniform_int_distribution<int> hkl{-8, 8};
+        std::uniform_real_distribution<float> uniform{.0f, 1.f};
+        std::uniform_real_distribution<float> box{-.25f, .25f};
+        std::normal_distribution<float> gauss{.0f, noise};
+
+        const Eigen::Quaternion<float> q = Eigen::Quaternion<float>{uniform(rng) - .5f, uniform(rng) - .5f, uniform(rng) - .5f, uniform(rng) - .5f}.normalized();
+        frame f{M3{Eigen::Vector3f{40.f, 60.f, 80.f}.asDiagonal()} * q.toRotationMatrix().transpose(), Mx3{n_spots, 3u}};
+        const M3 recip = f.cell.inverse();  // columns are the reciprocal basis vectors
+        for (unsigned i=0u; i<n_spots; i++) {
+            if (uniform(rng) < outliers) {
+                f.spots.row(i) << box(rng), box(rng), box(rng);
+            } else {
+                Eigen::Vector3f m;
+                do {
+                    m << hkl(rng), hkl(rng), hkl(rng);
+                } while (m.isZero());
+                f.spots.row(i) = (recip * m).transpose() + Eigen::RowVector3f{gauss(rng), gauss(rng), gauss(rng)};
+            }
+        }
+        return f;
+    }
+
+    // Fill cells [first..first+n[ with slightly distorted copies of cell, scores like the raw indexer would give
+    void distorted_cells (Mx3& cells, Vx& scores, const M3& cell, unsigned first, unsigned n, std::mt19937& rng)
+    {
+        std::normal_distribution<float> gauss{.0f, .003f};
+        for (unsigned j=first; j<first+n; j++) {
+            M3 d = M3::Identity();
+            for (unsigned k=0u; k<9u; k++)
+                d(k / 3u, k % 3u) += gauss(rng);
+            cells.block(3u * j, 0u, 3u, 3u) = cell * d;
+            scores(j) = -10.f + .2f;    // threshold part .2
+        }
+    }
+
+    // Stream buffer dropping all output
+    struct null_buffer final : public std::streambuf {
+        inline int overflow (int c) override { return c; }
+        inline std::streamsize xsputn (const char*, std::streamsize n) override { return n; }
+    };
+
+    void bench_simple_data (bench::runner& run)
+    {
+        for (const auto name : data_files) {
+            const std::string file = data_dir + '/' + name;
+            const std::size_t n_spots = SimpleData{file}.spots.size();
+            run.run(std::string{"simple_data/parse/"} + name, n_spots, [&file](std::uint64_t n) {
+                for (std::uint64_t i=0u; i<n; i++) {
+                    SimpleData data{file};
+                    bench::do_not_optimize(data.spots.data());
+                }
+            });
+        }
+    }
+
+    template <typename refine_indexer, typename config>
+    void bench_refine (bench::runner& run, const std::string& method, const config& conf)
+    {
+        std::mt19937 rng{42u};
+        for (unsigned n_spots : {64u, 256u, 1024u}) {
+            frame f = synthetic_frame(n_spots, rng);
+            for (unsigned n_cells : {1u, 16u}) {
+                Mx3 cells0{3u * n_cells, 3u};
+                Vx scores0{n_cells};
+                distorted_cells(cells0, scores0, f.cell, 0u, n_cells, rng);
+                Mx3 cells{3u * n_cells, 3u};
+                Vx scores{n_cells};
+                const std::string name = "refine/" + method + "/spots=" + std::to_string(n_spots) + "/cells=" + std::to_string(n_cells);
+                run.run(name, n_cells, [&](std::uint64_t n) {
+                    for (std::uint64_t i=0u; i<n; i++) {
+                        cells = cells0;
+                        scores = scores0;
+                        refine_indexer::refine(f.spots, cells, scores, conf);
+                        bench::do_not_optimize(scores.data());
+                    }
+                });
+            }
+        }
+    }
+
+    void bench_crystalls (bench::runner& run)
+    {
+        std::mt19937 rng{43u};
+        for (unsigned n_spots : {64u, 256u, 1024u}) {
+            const frame a = synthetic_frame(n_spots / 2u, rng);
+            const frame b = synthetic_frame(n_spots - n_spots / 2u, rng);
+            Mx3 spots{n_spots, 3u};
+            spots << a.spots, b.spots;
+            for (unsigned n_cells : {2u, 32u}) {    // two crystalls
+                Mx3 cells{3u * n_cells, 3u};
+                Vx scores{n_cells};
+                distorted_cells(cells, scores, a.cell, 0u, n_cells / 2u, rng);
+                distorted_cells(cells, scores, b.cell, n_cells / 2u, n_cells - n_cells / 2u, rng);
+                const std::string name = "compute_crystalls/spots=" + std::to_string(n_spots) + "/cells=" + std::to_string(n_cells);
+                run.run(name, n_cells, [&](std::uint64_t n) {
+                    for (std::uint64_t i=0u; i<n; i++) {
+                        auto crystalls = refine::compute_crystalls(cells, spots, scores);
+                        bench::do_not_optimize(crystalls.data());
+                    }
+                });
+            }
+        }
+    }
+
+    void bench_cell_checks (bench::runner& run)
+    {
+        std::mt19937 rng{44u};
+        for (unsigned n_spots : {64u, 256u, 1024u}) {
+            const frame f = synthetic_frame(n_spots, rng);
+            run.run("is_viable_cell/spots=" + std::to_string(n_spots), 1., [&f](std::uint64_t n) {
+                for (std::uint64_t i=0u; i<n; i++) {
+                    bool viable = refine::is_viable_cell(f.cell, f.spots);
+                    bench::do_not_optimize(viable);
+                }
+            });
+        }
+        const frame a = synthetic_frame(1u, rng);
+        const frame b = synthetic_frame(1u, rng);
+        run.run("cell_similarity", 1., [&a, &b](std::uint64_t n) {
+            for (std::uint64_t i=0u; i<n; i++) {
+                float s = refine::cell_similarity(a.cell, b.cell);
+                bench::do_not_optimize(s);
+            }
+        });
+    }
+
+    void bench_cand_groups (bench::runner& run)
+    {
+        std::mt19937 rng{45u};
+        std::normal_distribution<float> gauss{.0f, .5f};
+        const fast_feedback::config_runtime<float> crt{};
+        auto bench_cells = [&run, &crt](const std::string& name, Mx3& icells) {
+            const unsigned n_cells = icells.rows() / 3u;
+            std::vector<unsigned> cand_idx(3u * n_cells);
+            std::vector<float> cand_len(3u * n_cells);
+            std::vector<unsigned> cell_vec(n_cells);
+            std::vector<unsigned> vec_cand(n_cells);
+            const fast_feedback::input<float> in{{&icells(0,0), &icells(0,1), &icells(0,2)}, {nullptr, nullptr, nullptr}, n_cells, 0u, false, false};
+            run.run(name, n_cells, [&](std::uint64_t n) {
+                for (std::uint64_t i=0u; i<n; i++) {
+                    std::fill(std::begin(cand_len), std::end(cand_len), .0f);
+                    unsigned n_groups = gpu::calc_cand_groups(cand_idx, cand_len, in, crt, n_cells);
+                    n_groups += gpu::calc_cell_cand(cell_vec, vec_cand, cand_idx, n_cells);
+                    bench::do_not_optimize(n_groups);
+                }
+            });
+        };
+        {
+            const SimpleData data{data_dir + '/' + data_files[0]};
+            Mx3 icells{3u, 3u};
+            for (unsigned i=0u; i<3u; i++)
+                icells.row(i) << data.unit_cell[i].x, data.unit_cell[i].y, data.unit_cell[i].z;
+            bench_cells(std::string{"calc_cand_groups/file="} + data_files[0], icells);
+        }
+        for (unsigned n_cells : {4u, 16u}) {
+            Mx3 icells{3u * n_cells, 3u};
+            for (unsigned j=0u; j<n_cells; j++) {
+                const frame f = synthetic_frame(1u, rng);
+                icells.block(3u * j, 0u, 3u, 3u) = f.cell * (1.f + gauss(rng) * .01f);
+            }
+            bench_cells("calc_cand_groups/cells=" + std::to_string(n_cells), icells);
+        }
+    }
+
+    void bench_queues (bench::runner& run)
+    {
+        {
+            fast_feedback::scheduler::mpmc_queue<int> q{1024u};
+            run.run("queue/mpmc_queue/push_pop", 1., [&q](std::uint64_t n) {
+                int item = 0;
+                for (std::uint64_t i=0u; i<n; i++) {
+                    q.push(item);
+                    q.try_pop(item);
+                }
+                bench::do_not_optimize(item);
+            });
+        }
+        {
+            fast_feedback::scheduler::work_stealing s{4u};
+            run.run("queue/work_stealing/push_pop_local", 1., [&s](std::uint64_t n) {
+                int item = 0;
+                for (std::uint64_t i=0u; i<n; i++) {
+                    s.push(item, 0u);
+                    item = s.try_pop(0u);
+                }
+                bench::do_not_optimize(item);
+            });
+            run.run("queue/work_stealing/push_pop_injected", 1., [&s](std::uint64_t n) {
+                int item = 0;
+                for (std::uint64_t i=0u; i<n; i++) {
+                    s.push(item);
+                    item = s.try_pop(1u);
+                }
+                bench::do_not_optimize(item);
+            });
+            run.run("queue/work_stealing/push_pop_stolen", 1., [&s](std::uint64_t n) {
+                int item = 0;
+                for (std::uint64_t i=0u; i<n; i++) {
+                    s.push(item, 0u);
+                    item = s.try_pop(3u);
+                }
+                bench::do_not_optimize(item);
+            });
+        }
+    }
+
+    void bench_logger (bench::runner& run)
+    {
+        const unsigned level = logger::level.load();
+        auto log_line = [](std::uint64_t n) {
+            for (std::uint64_t i=0u; i<n; i++)
+                logger::debug << logger::stanza << "iteration " << i << ", value " << 1.5f << '\n';
+        };
+        auto log_block = [](std::uint64_t n) {
+            for (std::uint64_t i=0u; i<n; i++) {
+                LOG_START(logger::l_debug) {
+                    logger::debug << logger::stanza << "iteration " << i << ", value " << 1.5f << '\n';
+                } LOG_END;
+            }
+        };
+        logger::level.store(logger::l_error);
+        run.run("logger/inactive/line", 1., log_line);
+        run.run("logger/inactive/block", 1., log_block);
+        null_buffer null{};
+        std::streambuf* clog_buffer = std::clog.rdbuf(&null);
+        logger::level.store(logger::l_debug);
+        run.run("logger/active/line", 1., log_line);
+        run.run("logger/active/block", 1., log_block);
+        std::clog.rdbuf(clog_buffer);
+        logger::level.store(level);
+    }
+
+    // Escape string for JSON
+    std::string json_string (const std::string& s)
+    {
+        std::ostringstream oss;
+        oss << '"';
+        for (char c : s) {
+            if ((c == '"') || (c == '\\'))
+                oss << '\\';
+            oss << c;
+        }
+        oss << '"';
+        return oss.str();
+    }
+
+    [[noreturn]] void usage (const char* prog, int status)
+    {
+        (status ? std::cerr : std::cout)
+            << "usage: " << prog << " [options]\n\n"
+            << "  Run CPU hot path microbenchmarks. options:\n"
+            << "  --help         show this help\n"
+            << "  --list         list benchmark names\n"
+            << "  --filter       run benchmarks with names matching this regular expression\n"
+            << "  --json         write results as JSON to this file\n"
+            << "  --min-time     minimal time per repetition in seconds (default .1)\n"
+            << "  --reps         number of timed repetitions (default 5)\n"
+            << "  --data         simple data files directory (default " BENCH_DATA_DIR ")\n"
+            << "  --counters     read hardware performance counters, report IPC and counts per iteration and item\n";
+        std::exit(status);
+    }
+
+    template <typename T>
+    void parse_val (T& val, const char* arg, const char* name)
+    {
+        std::istringstream iss{arg};
+        iss >> val;
+        if (! iss)
+            throw std::invalid_argument(std::string{"invalid value for --"} + name + ": " + arg);
+    }
+
+    void argparse (int argc, char* argv[], bench::runner& run)
+    {
+        constexpr static option opts[] = {
+            { "help",     0, nullptr, 0},
+            { "list",     0, nullptr, 1},
+            { "filter",   1, nullptr, 2},
+            { "json",     1, nullptr, 3},
+            { "min-time", 1, nullptr, 4},
+            { "reps",     1, nullptr, 5},
+            { "data",     1, nullptr, 6},
+            { "counters", 0, nullptr, 7},
+            { nullptr,    0, nullptr, 0}
+        };
+        int oidx;
+        do {
+            switch (getopt_long(argc, argv, "", opts, &oidx)) {
+                case -1:
+                    if (optind < argc)
+                        usage(argv[0], 1);
+                    return;
+                case 0:
+                    usage(argv[0], 0);
+                case 1:
+                    run.list_only = true; break;
+                case 2:
+                    run.filter = std::regex{optarg}; break;
+                case 3:
+                    json_file = optarg; break;
+                case 4:
+                    parse_val(run.min_time, optarg, "min-time"); break;
+                case 5:
+                    parse_val(run.repetitions, optarg, "reps");
+                    if (run.repetitions == 0u)
+                        throw std::invalid_argument("--reps must be positive");
+                    break;
+                case 6:
+                    data_dir = optarg; break;
+                case 7:
+                    hw_counters = true; break;
+                default:
+                    usage(argv[0], 1);
+            }
+        } while (true);
+    }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+    try {
+        bench::runner run{};
+        argparse(argc, argv, run);
+        run.progress = &std::cout;
+
+        std::unique_ptr<bench::perf::thread_counters> counters;
+        if (hw_counters && ! run.list_only) {
+            counters.reset(new bench::perf::thread_counters{});
+            if (! counters->available())
+                throw std::runtime_error("no hardware performance counters, check /proc/sys/kernel/perf_event_paranoid");
+            run.counters = counters.get();
+        }
+
+        if (! run.list_only) {
+            std::cout << std::left << std::setw(48) << "benchmark" << std::right
+                      << std::setw(17) << "median" << std::setw(17) << "min" << std::setw(12) << "iterations";
+            if (counters && (counters->counted() & (1u << bench::perf::cycles)))
+                std::cout << std::setw(8) << "IPC";
+            std::cout << '\n';
+        }
+
+        bench_simple_data(run);
+        bench_refine<refine::indexer_ifss<float>>(run, "ifss", refine::config_ifss<float>{});
+        bench_refine<refine::indexer_ifse<float>>(run, "ifse", refine::config_ifse<float>{});
+        bench_crystalls(run);
+        bench_cell_checks(run);
+        bench_cand_groups(run);
+        bench_queues(run);
+        bench_logger(run);
+
+        if (! json_file.empty()) {
+            std::ofstream out{json_file};
+            if (! out)
+                throw std::invalid_argument("unable to open file " + json_file);
+            std::ostringstream context;
+            context << "\"executable\": " << json_string(argv[0])
+                    << ", \"data_dir\": " << json_string(data_dir)
+                    << ", \"hardware_concurrency\": " << std::thread::hardware_concurrency()
+                    << ", \"min_time\": " << run.min_time << ", \"repetitions\": " << run.repetitions
+#ifdef NDEBUG
+                    << ", \"build\": \"release\"";
+#else
+                    << ", \"build\": \"debug\"";
+#endif
+            run.write_json(out, context.str());
+            if (! out)
+                throw std::runtime_error("unable to write file " + json_file);
+        }
+    } catch (std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,206 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#ifndef FFBIDX_BENCH_HARNESS_H
+#define FFBIDX_BENCH_HARNESS_H
+
+// Small microbenchmark harness
+//
+// A benchmark body runs a given number of iterations. The harness first finds an
+// iteration count that takes at least min_time seconds, then times several
+// repetitions with that count and reports nanoseconds per iteration.
+// With hardware counters, counts of the calling thread are taken around the
+// timed repetitions and reported per iteration and per item.
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <ostream>
+#include <regex>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include "ffbidx/perf_counters.h"
+
+namespace bench {
+
+    // Keep the compiler from optimizing value away
+    template <typename T>
+    inline void do_not_optimize (const T& value) noexcept
+    {
+        asm volatile("" : : "r,m"(value) : "memory");
+    }
+
+    // Force memory writes to happen
+    inline void clobber () noexcept
+    {
+        asm volatile("" : : : "memory");
+    }
+
+    // Benchmark body, runs n iterations
+    using body_type = std::function<void(std::uint64_t n)>;
+
+    namespace perf = fast_feedback::perf_counters;
+
+    struct result final {
+        std::string name;
+        std::uint64_t iterations;       // iterations per repetition
+        double items;                   // items processed per iteration
+        std::vector<double> ns;         // nanoseconds per iteration for every repetition
+        perf::values counters{};        // hardware counts over all repetitions
+
+        // Hardware count of event per iteration
+        inline double per_iteration (perf::event e) const
+        { return (double)counters[e] / (iterations * ns.size()); }
+
+        inline double min () const
+        { return *std::min_element(std::cbegin(ns), std::cend(ns)); }
+
+        inline double max () const
+        { return *std::max_element(std::cbegin(ns), std::cend(ns)); }
+
+        inline double mean () const
+        { return std::accumulate(std::cbegin(ns), std::cend(ns), .0) / ns.size(); }
+
+        inline double median () const
+        {
+            std::vector<double> v{ns};
+            std::sort(std::begin(v), std::end(v));
+            const std::size_t m = v.size() / 2u;
+            return (v.size() % 2u) ? v[m] : .5 * (v[m - 1u] + v[m]);
+        }
+    };
+
+    class runner final {
+        using clock = std::chrono::steady_clock;
+        using duration = std::chrono::duration<double>;
+
+        std::vector<result> results;
+
+        // Time n iterations of body, add hardware counts to hw if counters are on
+        inline double time (const body_type& body, std::uint64_t n, perf::values& hw) const
+        {
+            const perf::values c0 = (counters != nullptr) ? counters->read() : perf::values{};
+            const auto t0 = clock::now();
+            body(n);
+            const auto t1 = clock::now();
+            if (counters != nullptr)
+                hw += counters->read() - c0;
+            return duration{t1 - t0}.count();
+        }
+
+      public:
+        double min_time = .1;           // minimal seconds per repetition
+        unsigned repetitions = 5u;      // timed repetitions
+        std::regex filter{".*"};        // run benchmarks with matching names only
+        bool list_only = false;         // only print names
+        std::ostream* progress = nullptr; // print a line per benchmark here
+        const perf::thread_counters* counters = nullptr; // hardware counters of the running thread, or none
+
+        // Run benchmark name, items is the number of items processed per iteration
+        inline void run (const std::string& name, double items, const body_type& body)
+        {
+            if (! std::regex_search(name, filter))
+                return;
+            if (list_only) {
+                if (progress != nullptr)
+                    *progress << name << '\n';
+                return;
+            }
+
+            std::uint64_t n = 1u;       // calibrate iteration count
+            perf::values hw{};
+            double t = time(body, n, hw);
+            while (t < min_time) {
+                const double f = (t > min_time * 1e-3) ? 1.2 * min_time / t : 1e3;
+                n = std::max(n + 1u, (std::uint64_t)(n * std::min(f, 1e3)));
+                hw = perf::values{};
+                t = time(body, n, hw);
+            }
+
+            result res{name, n, items, {}, hw};
+            res.ns.push_back(t * 1e9 / n);
+            for (unsigned r=1u; r<repetitions; r++)
+                res.ns.push_back(time(body, n, res.counters) * 1e9 / n);
+
+            if (progress != nullptr) {
+                const auto flags = progress->flags();
+                const auto prec = progress->precision(1);
+                *progress << std::left << std::setw(48) << name << std::right << std::fixed
+                          << std::setw(14) << res.median() << " ns" << std::setw(14) << res.min() << " ns"
+                          << std::setw(12) << n;
+                if (res.counters.has(perf::cycles))
+                    *progress << std::setprecision(2) << std::setw(8) << res.counters.ipc();
+                *progress << '\n';
+                progress->precision(prec);
+                progress->flags(flags);
+            }
+            results.push_back(std::move(res));
+        }
+
+        inline const std::vector<result>& get_results () const noexcept
+        { return results; }
+
+        // Write results as JSON, context is a list of "key": value pairs
+        inline void write_json (std::ostream& out, const std::string& context) const
+        {
+            const auto prec = out.precision(6);
+            out << "{\"context\": {" << context << "},\n\"benchmarks\": [";
+            for (std::size_t i=0u; i<results.size(); i++) {
+                const auto& r = results[i];
+                out << (i ? ",\n  " : "\n  ")
+                    << "{\"name\": \"" << r.name << "\", \"iterations\": " << r.iterations
+                    << ", \"repetitions\": " << r.ns.size() << ", \"unit\": \"ns\""
+                    << ", \"median\": " << r.median() << ", \"mean\": " << r.mean()
+                    << ", \"min\": " << r.min() << ", \"max\": " << r.max()
+                    << ", \"items_per_second\": " << (r.items * 1e9 / r.median());
+                if (r.counters.valid != 0u) {
+                    out << ", \"counters\": {\"ipc\": " << r.counters.ipc();
+                    for (unsigned e=0u; e<perf::count; e++) {
+                        if (r.counters.has((perf::event)e))
+                            out << ", \"" << perf::name[e] << "\": " << r.per_iteration((perf::event)e);
+                    }
+                    out << ", \"per_item\": {";
+                    const char* sep = "";
+                    for (unsigned e=perf::l1d_misses; e<perf::count; e++) {
+                        if (r.counters.has((perf::event)e)) {
+                            out << sep << '"' << perf::name[e] << "\": " << (r.per_iteration((perf::event)e) / r.items);
+                            sep = ", ";
+                        }
+                    }
+                    out << "}}";
+                }
+                out << '}';
+            }
+            out << "\n]}\n";
+            out.precision(prec);
+        }
+    };
+
+} // namespace bench
+
+#endif // FFBIDX_BENCH_HARNESS_H
@@ -0,0 +1,301 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#ifndef SIMPLE_DATA_GENERATOR_H
+#define SIMPLE_DATA_GENERATOR_H
+
+// Generate synthetic simple data frames
+//
+// A frame contains spots of one or more lattices with the same real space cell in random
+// orientations, plus outliers. Lattice spots are reciprocal lattice points within the
+// resolution limit, picked uniformly at random after dropping missing reflections, and
+// moved by gaussian noise. Outliers are uniformly distributed within the resolution limit.
+// The random number generation is implemented here, so a seed gives the same frame
+// with every compiler and standard library.
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <random>
+#include <vector>
+#include "ffbidx/simple_data.h"
+
+namespace simple_data {
+
+    // synthetic frame parameters
+    template <typename float_type>
+    struct generator_config final {
+        std::array<Coord<float_type>, 3> cell;  // real space cell vectors a, b, c
+        unsigned n_spots = 300u;                // number of spots including outliers, 0 for all lattice points in resolution
+        float_type resolution = 2.;             // resolution limit d_min, spots have length <= 1/d_min
+        float_type noise = .0;                  // standard deviation of gaussian spot position noise per coordinate
+        float_type outliers = .0;               // fraction of outlier spots, unused if n_spots == 0
+        unsigned n_lattices = 1u;               // number of lattices
+        float_type missing = .0;                // probability of a missing reflection
+        std::uint64_t seed = 0u;                // random number generator seed
+    };
+
+    // synthetic frame with ground truth
+    template <typename float_type, typename error_function=stop>
+    struct generated_frame final {
+        SimpleData<float_type, error_function> data;            // input cell and spots
+        std::vector<std::array<Coord<float_type>, 3>> lattices; // oriented real space cell vectors per lattice
+        std::vector<std::array<float_type, 9>> rotations;       // rotation matrix per lattice, row major, lattice = rotation * cell
+        std::vector<int> spot_lattice;                          // lattice of every spot, -1 for outliers
+    };
+
+    namespace generator {
+
+        using rng_type = std::mt19937_64;
+
+        // uniform in [0, 1[
+        template <typename float_type>
+        inline float_type uniform (rng_type& rng)
+        {
+            return (float_type)((rng() >> 11) * 0x1.0p-53);
+        }
+
+        // standard normal distribution, Box-Muller
+        template <typename float_type>
+        inline float_type gaussian (rng_type& rng)
+        {
+            constexpr double pi2 = 6.2831853071795864769257;
+            const double u = 1. - (rng() >> 11) * 0x1.0p-53;    // ]0, 1]
+            const double v = (rng() >> 11) * 0x1.0p-53;
+            return (float_type)(std::sqrt(-2. * std::log(u)) * std::cos(pi2 * v));
+        }
+
+        // uniform in [0, n[
+        inline std::uint64_t below (rng_type& rng, std::uint64_t n)
+        {
+            return (std::uint64_t)(((unsigned __int128)rng() * n) >> 64);
+        }
+
+        using mat3 = std::array<double, 9>; // row major 3x3 matrix
+
+        // uniformly distributed random rotation, from a normalized random quaternion
+        inline mat3 random_rotation (rng_type& rng)
+        {
+            double q[4];
+            double norm;
+            do {
+                norm = .0;
+                for (auto& e : q) {
+                    e = gaussian<double>(rng);
+                    norm += e * e;
+                }
+            } while (norm < 1e-12);
+            norm = std::sqrt(norm);
+            const double w = q[0] / norm, x = q[1] / norm, y = q[2] / norm, z = q[3] / norm;
+            return mat3{
+                1. - 2. * (y*y + z*z), 2. * (x*y - z*w),      2. * (x*z + y*w),
+                2. * (x*y + z*w),      1. - 2. * (x*x + z*z), 2. * (y*z - x*w),
+                2. * (x*z - y*w),      2. * (y*z + x*w),      1. - 2. * (x*x + y*y)
+            };
+        }
+
+        // inverse of a 3x3 matrix
+        template <typename error_function>
+        inline mat3 inverse (const mat3& m, error_function& error)
+        {
+            const double c00 = m[4]*m[8] - m[5]*m[7];
+            const double c01 = m[5]*m[6] - m[3]*m[8];
+            const double c02 = m[3]*m[7] - m[4]*m[6];
+            const double det = m[0]*c00 + m[1]*c01 + m[2]*c02;
+            if (std::abs(det) < 1e-12)
+                error("singular cell");
+            const double f = 1. / det;
+            return mat3{
+                c00 * f, (m[2]*m[7] - m[1]*m[8]) * f, (m[1]*m[5] - m[2]*m[4]) * f,
+                c01 * f, (m[0]*m[8] - m[2]*m[6]) * f, (m[2]*m[3] - m[0]*m[5]) * f,
+                c02 * f, (m[1]*m[6] - m[0]*m[7]) * f, (m[0]*m[4] - m[1]*m[3]) * f
+            };
+        }
+
+        // reflections of one lattice
+        // cell: real space vectors as rows, returns n reciprocal lattice points (all if n == 0)
+        // within resolution, each present with probability 1 - missing, picked by reservoir sampling
+        template <typename float_type, typename error_function>
+        std::vector<std::array<double, 3>> reflections (const mat3& cell, unsigned n, float_type resolution, float_type missing,
+                                                         rng_type& rng, error_function& error)
+        {
+            const mat3 recip = inverse(cell, error);    // columns are the reciprocal basis vectors
+            const double smax = 1. / resolution;
+            int hmax[3];                                // |h_i| = |s . cell_i| <= smax * |cell_i|
+            for (unsigned i=0u; i<3u; i++)
+                hmax[i] = (int)(smax * std::sqrt(cell[3*i]*cell[3*i] + cell[3*i+1]*cell[3*i+1] + cell[3*i+2]*cell[3*i+2]));
+
+            std::vector<std::array<double, 3>> points;
+            std::uint64_t seen = 0u;
+            for (int h=-hmax[0]; h<=hmax[0]; h++) {
+                for (int k=-hmax[1]; k<=hmax[1]; k++) {
+                    for (int l=-hmax[2]; l<=hmax[2]; l++) {
+                        if ((h == 0) && (k == 0) && (l == 0))
+                            continue;
+                        const std::array<double, 3> s{
+                            recip[0]*h + recip[1]*k + recip[2]*l,
+                            recip[3]*h + recip[4]*k + recip[5]*l,
+                            recip[6]*h + recip[7]*k + recip[8]*l
+                        };
+                        if (s[0]*s[0] + s[1]*s[1] + s[2]*s[2] > smax * smax)
+                            continue;
+                        if ((missing > float_type{.0}) && (uniform<float_type>(rng) < missing))
+                            continue;
+                        if ((n == 0u) || (points.size() < n)) {
+                            points.push_back(s);
+                        } else {
+                            const std::uint64_t j = below(rng, seen + 1u);
+                            if (j < n)
+                                points[j] = s;
+                        }
+                        seen++;
+                    }
+                }
+            }
+            return points;
+        }
+
+    } // namespace generator
+
+    // generate a synthetic frame
+    // the frame gets fewer spots than requested if a lattice has too few reflections
+    template <typename float_type, typename error_function=stop>
+    generated_frame<float_type, error_function> generate (const generator_config<float_type>& conf)
+    {
+        using namespace generator;
+        generated_frame<float_type, error_function> frame{};
+        error_function& error = frame.data.error;
+
+        if (conf.n_lattices == 0u)
+            error("no lattices");
+        if (conf.resolution <= float_type{.0})
+            error("nonpositive resolution");
+        if ((conf.outliers < float_type{.0}) || (conf.outliers > float_type{1.}))
+            error("outlier fraction not in [0, 1]");
+        if ((conf.missing < float_type{.0}) || (conf.missing >= float_type{1.}))
+            error("missing reflection probability not in [0, 1[");
+        if (conf.noise < float_type{.0})
+            error("negative noise");
+
+        rng_type rng{conf.seed};
+        frame.data.unit_cell = conf.cell;
+        mat3 cell;
+        for (unsigned i=0u; i<3u; i++) {
+            cell[3*i] = conf.cell[i].x;
+            cell[3*i+1] = conf.cell[i].y;
+            cell[3*i+2] = conf.cell[i].z;
+        }
+
+        const unsigned n_outliers = (conf.n_spots == 0u) ? 0u : (unsigned)std::lround(conf.n_spots * conf.outliers);
+        const unsigned n_lattice_spots = conf.n_spots - n_outliers;
+        std::vector<Coord<float_type>>& spots = frame.data.spots;
+
+        for (unsigned lattice=0u; lattice<conf.n_lattices; lattice++) {
+            const mat3 r = random_rotation(rng);
+            mat3 oriented;                          // oriented cell rows: r * cell vector
+            for (unsigned i=0u; i<3u; i++)
+                for (unsigned j=0u; j<3u; j++)
+                    oriented[3*i+j] = r[3*j] * cell[3*i] + r[3*j+1] * cell[3*i+1] + r[3*j+2] * cell[3*i+2];
+            {
+                std::array<Coord<float_type>, 3> vecs;
+                std::array<float_type, 9> rot;
+                for (unsigned i=0u; i<3u; i++)
+                    vecs[i] = Coord<float_type>{(float_type)oriented[3*i], (float_type)oriented[3*i+1], (float_type)oriented[3*i+2]};
+                for (unsigned i=0u; i<9u; i++)
+                    rot[i] = (float_type)r[i];
+                frame.lattices.push_back(vecs);
+                frame.rotations.push_back(rot);
+            }
+
+            const unsigned n = (conf.n_spots == 0u) ? 0u : n_lattice_spots / conf.n_lattices + (lattice < n_lattice_spots % conf.n_lattices ? 1u : 0u);
+            if ((conf.n_spots != 0u) && (n == 0u))
+                continue;
+            for (const auto& s : reflections(oriented, n, conf.resolution, conf.missing, rng, error)) {
+                spots.push_back(Coord<float_type>{
+                    (float_type)s[0] + conf.noise * gaussian<float_type>(rng),
+                    (float_type)s[1] + conf.noise * gaussian<float_type>(rng),
+                    (float_type)s[2] + conf.noise * gaussian<float_type>(rng)
+                });
+                frame.spot_lattice.push_back((int)lattice);
+            }
+        }
+
+        const double smax = 1. / conf.resolution;
+        for (unsigned i=0u; i<n_outliers; i++) {    // uniform in resolution sphere by rejection
+            std::array<double, 3> s;
+            do {
+                for (auto& e : s)
+                    e = (2. * uniform<double>(rng) - 1.) * smax;
+            } while (s[0]*s[0] + s[1]*s[1] + s[2]*s[2] > smax * smax);
+            spots.push_back(Coord<float_type>{(float_type)s[0], (float_type)s[1], (float_type)s[2]});
+            frame.spot_lattice.push_back(-1);
+        }
+
+        for (std::size_t i=spots.size(); i>1u; i--) { // interleave lattices and outliers
+            const std::size_t j = below(rng, i);
+            std::swap(spots[i-1u], spots[j]);
+            std::swap(frame.spot_lattice[i-1u], frame.spot_lattice[j]);
+        }
+
+        return frame;
+    }
+
+    // write input cell and spots in simple data format
+    template <typename float_type, typename error_function>
+    void write (std::ostream& out, const SimpleData<float_type, error_function>& data)
+    {
+        const auto prec = out.precision(9);
+        for (unsigned i=0u; i<3u; i++)
+            out << (i ? " " : "") << data.unit_cell[i].x << ' ' << data.unit_cell[i].y << ' ' << data.unit_cell[i].z;
+        out << '\n';
+        for (const auto& s : data.spots)
+            out << s.x << ' ' << s.y << ' ' << s.z << '\n';
+        out.precision(prec);
+    }
+
+    // write ground truth: one line per lattice with lattice index, number of spots,
+    // oriented real space cell vectors a b c, and the rotation matrix in row major order
+    template <typename float_type, typename error_function>
+    void write_truth (std::ostream& out, const generated_frame<float_type, error_function>& frame)
+    {
+        const auto prec = out.precision(9);
+        out << "# lattice spots ax ay az bx by bz cx cy cz r00 r01 r02 r10 r11 r12 r20 r21 r22\n";
+        for (unsigned l=0u; l<frame.lattices.size(); l++) {
+            out << l << ' ' << std::count(std::cbegin(frame.spot_lattice), std::cend(frame.spot_lattice), (int)l);
+            for (const auto& v : frame.lattices[l])
+                out << ' ' << v.x << ' ' << v.y << ' ' << v.z;
+            for (auto e : frame.rotations[l])
+                out << ' ' << e;
+            out << '\n';
+        }
+        out << "# outliers " << std::count(std::cbegin(frame.spot_lattice), std::cend(frame.spot_lattice), -1) << '\n';
+        out.precision(prec);
+    }
+
+} // namespace simple_data
+
+#endif
@@ -0,0 +1,186 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+// Generate synthetic simple data files with ground truth
+
+#include <getopt.h>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include "ffbidx/simple_data_generator.h"
+
+namespace {
+    using float_type = float;
+    using config_type = simple_data::generator_config<float_type>;
+
+    // default cell: approximate solution for the image*.txt simple data files
+    constexpr float_type default_cell[9] = {
+        39.431335f, 25.273994f, 63.585350f,
+        28.513729f, 60.642746f, -41.786659f,
+        -29.096014f, 20.499205f, 9.895323f
+    };
+
+    std::string out_prefix{};   // output file name prefix
+    unsigned n_frames = 1u;     // number of frames
+
+    [[noreturn]] void usage (const char* prog, int status)
+    {
+        (status ? std::cerr : std::cout)
+            << "usage: " << prog << " [options] --out=<prefix>\n\n"
+            << "  Generate synthetic simple data frames <prefix><i>.txt with ground truth <prefix><i>_truth.txt.\n"
+            << "  Frame i uses seed+i. options:\n"
+            << "  --help         show this help\n"
+            << "  --out          output file name prefix\n"
+            << "  --frames       number of frames (default 1)\n"
+            << "  --cell         real space cell as 9 comma separated numbers ax,ay,az,bx,by,bz,cx,cy,cz\n"
+            << "                 (default: the approximate cell of the image*.txt files)\n"
+            << "  --cell-file    take the cell from this simple data file\n"
+            << "  --spots        number of spots including outliers, 0 for all lattice points (default 300)\n"
+            << "  --resolution   resolution limit in cell length units (default 2)\n"
+            << "  --noise        gaussian spot position noise per coordinate in reciprocal units (default 0)\n"
+            << "  --outliers     fraction of outlier spots (default 0)\n"
+            << "  --lattices     number of lattices (default 1)\n"
+            << "  --missing      probability of a missing reflection (default 0)\n"
+            << "  --seed         random number generator seed (default 0)\n";
+        std::exit(status);
+    }
+
+    template <typename T>
+    void parse_val (T& val, const std::string& arg, const char* name)
+    {
+        std::istringstream iss{arg};
+        iss >> val;
+        if (! iss || ! iss.eof())
+            throw std::invalid_argument(std::string{"invalid value for --"} + name + ": " + arg);
+    }
+
+    void parse_cell (config_type& conf, const std::string& arg)
+    {
+        std::istringstream iss{arg};
+        float_type v[9];
+        for (unsigned i=0u; i<9u; i++) {
+            std::string elem;
+            if (! std::getline(iss, elem, ','))
+                throw std::invalid_argument("--cell needs 9 comma separated numbers: " + arg);
+            parse_val(v[i], elem, "cell");
+        }
+        if (! iss.eof())
+            throw std::invalid_argument("--cell needs 9 comma separated numbers: " + arg);
+        for (unsigned i=0u; i<3u; i++)
+            conf.cell[i] = Coord<float_type>{v[3*i], v[3*i+1], v[3*i+2]};
+    }
+
+    void argparse (int argc, char* argv[], config_type& conf)
+    {
+        constexpr static option opts[] = {
+            { "help",       0, nullptr, 0},
+            { "out",        1, nullptr, 1},
+            { "frames",     1, nullptr, 2},
+            { "cell",       1, nullptr, 3},
+            { "cell-file",  1, nullptr, 4},
+            { "spots",      1, nullptr, 5},
+            { "resolution", 1, nullptr, 6},
+            { "noise",      1, nullptr, 7},
+            { "outliers",   1, nullptr, 8},
+            { "lattices",   1, nullptr, 9},
+            { "missing",    1, nullptr, 10},
+            { "seed",       1, nullptr, 11},
+            { nullptr,      0, nullptr, 0}
+        };
+        int oidx;
+        do {
+            switch (getopt_long(argc, argv, "", opts, &oidx)) {
+                case -1:
+                    if ((optind < argc) || out_prefix.empty())
+                        usage(argv[0], 1);
+                    return;
+                case 0:
+                    usage(argv[0], 0);
+                case 1:
+                    out_prefix = optarg; break;
+                case 2:
+                    parse_val(n_frames, optarg, "frames"); break;
+                case 3:
+                    parse_cell(conf, optarg); break;
+                case 4:
+                    conf.cell = simple_data::SimpleData<float_type, simple_data::raise>{optarg}.unit_cell; break;
+                case 5:
+                    parse_val(conf.n_spots, optarg, "spots"); break;
+                case 6:
+                    parse_val(conf.resolution, optarg, "resolution"); break;
+                case 7:
+                    parse_val(conf.noise, optarg, "noise"); break;
+                case 8:
+                    parse_val(conf.outliers, optarg, "outliers"); break;
+                case 9:
+                    parse_val(conf.n_lattices, optarg, "lattices"); break;
+                case 10:
+                    parse_val(conf.missing, optarg, "missing"); break;
+                case 11:
+                    parse_val(conf.seed, optarg, "seed"); break;
+                default:
+                    usage(argv[0], 1);
+            }
+        } while (true);
+    }
+
+    template <typename Writer>
+    void write_file (const std::string& name, const Writer& writer)
+    {
+        std::ofstream out{name};
+        if (! out)
+            throw std::runtime_error("unable to open file " + name);
+        writer(out);
+        if (! out)
+            throw std::runtime_error("unable to write file " + name);
+    }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+    try {
+        config_type conf{};
+        for (unsigned i=0u; i<3u; i++)
+            conf.cell[i] = Coord<float_type>{default_cell[3*i], default_cell[3*i+1], default_cell[3*i+2]};
+        argparse(argc, argv, conf);
+
+        const std::uint64_t seed = conf.seed;
+        for (unsigned i=0u; i<n_frames; i++) {
+            conf.seed = seed + i;
+            const auto frame = simple_data::generate<float_type, simple_data::raise>(conf);
+            const std::string name = out_prefix + std::to_string(i);
+            write_file(name + ".txt", [&frame](std::ostream& out) { simple_data::write(out, frame.data); });
+            write_file(name + "_truth.txt", [&frame](std::ostream& out) { simple_data::write_truth(out, frame); });
+        }
+    } catch (std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
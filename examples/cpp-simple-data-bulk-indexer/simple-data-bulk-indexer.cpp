@@ -24,10 +24,19 @@ Author: hans-christian.stadler@psi.ch
 */
 
 #include <ffbidx/indexer.h>
+#include <ffbidx/mpmc_queue.h>
+#include <ffbidx/scheduler.h>
+#include <ffbidx/histogram.h>
+#include <ffbidx/affinity.h>
+#include <ffbidx/trace.h>
+#include <ffbidx/probes.h>
+#include <ffbidx/perf_counters.h>
+#include <ffbidx/alloc_count.h>
 #include <getopt.h>
 #include <cstdlib>
 #include <cstdint>
 #include <iostream>
+#include <iomanip>
 #include <sstream>
 #include <fstream>
 #include <stdexcept>
@@ -36,6 +45,8 @@ Author: hans-christian.stadler@psi.ch
 #include <sys/cdefs.h>
 #include <sys/types.h>
 #include <vector>
+#include <array>
+#include <memory>
 #include <thread>
 #include <Eigen/Dense>
 #include "cuda_runtime.h"
@@ -45,7 +56,7 @@ Author: hans-christian.stadler@psi.ch
 using namespace fast_feedback;
 
 namespace {
-    using clock = std::chrono::high_resolution_clock;
+    using clock = scheduler::work_stealing::clock;
     using time_point = std::chrono::time_point<clock>;
     using duration = std::chrono::duration<double>;
 
@@ -87,14 +98,19 @@ namespace {
                      "  --delta        log2 curve position\n"
                      "  --contr        ifss/ifse threshold contraction\n"
                      "  --minpts       ifss/ifse minimum number of points for fitting\n"
-                     "  --iter         ifse maximum iterations\n"
+                     "  --iter         ifss/ifse maximum iterations\n"
                      "  --ths          worker threads\n"
                      "  --rblks        refinement blocks\n"
                      "  --ipg          indexer objects per gpu\n"
                      "  --rep          repetitions, every file will be indexer that many times\n"
                      "  --quiet        no indexing result output\n"
                      "  --method       output cell refinement method, one of raw, ifss(default), ifse\n"
-                     "  --reducalc     calculate candidate vectors for all cell vectors instead of one\n\n";
+                     "  --reducalc     calculate candidate vectors for all cell vectors instead of one\n"
+                     "  --hist         write per stage latency histograms to this JSON file\n"
+                     "  --live         comma separated list of live feedback files, served before the others\n"
+                     "  --deadline     live feedback deadline in ms after a live file repetition became due (default 100)\n"
+                     "  --pin          pin worker threads, one of none(default), core, node\n"
+                     "  --counters     read hardware performance counters per stage and worker thread\n\n";
         if (! msg.empty())
             error(msg);
         std::cout << success;
@@ -120,6 +136,12 @@ namespace {
     bool quiet = false;                 // don't produce indexing result output
     bool reducalc = false;              // calculate candidates for all 3 cell vectors instead of one
     std::string method{};               // refinement method
+    std::string hist_file{};            // JSON output file for latency histograms
+    std::vector<std::string> live_files;// list of live feedback simple data files
+    std::size_t n_bulk = 0u;            // number of bulk files, live files follow these in the files list
+    double deadline_ms = 100.;          // live feedback deadline
+    std::string pin_mode{"none"};       // worker thread pinning
+    bool hw_counters = false;           // read hardware performance counters
 
     void check_method()
     {
@@ -170,6 +192,19 @@ namespace {
         } while (end < opt.size());
     }
 
+    void parse_files_list(std::vector<std::string>& files, const std::string& opt)
+    {
+        using size_type = std::string::size_type;
+
+        size_type start=0, end=std::string::npos;
+        do {
+            end = opt.find(',', start);
+            if (end > start)
+                files.emplace_back(opt.substr(start, end - start));
+            start = end + 1;
+        } while (end < opt.size());
+    }
+
     // parse program arguments and store values into the global prog arg vars
     void argparse(int argc, char* argv[])
     {
@@ -193,6 +228,11 @@ namespace {
             { "method",   1, nullptr, 16},
             { "reducalc", 0, nullptr, 17},
             { "help",     0, nullptr, 18},
+            { "hist",     1, nullptr, 19},
+            { "live",     1, nullptr, 20},
+            { "deadline", 1, nullptr, 21},
+            { "pin",      1, nullptr, 22},
+            { "counters", 0, nullptr, 23},
             { nullptr,    0, nullptr, -1}
         };
 
@@ -258,12 +298,31 @@ namespace {
                     break;
                 case 18:
                     usage();
+                case 19:
+                    parse_val(hist_file, optarg); break;
+                case 20:
+                    parse_files_list(live_files, optarg); break;
+                case 21:
+                    parse_val(deadline_ms, optarg);
+                    if (deadline_ms <= .0)
+                        error("deadline must be positive");
+                    break;
+                case 22:
+                    parse_val(pin_mode, optarg);
+                    if ((pin_mode != "none") && (pin_mode != "core") && (pin_mode != "node"))
+                        error(std::string("unsupported pinning: ") + pin_mode);
+                    break;
+                case 23:
+                    hw_counters = true;
+                    break;
                 default:
                     error("internal: unknown option id");
             }
         } while (true);
         for (; optind<argc; optind++)
             files.emplace_back(argv[optind]);
+        n_bulk = files.size();
+        files.insert(std::end(files), std::begin(live_files), std::end(live_files));
         if (files.empty())
             usage("no data files");
     }
@@ -291,6 +350,8 @@ namespace {
     {
         if (refinement_blocks > worker_threads)
             error("more refinement blocks than worker threads");
+        if (hw_counters && ! perf_counters::thread_counters{}.available())
+            error("no hardware performance counters, check /proc/sys/kernel/perf_event_paranoid");
         ;   // TODO
     }
 
@@ -312,89 +373,10 @@ namespace {
             cifss.threshold_contraction = cifse.threshold_contraction = contr;
         if (minpts > 0u)
             cifss.min_spots = cifse.min_spots = minpts;
-        if (iter == 0u)
+        if (iter > 0u)
             cifss.max_iter = cifse.max_iter = iter;
     }
 
-    // cyclic nonnegative integer queue
-    // writers ensure by external means there are never more than size items in the queue
-    // items are nonnegative integers
-    class CNIQ final {
-        constexpr static int invalid = 0;                       // invalid ticket
-        constexpr static int valid = 1;                         // valid ticket
-        std::vector<std::unique_ptr<std::atomic_int>> items;    // always at least one slot free
-        std::vector<std::unique_ptr<std::atomic_int>> tickets;  // ticket fore every slot
-        std::atomic_uint head;                                  // 1 before front
-        std::atomic_uint tail;                                  // end
-        unsigned cap;                                           // capacity
-
-      public:
-        constexpr static int free = -1;                         // free slot value
-
-        explicit CNIQ(unsigned size=0u)
-        {
-            reset(size);
-        }
-
-        void reset (unsigned size)
-        {
-            cap = size+1u;
-            items.resize(cap);
-            tickets.resize(cap);
-            for (auto& ptr: items)
-                ptr.reset(new std::atomic_int{free});
-            for (auto& ptr: tickets)
-                ptr.reset(new std::atomic_int{invalid});
-            head = 0u;
-            tail = 0u;
-        }
-
-        void push_front (int item) noexcept
-        {
-            int e;
-            unsigned h = head.load();
-            while (! head.compare_exchange_weak(h, (h + cap - 1u) % cap));
-            do {
-                e = free;
-            } while (! items[h]->compare_exchange_strong(e, item));
-        }
-
-        void push_back (int item) noexcept
-        {
-            int e;
-            unsigned t = tail.load();
-            while (! tail.compare_exchange_weak(t, (t + 1u) % cap));
-            t = (t + 1u) % cap;
-            do {
-                e = free;
-            } while (! items[t]->compare_exchange_strong(e, item));
-        }
-
-        int pop_back () noexcept
-        {
-            int e;
-            int ticket;
-            unsigned s;
-            unsigned t;
-            do {
-                t = tail.load();
-                if (head.load() == t)
-                    return free;
-                ticket = invalid;
-                if (! tickets[t]->compare_exchange_weak(ticket, valid))
-                    continue;
-                s = t;
-                e = items[t]->load();
-                if ((e != free) && tail.compare_exchange_strong(t, (t + cap - 1u) % cap))
-                    break;
-                tickets[s]->store(invalid);
-            } while (true);
-            items[s]->store(free);
-            tickets[s]->store(invalid);
-            return e;
-        }
-   }; // CNIQ
-
     using indexer_t = indexer<float>;
     using input_t = input<float>;
     using output_t = output<float>;
@@ -404,13 +386,34 @@ namespace {
     using indexer_ifse = refine::indexer_ifse<float>;
     using cifss_t = refine::config_ifss<float>;
     using cifse_t = refine::config_ifse<float>;
+    using rstats_t = refine::refine_stats<float>;
     using mempin_t = memory_pin;
     using SimpleData = simple_data::SimpleData<float, simple_data::raise>;
     using Mx3 = Eigen::Matrix<float, Eigen::Dynamic, 3u>;
     using Vx = Eigen::Vector<float, Eigen::Dynamic>;
 
+    using scheduler_t = scheduler::work_stealing;
+    using queue_t = scheduler::mpmc_queue<int>;
+    using histogram_t = histogram::log_linear<>;
+
+    constexpr int none = -1;                            // no indexer object or work item
+
+    namespace wclass {
+        enum : unsigned {   // work item classes, in order of precedence
+            live,           // live feedback, urgent with a deadline
+            bulk,           // bulk (re)processing
+            count
+        };
+
+        constexpr const char* name[count] = {
+            "live", "bulk"
+        };
+    } // namespace wclass
+
     std::vector<std::unique_ptr<indexer_t>> indexer;    // indexer[gpu * indexers_per_gpu], array of indexer objects
-    CNIQ indexer_idle;                                  // queue of indices to idle indexer objects
+    std::vector<queue_t> indexer_idle;                  // per NUMA node queues of indices to idle indexer objects
+    std::vector<unsigned> indexer_node;                 // indexer_node[indexer], NUMA node of the indexer object GPU
+    std::array<queue_t, wclass::count> indexer_wait;    // per class queues of work items waiting for an idle indexer object
 
     enum state_t : int {    // work item next step states
         read_file,          // read the input data from simple data file
@@ -446,6 +449,7 @@ namespace {
         Mx3 coords;                             // one unit cell plus spot coordinates
         Mx3 cells;                              // output cells
         Vx scores;                              // output cell scores
+        std::vector<rstats_t> rstats;           // refinement convergence records for output cells
         input_t in;                             // indexer input
         output_t out;                           // indexer output
         mempin_t pin_coords;                    // pin object for coords matrix
@@ -458,38 +462,96 @@ namespace {
         int id;                                 // index into work item list
 
         time_point tp;                          // start time of a work item step
-        int indexer = CNIQ::free;               // associated indexer object
+        time_point tq;                          // time the work item became progressible
+        time_point tw;                          // time the work item started waiting for an idle indexer object
+        time_point te;                          // start time of the current repetition
+        time_point deadline;                    // live feedback deadline of the current repetition
+        unsigned wclass;                        // work item class
+        bool waiting = false;                   // work item has been waiting for an idle indexer object
+        int indexer = none;                     // associated indexer object
         state_t state = read_file;              // work item next step state
 
-        work_item (const std::string& fname, int wid)
+        work_item (const std::string& fname, int wid, unsigned wcls)
             : filename{fname}, coords{3u + maxspot, 3u},
-              cells{3u * ncells, 3u}, scores{ncells},
+              cells{3u * ncells, 3u}, scores{ncells}, rstats(ncells),
               in{{&coords(0,0), &coords(0,1), &coords(0,2)}, {&coords(3,0), &coords(3,1), &coords(3,2)}, 1u, maxspot, true, true},
               out{&cells(0,0), &cells(0,1), &cells(0,2), scores.data(), ncells},
-              pin_coords{coords}, pin_cells{cells}, pin_scores(scores), rblock{0u}, id{wid}
+              pin_coords{coords}, pin_cells{cells}, pin_scores(scores), rblock{0u}, id{wid}, wclass{wcls}
         {}
     };
 
     std::vector<std::unique_ptr<work_item>> witem_list; // list of work items
-    CNIQ work_queue;                                    // queue of indices to progressible work items
+    scheduler_t work_queue;                             // scheduler for indices to progressible work items
 
     std::vector<std::thread> thread_pool;               // pool of worker threads
-    std::atomic_bool pool_start = false;                // worker threads start switch
     std::atomic_uint counter = 0u;                      // counter for finished work items
 
-    std::atomic<double> read_time{.0};                  // accumulated simple data file read time
-    std::atomic<double> indexer_time{.0};               // accumulated indexing time
-    std::atomic<double> refine_time{.0};                // accumulated output cell refinement time
+    namespace stage {
+        enum : unsigned {   // work item stages with latency statistics
+            queue_wait,     // progressible work item waiting in the scheduler
+            read,           // simple data file reading
+            index_wait,     // waiting for an idle indexer object
+            index,          // indexing, from launch to index_end
+            refine,         // refinement of one output cell block
+            end_to_end,     // one repetition, from becoming due to finished
+            count
+        };
 
-    // atomic add for double
-    void atomic_add (std::atomic<double>& dest, double val)
-    {
-        double old_val = dest.load();
-        double new_val = old_val + val;
+        constexpr const char* name[count] = {
+            "queue_wait", "read", "index_wait", "index", "refine", "end_to_end"
+        };
+    } // namespace stage
+
+    namespace conv {
+        enum : unsigned {   // refinement convergence quantities per output cell
+            iterations,     // fit iterations
+            inliers,        // spots within the threshold at the last check
+            threshold,      // threshold of the last check, in millionths
+            count
+        };
 
-        while (! dest.compare_exchange_strong(old_val, new_val))
-            new_val = old_val + val;
-    }
+        constexpr const char* name[count] = {
+            "iterations", "inliers", "threshold"
+        };
+
+        constexpr unsigned n_exits = (unsigned)refine::refine_exit::count;
+    } // namespace conv
+
+    using stage_hist = std::array<histogram_t, stage::count>;
+    using conv_hist = std::array<histogram_t, conv::count>;
+
+    // per class latency histograms of one worker thread, in nanoseconds
+    struct stage_stats final {
+        std::array<stage_hist, wclass::count> hist;
+        conv_hist conv;                         // refinement convergence histograms
+        std::array<std::uint64_t, conv::n_exits> exits{}; // refined cells per exit reason
+        std::uint64_t missed = 0u;              // number of live repetitions that missed their deadline
+        clock::duration alive{};                // worker thread run time
+        clock::duration waiting{};              // time spent in the scheduler waiting for a work item
+        clock::duration parked{};               // part of waiting spent parked
+        std::array<perf_counters::values, stage::count> hw{}; // hardware counts of read, index and refine
+        std::array<std::uint64_t, stage::count> spots{};     // spots processed in read, index and refine
+    };
+
+    // add hardware counts of the calling thread from construction to destruction to total
+    // does nothing without counters
+    struct hw_section final {
+        const perf_counters::thread_counters* counters;
+        perf_counters::values& total;
+        perf_counters::values start;
+
+        inline hw_section (const perf_counters::thread_counters* c, perf_counters::values& t) noexcept
+            : counters{c}, total{t}, start{c ? c->read() : perf_counters::values{}}
+        {}
+
+        inline ~hw_section ()
+        {
+            if (counters)
+                total += counters->read() - start;
+        }
+    };
+
+    std::vector<std::unique_ptr<stage_stats>> thread_stats; // per worker thread latency histograms, merged at exit
 
     // check cuda call return values for proper completion
     void cuda_call(cudaError_t result)
@@ -498,7 +560,49 @@ namespace {
             error(std::string(cudaGetErrorName(result)) + ": " + cudaGetErrorString(result));
     }
 
-    // initialize indexer array and indexer_idle queue
+    affinity::topology topo;                            // NUMA topology
+    std::vector<std::vector<unsigned>> worker_cpus;     // worker_cpus[worker], cpus for worker thread, empty if not pinned
+    std::vector<unsigned> worker_node;                  // worker_node[worker], NUMA node of worker thread
+
+    // distribute worker threads over cpus or NUMA nodes
+    // consecutive workers share a node, so work stealing from neighbours stays node local
+    void init_placement ()
+    {
+        topo = affinity::topology::get();
+        worker_cpus.assign(worker_threads, {});
+        worker_node.assign(worker_threads, 0u);
+        if (pin_mode == "core") {
+            const auto cpus = topo.cpus();  // ordered by node
+            for (unsigned i=0u; i<worker_threads; i++) {
+                const unsigned cpu = cpus[(i * cpus.size() / worker_threads) % cpus.size()];
+                worker_cpus[i] = {cpu};
+                worker_node[i] = topo.node_of_cpu(cpu);
+            }
+        } else if (pin_mode == "node") {
+            const auto nodes = topo.cpu_nodes();
+            for (unsigned i=0u; i<worker_threads; i++) {
+                worker_node[i] = nodes[i * nodes.size() / worker_threads];
+                worker_cpus[i] = topo.node_cpus[worker_node[i]];
+            }
+        }
+    }
+
+    // home worker of a work item, its buffers are first touched there
+    unsigned home_worker (int witem_id)
+    {
+        return witem_id % worker_threads;
+    }
+
+    // NUMA node of cuda device, 0 if unknown
+    unsigned gpu_node (unsigned dev)
+    {
+        std::array<char, 32> bus_id{};
+        cuda_call(cudaDeviceGetPCIBusId(bus_id.data(), bus_id.size(), dev));
+        int node = affinity::pci_node(bus_id.data());
+        return ((node < 0) || ((unsigned)node >= topo.n_nodes())) ? 0u : (unsigned)node;
+    }
+
+    // initialize indexer array and per node indexer_idle queues
     void init_indexers (const config_persistent<float>& cpers)
     {
         if (gpus.empty())
@@ -508,33 +612,111 @@ namespace {
             for (auto dev : gpus) {
                 cuda_call(cudaSetDevice(dev));
                 indexer.emplace_back(new indexer_t{cpers});
+                indexer_node.push_back(gpu_node(dev));
             }
         }
 
         if (indexer.empty())
             error("no indexers");
 
-        indexer_idle.reset(indexer.size());
+        indexer_idle = std::vector<queue_t>(topo.n_nodes());
+        for (auto& idle : indexer_idle)
+            idle.reset(indexer.size());
         for (int i=0; i<(int)indexer.size(); i++) // all indexers idle
-            indexer_idle.push_front(i);
+            indexer_idle[indexer_node[i]].push(i);
+    }
+
+    // get an idle indexer object, preferably one on node, return false if there is none
+    bool acquire_indexer (unsigned node, int& idx)
+    {
+        const unsigned n = indexer_idle.size();
+        for (unsigned i=0u; i<n; i++) {
+            if (indexer_idle[(node + i) % n].try_pop(idx))
+                return true;
+        }
+        return false;
+    }
+
+    // make indexer object idle
+    void release_indexer (int idx)
+    {
+        indexer_idle[indexer_node[idx]].push(idx);
     }
 
-    // initialize work items and progressible work item queue
+    // initialize work items, progressible work item scheduler, and the queue for work items waiting for an indexer
     void init_work ()
     {
-        work_queue.reset(files.size());
-        for (int i=0; i<(int)files.size(); i++) {
-            work_queue.push_front(static_cast<int>(witem_list.size())); // all work items are progressible
-            witem_list.emplace_back(new work_item{files[i], i});
+        work_queue.reset(worker_threads, files.size());
+        for (auto& wait : indexer_wait)
+            wait.reset(files.size());
+        witem_list.resize(files.size());
+
+        // create the work items on threads pinned like their home worker for NUMA local first touch
+        affinity::first_touch(worker_cpus, files.size(),
+            [](std::size_t i) { return home_worker(i); },
+            [](std::size_t i) { witem_list[i].reset(new work_item{files[i], (int)i, i < n_bulk ? wclass::bulk : wclass::live}); });
+    }
+
+    // make work item progressible, on the deque of worker or injected if worker is none
+    // live work items are urgent and overtake the others at the next stage boundary
+    // with pinned workers, other work items go to their home worker to keep data NUMA local
+    void progressible (work_item& work, int worker=none)
+    {
+        work.tq = clock::now(); // queue wait start time
+        if (pin_mode != "none")
+            worker = home_worker(work.id);
+        if (work.wclass == wclass::live)
+            work_queue.push_urgent(work.id, work.deadline);
+        else if (worker == none)
+            work_queue.push(work.id);
+        else
+            work_queue.push(work.id, worker);
+    }
+
+    // reset refinement blocks, set start time and deadline for the next repetition of a work item
+    void start_repetition (work_item& work)
+    {
+        work.rblock = 0u;
+        work.te = clock::now();
+        work.deadline = work.te + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>{deadline_ms});
+    }
+
+    // make all work items progressible, this starts the parked worker threads
+    void start_work ()
+    {
+        for (const auto& work : witem_list) {
+            start_repetition(*work);
+            progressible(*work, home_worker(work->id));
+        }
+    }
+
+    // count a finished work item and stop the scheduler after the last one
+    void finish_item ()
+    {
+        if (++counter >= repetitions * files.size())
+            work_queue.stop();
+    }
+
+    // make one work item waiting for an idle indexer object progressible again, if there is one
+    // the caller must have made an indexer object idle before
+    void wake_waiting ()
+    {
+        int witem_id;
+        std::atomic_thread_fence(std::memory_order_seq_cst); // order idle push before wait pop, see index_start
+        for (auto& wait : indexer_wait) { // live work items first
+            if (wait.try_pop(witem_id)) {
+                progressible(*witem_list[witem_id]);
+                break;
+            }
         }
     }
 
     // asynchronous indexer action callback
     void result_ready (void* data)
     {
-        const work_item* work = (work_item*)data;
+        work_item* work = (work_item*)data;
         //std::cout << "-> data: " << work->id << '\n';
-        work_queue.push_back(work->id); // work item is now progressible again
+        progressible(*work); // work item is now progressible again
     }
 
     // read data and return false if the file should be dropped
@@ -584,41 +766,92 @@ namespace {
         return true;
     }
 
+    // record end to end latency of a finished repetition, make work item progressible for the next one if there is one
+    void next_repetition (stage_stats& stats, work_item& work, time_point t, unsigned id)
+    {
+        stats.hist[work.wclass][stage::end_to_end].record(t - work.te);
+        if ((work.wclass == wclass::live) && (t > work.deadline))
+            stats.missed++;
+        work.repetition++;
+        if (work.repetition < repetitions) {
+            work.state = index_start;
+            start_repetition(work);
+            progressible(work, id);
+        } else {
+            work.state = finished;
+        }
+    }
+
+    // record convergence of the output cells in refinement block, same cell split as in refine()
+    void record_convergence (stage_stats& stats, const work_item& work, unsigned block)
+    {
+        const unsigned blocksize = (ncells + refinement_blocks - 1u) / refinement_blocks;
+        const unsigned endcell = std::min((block + 1u) * blocksize, ncells);
+        for (unsigned j=block * blocksize; j<endcell; j++) {
+            const rstats_t& rs = work.rstats[j];
+            stats.conv[conv::iterations].record(rs.iterations);
+            stats.conv[conv::inliers].record(rs.inliers);
+            stats.conv[conv::threshold].record((std::uint64_t)(rs.threshold * 1e6f));
+            stats.exits[(unsigned)rs.exit]++;
+        }
+    }
+
     // worker thread
     void worker (const cfgrt_t& crt, const cifss_t& cifss, const cifse_t& cifse, unsigned id)
     {
         try {
-            double read_time_priv = .0;     // thread private accumulator for simple data reading time
-            double indexer_time_priv = .0;  // thread private accumulator for indexing time
-            double refine_time_priv = .0;   // thread private accumulator for refinement time
+            if (! worker_cpus[id].empty())
+                affinity::pin_thread(worker_cpus[id]);
 
-            std::array<char, 1024> buffer;  // buffer for file reading
+            stage_stats& stats = *thread_stats[id]; // thread private latency histograms
+            const auto t_alive = clock::now();
 
-            while (! pool_start.load());    // wait for start switch
+            std::unique_ptr<perf_counters::thread_counters> counters;  // hardware counters of this thread
+            if (hw_counters)
+                counters.reset(new perf_counters::thread_counters{});
 
-            do {
-                int witem_id = work_queue.pop_back();
+            std::array<char, 1024> buffer;  // buffer for file reading
+            FF_ALLOC_SCOPE("worker");       // allocations of the driver itself
 
-                if (witem_id == CNIQ::free) {
-                    std::this_thread::yield();  // no progressible work item
+            do {
+                const auto t_pop = clock::now();
+                int witem_id = work_queue.pop(id);  // parks until there is a progressible work item
+                const auto t_got = clock::now();
+                stats.waiting += t_got - t_pop;
+
+                if (witem_id == scheduler_t::free) {
+                    stats.alive = t_got - t_alive;
+                    break;  // all files indexed and refined
                 } else {
                     std::unique_ptr<work_item>& work = witem_list[witem_id];
+                    stage_hist& hist = stats.hist[work->wclass];
+                    hist[stage::queue_wait].record(clock::now() - work->tq);
+                    FF_TRACE_FRAME(witem_id);
 
                     switch (work->state) {
 
                         case read_file: {   // read simple file data and accumulate reading time
+                                FF_TRACE_SPAN("read_file", witem_id, work->repetition);
+                                FF_PROBE(state, witem_id, (int)read_file, work->repetition);
                                 // std::cout << id << ": " << witem_id << "-read_file " << work->filename << '\n';
 
                                 auto t = clock::now();
 
-                                bool ok = read_data(work.get(), buffer);
+                                bool ok;
+                                {
+                                    hw_section hw{counters.get(), stats.hw[stage::read]};
+                                    FF_ALLOC_SCOPE("read");
+                                    ok = read_data(work.get(), buffer);
+                                }
 
-                                read_time_priv += duration{clock::now() - t}.count();
+                                hist[stage::read].record(clock::now() - t);
+                                stats.spots[stage::read] += work->in.n_spots;
 
                                 if (! ok) { // drop file
                                     work->cells.setZero();
                                     work->scores.setZero();
-                                    counter++;
+                                    for (; work->repetition < repetitions; work->repetition++)
+                                        finish_item();
                                     break;
                                 }
 
@@ -626,41 +859,57 @@ namespace {
                             }
                             // fall through
                         case index_start: { // launch indexer asynchronously, set start time
-                                int idx = indexer_idle.pop_back();
-
-                                if (idx == CNIQ::free) { // no idle indexer object, push work item back to the queue
-                                    // std::cout << id << ": " << witem_id << "-enqueue\n";
-                                    work_queue.push_front(witem_id);
-                                    std::this_thread::yield();
+                                FF_TRACE_SPAN("state_index_start", witem_id, work->repetition);
+                                FF_PROBE(state, witem_id, (int)index_start, work->repetition);
+                                int idx;
+
+                                if (! acquire_indexer(worker_node[id], idx)) { // no idle indexer object, let work item wait for one
+                                    // std::cout << id << ": " << witem_id << "-wait\n";
+                                    if (! work->waiting) {
+                                        work->tw = clock::now();    // index wait start time
+                                        work->waiting = true;
+                                    }
+                                    indexer_wait[work->wclass].push(witem_id);
+                                    std::atomic_thread_fence(std::memory_order_seq_cst); // order wait push before idle pop, see wake_waiting
+                                    if (acquire_indexer(worker_node[id], idx)) { // recheck, an indexer object might have become idle in between
+                                        release_indexer(idx);
+                                        wake_waiting();
+                                    }
                                 } else {
                                     // std::cout << id << ": " << witem_id << "-index_start(" << idx << ") " << work->filename << '\n';
                                     work->tp = clock::now();    // indexing start time
+                                    if (work->waiting) {
+                                        hist[stage::index_wait].record(work->tp - work->tw);
+                                        work->waiting = false;
+                                    }
                                     work->indexer = idx;        // associated indexer (currently idle)
                                     work->state = index_end;
 
+                                    hw_section hw{counters.get(), stats.hw[stage::index]};
                                     indexer[idx]->index_start(work->in, work->out, crt, result_ready, work.get()); // launch indexer asynchronously
                                 }
                             } break;
 
                         case index_end: {   // finish asynchronous indexing step, accumulate indexing time
+                                FF_TRACE_SPAN("state_index_end", witem_id, work->repetition);
+                                FF_PROBE(state, witem_id, (int)index_end, work->repetition);
                                 // std::cout << id << ": " << witem_id << "-index_end(" << work->indexer << ") " << work->filename << '\n';
 
                                 auto& ind = *indexer[work->indexer];
-                                ind.index_end(work->out);
-                                indexer_idle.push_back(work->indexer); // associated indexer object is now idle
+                                {
+                                    hw_section hw{counters.get(), stats.hw[stage::index]};
+                                    ind.index_end(work->out);
+                                }
+                                stats.spots[stage::index] += work->in.n_spots;
+                                release_indexer(work->indexer); // associated indexer object is now idle
+                                wake_waiting();
 
                                 auto t = clock::now();
-                                indexer_time_priv += duration{t - work->tp}.count();
+                                hist[stage::index].record(t - work->tp);
 
                                 if (method == "raw") {
-                                    counter++;
-                                    work->repetition++;
-                                    if (work->repetition < repetitions) {
-                                        work->state = index_start;
-                                        work_queue.push_back(witem_id);
-                                    } else {
-                                        work->state = finished;
-                                    }
+                                    finish_item();
+                                    next_repetition(stats, *work, t, id);
                                     break;
                                 }
 
@@ -668,34 +917,35 @@ namespace {
                             }
                             // fall through
                         case refine_block: {    // refine one output cell block, accumulate refinement time
+                                FF_TRACE_SPAN("state_refine_block", witem_id, work->repetition);
+                                FF_PROBE(state, witem_id, (int)refine_block, work->repetition);
 
                                 unsigned block = work->rblock; // output cell block to refine
                                 // std::cout << id << ": " << witem_id << "-refine(" << block << '/' << refinement_blocks << ") " << work->filename << '\n';
 
                                 work->rblock++;
                                 if (work->rblock < refinement_blocks)
-                                    work_queue.push_back(witem_id); // refine next block
+                                    progressible(*work, id); // refine next block
                                 else
-                                    counter++; // no more blocks to refine, work for this item is finished
+                                    finish_item(); // no more blocks to refine, work for this item is finished
 
                                 auto t = clock::now();
 
-                                if (method == "ifss")
-                                    indexer_ifss::refine(work->coords.bottomRows(work->in.n_spots), work->cells, work->scores, cifss, block, refinement_blocks);
-                                else if (method == "ifse")
-                                    indexer_ifse::refine(work->coords.bottomRows(work->in.n_spots), work->cells, work->scores, cifse, block, refinement_blocks);
+                                {
+                                    hw_section hw{counters.get(), stats.hw[stage::refine]};
+                                    if (method == "ifss")
+                                        indexer_ifss::refine(work->coords.bottomRows(work->in.n_spots), work->cells, work->scores, cifss, block, refinement_blocks, work->rstats.data());
+                                    else if (method == "ifse")
+                                        indexer_ifse::refine(work->coords.bottomRows(work->in.n_spots), work->cells, work->scores, cifse, block, refinement_blocks, work->rstats.data());
+                                }
 
-                                refine_time_priv += duration{clock::now() - t}.count();
+                                auto t_end = clock::now();
+                                hist[stage::refine].record(t_end - t);
+                                stats.spots[stage::refine] += work->in.n_spots;
+                                record_convergence(stats, *work, block);
 
-                                if (block + 1u >= refinement_blocks) {
-                                    work->repetition++;
-                                    if (work->repetition < repetitions) {
-                                        work->state = index_start;
-                                        work_queue.push_back(witem_id);
-                                    } else {
-                                        work->state = finished;
-                                    }
-                                }
+                                if (block + 1u >= refinement_blocks)
+                                    next_repetition(stats, *work, t_end, id);
                             } break;
 
                         default: {
@@ -705,11 +955,7 @@ namespace {
                     }
                 }
 
-            } while (counter.load() < repetitions * files.size()); // while not all files indexed and refined
-
-            atomic_add(read_time, read_time_priv);
-            atomic_add(indexer_time, indexer_time_priv);
-            atomic_add(refine_time, refine_time_priv);
+            } while (true);
 
         } catch (std::exception& ex) {
             std::cerr << "Error: " << ex.what() << '\n';
@@ -717,9 +963,11 @@ namespace {
         }
     }
 
-    // initialize thread pool
+    // initialize thread pool and per thread latency histograms
     void init_pool (const cfgrt_t& crt, const cifss_t& cifss, const cifse_t& cifse)
     {
+        for (unsigned i=0u; i<worker_threads; i++) // separate allocations, no false sharing
+            thread_stats.emplace_back(new stage_stats{});
         for (unsigned i=1u; i<worker_threads; i++) // don't put the main thread into the list
             thread_pool.push_back(std::thread(worker, crt, cifss, cifse, i));
     }
@@ -731,6 +979,231 @@ namespace {
             thread.join();
     }
 
+    // merge per thread latency histograms and worker times, call after all workers finished
+    std::unique_ptr<stage_stats> merge_stats ()
+    {
+        std::unique_ptr<stage_stats> total{new stage_stats{}};
+        for (unsigned i=0u; i<thread_stats.size(); i++) {
+            const auto& stats = thread_stats[i];
+            for (unsigned c=0u; c<wclass::count; c++)
+                for (unsigned s=0u; s<stage::count; s++)
+                    total->hist[c][s].merge(stats->hist[c][s]);
+            for (unsigned q=0u; q<conv::count; q++)
+                total->conv[q].merge(stats->conv[q]);
+            for (unsigned e=0u; e<conv::n_exits; e++)
+                total->exits[e] += stats->exits[e];
+            total->missed += stats->missed;
+            total->alive += stats->alive;
+            total->waiting += stats->waiting;
+            total->parked += work_queue.parked(i);
+            for (unsigned s=0u; s<stage::count; s++) {
+                total->hw[s] += stats->hw[s];
+                total->spots[s] += stats->spots[s];
+            }
+        }
+        return total;
+    }
+
+    // merge per class latency histograms
+    std::unique_ptr<stage_hist> merge_classes (const stage_stats& stats)
+    {
+        std::unique_ptr<stage_hist> total{new stage_hist{}};
+        for (unsigned c=0u; c<wclass::count; c++)
+            for (unsigned s=0u; s<stage::count; s++)
+                (*total)[s].merge(stats.hist[c][s]);
+        return total;
+    }
+
+    // print latency percentiles in milliseconds
+    void print_stats (const stage_hist& hist, const std::string& title)
+    {
+        static constexpr double pct[] = {50., 90., 99., 99.9};
+        const auto flags = std::cout.flags();
+        const auto prec = std::cout.precision(3);
+        std::cout << std::fixed << title << " [ms]:\n"
+                  << std::setw(14) << "stage" << std::setw(10) << "count"
+                  << std::setw(10) << "p50" << std::setw(10) << "p90" << std::setw(10) << "p99"
+                  << std::setw(10) << "p99.9" << std::setw(10) << "max" << '\n';
+        for (unsigned s=0u; s<stage::count; s++) {
+            const auto& h = hist[s];
+            std::cout << std::setw(14) << stage::name[s] << std::setw(10) << h.count();
+            for (auto p : pct)
+                std::cout << std::setw(10) << h.percentile(p) * 1e-6;
+            std::cout << std::setw(10) << h.max() * 1e-6 << '\n';
+        }
+        std::cout.precision(prec);
+        std::cout.flags(flags);
+    }
+
+    // print refinement convergence percentiles and exit reasons
+    void print_convergence (const stage_stats& stats)
+    {
+        static constexpr double pct[] = {50., 90., 99., 99.9};
+        static constexpr double scale[conv::count] = {1., 1., 1e-6};
+        const auto flags = std::cout.flags();
+        const auto prec = std::cout.precision(3);
+        std::cout << "refinement convergence per cell:\n"
+                  << std::setw(14) << "quantity" << std::setw(10) << "count"
+                  << std::setw(10) << "p50" << std::setw(10) << "p90" << std::setw(10) << "p99"
+                  << std::setw(10) << "p99.9" << std::setw(10) << "max" << '\n';
+        for (unsigned q=0u; q<conv::count; q++) {
+            const auto& h = stats.conv[q];
+            std::cout << std::setw(14) << conv::name[q] << std::setw(10) << h.count();
+            for (auto p : pct)
+                std::cout << std::setw(10) << h.percentile(p) * scale[q];
+            std::cout << std::setw(10) << h.max() * scale[q] << '\n';
+        }
+        std::cout << "refinement exit:";
+        for (unsigned e=0u; e<conv::n_exits; e++)
+            std::cout << ' ' << refine::to_string((refine::refine_exit)e) << '=' << stats.exits[e];
+        std::cout << '\n';
+        std::cout.precision(prec);
+        std::cout.flags(flags);
+    }
+
+    // fractions of worker thread time: working, waiting for a work item, parked, and waiting without being parked (spin)
+    struct worker_time final {
+        double busy, idle, parked, spin;
+
+        explicit worker_time (const stage_stats& stats) noexcept
+        {
+            const double alive = std::max(duration{stats.alive}.count(), 1e-9);
+            idle = std::min(duration{stats.waiting}.count() / alive, 1.);
+            parked = std::min(duration{stats.parked}.count() / alive, idle);
+            spin = idle - parked;
+            busy = 1. - idle;
+        }
+    };
+
+    // print worker thread time fractions
+    void print_workers (const stage_stats& stats)
+    {
+        const worker_time wt{stats};
+        const auto flags = std::cout.flags();
+        const auto prec = std::cout.precision(1);
+        std::cout << std::fixed << "worker time: busy " << 100. * wt.busy << "%, idle " << 100. * wt.idle
+                  << "% (parked " << 100. * wt.parked << "%, spin " << 100. * wt.spin << "%)\n";
+        std::cout.precision(prec);
+        std::cout.flags(flags);
+    }
+
+    // stages with hardware counts
+    constexpr unsigned hw_stages[] = { stage::read, stage::index, stage::refine };
+
+    // hardware counts of all stages of a worker thread
+    perf_counters::values hw_total (const stage_stats& stats)
+    {
+        perf_counters::values total{};
+        for (unsigned s : hw_stages)
+            total += stats.hw[s];
+        return total;
+    }
+
+    // print IPC and hardware counts per spot for every stage, and IPC per worker thread
+    void print_counters (const stage_stats& stats)
+    {
+        using namespace perf_counters;
+        const auto flags = std::cout.flags();
+        const auto prec = std::cout.precision(3);
+        std::cout << std::fixed << "hardware counters per spot:\n" << std::setw(14) << "stage" << std::setw(10) << "spots" << std::setw(8) << "IPC";
+        for (unsigned e=0u; e<count; e++)
+            std::cout << std::setw(15) << name[e];
+        std::cout << '\n';
+        for (unsigned s : hw_stages) {
+            const auto& hw = stats.hw[s];
+            const double n = std::max(stats.spots[s], std::uint64_t{1u});
+            std::cout << std::setw(14) << stage::name[s] << std::setw(10) << stats.spots[s] << std::setw(8) << hw.ipc();
+            for (unsigned e=0u; e<count; e++) {
+                if (hw.has((event)e))
+                    std::cout << std::setw(15) << hw[(event)e] / n;
+                else
+                    std::cout << std::setw(15) << "n/a";
+            }
+            std::cout << '\n';
+        }
+        std::cout << "IPC per worker thread:";
+        for (const auto& ts : thread_stats)
+            std::cout << ' ' << hw_total(*ts).ipc();
+        std::cout << '\n';
+        std::cout.precision(prec);
+        std::cout.flags(flags);
+    }
+
+    // write JSON object with hardware counts
+    void write_counters (std::ostream& out, const perf_counters::values& hw)
+    {
+        out << "{\"ipc\": " << hw.ipc();
+        for (unsigned e=0u; e<perf_counters::count; e++) {
+            if (hw.has((perf_counters::event)e))
+                out << ", \"" << perf_counters::name[e] << "\": " << hw[(perf_counters::event)e];
+        }
+        out << '}';
+    }
+
+    // write JSON object with latency histograms in milliseconds
+    void write_hist (std::ostream& out, const stage_hist& hist, const std::string& indent)
+    {
+        out << '{';
+        for (unsigned s=0u; s<stage::count; s++) {
+            out << (s ? ",\n" : "\n") << indent << "  \"" << stage::name[s] << "\": ";
+            hist[s].write_json(out, 1e-6);
+        }
+        out << '\n' << indent << '}';
+    }
+
+    // write latency histograms in milliseconds as JSON to file
+    void write_stats (const stage_stats& stats, const stage_hist& all, double elapsed_sec, const std::string& file_name)
+    {
+        const worker_time wt{stats};
+        std::ofstream out(file_name);
+        if (! out)
+            throw std::invalid_argument(std::string{"unable to open file "} + file_name);
+        out << "{\"unit\": \"ms\", \"threads\": " << worker_threads << ", \"indexers\": " << indexer.size()
+            << ", \"refinement_blocks\": " << refinement_blocks << ", \"files\": " << files.size()
+            << ", \"live_files\": " << (files.size() - n_bulk) << ", \"repetitions\": " << repetitions
+            << ", \"deadline\": " << deadline_ms << ", \"deadline_misses\": " << stats.missed
+            << ",\n\"elapsed\": " << elapsed_sec << ", \"frames\": " << counter.load()
+            << ", \"frames_per_second\": " << (counter.load() / elapsed_sec)
+            << ",\n\"workers\": {\"busy\": " << wt.busy << ", \"idle\": " << wt.idle
+            << ", \"parked\": " << wt.parked << ", \"spin\": " << wt.spin << '}'
+            << ",\n\"stages\": ";
+        write_hist(out, all, "");
+        out << ",\n\"classes\": {";
+        for (unsigned c=0u; c<wclass::count; c++) {
+            out << (c ? ",\n  \"" : "\n  \"") << wclass::name[c] << "\": ";
+            write_hist(out, stats.hist[c], "  ");
+        }
+        if (method != "raw") {
+            out << "\n},\n\"refinement\": {\"exits\": {";
+            for (unsigned e=0u; e<conv::n_exits; e++)
+                out << (e ? ", \"" : "\"") << refine::to_string((refine::refine_exit)e) << "\": " << stats.exits[e];
+            out << '}';
+            for (unsigned q=0u; q<conv::count; q++) {
+                out << ",\n  \"" << conv::name[q] << "\": ";
+                stats.conv[q].write_json(out, q == conv::threshold ? 1e-6 : 1.);
+            }
+        }
+        out << "\n}";
+        if (hw_counters) {
+            out << ",\n\"counters\": {\"stages\": {";
+            for (unsigned i=0u; i<std::size(hw_stages); i++) {
+                const unsigned s = hw_stages[i];
+                out << (i ? ",\n  \"" : "\n  \"") << stage::name[s] << "\": {\"spots\": " << stats.spots[s] << ", \"counts\": ";
+                write_counters(out, stats.hw[s]);
+                out << '}';
+            }
+            out << "},\n  \"threads\": [";
+            for (unsigned i=0u; i<thread_stats.size(); i++) {
+                out << (i ? ",\n    " : "\n    ");
+                write_counters(out, hw_total(*thread_stats[i]));
+            }
+            out << "]}";
+        }
+        out << "}\n";
+        if (! out)
+            throw std::runtime_error(std::string{"unable to write file "} + file_name);
+    }
+
 } // namespace
 
 int main (int argc, char *argv[])
@@ -755,18 +1228,19 @@ int main (int argc, char *argv[])
         debug << stanza << "cpers: cells=" << cpers.max_output_cells << ", maxspots=" << cpers.max_spots << ", cands=" << cpers.num_candidate_vectors << ", reducalc=" << cpers.redundant_computations << '\n'
               << stanza << "crt: samples=" << crt.num_sample_points << ", triml=" << crt.triml << ", trimh=" << crt.trimh << ", delta=" << crt.delta << '\n';
         if (method == "ifss") {
-            debug << stanza << "cifss: contr=" << cifss.threshold_contraction << ", minpts=" << cifss.min_spots << '\n';
+            debug << stanza << "cifss: contr=" << cifss.threshold_contraction << ", minpts=" << cifss.min_spots << ", iter=" << cifss.max_iter << '\n';
         } else {
             debug << stanza << "cifse: contr=" << cifse.threshold_contraction << ", minpts=" << cifss.min_spots << ", iter=" << cifse.max_iter << '\n';
         }
 
+        init_placement();
         init_indexers(cpers);
         init_work();
-        init_pool(crt, cifss, cifse);
 
-        auto t0 = clock::now();
+        auto t0 = clock::now();                 // include worker thread start, so worker times cover the run
 
-        pool_start.store(true);                 // activate start switch
+        init_pool(crt, cifss, cifse);
+        start_work();                           // unpark worker threads
         worker(crt, cifss, cifse, 0);           // become part of the thread pool
         join_workers();
 
@@ -783,11 +1257,31 @@ int main (int argc, char *argv[])
             }
         }
 
+        const auto stats = merge_stats();
+        const auto all = merge_classes(*stats);
+
         std::cout << "per file average timings:\n";
         std::cout << "    clock time: " << (elapsed_sec / counter.load()) << "s\n";
-        std::cout << "  reading time: " << (read_time / counter.load()) << "s\n";
-        std::cout << "    index time: " << (indexer_time / counter.load()) << "s\n";
-        std::cout << "   refine time: " << (refine_time / counter.load()) << "s\n";
+        std::cout << "  reading time: " << ((*all)[stage::read].sum() * 1e-9 / counter.load()) << "s\n";
+        std::cout << "    index time: " << ((*all)[stage::index].sum() * 1e-9 / counter.load()) << "s\n";
+        std::cout << "   refine time: " << ((*all)[stage::refine].sum() * 1e-9 / counter.load()) << "s\n";
+
+        print_workers(*stats);
+        print_stats(*all, "latency percentiles");
+        if (n_bulk < files.size()) {
+            for (unsigned c=0u; c<wclass::count; c++)
+                print_stats(stats->hist[c], std::string{wclass::name[c]} + " latency percentiles");
+            std::cout << "live deadline misses: " << stats->missed << " of " << stats->hist[wclass::live][stage::end_to_end].count()
+                      << " (deadline " << deadline_ms << "ms)\n";
+        }
+        if (method != "raw")
+            print_convergence(*stats);
+        if (hw_counters)
+            print_counters(*stats);
+        if (alloc_count::enabled())
+            alloc_count::report(std::cout, alloc_count::snapshot(), counter.load());
+        if (! hist_file.empty())
+            write_stats(*stats, *all, elapsed_sec, hist_file);
 
     } catch (std::exception& ex) {
         std::cerr << "indexing failed: " << ex.what() << '\n' << failure;
@@ -0,0 +1,176 @@
+// Check the asynchronous C wrapper entry points against index_refined and index_raw
+// usage: async-test <simple data file>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "ffbidx/c-wrapper.h"
+
+#define MAX_SPOTS 300u
+#define N_FRAMES 6u
+
+struct input {
+    float cell[9];
+    float x[MAX_SPOTS], y[MAX_SPOTS], z[MAX_SPOTS];
+    unsigned nspots;
+};
+
+struct frame_data {
+    float cell[9];
+    int result;
+};
+
+static void fail(const char* msg, long long val)
+{
+    printf("Test failed: %s (%lld)\n", msg, val);
+    exit(1);
+}
+
+static void read_input(const char* file_name, struct input* in)
+{
+    FILE* f = fopen(file_name, "r");
+    if (f == NULL)
+        fail("unable to open input file", 0);
+    for (unsigned i=0; i<9; i++) {     // cell vectors a, b, c with x, y, z each
+        if (fscanf(f, "%f", &in->cell[(i % 3) * 3 + i / 3]) != 1)
+            fail("unable to read input cell", i);
+    }
+    in->nspots = 0;
+    while (in->nspots < MAX_SPOTS &&
+           fscanf(f, "%f %f %f", &in->x[in->nspots], &in->y[in->nspots], &in->z[in->nspots]) == 3)
+        in->nspots++;
+    fclose(f);
+    if (in->nspots < 10 * N_FRAMES)
+        fail("not enough spots", in->nspots);
+}
+
+// frame f uses fewer spots than frame f-1, so frames differ
+static unsigned frame_spots(const struct input* in, unsigned f)
+{
+    return in->nspots - 10 * f;
+}
+
+static void frame_setup(const struct input* in, unsigned f, float cell[9], struct ffbidx_frame* frame)
+{
+    memcpy(cell, in->cell, sizeof(in->cell));
+    frame->cell = cell;
+    frame->x = (float*)in->x;
+    frame->y = (float*)in->y;
+    frame->z = (float*)in->z;
+    frame->nspots = frame_spots(in, f);
+    frame->result = -2;
+}
+
+static void check_frame(const struct ffbidx_frame* frame, const struct frame_data* ref, const char* msg, unsigned f)
+{
+    if (frame->result != ref->result)
+        fail(msg, f);
+    for (unsigned i=0; i<9; i++) {
+        if (fabsf(frame->cell[i] - ref->cell[i]) > 1e-4f * (1.f + fabsf(ref->cell[i])))
+            fail(msg, f);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    static struct input in;
+    struct ffbidx_settings settings = {200u, 32u, 32u, 32u*1024u, 6u, .02f};
+    struct ffbidx_indexer idx;
+    struct frame_data refined[N_FRAMES], raw[N_FRAMES];
+    struct ffbidx_frame frames[N_FRAMES];
+    float cells[N_FRAMES][9];
+    ffbidx_token t1, t2, t3;
+
+    if (argc != 2)
+        fail("usage: async-test <simple data file>", argc);
+    read_input(argv[1], &in);
+    if (allocate_fast_indexer(&idx, &settings) != 0)
+        fail("unable to allocate indexer", 0);
+
+    // synchronous reference results
+    for (unsigned f=0; f<N_FRAMES; f++) {
+        memcpy(refined[f].cell, in.cell, sizeof(in.cell));
+        refined[f].result = index_refined(idx, refined[f].cell, in.x, in.y, in.z, frame_spots(&in, f));
+        memcpy(raw[f].cell, in.cell, sizeof(in.cell));
+        raw[f].result = index_raw(idx, raw[f].cell, in.x, in.y, in.z, frame_spots(&in, f));
+        if (refined[f].result < 0 || raw[f].result < 0)
+            fail("synchronous indexing failed for frame", f);
+    }
+
+    // no tokens before the first submission
+    if (ffbidx_poll(idx, 1) != -1 || ffbidx_wait(idx, 1) != -1)
+        fail("token accepted before any submission", 1);
+
+    // batches and single frames, waited for out of order
+    for (unsigned f=0; f<N_FRAMES; f++)
+        frame_setup(&in, f, cells[f], &frames[f]);
+    t1 = ffbidx_submit_batch(idx, &frames[0], 3, 1);
+    t2 = ffbidx_submit(idx, &frames[3], 0);
+    t3 = ffbidx_submit_batch(idx, &frames[4], 2, 1);
+    if (t1 <= 0 || t2 != t1 + 1 || t3 != t2 + 1)
+        fail("unexpected token", t3);
+    for (ffbidx_token t=t1; t<=t3; t++) {
+        int p = ffbidx_poll(idx, t);
+        if (p != 0 && p != 1)
+            fail("poll of a valid token failed", t);
+    }
+    const ffbidx_token invalid[] = {0, -1, t3 + 1, t3 + 1000};
+    for (unsigned i=0; i<sizeof(invalid)/sizeof(invalid[0]); i++) {
+        if (ffbidx_poll(idx, invalid[i]) != -1)
+            fail("poll accepted invalid token", invalid[i]);
+        if (ffbidx_wait(idx, invalid[i]) != -1)
+            fail("wait accepted invalid token", invalid[i]);
+    }
+    if (ffbidx_wait(idx, t3) != 0)
+        fail("wait for the last token failed", t3);
+    for (ffbidx_token t=t1; t<=t3; t++) {
+        if (ffbidx_poll(idx, t) != 1)
+            fail("earlier request not completed after waiting for a later one", t);
+    }
+    if (ffbidx_wait(idx, t2) != 0 || ffbidx_wait(idx, t1) != 0)
+        fail("wait for a completed token failed", t1);
+    for (unsigned f=0; f<N_FRAMES; f++)
+        check_frame(&frames[f], (f == 3) ? &raw[f] : &refined[f], "asynchronous result differs for frame", f);
+
+    // poll until done
+    for (unsigned f=0; f<N_FRAMES; f++)
+        frame_setup(&in, f, cells[f], &frames[f]);
+    t1 = ffbidx_submit_batch(idx, frames, N_FRAMES, 0);
+    for (long i=0; ffbidx_poll(idx, t1) == 0; i++) {
+        if (i > 100000000l)
+            fail("request never completed", t1);
+    }
+    if (ffbidx_poll(idx, t1) != 1)
+        fail("poll failed", t1);
+    for (unsigned f=0; f<N_FRAMES; f++)
+        check_frame(&frames[f], &raw[f], "polled result differs for frame", f);
+
+    // synchronous calls drain pending requests first
+    for (unsigned f=0; f<N_FRAMES; f++)
+        frame_setup(&in, f, cells[f], &frames[f]);
+    t1 = ffbidx_submit_batch(idx, frames, N_FRAMES, 1);
+    {
+        struct frame_data sync;
+        memcpy(sync.cell, in.cell, sizeof(in.cell));
+        sync.result = index_raw(idx, sync.cell, in.x, in.y, in.z, frame_spots(&in, 1));
+        if (ffbidx_poll(idx, t1) != 1)
+            fail("index_raw did not wait for pending requests", t1);
+        struct ffbidx_frame frame = {sync.cell, in.x, in.y, in.z, frame_spots(&in, 1), sync.result};
+        check_frame(&frame, &raw[1], "index_raw after submission differs", 1);
+    }
+    for (unsigned f=0; f<N_FRAMES; f++)
+        check_frame(&frames[f], &refined[f], "result before index_raw differs for frame", f);
+
+    // freeing the indexer finishes pending requests
+    for (unsigned f=0; f<N_FRAMES; f++)
+        frame_setup(&in, f, cells[f], &frames[f]);
+    if (ffbidx_submit_batch(idx, frames, N_FRAMES, 1) <= 0)
+        fail("submission failed", 0);
+    free_fast_indexer(idx);
+    for (unsigned f=0; f<N_FRAMES; f++)
+        check_frame(&frames[f], &refined[f], "result of request pending at free differs for frame", f);
+
+    printf("Test OK.\n");
+    return 0;
+}
@@ -5,6 +5,14 @@
 #include <algorithm>
 #include <string>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <utility>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <sstream>
 #include <cstdlib>
 #include <cassert>
 #include <ffbidx/refine.h>
@@ -21,16 +29,33 @@ namespace {
         float threshold = .02f;
     };
 
-    std::mutex config_mutex;
-    bool config_ok = false;
+    // Immutable configuration snapshot of an indexer handle
+    struct indexer_config final {
+        fast_feedback::config_persistent<float> cpers{};
+        fast_feedback::config_runtime<float> crt{};
+        fast_feedback::refine::config_ifss<float> cifss{};
+        viable_cell_config cvc{};
+        cell_similarity_config ccs{};
+        bool refine = true;
+    };
+
+    struct async_queue;
 
-    fast_feedback::config_persistent<float> cpers{};
-    fast_feedback::config_runtime<float> crt{};
-    fast_feedback::refine::config_ifss<float> cifss{};
-    viable_cell_config cvc{};
-    cell_similarity_config ccs{};
-    unsigned refine = true;
-    unsigned redundant_computations = true;
+    // Indexer handle content
+    struct handle_t final {
+        std::shared_ptr<const indexer_config> conf;
+        fast_feedback::refine::indexer<float> idx;
+        std::unique_ptr<async_queue> queue;     // asynchronous requests, created on first submission
+
+        explicit inline handle_t(std::shared_ptr<const indexer_config>&& c)
+            : conf(std::move(c)), idx{conf->cpers, conf->crt}
+        {}
+
+        ~handle_t();
+    };
+
+    constexpr unsigned refine_default = true;
+    constexpr unsigned redundant_computations_default = true;
 
     struct value_t {
         union {
@@ -57,16 +82,18 @@ namespace {
         return out;
     }
 
-    std::map<std::string, value_t> param = {
+    using param_t = std::map<std::string, value_t>;
+
+    const param_t param_defaults = {
         {"cpers_max_spots", make_value(200u)},
         {"cpers_max_output_cells", make_value(32u)},
         {"cpers_num_candidate_vectors", make_value(32u)},
-        {"cpers_redundant_computations", make_value(redundant_computations)},
+        {"cpers_redundant_computations", make_value(redundant_computations_default)},
         {"crt_num_sample_points", make_value(32u*1024u)},
         {"cifss_min_spots", make_value(6u)},
         {"cvc_threshold", make_value(.02f)},
         {"ccs_threshold", make_value(.02f)},
-        {"idx_refine", make_value(refine)},
+        {"idx_refine", make_value(refine_default)},
     };
 
     template<typename T>
@@ -77,82 +104,143 @@ namespace {
         }
     }
 
-    void set_conf(const ffbidx_settings* settings)
+    // Parameter overrides from the environment, parsed once per process
+    const param_t& env_params()
     {
-        std::lock_guard config_lock(config_mutex);
-        if (config_ok)
-            return;
+        static const param_t env_param = []() {
+            param_t env_param;
+            constexpr const char* pvar_name = "FFBIDX_PARAMS";
+            const char* env_c = std::getenv(pvar_name);
+
+            if (env_c != nullptr) {
+                std::string env{env_c};
+                std::string::size_type start=0, end=0;
+
+                while (end != std::string::npos) {
+                    if ((end = env.find('=', start)) == std::string::npos) {
+                        std::cerr << "unable to parse " << pvar_name << " at " << env.substr(start) << '\n';
+                        std::exit(-1);
+                    };
+
+                    std::string key = env.substr(start, end-start);
+                    auto entry = param_defaults.find(key);
+                    if (entry == param_defaults.end()) {
+                        std::cerr << pvar_name << " no such key: " << key << '\n';
+                        std::exit(-1);
+                    }
+                    value_t value = entry->second;
+
+                    start = end + 1;
+                    end = env.find(' ', start);
+                    std::string val = env.substr(start, end-start);
+                    switch (value.t) {
+                        case 'f':
+                            parse_val(value.f, val); break;
+                        case 'u':
+                            parse_val(value.u, val); break;
+                        default:
+                            break;
+                    }
+                    env_param[key] = value;
+
+                    start = end + 1;
+                }
+            }
+            return env_param;
+        }();
+        return env_param;
+    }
 
+    // Configuration snapshot for settings with environment overrides applied
+    std::shared_ptr<const indexer_config> make_conf(const ffbidx_settings* settings)
+    {
+        param_t param = param_defaults;
         param["cpers_max_spots"].u = settings->cpers_max_spots;
         param["cpers_max_output_cells"].u = settings->cpers_max_output_cells;
         param["cpers_num_candidate_vectors"].u = settings->cpers_num_candidate_vectors;
-        param["cpers_redundant_computations"].u = redundant_computations;
         param["crt_num_sample_points"].u = settings->crt_num_sample_points;
         param["cifss_min_spots"].u = settings->cifss_min_spots;
         param["cvc_threshold"].f = settings->cvc_threshold;
-        param["ccs_threshold"].f = ccs.threshold;
-        param["idx_refine"].u = refine;
-
-        constexpr const char* pvar_name = "FFBIDX_PARAMS";
-        const char* env_c = std::getenv(pvar_name);
-
-        if (env_c != nullptr) {
-            std::string env{env_c};
-            std::string::size_type start=0, end=0;
-
-            while (end != std::string::npos) {
-                if ((end = env.find('=', start)) == std::string::npos) {
-                    std::cerr << "unable to parse " << pvar_name << " at " << env.substr(start) << '\n';
-                    std::exit(-1);
-                };
-
-                std::string key = env.substr(start, end-start);
-                auto entry = param.find(key);
-                if (entry == param.end()) {
-                    std::cerr << pvar_name << " no such key: " << key << '\n';
-                    std::exit(-1);
-                }
-
-                start = end + 1;
-                end = env.find(' ', start);
-                std::string val = env.substr(start, end-start);
-                switch (entry->second.t) {
-                    case 'f':
-                        parse_val(entry->second.f, val); break;
-                    case 'u':
-                        parse_val(entry->second.u, val); break;
-                    default:
-                        break;
-                }
+        for (const auto& entry : env_params())
+            param[entry.first] = entry.second;
 
-                start = end + 1;
-            }
-        }
+        static std::once_flag print_once;
+        std::call_once(print_once, [&param]() {
+            for (const auto& entry : param)
+                std::cout << entry.first << '=' << entry.second << '\n';
+        });
 
+        auto conf = std::make_shared<indexer_config>();
         for (const auto& entry : param) {
-            std::cout << entry.first << '=' << entry.second << '\n';
             if (entry.first == "cpers_max_spots") {
-                cpers.max_spots = entry.second.u;
+                conf->cpers.max_spots = entry.second.u;
             } else if (entry.first == "cpers_max_output_cells") {
-                cpers.max_output_cells = entry.second.u;
+                conf->cpers.max_output_cells = entry.second.u;
             } else if (entry.first == "cpers_num_candidate_vectors") {
-                cpers.num_candidate_vectors = entry.second.u;
+                conf->cpers.num_candidate_vectors = entry.second.u;
             } else if (entry.first == "cpers_redundant_computations") {
-                cpers.redundant_computations = bool(entry.second.u);
+                conf->cpers.redundant_computations = bool(entry.second.u);
             } else if (entry.first == "crt_num_sample_points") {
-                crt.num_sample_points = entry.second.u;
+                conf->crt.num_sample_points = entry.second.u;
             } else if (entry.first == "cifss_min_spots") {
-                cifss.min_spots = entry.second.u;
+                conf->cifss.min_spots = entry.second.u;
             } else if (entry.first == "cvc_threshold") {
-                cvc.threshold = entry.second.f;
+                conf->cvc.threshold = entry.second.f;
             } else if (entry.first == "ccs_threshold") {
-                ccs.threshold = entry.second.f;
+                conf->ccs.threshold = entry.second.f;
             } else if (entry.first == "idx_refine") {
-                refine = bool(entry.second.u);
+                conf->refine = bool(entry.second.u);
+            }
+        }
+
+        return conf;
+    }
+
+    bool operator== (const ffbidx_settings& a, const ffbidx_settings& b) noexcept
+    {
+        return (a.cpers_max_spots == b.cpers_max_spots) &&
+               (a.cpers_max_output_cells == b.cpers_max_output_cells) &&
+               (a.cpers_num_candidate_vectors == b.cpers_num_candidate_vectors) &&
+               (a.crt_num_sample_points == b.crt_num_sample_points) &&
+               (a.cifss_min_spots == b.cifss_min_spots) &&
+               (a.cvc_threshold == b.cvc_threshold);
+    }
+
+    // Indexer object kept per thread by fast_feedback_crystfel
+    struct cached_indexer final {
+        ffbidx_settings settings;   // settings the indexer was allocated for
+        unsigned generation;        // cache generation at allocation
+        ffbidx_indexer idx{nullptr};
+
+        inline ~cached_indexer()
+        {
+            if (idx.ptr != nullptr) {
+                try {
+                    free_fast_indexer(idx);
+                } catch (...) {}    // ignore teardown errors at exit
             }
         }
+    };
+
+    std::atomic<unsigned> cache_generation{0u};             // incremented by flush_fast_indexer
+    thread_local std::unique_ptr<cached_indexer> thread_cache;
+
+    // Get the cached indexer of this thread for settings, allocate it if necessary
+    // Return nullptr if allocation failed
+    ffbidx_indexer* cached_fast_indexer(ffbidx_settings* settings)
+    {
+        const unsigned generation = cache_generation.load(std::memory_order_acquire);
+        if (thread_cache && ((thread_cache->generation != generation) || !(thread_cache->settings == *settings)))
+            thread_cache.reset();   // flushed or other settings
+
+        if (! thread_cache) {
+            std::unique_ptr<cached_indexer> entry{new cached_indexer{*settings, generation}};
+            if (allocate_fast_indexer(&entry->idx, settings) != 0)
+                return nullptr;
+            thread_cache = std::move(entry);
+        }
 
-        config_ok = true;
+        return &thread_cache->idx;
     }
 
     // input:
@@ -167,10 +255,8 @@ namespace {
     // 1 - error
     int index_step(ffbidx_indexer ptr, float cell[9], float *x, float *y, float *z, unsigned nspots)
     {
-        using indexer = fast_feedback::refine::indexer<float>;
-
         try {
-            indexer* idx = (indexer*)ptr.ptr;
+            auto* idx = &((handle_t*)ptr.ptr)->idx;
             std::copy(&cell[0], &cell[3], &idx->iCellX());
             std::copy(&cell[3], &cell[6], &idx->iCellY());
             std::copy(&cell[6], &cell[9], &idx->iCellZ());
@@ -202,22 +288,23 @@ namespace {
     int viable_cell(ffbidx_indexer ptr, float cell[9])
     {
         using namespace Eigen;
-        using indexer = fast_feedback::refine::indexer<float>;
 
         int indexable;
         try {
-            indexer* idx = (indexer*)ptr.ptr;
+            handle_t* handle = (handle_t*)ptr.ptr;
+            const indexer_config& conf = *handle->conf;
+            auto* idx = &handle->idx;
             Map<Matrix<float, 3, 3>> mcell{cell};
 
-            for (unsigned i=0u; i<cpers.max_output_cells; i++)
-                idx->oScore(i) += fast_feedback::refine::cell_similarity(idx->oCell(i), mcell, ccs.threshold);
+            for (unsigned i=0u; i<conf.cpers.max_output_cells; i++)
+                idx->oScore(i) += fast_feedback::refine::cell_similarity(idx->oCell(i), mcell, conf.ccs.threshold);
 
             unsigned best =  fast_feedback::refine::best_cell(idx->oScoreV());
 
             const Matrix<float, 3, 3>& ocell = idx->oCell(best);
             mcell = ocell;
 
-            indexable = fast_feedback::refine::is_viable_cell(ocell, idx->Spots(), cvc.threshold, cvc.n_spots);
+            indexable = fast_feedback::refine::is_viable_cell(ocell, idx->Spots(), conf.cvc.threshold, conf.cvc.n_spots);
         } catch (std::exception& ex) {
             std::cerr << "Error: " << ex.what() << '\n';
             return -1;
@@ -228,19 +315,158 @@ namespace {
         return indexable;
     }
 
+    // input:
+    // ptr     - convenience indexer object pointer
+    // cell    - given cell [x1, x2, x3, y1, y2, y3, z1, z2, z3] in memory
+    // x,y,z   - spot coords, size=nspots
+    // refined - refine cells with ifss
+    // output:
+    // cell    - best cell [x1, x2, x3, y1, y2, y3, z1, z2, z3] in memory
+    // return:
+    // -1 - error
+    // 0  - cell not viable (frame not indexable)
+    // 1  - cell viable (frame indexable)
+    int index_frame(ffbidx_indexer ptr, float cell[9], float *x, float *y, float *z, unsigned nspots, bool refined)
+    {
+        using ifss = fast_feedback::refine::indexer_ifss<float>;
+
+        if (index_step(ptr, cell, x, y, z, nspots) != 0)
+            return -1;
+
+        if (refined) {
+            try {
+                handle_t* handle = (handle_t*)ptr.ptr;
+                auto* idx = &handle->idx;
+
+                ifss::refine(idx->Spots(), idx->oCellM(), idx->oScoreV(), handle->conf->cifss);
+            } catch (std::exception& ex) {
+                std::cerr << "Error: " << ex.what() << '\n';
+                return -1;
+            } catch (...) {
+                return -1;
+            }
+        }
+
+        return viable_cell(ptr, cell);
+    }
+
+    // Asynchronous requests of an indexer handle, served in submission order by one thread
+    // The worker copies spots straight from the caller buffers into the pinned indexer buffers
+    struct async_queue final {
+        struct request final {
+            ffbidx_frame* frames;
+            unsigned n_frames;
+            bool refined;
+            ffbidx_token token;
+        };
+
+        std::mutex lock;                    // protect everything below except worker
+        std::condition_variable cv;         // signal new requests and completions
+        std::deque<request> requests;       // pending requests
+        ffbidx_token submitted = 0;         // token of the last submitted request
+        ffbidx_token completed = 0;         // token of the last completed request
+        bool stopped = false;
+        std::thread worker;
+
+        void run (ffbidx_indexer ptr)
+        {
+            std::unique_lock<std::mutex> guard{lock};
+            for (;;) {
+                cv.wait(guard, [this]{ return stopped || ! requests.empty(); });
+                if (requests.empty())
+                    return;
+                const request req = requests.front();
+                guard.unlock();
+                for (unsigned i=0u; i<req.n_frames; i++) {
+                    ffbidx_frame& frame = req.frames[i];
+                    frame.result = index_frame(ptr, frame.cell, frame.x, frame.y, frame.z, frame.nspots, req.refined);
+                }
+                guard.lock();
+                requests.pop_front();
+                completed = req.token;
+                cv.notify_all();
+            }
+        }
+
+        // Queue request and return its token
+        ffbidx_token submit (ffbidx_frame* frames, unsigned n_frames, bool refined)
+        {
+            ffbidx_token token;
+            {
+                std::lock_guard<std::mutex> guard{lock};
+                token = ++submitted;
+                requests.push_back(request{frames, n_frames, refined, token});
+            }
+            cv.notify_all();
+            return token;
+        }
+
+        // Wait for the request with token, or for all requests if token is the last submitted one
+        void wait (ffbidx_token token)
+        {
+            std::unique_lock<std::mutex> guard{lock};
+            cv.wait(guard, [this, token]{ return completed >= token; });
+        }
+
+        // Finish pending requests and stop the worker
+        void stop ()
+        {
+            {
+                std::lock_guard<std::mutex> guard{lock};
+                stopped = true;
+            }
+            cv.notify_all();
+            if (worker.joinable())
+                worker.join();
+        }
+    };
+
+    handle_t::~handle_t()
+    {
+        if (queue)
+            queue->stop();
+    }
+
+    // Wait for pending asynchronous requests before synchronous use of the handle
+    void drain(ffbidx_indexer ptr)
+    {
+        handle_t* handle = (handle_t*)ptr.ptr;
+        if (handle->queue) {
+            async_queue& q = *handle->queue;
+            ffbidx_token last;
+            {
+                std::lock_guard<std::mutex> guard{q.lock};
+                last = q.submitted;
+            }
+            q.wait(last);
+        }
+    }
+
+    // Get handle queue, start the worker on first use
+    async_queue& get_queue(ffbidx_indexer ptr)
+    {
+        handle_t* handle = (handle_t*)ptr.ptr;
+        if (! handle->queue) {
+            std::unique_ptr<async_queue> q{new async_queue{}};
+            q->worker = std::thread{&async_queue::run, q.get(), ptr};
+            handle->queue = std::move(q);
+        }
+        return *handle->queue;
+    }
+
 }
 
 extern "C" {
 
     int allocate_fast_indexer(ffbidx_indexer* idx, ffbidx_settings* settings)
     {
-        using indexer = fast_feedback::refine::indexer<float>;
-
+        namespace metrics = fast_feedback::metrics;
         idx->ptr = nullptr;
 
         try {
-            set_conf(settings);
-            idx->ptr = new indexer{cpers, crt};
+            static metrics::counter& allocated = metrics::get_counter("ffbidx_crystfel_indexers_allocated_total", "Number of indexer objects allocated by the CrystFEL wrapper");
+            idx->ptr = new handle_t{make_conf(settings)};
+            allocated.add();
         } catch (std::exception& ex) {
             std::cerr << "Error: " << ex.what() << '\n';
         } catch (...) {
@@ -252,58 +478,86 @@ extern "C" {
 
     void free_fast_indexer(ffbidx_indexer ptr)
     {
-        using indexer = fast_feedback::refine::indexer<float>;
-
-        indexer* idx = (indexer*)ptr.ptr;
-        delete idx;
+        handle_t* handle = (handle_t*)ptr.ptr;
+        delete handle;
         ptr.ptr = nullptr;
     }
 
     // cell: 0-3: x-coords, 3-6: y-coords, 6-9: z-coords
     int index_raw(ffbidx_indexer ptr, float cell[9], float *x, float *y, float *z, unsigned nspots)
     {
-        if (index_step(ptr, cell, x, y, z, nspots) != 0)
-            return -1;
-        
-        return viable_cell(ptr, cell);
+        drain(ptr);
+        return index_frame(ptr, cell, x, y, z, nspots, false);
     }
 
     // cell: 0-3: x-coords, 3-6: y-coords, 6-9: z-coords
     int index_refined(ffbidx_indexer ptr, float cell[9], float *x, float *y, float *z, unsigned nspots)
     {
-        using indexer = fast_feedback::refine::indexer<float>;
-        using ifss = fast_feedback::refine::indexer_ifss<float>;
-
-        if (index_step(ptr, cell, x, y, z, nspots) != 0)
-            return -1;
+        drain(ptr);
+        return index_frame(ptr, cell, x, y, z, nspots, true);
+    }
 
+    ffbidx_token ffbidx_submit_batch(ffbidx_indexer ptr, struct ffbidx_frame* frames, unsigned n_frames, int refined)
+    {
         try {
-            indexer* idx = (indexer*)ptr.ptr;
-
-            ifss::refine(idx->Spots(), idx->oCellM(), idx->oScoreV(), cifss);
+            return get_queue(ptr).submit(frames, n_frames, refined != 0);
         } catch (std::exception& ex) {
             std::cerr << "Error: " << ex.what() << '\n';
-            return -1;
         } catch (...) {
-            return -1;
+            // ignore
         }
+        return -1;
+    }
 
-        return viable_cell(ptr, cell);
+    ffbidx_token ffbidx_submit(ffbidx_indexer ptr, struct ffbidx_frame* frame, int refined)
+    {
+        return ffbidx_submit_batch(ptr, frame, 1u, refined);
+    }
+
+    int ffbidx_poll(ffbidx_indexer ptr, ffbidx_token token)
+    {
+        handle_t* handle = (handle_t*)ptr.ptr;
+        if (! handle->queue)
+            return -1;
+        async_queue& q = *handle->queue;
+        std::lock_guard<std::mutex> guard{q.lock};
+        if ((token <= 0) || (token > q.submitted))
+            return -1;
+        return q.completed >= token;
+    }
+
+    int ffbidx_wait(ffbidx_indexer ptr, ffbidx_token token)
+    {
+        handle_t* handle = (handle_t*)ptr.ptr;
+        if (! handle->queue)
+            return -1;
+        async_queue& q = *handle->queue;
+        {
+            std::lock_guard<std::mutex> guard{q.lock};
+            if ((token <= 0) || (token > q.submitted))
+                return -1;
+        }
+        q.wait(token);
+        return 0;
     }
 
     // cell: 0-3: x-coords, 3-6: y-coords, 6-9: z-coords
     int fast_feedback_crystfel(struct ffbidx_settings *settings, float cell[9], float *x, float *y, float *z, unsigned nspots) {
         using namespace Eigen;
 
-        ffbidx_indexer idx;
-        int res;
-
-        if (allocate_fast_indexer(&idx, settings) != 0)
+        ffbidx_indexer* idx;
+        try {
+            idx = cached_fast_indexer(settings);
+        } catch (std::exception& ex) {
+            std::cerr << "Error: " << ex.what() << '\n';
             return -1;
-        res = refine ?
-                index_refined(idx, cell, x, y, z, nspots) :
-                index_raw(idx, cell, x, y, z, nspots);
-        free_fast_indexer(idx);
+        }
+        if (idx == nullptr)
+            return -1;
+
+        int res = ((handle_t*)idx->ptr)->conf->refine ?
+                index_refined(*idx, cell, x, y, z, nspots) :
+                index_raw(*idx, cell, x, y, z, nspots);
 
         Map<Matrix<float, 3, 3>> mcell{cell};
         fast_feedback::refine::make_right_handed(mcell);
@@ -311,4 +565,10 @@ extern "C" {
         return res;
     }
 
+    void flush_fast_indexer(void)
+    {
+        cache_generation.fetch_add(1u, std::memory_order_release);
+        thread_cache.reset();
+    }
+
 } // extern "C"
@@ -0,0 +1,152 @@
+// Check the per thread indexer cache of fast_feedback_crystfel
+// usage: cache-test <simple data file>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <Eigen/Dense>
+#include <ffbidx/metrics.h>
+#include <ffbidx/refine.h>
+#include "ffbidx/c-wrapper.h"
+
+namespace {
+
+    constexpr unsigned max_spots = 300u;
+
+    struct input final {
+        float cell[9];
+        float x[max_spots], y[max_spots], z[max_spots];
+        unsigned nspots = 0u;
+    };
+
+    struct result final {
+        float cell[9];
+        int res;
+    };
+
+    [[noreturn]] void fail (const char* msg, long long val)
+    {
+        std::printf("Test failed: %s (%lld)\n", msg, val);
+        std::exit(1);
+    }
+
+    void read_input (const char* file_name, input& in)
+    {
+        std::FILE* f = std::fopen(file_name, "r");
+        if (f == nullptr)
+            fail("unable to open input file", 0);
+        for (unsigned i=0u; i<9u; i++) {   // cell vectors a, b, c with x, y, z each
+            if (std::fscanf(f, "%f", &in.cell[(i % 3u) * 3u + i / 3u]) != 1)
+                fail("unable to read input cell", i);
+        }
+        while ((in.nspots < max_spots) &&
+               (std::fscanf(f, "%f %f %f", &in.x[in.nspots], &in.y[in.nspots], &in.z[in.nspots]) == 3))
+            in.nspots++;
+        std::fclose(f);
+        if (in.nspots == 0u)
+            fail("no spots", 0);
+    }
+
+    // Number of indexer objects allocated by the wrapper so far
+    unsigned long long allocated ()
+    {
+        return fast_feedback::metrics::get_counter("ffbidx_crystfel_indexers_allocated_total", "").value();
+    }
+
+    result cached (ffbidx_settings& settings, input& in)
+    {
+        result r;
+        std::copy(std::begin(in.cell), std::end(in.cell), r.cell);
+        r.res = fast_feedback_crystfel(&settings, r.cell, in.x, in.y, in.z, in.nspots);
+        if (r.res < 0)
+            fail("fast_feedback_crystfel failed", r.res);
+        return r;
+    }
+
+    // Result of a freshly allocated indexer, like fast_feedback_crystfel with default refinement
+    result fresh (ffbidx_settings& settings, input& in)
+    {
+        ffbidx_indexer idx;
+        if (allocate_fast_indexer(&idx, &settings) != 0)
+            fail("unable to allocate indexer", 0);
+        result r;
+        std::copy(std::begin(in.cell), std::end(in.cell), r.cell);
+        r.res = index_refined(idx, r.cell, in.x, in.y, in.z, in.nspots);
+        free_fast_indexer(idx);
+        if (r.res < 0)
+            fail("index_refined failed", r.res);
+        Eigen::Map<Eigen::Matrix<float, 3, 3>> mcell{r.cell};
+        fast_feedback::refine::make_right_handed(mcell);
+        return r;
+    }
+
+    void check_same (const result& a, const result& b, const char* msg)
+    {
+        if (a.res != b.res)
+            fail(msg, a.res);
+        for (unsigned i=0u; i<9u; i++) {
+            if (std::fabs(a.cell[i] - b.cell[i]) > 1e-4f * (1.f + std::fabs(b.cell[i])))
+                fail(msg, i);
+        }
+    }
+
+    void check_allocated (unsigned long long expected, const char* msg)
+    {
+        if (allocated() != expected)
+            fail(msg, (long long)allocated() - (long long)expected);
+    }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+    if (argc != 2)
+        fail("usage: cache-test <simple data file>", argc);
+    input in;
+    read_input(argv[1], in);
+
+    ffbidx_settings settings = {200u, 32u, 32u, 32u*1024u, 6u, .02f};
+    ffbidx_settings fewer_spots = settings;
+    fewer_spots.cpers_max_spots = in.nspots / 2u;
+
+    const result ref = fresh(settings, in);
+    const result ref_fewer = fresh(fewer_spots, in);
+    unsigned long long n = allocated();
+
+    // first call allocates, following calls with equal settings reuse the indexer
+    check_same(cached(settings, in), ref, "first cached result differs from a fresh indexer");
+    check_allocated(++n, "first call didn't allocate one indexer");
+    for (unsigned i=0u; i<3u; i++)
+        check_same(cached(settings, in), ref, "repeated cached result differs from a fresh indexer");
+    check_allocated(n, "call with equal settings allocated");
+
+    // settings change reallocates
+    check_same(cached(fewer_spots, in), ref_fewer, "cached result after a settings change differs from a fresh indexer");
+    check_allocated(++n, "settings change didn't reallocate");
+    check_same(cached(fewer_spots, in), ref_fewer, "repeated cached result after a settings change differs");
+    check_allocated(n, "call with the changed settings allocated");
+
+    // flush on another thread invalidates the indexer of this thread on its next call
+    std::thread{flush_fast_indexer}.join();
+    check_allocated(n, "flush on another thread allocated");
+    check_same(cached(fewer_spots, in), ref_fewer, "cached result after a flush on another thread differs");
+    check_allocated(++n, "flush on another thread didn't invalidate the cached indexer");
+
+    // flush on this thread
+    flush_fast_indexer();
+    check_same(cached(settings, in), ref, "cached result after a flush differs");
+    check_allocated(++n, "flush didn't invalidate the cached indexer");
+
+    // other threads have their own indexer
+    std::thread{[&settings, &in, &ref]() {
+        check_same(cached(settings, in), ref, "cached result of another thread differs");
+    }}.join();
+    check_allocated(++n, "another thread didn't allocate its own indexer");
+    check_same(cached(settings, in), ref, "cached result after another thread differs");
+    check_allocated(n, "another thread invalidated the cached indexer");
+
+    flush_fast_indexer();
+    std::printf("Test OK.\n");
+    return 0;
+}
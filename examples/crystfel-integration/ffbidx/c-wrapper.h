@@ -21,6 +21,9 @@ struct ffbidx_settings {
 };
 
 // Allocate and free indexer object. These are expensive.
+// Every indexer object keeps an immutable configuration taken from settings and the FFBIDX_PARAMS
+// environment variable, which is read once per process. Different indexer objects can be used
+// concurrently by different threads.
 int allocate_fast_indexer(struct ffbidx_indexer* idx, struct ffbidx_settings *settings);
 void free_fast_indexer(struct ffbidx_indexer idx);
 
@@ -30,12 +33,44 @@ void free_fast_indexer(struct ffbidx_indexer idx);
 int index_raw(struct ffbidx_indexer idx, float cell[9], float *x, float *y, float *z, unsigned nspots);
 int index_refined(struct ffbidx_indexer idx, float cell[9], float *x, float *y, float *z, unsigned nspots);
 
+// Asynchronous indexing
+// Frames are indexed in submission order by a thread belonging to the indexer object.
+// The frame memory, including cell and spot coordinates, must stay valid and unchanged until the
+// request is completed. Synchronous calls on the same indexer object wait for pending requests first.
+// An indexer object must not be used by several threads concurrently.
+typedef long long ffbidx_token;             // completion token, positive
+
+struct ffbidx_frame {
+    float* cell;                            // in: given cell, out: best cell, 0-3: x-coords, 3-6: y-coords, 6-9: z-coords
+    float* x;                               // spot x coordinates
+    float* y;                               // spot y coordinates
+    float* z;                               // spot z coordinates
+    unsigned nspots;                        // number of spots
+    int result;                             // out: -1 error, 0 cell not viable, 1 cell viable (like index_raw/index_refined)
+};
+
+// Submit one frame or a batch of n_frames frames, indexed like index_refined if refined is nonzero,
+// otherwise like index_raw. Return the completion token of the request, or -1 on error.
+ffbidx_token ffbidx_submit(struct ffbidx_indexer idx, struct ffbidx_frame* frame, int refined);
+ffbidx_token ffbidx_submit_batch(struct ffbidx_indexer idx, struct ffbidx_frame* frames, unsigned n_frames, int refined);
+
+// Return 1 if the request with token is completed, 0 if not, -1 for an invalid token.
+// Requests are completed in submission order.
+int ffbidx_poll(struct ffbidx_indexer idx, ffbidx_token token);
+
+// Wait for completion of the request with token. Return 0, or -1 for an invalid token.
+int ffbidx_wait(struct ffbidx_indexer idx, ffbidx_token token);
+
 // Convenience function for:
-// - allocate an indexer
+// - get the indexer of the calling thread, allocated on first use or if settings changed
 // - index
-// - free indexer
+// The indexer is kept for following calls and freed at thread exit or by flush_fast_indexer().
 int fast_feedback_crystfel(struct ffbidx_settings *settings, float cell[9], float *x, float *y, float *z, unsigned nspots);
 
+// Free the indexer kept by fast_feedback_crystfel for the calling thread.
+// Indexers kept by other threads are freed on their next call.
+void flush_fast_indexer(void);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -91,4 +91,5 @@ int main ()
         printf("%f %f %f\n", data[i], data[i+1], data[i+2]);
     }
     printf("is_viable = %d\n", res);
+    flush_fast_indexer();
 }
@@ -0,0 +1,244 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <mutex>
+#include <new>
+#include "ffbidx/alloc_count.h"
+
+namespace {
+
+    using namespace fast_feedback::alloc_count;
+
+    struct alignas(64) counter final {
+        std::atomic<std::uint64_t> allocations{0u};
+        std::atomic<std::uint64_t> bytes{0u};
+    };
+
+    // Everything here is constant initialized, so counting works before static constructors ran
+    counter counters[max_tags];                 // per tag counts
+    std::atomic<const char*> names[max_tags];   // tag names, names[0] is unused ("other")
+    std::atomic<unsigned> n_tags{1u};           // number of registered tags
+    std::mutex register_lock;                   // protect tag registration
+
+    // initial-exec: no lazy TLS allocation, which would recurse into the allocator
+    thread_local unsigned current_tag __attribute__((tls_model("initial-exec"))) = 0u;
+
+    [[maybe_unused]] inline void count (std::size_t size) noexcept
+    {
+        counter& c = counters[current_tag];
+        c.allocations.fetch_add(1u, std::memory_order_relaxed);
+        c.bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    inline const char* tag_name (unsigned tag) noexcept
+    {
+        return tag ? names[tag].load(std::memory_order_acquire) : "other";
+    }
+
+} // namespace
+
+namespace fast_feedback {
+    namespace alloc_count {
+
+        bool enabled () noexcept
+        {
+#ifdef FFBIDX_ALLOC_COUNT
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        unsigned tag_id (const char* name) noexcept
+        {
+            std::lock_guard<std::mutex> lock{register_lock};
+            const unsigned n = n_tags.load(std::memory_order_relaxed);
+            for (unsigned i=1u; i<n; i++) {
+                if (std::strcmp(names[i].load(std::memory_order_relaxed), name) == 0)
+                    return i;
+            }
+            if (n >= max_tags)
+                return 0u;
+            names[n].store(name, std::memory_order_release);
+            n_tags.store(n + 1u, std::memory_order_release);
+            return n;
+        }
+
+        unsigned swap_tag (unsigned tag) noexcept
+        {
+            const unsigned previous = current_tag;
+            current_tag = (tag < max_tags) ? tag : 0u;
+            return previous;
+        }
+
+        std::vector<tag_counts> snapshot ()
+        {
+            const unsigned n = n_tags.load(std::memory_order_acquire);
+            std::vector<tag_counts> res;
+            res.reserve(n);
+            for (unsigned i=0u; i<n; i++)
+                res.push_back({tag_name(i), counters[i].allocations.load(std::memory_order_relaxed), counters[i].bytes.load(std::memory_order_relaxed)});
+            return res;
+        }
+
+        std::vector<tag_counts> difference (const std::vector<tag_counts>& end, const std::vector<tag_counts>& start)
+        {
+            std::vector<tag_counts> res{end};
+            for (std::size_t i=0u; i<start.size() && i<res.size(); i++) {
+                res[i].allocations -= start[i].allocations;
+                res[i].bytes -= start[i].bytes;
+            }
+            return res;
+        }
+
+        void report (std::ostream& out, const std::vector<tag_counts>& counts, double frames)
+        {
+            const auto flags = out.flags();
+            const auto prec = out.precision(1);
+            out << std::fixed << "allocations per frame:\n"
+                << std::setw(20) << "tag" << std::setw(14) << "allocations" << std::setw(14) << "bytes" << '\n';
+            for (const auto& c : counts) {
+                if (c.allocations == 0u)
+                    continue;
+                out << std::setw(20) << c.name << std::setw(14) << c.allocations / frames
+                    << std::setw(14) << c.bytes / frames << '\n';
+            }
+            out.precision(prec);
+            out.flags(flags);
+        }
+
+    } // namespace alloc_count
+} // namespace fast_feedback
+
+#ifdef FFBIDX_ALLOC_COUNT
+
+#if defined(__GLIBC__)
+
+// Interpose the C allocator, operator new ends up here as well
+extern "C" {
+    void* __libc_malloc (std::size_t size);
+    void* __libc_calloc (std::size_t n, std::size_t size);
+    void* __libc_realloc (void* ptr, std::size_t size);
+    void* __libc_memalign (std::size_t alignment, std::size_t size);
+
+    void* malloc (std::size_t size)
+    {
+        count(size);
+        return __libc_malloc(size);
+    }
+
+    void* calloc (std::size_t n, std::size_t size)
+    {
+        count(n * size);
+        return __libc_calloc(n, size);
+    }
+
+    void* realloc (void* ptr, std::size_t size)
+    {
+        if (size != 0u)
+            count(size);
+        return __libc_realloc(ptr, size);
+    }
+
+    void* memalign (std::size_t alignment, std::size_t size)
+    {
+        count(size);
+        return __libc_memalign(alignment, size);
+    }
+
+    void* aligned_alloc (std::size_t alignment, std::size_t size)
+    {
+        count(size);
+        return __libc_memalign(alignment, size);
+    }
+
+    int posix_memalign (void** ptr, std::size_t alignment, std::size_t size)
+    {
+        if ((alignment % sizeof(void*)) || (alignment & (alignment - 1u)))
+            return EINVAL;
+        count(size);
+        void* p = __libc_memalign(alignment, size);
+        if (p == nullptr)
+            return ENOMEM;
+        *ptr = p;
+        return 0;
+    }
+} // extern "C"
+
+#else
+
+// Replace the global operator new, the matching delete operators free with std::free
+void* operator new (std::size_t size)
+{
+    count(size);
+    if (void* p = std::malloc(size ? size : 1u))
+        return p;
+    throw std::bad_alloc{};
+}
+
+void* operator new[] (std::size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new (std::size_t size, const std::nothrow_t&) noexcept
+{
+    count(size);
+    return std::malloc(size ? size : 1u);
+}
+
+void* operator new[] (std::size_t size, const std::nothrow_t& tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+void operator delete (void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[] (void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete (void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[] (void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+#endif // __GLIBC__
+
+#endif // FFBIDX_ALLOC_COUNT
@@ -0,0 +1,241 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#ifndef FAST_FEEDBACK_AFFINITY_H
+#define FAST_FEEDBACK_AFFINITY_H
+
+// Thread affinity and NUMA placement helpers for Linux
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+#include <thread>
+#include <exception>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "ffbidx/exception.h"
+
+namespace fast_feedback {
+    namespace affinity {
+
+        // Parse a Linux cpu or node list like "0-3,8,10-11"
+        inline std::vector<unsigned> parse_list (const std::string& list)
+        {
+            std::vector<unsigned> ids;
+            std::istringstream iss(list);
+            std::string range;
+            while (std::getline(iss, range, ',')) {
+                if (range.empty() || (range == "\n"))
+                    continue;
+                unsigned start, end;
+                char dash = 0;
+                std::istringstream rss(range);
+                if (! (rss >> start))
+                    throw FF_EXCEPTION_OBJ << "invalid list entry '" << range << "' in " << list;
+                end = start;
+                if ((rss >> dash) && ((dash != '-') || !(rss >> end) || (end < start)))
+                    throw FF_EXCEPTION_OBJ << "invalid list range '" << range << "' in " << list;
+                for (unsigned id=start; id<=end; id++)
+                    ids.push_back(id);
+            }
+            return ids;
+        }
+
+        // First line of file, empty if the file can't be read
+        inline std::string read_line (const std::string& path)
+        {
+            std::ifstream ifs(path);
+            std::string line;
+            std::getline(ifs, line);
+            return line;
+        }
+
+        // Cpus the calling thread is allowed to run on
+        inline std::vector<unsigned> allowed_cpus ()
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (sched_getaffinity(0, sizeof(set), &set) != 0)
+                throw FF_EXCEPTION("unable to get cpu affinity");
+            std::vector<unsigned> cpus;
+            for (unsigned cpu=0u; cpu<CPU_SETSIZE; cpu++)
+                if (CPU_ISSET(cpu, &set))
+                    cpus.push_back(cpu);
+            return cpus;
+        }
+
+        // NUMA topology restricted to the allowed cpus
+        //
+        // Read from /sys/devices/system/node. Without NUMA support in the kernel,
+        // all allowed cpus are on node 0.
+        struct topology final {
+            std::vector<std::vector<unsigned>> node_cpus;   // allowed cpus per node, some nodes may have none
+
+            // Topology of the machine as seen by the calling thread
+            static inline topology get ()
+            {
+                topology topo;
+                const std::vector<unsigned> allowed = allowed_cpus();
+                const std::string online = read_line("/sys/devices/system/node/online");
+                if (! online.empty()) {
+                    for (unsigned node : parse_list(online)) {
+                        if (topo.node_cpus.size() <= node)
+                            topo.node_cpus.resize(node + 1u);
+                        auto& cpus = topo.node_cpus[node];
+                        for (unsigned cpu : parse_list(read_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist")))
+                            if (std::binary_search(std::begin(allowed), std::end(allowed), cpu))
+                                cpus.push_back(cpu);
+                    }
+                }
+                if (topo.node_cpus.empty())
+                    topo.node_cpus.push_back(allowed);
+                return topo;
+            }
+
+            // Number of nodes
+            inline unsigned n_nodes () const noexcept
+            {
+                return node_cpus.size();
+            }
+
+            // Nodes with allowed cpus
+            inline std::vector<unsigned> cpu_nodes () const
+            {
+                std::vector<unsigned> nodes;
+                for (unsigned node=0u; node<node_cpus.size(); node++)
+                    if (! node_cpus[node].empty())
+                        nodes.push_back(node);
+                return nodes;
+            }
+
+            // All allowed cpus, ordered by node
+            inline std::vector<unsigned> cpus () const
+            {
+                std::vector<unsigned> all;
+                for (const auto& cpus : node_cpus)
+                    all.insert(std::end(all), std::begin(cpus), std::end(cpus));
+                return all;
+            }
+
+            // Node of an allowed cpu, 0 if unknown
+            inline unsigned node_of_cpu (unsigned cpu) const noexcept
+            {
+                for (unsigned node=0u; node<node_cpus.size(); node++)
+                    if (std::find(std::begin(node_cpus[node]), std::end(node_cpus[node]), cpu) != std::end(node_cpus[node]))
+                        return node;
+                return 0u;
+            }
+        };
+
+        // Restrict the calling thread to cpus
+        inline void pin_thread (const std::vector<unsigned>& cpus)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (unsigned cpu : cpus)
+                CPU_SET(cpu, &set);
+            if (int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set); err != 0)
+                throw FF_EXCEPTION_OBJ << "unable to set cpu affinity, error " << err;
+        }
+
+        // Create items on threads pinned like their home worker, for NUMA local first touch
+        // - worker_cpus    cpus per worker, empty if the worker isn't pinned
+        // - n_items        number of items
+        // - home           home(i) is the home worker of item i
+        // - create         create(i) allocates and touches item i
+        // Without pinned workers all items are created on the calling thread.
+        // The first exception of a creating thread is rethrown after all of them are joined.
+        template <typename Home, typename Create>
+        inline void first_touch (const std::vector<std::vector<unsigned>>& worker_cpus, std::size_t n_items, Home home, Create create)
+        {
+            const bool pinned = std::any_of(std::begin(worker_cpus), std::end(worker_cpus), [](const auto& cpus) { return ! cpus.empty(); });
+            if (! pinned) {
+                for (std::size_t i=0u; i<n_items; i++)
+                    create(i);
+                return;
+            }
+            std::vector<std::exception_ptr> errors(worker_cpus.size());
+            std::vector<std::thread> creators;
+            for (unsigned w=0u; w<worker_cpus.size(); w++) {
+                creators.emplace_back([&, w]() {
+                    try {
+                        if (! worker_cpus[w].empty())
+                            pin_thread(worker_cpus[w]);
+                        for (std::size_t i=0u; i<n_items; i++) {
+                            if (home(i) == w)
+                                create(i);
+                        }
+                    } catch (...) {
+                        errors[w] = std::current_exception();
+                    }
+                });
+            }
+            for (auto& creator : creators)
+                creator.join();
+            for (const auto& error : errors) {
+                if (error)
+                    std::rethrow_exception(error);
+            }
+        }
+
+        // NUMA node of the page containing addr, -1 if unknown
+        // The page must have been touched, otherwise it is not placed yet
+        inline int node_of (const void* addr) noexcept
+        {
+#ifdef SYS_get_mempolicy
+            constexpr unsigned long mpol_f_node = 1ul << 0;     // MPOL_F_NODE
+            constexpr unsigned long mpol_f_addr = 1ul << 1;     // MPOL_F_ADDR
+            int node = -1;
+            if (syscall(SYS_get_mempolicy, &node, nullptr, 0ul, addr, mpol_f_node | mpol_f_addr) != 0)
+                return -1;
+            return node;
+#else
+            (void)addr;
+            return -1;
+#endif
+        }
+
+        // NUMA node of a PCI device like a GPU, -1 if unknown
+        // pci_bus_id as returned by cudaDeviceGetPCIBusId(), e.g. "0000:3b:00.0"
+        inline int pci_node (std::string pci_bus_id)
+        {
+            std::transform(std::begin(pci_bus_id), std::end(pci_bus_id), std::begin(pci_bus_id), [](unsigned char c) { return std::tolower(c); });
+            std::istringstream iss(read_line("/sys/bus/pci/devices/" + pci_bus_id + "/numa_node"));
+            int node = -1;
+            if (! (iss >> node))
+                return -1;
+            return node;
+        }
+
+    } // namespace affinity
+} // namespace fast_feedback
+
+#endif // FAST_FEEDBACK_AFFINITY_H
@@ -0,0 +1,102 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#ifndef FAST_FEEDBACK_ALLOC_COUNT_H
+#define FAST_FEEDBACK_ALLOC_COUNT_H
+
+// Allocation accounting per scope tag
+//
+// With the FFBIDX_ALLOC_COUNT cmake option the library interposes the allocator
+// (malloc, calloc, realloc and the aligned variants with glibc, the global operator new
+// otherwise) and counts allocations and bytes per tag. FF_ALLOC_SCOPE(tag) attributes the
+// allocations of the calling thread to tag until the end of the enclosing scope, the
+// innermost scope wins. Allocations outside of any scope are counted for tag "other".
+// Without FFBIDX_ALLOC_COUNT, FF_ALLOC_SCOPE compiles to nothing and nothing is counted.
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+namespace fast_feedback {
+    namespace alloc_count {
+
+        constexpr unsigned max_tags = 32u;      // more tags are counted as "other"
+
+        struct tag_counts final {
+            const char* name;                   // tag name
+            std::uint64_t allocations;          // number of allocations
+            std::uint64_t bytes;                // requested bytes
+        };
+
+        // Is the library built with allocation accounting?
+        bool enabled () noexcept;
+
+        // Tag id for name, which must stay valid (string literal), registering it if necessary
+        unsigned tag_id (const char* name) noexcept;
+
+        // Set the tag of the calling thread, return the previous one
+        unsigned swap_tag (unsigned tag) noexcept;
+
+        // Counts of all registered tags, tag "other" first
+        std::vector<tag_counts> snapshot ();
+
+        // Counts from start to end, tags registered in between start from zero
+        std::vector<tag_counts> difference (const std::vector<tag_counts>& end, const std::vector<tag_counts>& start);
+
+        // Print allocations and bytes per frame for every tag with allocations
+        void report (std::ostream& out, const std::vector<tag_counts>& counts, double frames);
+
+        // Attribute allocations of the calling thread to tag during the lifetime of this object
+        class scope final {
+            unsigned previous;
+          public:
+            explicit inline scope (unsigned tag) noexcept
+                : previous{swap_tag(tag)}
+            {}
+
+            scope (const scope&) = delete;
+            scope& operator= (const scope&) = delete;
+
+            inline ~scope ()
+            {
+                swap_tag(previous);
+            }
+        };
+
+    } // namespace alloc_count
+} // namespace fast_feedback
+
+#define FF_ALLOC_CONCAT_(a, b) a ## b
+#define FF_ALLOC_CONCAT(a, b) FF_ALLOC_CONCAT_(a, b)
+
+#ifdef FFBIDX_ALLOC_COUNT
+    #define FF_ALLOC_SCOPE(tag) \
+        static const unsigned FF_ALLOC_CONCAT(ff_alloc_tag_, __LINE__) = fast_feedback::alloc_count::tag_id(tag); \
+        const fast_feedback::alloc_count::scope FF_ALLOC_CONCAT(ff_alloc_scope_, __LINE__){FF_ALLOC_CONCAT(ff_alloc_tag_, __LINE__)}
+#else
+    #define FF_ALLOC_SCOPE(tag) do {} while (false)
+#endif
+
+#endif // FAST_FEEDBACK_ALLOC_COUNT_H
@@ -0,0 +1,161 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#ifndef INDEXER_CAND_GROUPS_H
+#define INDEXER_CAND_GROUPS_H
+
+// Host side candidate vector group computation of the GPU indexer
+// Internal header, separate from indexer_gpu.cu so it can be used without CUDA (benchmarks)
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+#include "ffbidx/exception.h"
+#include "ffbidx/log.h"
+#include "ffbidx/trace.h"
+#include "ffbidx/probes.h"
+#include "ffbidx/indexer.h"
+
+namespace gpu {
+    using namespace fast_feedback;
+    using logger::stanza;
+
+    // Calculate vector candidate groups
+    //   All input cell vectors are mapped to a candidate vector group that uniquely represents the length of the vector.
+    //   crt.length_threshold determines if two vectors are considered to have the same length.
+    // Input Args:
+    //   in        : indexing input
+    //   crt       : runtime configuration
+    //   n_cells_in: number of considered input cells
+    // Output Args:
+    //   cand_idx: input cell vector to candidate vector group mapping (preallocated size: 3 * n_cells_in)
+    //   cand_len: sorted candidate vector group length                (preallocated size: 3 * n_cells_in, initialized to: 0)
+    // Return:
+    //   number of candidate vector groups N ∈ [1 ... 3 * n_cells_in]
+    template <typename float_type>
+    inline unsigned calc_cand_groups(std::vector<unsigned>& cand_idx, std::vector<float_type>& cand_len,
+                              const fast_feedback::input<float_type>& in,
+                              const fast_feedback::config_runtime<float_type>& crt, const unsigned n_cells_in)
+    {
+        FF_TRACE_SPAN("calc_cand_groups", trace::current_frame, n_cells_in);
+        const unsigned n_vecs = 3u * n_cells_in;
+
+        if (cand_idx.size() < n_vecs)
+            throw FF_EXCEPTION("candidate index vector too small");
+        if (cand_len.size() < n_vecs)
+            throw FF_EXCEPTION("candidate length vector too small");
+        
+        // All vector lengths
+        for (unsigned i=0u; i<n_vecs; i++) {
+            const auto x = in.cell.x[i];
+            const auto y = in.cell.y[i];
+            const auto z = in.cell.z[i];
+            cand_len[i] = std::sqrt(x*x + y*y + z*z);
+        }
+
+        unsigned n_cand_groups{};
+        {   // Only keep elements that differ by more than length_threshold
+            std::sort(std::begin(cand_len), std::end(cand_len), std::greater<float_type>{});
+
+            const float_type l_threshold = crt.length_threshold;
+            LOG_START(logger::l_debug) {
+                logger::debug << stanza << "candidate_length =";
+                for (const auto& e : cand_len)
+                    logger::debug << ' ' << e;
+                logger::debug << ", threshold = " << l_threshold << '\n';                
+            } LOG_END;
+            
+            unsigned i=0, j=1;
+            do {
+                if ((cand_len[i] - cand_len[j]) < l_threshold) {
+                    LOG_START(logger::l_debug) {
+                        logger::debug << stanza << "  ignore " << cand_len[j] << '\n';
+                    } LOG_END;
+                } else if (++i != j) {
+                    cand_len[i] = cand_len[j];
+                }
+            } while(++j != n_vecs);
+            n_cand_groups = i + 1;
+            for (unsigned i=0u; i<n_vecs; i++) {
+                const auto x = in.cell.x[i];
+                const auto y = in.cell.y[i];
+                const auto z = in.cell.z[i];
+                float_type length = std::sqrt(x*x + y*y + z*z);
+                auto it = std::lower_bound(std::cbegin(cand_len), std::cbegin(cand_len) + n_cand_groups, length,
+                                        [l_threshold](const float_type& a, const float_type& l) -> bool {
+                                                return (a - l) >= l_threshold;
+                                        });
+                cand_idx[i] = it - std::cbegin(cand_len);
+            }
+        }
+        FF_PROBE(cand_groups, trace::current_frame, n_cells_in, n_cand_groups);
+        return n_cand_groups;
+    }
+
+    // Calculate a candidate vector for each cell
+    //   Chose a vector for every input cell. This vector will be used for the initial half-sphere brute force sampling step.
+    //   The algorithm relies on the decreasing order of the candidate group lengths and corresponding indices in cand_idx.
+    //   So a lower candidate vector group index in cand_idx means a longer vector.
+    // Input Args:
+    //   cand_idx: input cell vector to candidate vector group mapping (see ordering requirement above, size 3 * n_cells_in)
+    // Output Args:
+    //   cell_vec: cell to chosen input vector mapping (preallocated size: n_cells_in)
+    //   vec_cand: candidate groups of chosen input vectors (preallocated size: n_cells_in)
+    // Return:
+    //   Number of candidate groups for the chosen vectors
+    inline unsigned calc_cell_cand(std::vector<unsigned>& cell_vec, std::vector<unsigned>& vec_cand,
+                            const std::vector<unsigned>& cand_idx, const unsigned n_cells_in)
+    {
+        const unsigned n_vecs = 3u * n_cells_in;
+
+        if (cand_idx.size() < n_vecs)
+            throw FF_EXCEPTION("candidate index vector too small");
+        if (cell_vec.size() < n_cells_in)
+            throw FF_EXCEPTION("cell candidate vector too small");
+        if (vec_cand.size() < n_cells_in)
+            throw FF_EXCEPTION("candidate groups vector too small");
+
+        unsigned num_cand_grps = 0u;
+        unsigned vec = 0u;
+        for (unsigned cell=0u; cell<n_cells_in; cell++) {
+            unsigned cand = vec++;
+            for (unsigned v=1u; v<3u; vec++, v++) {
+                if (cand_idx[cand] > cand_idx[vec])
+                    cand = vec;
+            }
+            cell_vec[cell] = cand;
+            unsigned cand_grp = cand_idx[cand];
+            auto it = std::find(&vec_cand[0u], &vec_cand[num_cand_grps], cand_grp);
+            if (it == &vec_cand[num_cand_grps])
+                vec_cand[num_cand_grps++] = cand_grp;
+        }
+
+        return num_cand_grps;
+    }
+
+} // namespace gpu
+
+#endif
@@ -0,0 +1,189 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#ifndef FAST_FEEDBACK_HISTOGRAM_H
+#define FAST_FEEDBACK_HISTOGRAM_H
+
+// Log linear histogram for latencies and other nonnegative integer values
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <limits>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+namespace fast_feedback {
+    namespace histogram {
+
+        // HDR style log linear histogram
+        //
+        // Values below 2^sub_bucket_bits are counted exactly, larger values go into one of
+        // 2^sub_bucket_bits linear sub buckets of their power of two range, so the relative
+        // error of a reported value is below 2^-sub_bucket_bits.
+        //
+        // Recording is a few integer operations without locks or atomics. Use one histogram
+        // per thread and merge them after the threads are done.
+        template<unsigned sub_bucket_bits=5u>
+        class log_linear final {
+            static_assert((sub_bucket_bits > 0u) && (sub_bucket_bits < 16u), "unsupported number of sub bucket bits");
+          public:
+            static constexpr unsigned value_bits = 64u;
+            static constexpr std::uint64_t sub_buckets = std::uint64_t{1u} << sub_bucket_bits;
+            static constexpr std::size_t n_buckets = (value_bits - sub_bucket_bits + 1u) * sub_buckets;
+
+          private:
+            std::array<std::uint64_t, n_buckets> counts{};                  // per bucket counts
+            std::uint64_t n = 0u;                                           // number of recorded values
+            std::uint64_t min_val = std::numeric_limits<std::uint64_t>::max(); // smallest recorded value
+            std::uint64_t max_val = 0u;                                     // largest recorded value
+            double total = .0;                                              // sum of recorded values
+
+          public:
+            // Bucket index for value
+            static inline std::size_t bucket (std::uint64_t value) noexcept
+            {
+                if (value < sub_buckets)
+                    return (std::size_t)value;
+                const unsigned msb = (value_bits - 1u) - (unsigned)__builtin_clzll(value);
+                const unsigned shift = msb - sub_bucket_bits;
+                return (std::size_t)(shift * sub_buckets + (value >> shift));
+            }
+
+            // Smallest value in bucket i
+            static inline std::uint64_t lower_bound (std::size_t i) noexcept
+            {
+                if (i < 2u * sub_buckets)
+                    return i;
+                const unsigned shift = i / sub_buckets - 1u;
+                return (std::uint64_t)(i - shift * sub_buckets) << shift;
+            }
+
+            // Largest value in bucket i
+            static inline std::uint64_t upper_bound (std::size_t i) noexcept
+            {
+                if (i + 1u >= n_buckets)
+                    return std::numeric_limits<std::uint64_t>::max();
+                return lower_bound(i + 1u) - 1u;
+            }
+
+            // Record value
+            inline void record (std::uint64_t value) noexcept
+            {
+                counts[bucket(value)]++;
+                n++;
+                min_val = std::min(min_val, value);
+                max_val = std::max(max_val, value);
+                total += (double)value;
+            }
+
+            // Record duration in nanoseconds
+            template<typename Rep, typename Period>
+            inline void record (const std::chrono::duration<Rep, Period>& d) noexcept
+            {
+                const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+                record(ns > 0 ? (std::uint64_t)ns : std::uint64_t{0u});
+            }
+
+            // Add counts of other histogram
+            inline void merge (const log_linear& other) noexcept
+            {
+                for (std::size_t i=0u; i<n_buckets; i++)
+                    counts[i] += other.counts[i];
+                n += other.n;
+                min_val = std::min(min_val, other.min_val);
+                max_val = std::max(max_val, other.max_val);
+                total += other.total;
+            }
+
+            // Forget all recorded values
+            inline void clear () noexcept
+            {
+                *this = log_linear{};
+            }
+
+            inline std::uint64_t count () const noexcept
+            { return n; }
+
+            inline std::uint64_t count (std::size_t i) const noexcept
+            { return counts[i]; }
+
+            inline std::uint64_t min () const noexcept
+            { return n ? min_val : 0u; }
+
+            inline std::uint64_t max () const noexcept
+            { return max_val; }
+
+            inline double sum () const noexcept
+            { return total; }
+
+            inline double mean () const noexcept
+            { return n ? total / n : .0; }
+
+            // Value at percentile p in [0..100]
+            // This is the largest value of the bucket containing the percentile, but at most max()
+            inline std::uint64_t percentile (double p) const noexcept
+            {
+                if (n == 0u)
+                    return 0u;
+                const double rank = std::ceil(std::clamp(p, .0, 100.) / 100. * (double)n);
+                const std::uint64_t target = std::max(std::uint64_t{1u}, (std::uint64_t)rank);
+                std::uint64_t cumulative = 0u;
+                for (std::size_t i=0u; i<n_buckets; i++) {
+                    cumulative += counts[i];
+                    if (cumulative >= target)
+                        return std::min(upper_bound(i), max_val);
+                }
+                return max_val;
+            }
+
+            // Write a JSON object with summary statistics and the nonempty buckets
+            // Values are scaled by scale, e.g. 1e-6 for nanoseconds to milliseconds
+            template<typename Out>
+            inline void write_json (Out& out, double scale=1.) const
+            {
+                static constexpr double pct[] = {50., 90., 99., 99.9};
+                static constexpr const char* pct_name[] = {"p50", "p90", "p99", "p99.9"};
+                out << "{\"count\": " << n << ", \"min\": " << min() * scale << ", \"mean\": " << mean() * scale
+                    << ", \"max\": " << max() * scale;
+                for (unsigned i=0u; i<4u; i++)
+                    out << ", \"" << pct_name[i] << "\": " << percentile(pct[i]) * scale;
+                out << ", \"buckets\": [";
+                const char* sep = "";
+                for (std::size_t i=0u; i<n_buckets; i++) {
+                    if (counts[i] == 0u)
+                        continue;
+                    out << sep << '[' << lower_bound(i) * scale << ", " << upper_bound(i) * scale << ", " << counts[i] << ']';
+                    sep = ", ";
+                }
+                out << "]}";
+            }
+        }; // log_linear
+
+    } // namespace histogram
+} // namespace fast_feedback
+
+#endif // FAST_FEEDBACK_HISTOGRAM_H
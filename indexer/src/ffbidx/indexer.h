@@ -60,6 +60,18 @@ namespace fast_feedback {
         bool new_spots;     // set to true if spots are new or have changed
     };
 
+    // Timing of one indexing call in milliseconds
+    // GPU parts are measured with CUDA events, the others with the host clock
+    struct timing final {
+        float preparation=.0f;  // host side checks, candidate groups computation, input copy and kernel launches
+        float candidates=.0f;   // GPU vector candidates search
+        float cells=.0f;        // GPU cells search
+        float expansion=.0f;    // GPU output cells expansion
+        float output=.0f;       // output copy to the host
+        float total=.0f;        // from the start of index_start to the end of index_end
+        float refine=.0f;       // refinement, only measured by the refinement indexers
+    };
+
     // Output data for fast feedback indexer
     //
     // Output data consists of the (x,y,z) 3D space
@@ -74,6 +86,7 @@ namespace fast_feedback {
         float_type* z;      // z coordinates, pinned memory
         float_type* score;  // per cell score, pinned memory
         unsigned n_cells=1u;// number of unit cells
+        timing* time=nullptr; // filled by index_end if given at index_start
     };
 
     // Configuration setting for the fast feedback indexer runtime state
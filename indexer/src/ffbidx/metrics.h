@@ -0,0 +1,180 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#ifndef FAST_FEEDBACK_METRICS_H
+#define FAST_FEEDBACK_METRICS_H
+
+// Library metrics registry with Prometheus text format export
+//
+// Counters and histograms are sharded, every thread updates its own cache line with relaxed
+// atomics. Metrics are registered once and live until process exit, keep references to them
+// in static variables. Names follow Prometheus conventions and may carry labels, like
+// ffbidx_refine_cells_total{method="ifss"}.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fast_feedback {
+    namespace metrics {
+
+        constexpr unsigned n_shards = 16u;  // number of update shards per metric
+
+        // Update shard of the calling thread
+        inline unsigned shard_index () noexcept
+        {
+            static std::atomic<unsigned> next{0u};
+            thread_local const unsigned index = next.fetch_add(1u, std::memory_order_relaxed) % n_shards;
+            return index;
+        }
+
+        // Monotonic counter
+        class counter final {
+            struct alignas(64) shard final {
+                std::atomic<std::uint64_t> value{0u};
+            };
+            std::array<shard, n_shards> shards;
+
+          public:
+            inline void add (std::uint64_t n=1u) noexcept
+            {
+                shards[shard_index()].value.fetch_add(n, std::memory_order_relaxed);
+            }
+
+            inline std::uint64_t value () const noexcept
+            {
+                std::uint64_t sum = 0u;
+                for (const auto& s : shards)
+                    sum += s.value.load(std::memory_order_relaxed);
+                return sum;
+            }
+        };
+
+        // Histogram of nonnegative integer values with power of two bucket bounds
+        //
+        // Bucket i < n_buckets-1 counts values below 2^(low_bits+i), the last bucket counts the rest.
+        // Exported bounds and sums are multiplied by scale, e.g. 1e-9 for nanoseconds to seconds.
+        class histogram final {
+          public:
+            static constexpr unsigned max_buckets = 40u;
+
+          private:
+            struct alignas(64) shard final {
+                std::array<std::atomic<std::uint64_t>, max_buckets> counts{};
+                std::atomic<std::uint64_t> sum{0u};
+            };
+            std::array<shard, n_shards> shards;
+            unsigned low;           // values below 2^low go into the first bucket
+            unsigned n_buckets;     // number of used buckets
+            double scale_;
+
+          public:
+            struct snapshot_t final {
+                std::vector<std::pair<double, std::uint64_t>> buckets; // (scaled upper bound, cumulative count), last bound is infinite
+                double sum = .0;                                        // scaled sum of values
+                std::uint64_t count = 0u;                               // number of values
+            };
+
+            inline histogram (double scale, unsigned low_bits, unsigned high_bits)
+                : low{low_bits}, n_buckets{high_bits - low_bits + 2u}, scale_{scale}
+            {}
+
+            inline unsigned bucket (std::uint64_t value) const noexcept
+            {
+                const unsigned bits = value ? 64u - (unsigned)__builtin_clzll(value) : 0u; // value < 2^bits
+                const unsigned b = (bits > low) ? bits - low : 0u;
+                return std::min(b, n_buckets - 1u);
+            }
+
+            inline void record (std::uint64_t value) noexcept
+            {
+                shard& s = shards[shard_index()];
+                s.counts[bucket(value)].fetch_add(1u, std::memory_order_relaxed);
+                s.sum.fetch_add(value, std::memory_order_relaxed);
+            }
+
+            // Record duration in nanoseconds
+            template<typename Rep, typename Period>
+            inline void record (const std::chrono::duration<Rep, Period>& d) noexcept
+            {
+                const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+                record(ns > 0 ? (std::uint64_t)ns : std::uint64_t{0u});
+            }
+
+            inline double scale () const noexcept
+            { return scale_; }
+
+            inline unsigned low_bits () const noexcept
+            { return low; }
+
+            inline unsigned high_bits () const noexcept
+            { return low + n_buckets - 2u; }
+
+            // Consistent enough view for export, concurrent updates might be partially visible
+            snapshot_t snapshot () const;
+        };
+
+        // Get or register metric name, help is only used on registration
+        // Throws if name is registered as a different metric type or with a different histogram layout.
+        counter& get_counter (const std::string& name, const std::string& help);
+        histogram& get_histogram (const std::string& name, const std::string& help, double scale=1e-9, unsigned low_bits=10u, unsigned high_bits=36u);
+
+        // Metric values at one point in time
+        struct sample final {
+            std::string name;                       // name with labels
+            std::string help;
+            bool is_histogram;
+            std::uint64_t value;                    // counter value
+            histogram::snapshot_t hist;             // histogram snapshot
+        };
+
+        // Values of all registered metrics, ordered by name
+        std::vector<sample> collect ();
+
+        // Write all metrics in Prometheus text exposition format
+        void write_prometheus (std::ostream& out);
+
+        // Start the exporter thread, which rewrites file_name every interval seconds if file_name
+        // isn't empty, and serves metrics on http://127.0.0.1:port/metrics if port isn't 0.
+        // A running exporter is stopped first.
+        void start_exporter (const std::string& file_name, unsigned port, double interval=10.);
+
+        // Stop the exporter thread, writes the file a last time
+        void stop_exporter ();
+
+        // Parse the FFBIDX_METRICS_FILE and FFBIDX_METRICS_PORT environment variables
+        // and start the exporter if any of them is set.
+        void init_metrics ();
+
+    } // namespace metrics
+} // namespace fast_feedback
+
+#endif // FAST_FEEDBACK_METRICS_H
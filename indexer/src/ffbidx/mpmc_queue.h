@@ -0,0 +1,195 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#ifndef FAST_FEEDBACK_MPMC_QUEUE_H
+#define FAST_FEEDBACK_MPMC_QUEUE_H
+
+// Bounded multi producer multi consumer queue
+
+#include <cstddef>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <utility>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "ffbidx/exception.h"
+
+namespace fast_feedback {
+    namespace scheduler {
+
+        constexpr std::size_t cache_line_size = 64u;    // assumed cache line size for padding
+
+        // Exponential backoff for spinning threads
+        // Spin with cpu relax hints first, then yield the cpu
+        class backoff final {
+            static constexpr unsigned spin_limit = 6u;  // max 2^spin_limit relax hints in a row
+            unsigned step = 0u;
+          public:
+            inline void pause () noexcept
+            {
+                if (step <= spin_limit) {
+                    for (unsigned i=0u; i<(1u << step); i++) {
+                        #if defined(__x86_64__) || defined(__i386__)
+                            _mm_pause();
+                        #elif defined(__aarch64__)
+                            asm volatile("yield");
+                        #endif
+                    }
+                    step++;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+
+            inline void reset () noexcept
+            {
+                step = 0u;
+            }
+        }; // backoff
+
+        // Bounded MPMC ring buffer after Dmitry Vyukov
+        //
+        // Every slot carries a sequence number telling producers and consumers whether
+        // it's their turn on that slot, so a push or pop costs one CAS on the shared
+        // position counter in the uncontended case. Slots are contiguous and padded to
+        // a cache line, and the head and tail positions live on separate cache lines.
+        //
+        // The capacity is rounded up to a power of two. T should be cheap to copy.
+        // Push and pop synchronize with acquire/release semantics only, use a sequentially
+        // consistent fence if a push must be ordered before a subsequent load elsewhere.
+        template<typename T>
+        class mpmc_queue final {
+            struct alignas(cache_line_size) slot final {
+                std::atomic<std::size_t> seq;   // slot sequence number
+                T value;                        // slot value
+            };
+
+            std::unique_ptr<slot[]> slots;                                  // ring buffer
+            std::size_t mask = 0u;                                          // capacity - 1
+            alignas(cache_line_size) std::atomic<std::size_t> tail{0u};     // next push position
+            alignas(cache_line_size) std::atomic<std::size_t> head{0u};     // next pop position
+
+          public:
+            explicit inline mpmc_queue (std::size_t capacity=1u)
+            {
+                reset(capacity);
+            }
+
+            mpmc_queue (const mpmc_queue&) = delete;
+            mpmc_queue& operator= (const mpmc_queue&) = delete;
+
+            // Drop all items and set capacity
+            // Must not be called concurrently with other methods
+            inline void reset (std::size_t capacity)
+            {
+                std::size_t size = 2u;
+                while (size < capacity) {
+                    size <<= 1u;
+                    if (size == 0u)
+                        throw FF_EXCEPTION("mpmc queue capacity too large");
+                }
+                slots.reset(new slot[size]);
+                for (std::size_t i=0u; i<size; i++)
+                    slots[i].seq.store(i, std::memory_order_relaxed);
+                mask = size - 1u;
+                tail.store(0u, std::memory_order_relaxed);
+                head.store(0u, std::memory_order_release);
+            }
+
+            // Number of slots
+            inline std::size_t capacity () const noexcept
+            {
+                return mask + 1u;
+            }
+
+            // Push value, return false if the queue is full
+            inline bool try_push (const T& value) noexcept
+            {
+                std::size_t pos = tail.load(std::memory_order_relaxed);
+                do {
+                    slot& s = slots[pos & mask];
+                    const std::size_t seq = s.seq.load(std::memory_order_acquire);
+                    const std::ptrdiff_t dif = (std::ptrdiff_t)seq - (std::ptrdiff_t)pos;
+                    if (dif == 0) {
+                        if (tail.compare_exchange_weak(pos, pos + 1u, std::memory_order_relaxed)) {
+                            s.value = value;
+                            s.seq.store(pos + 1u, std::memory_order_release);
+                            return true;
+                        }
+                    } else if (dif < 0) {
+                        return false;   // full
+                    } else {
+                        pos = tail.load(std::memory_order_relaxed);
+                    }
+                } while (true);
+            }
+
+            // Pop into value, return false if the queue is empty
+            inline bool try_pop (T& value) noexcept
+            {
+                std::size_t pos = head.load(std::memory_order_relaxed);
+                do {
+                    slot& s = slots[pos & mask];
+                    const std::size_t seq = s.seq.load(std::memory_order_acquire);
+                    const std::ptrdiff_t dif = (std::ptrdiff_t)seq - (std::ptrdiff_t)(pos + 1u);
+                    if (dif == 0) {
+                        if (head.compare_exchange_weak(pos, pos + 1u, std::memory_order_relaxed)) {
+                            value = std::move(s.value);
+                            s.seq.store(pos + mask + 1u, std::memory_order_release);
+                            return true;
+                        }
+                    } else if (dif < 0) {
+                        return false;   // empty
+                    } else {
+                        pos = head.load(std::memory_order_relaxed);
+                    }
+                } while (true);
+            }
+
+            // Push value, spin with backoff while the queue is full
+            inline void push (const T& value) noexcept
+            {
+                backoff bo;
+                while (! try_push(value))
+                    bo.pause();
+            }
+
+            // Pop value, spin with backoff while the queue is empty
+            inline T pop () noexcept
+            {
+                backoff bo;
+                T value;
+                while (! try_pop(value))
+                    bo.pause();
+                return value;
+            }
+        }; // mpmc_queue
+
+    } // namespace scheduler
+} // namespace fast_feedback
+
+#endif // FAST_FEEDBACK_MPMC_QUEUE_H
@@ -0,0 +1,226 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#ifndef FAST_FEEDBACK_PERF_COUNTERS_H
+#define FAST_FEEDBACK_PERF_COUNTERS_H
+
+// Per thread hardware performance counters with Linux perf_event_open
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <array>
+#include <string>
+#include <fstream>
+#include <limits>
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+namespace fast_feedback {
+    namespace perf_counters {
+
+        enum event : unsigned {
+            cycles,             // cpu cycles
+            instructions,       // retired instructions
+            l1d_misses,         // L1 data cache read misses
+            llc_misses,         // last level cache read misses
+            branch_misses,      // mispredicted branches
+            fp_vector,          // retired packed (vector) floating point instructions, see fp_vector_config()
+            count
+        };
+
+        constexpr const char* name[count] = {
+            "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses", "fp_vector"
+        };
+
+        // Counter values and the mask of events that were counted
+        struct values final {
+            std::array<std::uint64_t, count> value{};
+            unsigned valid = 0u;                // bit (1 << event) is set if event was counted
+
+            inline bool has (event e) const noexcept
+            {
+                return valid & (1u << e);
+            }
+
+            inline std::uint64_t operator[] (event e) const noexcept
+            {
+                return value[e];
+            }
+
+            // Accumulate, only events counted in both stay valid (an empty accumulator takes over the mask)
+            inline values& operator+= (const values& other) noexcept
+            {
+                for (unsigned e=0u; e<count; e++)
+                    value[e] += other.value[e];
+                valid = (valid == 0u) ? other.valid : (valid & other.valid);
+                return *this;
+            }
+
+            // Instructions per cycle, 0 if not counted
+            inline double ipc () const noexcept
+            {
+                if (! has(cycles) || ! has(instructions) || (value[cycles] == 0u))
+                    return .0;
+                return (double)value[instructions] / value[cycles];
+            }
+        };
+
+        // Counts from start to end, wraparound free since counters are 64 bit
+        inline values operator- (const values& end, const values& start) noexcept
+        {
+            values diff{};
+            for (unsigned e=0u; e<count; e++)
+                diff.value[e] = end.value[e] - start.value[e];
+            diff.valid = end.valid & start.valid;
+            return diff;
+        }
+
+        // Raw PMU event config for fp_vector, 0 if unknown
+        // The FFBIDX_PERF_FP_VECTOR environment variable overrides it, for instance with
+        // a value from perf list --details. The default is only known for Intel cpus since
+        // Skylake: FP_ARITH_INST_RETIRED.{128B,256B}_PACKED_{SINGLE,DOUBLE}.
+        inline std::uint64_t fp_vector_config ()
+        {
+            if (const char* env = std::getenv("FFBIDX_PERF_FP_VECTOR"))
+                return std::strtoull(env, nullptr, 0);
+#if defined(__x86_64__)
+            std::ifstream cpuinfo("/proc/cpuinfo");
+            std::string line;
+            while (std::getline(cpuinfo, line)) {
+                if (line.rfind("vendor_id", 0u) == 0u)
+                    return (line.find("GenuineIntel") != std::string::npos) ? 0x3cc7u : 0u;
+            }
+#endif
+            return 0u;
+        }
+
+        // Hardware counters of the calling thread, user space only
+        //
+        // Counting starts on construction. Take values with read() before and after a
+        // section and subtract them. Every event has its own counter, events that can't
+        // be opened (no PMU support, perf_event_paranoid, containers) are left out.
+        // If the kernel multiplexes counters, values are scaled by enabled/running time.
+        // Reading costs one system call per event, so use it around coarse sections.
+        class thread_counters final {
+            std::array<int, count> fd;          // perf event file descriptors, -1 if not counted
+            unsigned valid = 0u;                // mask of opened events
+
+#if defined(__linux__)
+            static inline int open (std::uint32_t type, std::uint64_t config) noexcept
+            {
+                perf_event_attr attr;
+                std::memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.type = type;
+                attr.config = config;
+                attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0ul);   // calling thread, any cpu
+            }
+
+            static constexpr std::uint64_t cache_read_miss (std::uint64_t cache) noexcept
+            {
+                return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8u) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16u);
+            }
+#endif
+
+          public:
+            explicit inline thread_counters (std::uint64_t fp_vector_raw=fp_vector_config()) noexcept
+            {
+                fd.fill(-1);
+#if defined(__linux__)
+                fd[cycles] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+                fd[instructions] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+                fd[l1d_misses] = open(PERF_TYPE_HW_CACHE, cache_read_miss(PERF_COUNT_HW_CACHE_L1D));
+                fd[llc_misses] = open(PERF_TYPE_HW_CACHE, cache_read_miss(PERF_COUNT_HW_CACHE_LL));
+                fd[branch_misses] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+                if (fp_vector_raw != 0u)
+                    fd[fp_vector] = open(PERF_TYPE_RAW, fp_vector_raw);
+                for (unsigned e=0u; e<count; e++) {
+                    if (fd[e] >= 0)
+                        valid |= 1u << e;
+                }
+#else
+                (void)fp_vector_raw;
+#endif
+            }
+
+            thread_counters (const thread_counters&) = delete;
+            thread_counters& operator= (const thread_counters&) = delete;
+
+            inline ~thread_counters ()
+            {
+#if defined(__linux__)
+                for (int f : fd) {
+                    if (f >= 0)
+                        close(f);
+                }
+#endif
+            }
+
+            // Is any event counted?
+            inline bool available () const noexcept
+            {
+                return valid != 0u;
+            }
+
+            // Mask of counted events
+            inline unsigned counted () const noexcept
+            {
+                return valid;
+            }
+
+            // Current counter values, call it on the thread that constructed this object
+            inline values read () const noexcept
+            {
+                values res{};
+                res.valid = valid;
+#if defined(__linux__)
+                for (unsigned e=0u; e<count; e++) {
+                    if (fd[e] < 0)
+                        continue;
+                    std::uint64_t buf[3];   // value, time enabled, time running
+                    if ((::read(fd[e], buf, sizeof(buf)) != (ssize_t)sizeof(buf)) || (buf[2] == 0u)) {
+                        res.valid &= ~(1u << e);
+                        continue;
+                    }
+                    res.value[e] = (buf[2] < buf[1]) ? (std::uint64_t)((double)buf[0] * buf[1] / buf[2]) : buf[0];
+                }
+#endif
+                return res;
+            }
+        };
+
+    } // namespace perf_counters
+} // namespace fast_feedback
+
+#endif // FAST_FEEDBACK_PERF_COUNTERS_H
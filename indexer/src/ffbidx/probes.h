@@ -0,0 +1,72 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#ifndef FAST_FEEDBACK_PROBES_H
+#define FAST_FEEDBACK_PROBES_H
+
+// USDT (SystemTap SDT) static probe points
+//
+// With FFBIDX_USDT defined, FF_PROBE(name, args...) places a probe point ffbidx:name
+// into the code, which perf, bpftrace or SystemTap can attach to, e.g.
+//   bpftrace -e 'usdt:/path/libfast_indexer.so:ffbidx:index_end { @[arg1] = count(); }'
+// A probe point is a nop instruction plus an ELF note, it doesn't cost anything while
+// nothing is attached. Without FFBIDX_USDT the probe macros are compiled away.
+//
+// Probe arguments are integers, scores and thresholds are given in millionths (probe::micro).
+//
+// Probes (arg0 is always the frame id, see trace::current_frame, ~0 if not set):
+//   index_start(frame, n_spots, n_input_cells)
+//   index_end(frame, n_output_cells, first_score)
+//   cand_groups(frame, n_input_cells, n_candidate_groups)
+//   refine_iter(frame, cell, iteration, n_selected_spots, threshold)
+//   refine_cell(frame, cell, iterations, score)
+//   viable_cell(frame, viable, n_close_spots, min_spots)
+//   state(frame, state, repetition) ... bulk indexer example work item state, frame is the work item id
+
+#include <cstdint>
+
+#ifdef FFBIDX_USDT
+    #include <sys/sdt.h>
+#endif
+
+namespace fast_feedback {
+    namespace probe {
+
+        // Value in millionths as probe argument
+        inline std::int64_t micro (double value) noexcept
+        {
+            return (std::int64_t)(value * 1e6);
+        }
+
+    } // namespace probe
+} // namespace fast_feedback
+
+#ifdef FFBIDX_USDT
+    #define FF_PROBE(name, ...) STAP_PROBEV(ffbidx, name, __VA_ARGS__)
+#else
+    #define FF_PROBE(name, ...) do {} while (false)
+#endif
+
+#endif // FAST_FEEDBACK_PROBES_H
@@ -33,9 +33,14 @@ Author: hans-christian.stadler@psi.ch
 #include <functional>
 #include <algorithm>
 #include <chrono>
+#include <memory>
 #include <ffbidx/exception.h>
 #include "ffbidx/indexer.h"
 #include "ffbidx/log.h"
+#include "ffbidx/trace.h"
+#include "ffbidx/metrics.h"
+#include "ffbidx/probes.h"
+#include "ffbidx/alloc_count.h"
 
 namespace fast_feedback {
     namespace refine {
@@ -57,6 +62,34 @@ namespace fast_feedback {
 
         using logger::stanza;
 
+        // Reason for ending the refinement of a cell
+        enum class refine_exit : unsigned {
+            max_iter,   // iteration budget used up
+            min_spots,  // less than min_spots spots within the threshold
+            count
+        };
+
+        inline const char* to_string (refine_exit e) noexcept
+        {
+            switch (e) {
+                case refine_exit::max_iter:
+                    return "max_iter";
+                case refine_exit::min_spots:
+                    return "min_spots";
+                default:
+                    return "invalid";
+            }
+        }
+
+        // Convergence record for one refined cell
+        template <typename float_type=float>
+        struct refine_stats final {
+            unsigned iterations=0u;                 // number of fit iterations
+            unsigned inliers=0u;                    // spots within the threshold at the last check
+            float_type threshold=.0;                // threshold of the last check
+            refine_exit exit=refine_exit::max_iter; // reason for ending the refinement
+        };
+
         // Base indexer class for refinement
         // - controlling all indexer data
         // - getter/setter interface
@@ -77,6 +110,7 @@ namespace fast_feedback {
             fast_feedback::memory_pin pin_scores;                   // pin output cell scores container
             fast_feedback::memory_pin pin_crt;                      // pin runtime config memory
             fast_feedback::config_runtime<float_type> crt;          // raw indexer runtime config
+            std::unique_ptr<fast_feedback::timing> tm;              // per call timing, if enabled
           public:
             inline static void check_config (const fast_feedback::config_persistent<float_type>& cp,
                                              const fast_feedback::config_runtime<float_type>& cr)
@@ -154,6 +188,18 @@ namespace fast_feedback {
                 index_end();
             }
 
+            // Measure per call timing from the next index_start on
+            inline void enable_timing (bool on=true)
+            {
+                if (on && ! tm)
+                    tm.reset(new fast_feedback::timing{});
+                output.time = on ? tm.get() : nullptr;
+            }
+
+            // Timing of the last call, nullptr if timing is not enabled
+            inline const fast_feedback::timing* last_timing () const noexcept
+            { return output.time; }
+
             // Reciprocal space spot access: spot i
             inline float_type& spotX (unsigned i=0u) noexcept
             { return spots(i, 0u); }
@@ -416,14 +462,23 @@ namespace fast_feedback {
             // output:
             // - cells      the refined cells
             // - scores     refined cell scores: largest distance of the min_spots closest to their approximated lattice points
+            // - stats      if not null, convergence record stats[j] for every refined cell j
             template<typename MatX3, typename VecX>
             inline static void refine (const Eigen::Ref<Eigen::MatrixX3<float_type>>& spots,
                                        Eigen::DenseBase<MatX3>& cells,
                                        Eigen::DenseBase<VecX>& scores,
                                        const config_ifss<float_type>& cifss,
-                                       unsigned block=0, unsigned nblocks=1)
+                                       unsigned block=0, unsigned nblocks=1,
+                                       refine_stats<float_type>* stats=nullptr)
             {
                 using namespace Eigen;
+                FF_TRACE_SPAN("refine_ifss", trace::current_frame, block);
+                FF_ALLOC_SCOPE("refine_ifss");
+                static metrics::counter& refined_cells = metrics::get_counter("ffbidx_refine_cells_total{method=\"ifss\"}", "Number of refined cells");
+                static metrics::counter& refine_iterations = metrics::get_counter("ffbidx_refine_iterations_total{method=\"ifss\"}", "Number of refinement iterations over all cells");
+                static metrics::histogram& refine_seconds = metrics::get_histogram("ffbidx_refine_seconds{method=\"ifss\"}", "Refinement time of one cell block");
+                const auto refine_start = std::chrono::steady_clock::now();
+                unsigned total_iter = 0u;
                 using Mx3 = MatrixX3<float_type>;
                 using M3 = Matrix3<float_type>;
                 const unsigned nspots = spots.rows();
@@ -439,13 +494,23 @@ namespace fast_feedback {
                 for (unsigned j=startcell; j<endcell; j++) {
                     cell = cells.block(3u * j, 0u, 3u, 3u).transpose();  // cell: col vectors
                     float_type threshold = indexer<float_type>::score_parts(scores[j]).second;
+                    const unsigned cell_iter = total_iter;
+                    unsigned n_below = 0u;
+                    float_type last_threshold = threshold;
+                    refine_exit exit = refine_exit::max_iter;
                     for (unsigned niter=0; niter<cifss.max_iter; niter++) {
                         resid = spots * cell;   // coordinates in system <cell>
                         miller = round(resid.array());
                         resid -= miller;
                         below = (resid.rowwise().norm().array() < threshold);
-                        if (below.count() < cifss.min_spots)
+                        n_below = below.count();
+                        last_threshold = threshold;
+                        FF_PROBE(refine_iter, trace::current_frame, j, niter, n_below, probe::micro(threshold));
+                        if (n_below < cifss.min_spots) {
+                            exit = refine_exit::min_spots;
                             break;
+                        }
+                        total_iter++;
                         threshold *= cifss.threshold_contraction;
                         sel.colwise() = below;
                         HouseholderQR<Mx3> qr{sel.select(spots, .0f)};
@@ -461,15 +526,24 @@ namespace fast_feedback {
                             std::pop_heap(front, back, greater), --back;
                         scores(j) = *back;
                     }
+                    FF_PROBE(refine_cell, trace::current_frame, j, total_iter - cell_iter, probe::micro(scores(j)));
+                    if (stats != nullptr)
+                        stats[j] = refine_stats<float_type>{total_iter - cell_iter, n_below, last_threshold, exit};
                     cells.block(3u * j, 0u, 3u, 3u) = cell.transpose();
                 }
+                refined_cells.add(endcell > startcell ? endcell - startcell : 0u);
+                refine_iterations.add(total_iter);
+                refine_seconds.record(std::chrono::steady_clock::now() - refine_start);
             }
 
             // Refined result
             inline void index_end () override
             {
                 indexer<float_type>::index_end();
+                const auto refine_start = std::chrono::steady_clock::now();
                 refine(this->Spots(), this->ocells, this->scores, cifss);
+                if (this->output.time != nullptr)
+                    this->output.time->refine = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - refine_start).count();
             }
 
             // ifss configuration access
@@ -557,14 +631,23 @@ namespace fast_feedback {
             // output:
             // - cells      the refined cells
             // - scores     refined cell scores: largest distance of the min_spots closest to their approximated lattice points
+            // - stats      if not null, convergence record stats[j] for every refined cell j
             template<typename MatX3, typename VecX>
             inline static void refine (const Eigen::Ref<Eigen::MatrixX3<float_type>>& spots,
                                        Eigen::DenseBase<MatX3>& cells,
                                        Eigen::DenseBase<VecX>& scores,
                                        const config_ifse<float_type>& cifse,
-                                       unsigned block=0, unsigned nblocks=1)
+                                       unsigned block=0, unsigned nblocks=1,
+                                       refine_stats<float_type>* stats=nullptr)
             {
                 using namespace Eigen;
+                FF_TRACE_SPAN("refine_ifse", trace::current_frame, block);
+                FF_ALLOC_SCOPE("refine_ifse");
+                static metrics::counter& refined_cells = metrics::get_counter("ffbidx_refine_cells_total{method=\"ifse\"}", "Number of refined cells");
+                static metrics::counter& refine_iterations = metrics::get_counter("ffbidx_refine_iterations_total{method=\"ifse\"}", "Number of refinement iterations over all cells");
+                static metrics::histogram& refine_seconds = metrics::get_histogram("ffbidx_refine_seconds{method=\"ifse\"}", "Refinement time of one cell block");
+                const auto refine_start = std::chrono::steady_clock::now();
+                unsigned total_iter = 0u;
                 using Mx3 = MatrixX3<float_type>;
                 using M3 = Matrix3<float_type>;
                 const unsigned nspots = spots.rows();
@@ -580,13 +663,23 @@ namespace fast_feedback {
                 for (unsigned j=startcell; j<endcell; j++) {
                     cell = cells.block(3u * j, 0u, 3u, 3u).transpose();  // cell: col vectors
                     float_type threshold = indexer<float_type>::score_parts(scores[j]).second;
+                    const unsigned cell_iter = total_iter;
+                    unsigned n_below = 0u;
+                    float_type last_threshold = threshold;
+                    refine_exit exit = refine_exit::max_iter;
                     for (unsigned niter=0; niter<cifse.max_iter; niter++) {
                         resid = spots * cell;   // coordinates in system <cell>
                         miller = round(resid.array());
                         resid -= miller;
                         below = (resid.rowwise().norm().array() < threshold);
-                        if (below.count() < cifse.min_spots)
+                        n_below = below.count();
+                        last_threshold = threshold;
+                        FF_PROBE(refine_iter, trace::current_frame, j, niter, n_below, probe::micro(threshold));
+                        if (n_below < cifse.min_spots) {
+                            exit = refine_exit::min_spots;
                             break;
+                        }
+                        total_iter++;
                         threshold *= cifse.threshold_contraction;
                         sel.colwise() = below;
                         HouseholderQR<Mx3> qr{sel.select(spots, .0f)};
@@ -602,15 +695,24 @@ namespace fast_feedback {
                             std::pop_heap(front, back, greater), --back;
                         scores(j) = *back;
                     }
+                    FF_PROBE(refine_cell, trace::current_frame, j, total_iter - cell_iter, probe::micro(scores(j)));
+                    if (stats != nullptr)
+                        stats[j] = refine_stats<float_type>{total_iter - cell_iter, n_below, last_threshold, exit};
                     cells.block(3u * j, 0u, 3u, 3u) = cell.transpose();
                 }
+                refined_cells.add(endcell > startcell ? endcell - startcell : 0u);
+                refine_iterations.add(total_iter);
+                refine_seconds.record(std::chrono::steady_clock::now() - refine_start);
             }
 
             // Refined result
             inline void index_end () override
             {
                 indexer<float_type>::index_end();
+                const auto refine_start = std::chrono::steady_clock::now();
                 refine(this->Spots(), this->ocells, this->scores, cifse);
+                if (this->output.time != nullptr)
+                    this->output.time->refine = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - refine_start).count();
             }
 
             // ifse configuration access
@@ -666,10 +768,18 @@ namespace fast_feedback {
                                     float_type threshold=.02f, unsigned min_spots=9u)
         {
             using M3x = Eigen::MatrixX3<float_type>;
+            static metrics::counter& checked_cells = metrics::get_counter("ffbidx_viable_cell_checks_total", "Number of is_viable_cell calls");
+            static metrics::counter& viable_cells = metrics::get_counter("ffbidx_viable_cells_total", "Number of cells found viable by is_viable_cell");
             M3x resid = spots * cell.transpose();
             const M3x miller = round(resid.array());
             resid -= miller;
-            return (resid.rowwise().norm().array() < threshold).count() >= min_spots;
+            const unsigned n_close = (resid.rowwise().norm().array() < threshold).count();
+            const bool viable = n_close >= min_spots;
+            FF_PROBE(viable_cell, trace::current_frame, viable, n_close, min_spots);
+            checked_cells.add();
+            if (viable)
+                viable_cells.add();
+            return viable;
         }
 
         // Return indices of cells representing crystalls
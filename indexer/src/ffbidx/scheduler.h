@@ -0,0 +1,298 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#ifndef FAST_FEEDBACK_SCHEDULER_H
+#define FAST_FEEDBACK_SCHEDULER_H
+
+// Blocking work stealing scheduler for work item indices
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "ffbidx/mpmc_queue.h"
+
+namespace fast_feedback {
+    namespace scheduler {
+
+        // Work stealing scheduler for nonnegative integer work items
+        //
+        // Every worker has its own deque. Items pushed for a worker go to the back of
+        // its deque, and the worker pops from the back (LIFO, the item is likely still in cache).
+        // Items pushed without a worker, for instance from an indexer completion callback,
+        // go to a shared bounded injection queue. A worker without local items takes the oldest
+        // injected item, or steals the oldest item from another worker.
+        //
+        // Urgent items, like frames needing live feedback, are pushed with a deadline and
+        // served before all other items, earliest deadline first. Since workers get a new
+        // item after every work item stage, urgent items overtake the backlog at stage boundaries.
+        //
+        // Workers that don't find any item park on a condition variable instead of spinning,
+        // push() unparks one of them. Once stop() is called, pop() returns free
+        // as soon as no more items are found. The time every worker spent parked is
+        // accumulated, see parked().
+        class work_stealing final {
+          public:
+            using clock = std::chrono::steady_clock;
+            using deadline_t = clock::time_point;
+
+          private:
+            struct alignas(cache_line_size) item_deque final {
+                std::mutex lock;                // protect items
+                std::deque<int> items;          // work items
+                clock::duration parked{};       // time the owning worker spent parked
+                std::uint64_t parks = 0u;       // number of times the owning worker parked
+            };
+
+            struct urgent_item final {
+                deadline_t deadline;            // serve earliest deadline first
+                std::uint64_t seq;              // push order for equal deadlines
+                int item;                       // work item
+
+                inline bool operator> (const urgent_item& other) const noexcept
+                {
+                    return (deadline > other.deadline) || ((deadline == other.deadline) && (seq > other.seq));
+                }
+            };
+
+            struct alignas(cache_line_size) urgent_heap final {
+                std::mutex lock;                // protect items and seq
+                std::vector<urgent_item> items; // min heap on (deadline, seq)
+                std::uint64_t seq = 0u;         // next push sequence number
+            };
+
+            std::vector<std::unique_ptr<item_deque>> local;             // per worker deques
+            urgent_heap urgent;                                         // urgent items
+            mpmc_queue<int> injected;                                   // items pushed by non workers
+            alignas(cache_line_size) std::atomic<unsigned> n_urgent;    // number of queued urgent items
+            alignas(cache_line_size) std::atomic<unsigned> n_items;     // number of queued items
+            alignas(cache_line_size) std::atomic<unsigned> n_parked;    // number of parked workers
+            std::atomic_bool stopped;                                   // stop switch
+            std::mutex park_lock;                                       // protect parking
+            std::condition_variable park_cv;                            // parking spot
+
+            // Unpark a worker if necessary after an item has been queued
+            inline void unpark ()
+            {
+                n_items.fetch_add(1u);
+                if (n_parked.load() > 0u) {
+                    std::lock_guard<std::mutex> p_lock{park_lock};  // parking worker is either before its check or waiting
+                    park_cv.notify_one();
+                }
+            }
+
+            // Push item to the back of deque q and unpark a worker if necessary
+            inline void push_to (item_deque& q, int item)
+            {
+                {
+                    std::lock_guard<std::mutex> q_lock{q.lock};
+                    q.items.push_back(item);
+                }
+                unpark();
+            }
+
+            // Pop from the back (lifo=true) or front of deque q, return free if empty
+            inline int pop_from (item_deque& q, bool lifo) noexcept
+            {
+                int item = free;
+                {
+                    std::lock_guard<std::mutex> q_lock{q.lock};
+                    if (q.items.empty())
+                        return free;
+                    if (lifo) {
+                        item = q.items.back();
+                        q.items.pop_back();
+                    } else {
+                        item = q.items.front();
+                        q.items.pop_front();
+                    }
+                }
+                n_items.fetch_sub(1u);
+                return item;
+            }
+
+            // Pop the urgent item with the earliest deadline, return free if there is none
+            inline int pop_urgent () noexcept
+            {
+                if (n_urgent.load() == 0u)
+                    return free;
+                int item = free;
+                {
+                    std::lock_guard<std::mutex> u_lock{urgent.lock};
+                    if (urgent.items.empty())
+                        return free;
+                    std::pop_heap(std::begin(urgent.items), std::end(urgent.items), std::greater<urgent_item>{});
+                    item = urgent.items.back().item;
+                    urgent.items.pop_back();
+                    n_urgent.fetch_sub(1u);
+                }
+                n_items.fetch_sub(1u);
+                return item;
+            }
+
+          public:
+            constexpr static int free = -1;                             // no item
+            constexpr static deadline_t no_deadline = deadline_t::max(); // urgent item without deadline
+
+            explicit inline work_stealing (unsigned n_workers=1u, unsigned capacity=1024u)
+                : n_urgent{0u}, n_items{0u}, n_parked{0u}, stopped{false}
+            {
+                reset(n_workers, capacity);
+            }
+
+            work_stealing (const work_stealing&) = delete;
+            work_stealing& operator= (const work_stealing&) = delete;
+
+            // Drop all items, set the number of workers and the injection queue capacity
+            // Pushing more than capacity items without a worker spins until one is taken
+            // Must not be called while workers are active
+            inline void reset (unsigned n_workers, unsigned capacity=1024u)
+            {
+                local.clear();
+                for (unsigned i=0u; i<n_workers; i++)
+                    local.emplace_back(new item_deque{});
+                injected.reset(capacity);
+                urgent.items.clear();
+                urgent.items.reserve(capacity);
+                n_urgent.store(0u);
+                n_items.store(0u);
+                stopped.store(false);
+            }
+
+            // Number of workers
+            inline unsigned n_workers () const noexcept
+            {
+                return local.size();
+            }
+
+            // Push item for worker, any thread may call this
+            inline void push (int item, unsigned worker)
+            {
+                push_to(*local[worker], item);
+            }
+
+            // Push item for any worker, any thread may call this
+            inline void push (int item)
+            {
+                injected.push(item);
+                unpark();
+            }
+
+            // Push urgent item, any thread may call this
+            // Urgent items are served before all others, earliest deadline first,
+            // items with equal deadline (like no_deadline) in push order
+            inline void push_urgent (int item, deadline_t deadline=no_deadline)
+            {
+                {
+                    std::lock_guard<std::mutex> u_lock{urgent.lock};
+                    urgent.items.push_back(urgent_item{deadline, urgent.seq++, item});
+                    std::push_heap(std::begin(urgent.items), std::end(urgent.items), std::greater<urgent_item>{});
+                    n_urgent.fetch_add(1u); // before n_items, see try_pop
+                }
+                unpark();
+            }
+
+            // Get an item for worker without blocking, return free if there is none
+            inline int try_pop (unsigned worker) noexcept
+            {
+                if (n_items.load() == 0u)
+                    return free;
+                int item = pop_urgent();
+                if (item != free)
+                    return item;
+                item = pop_from(*local[worker], true);
+                if (item != free)
+                    return item;
+                if (injected.try_pop(item)) {
+                    n_items.fetch_sub(1u);
+                    return item;
+                }
+                const unsigned n = local.size();
+                for (unsigned i=1u; i<n; i++) {
+                    if ((item = pop_from(*local[(worker + i) % n], false)) != free)
+                        return item;
+                }
+                return free;
+            }
+
+            // Get an item for worker, park while there is none
+            // Return free if stop() has been called and there are no more items
+            inline int pop (unsigned worker)
+            {
+                do {
+                    int item = try_pop(worker);
+                    if (item != free)
+                        return item;
+                    item_deque& q = *local[worker];
+                    const auto t = clock::now();
+                    std::unique_lock<std::mutex> p_lock{park_lock};
+                    n_parked.fetch_add(1u);
+                    park_cv.wait(p_lock, [this]() { return (n_items.load() > 0u) || stopped.load(); });
+                    n_parked.fetch_sub(1u);
+                    q.parked += clock::now() - t;   // only the owning worker writes
+                    q.parks++;
+                    if (stopped.load() && (n_items.load() == 0u))
+                        return free;
+                } while (true);
+            }
+
+            // Unpark all workers and make pop() return free once there are no more items
+            inline void stop ()
+            {
+                stopped.store(true);
+                std::lock_guard<std::mutex> p_lock{park_lock};
+                park_cv.notify_all();
+            }
+
+            // Time worker spent parked since the last reset()
+            // Read it after the worker has stopped calling pop()
+            inline clock::duration parked (unsigned worker) const noexcept
+            {
+                return local[worker]->parked;
+            }
+
+            // Number of times worker parked since the last reset()
+            inline std::uint64_t parks (unsigned worker) const noexcept
+            {
+                return local[worker]->parks;
+            }
+
+            // Has stop() been called?
+            inline bool is_stopped () const noexcept
+            {
+                return stopped.load();
+            }
+        }; // work_stealing
+
+    } // namespace scheduler
+} // namespace fast_feedback
+
+#endif // FAST_FEEDBACK_SCHEDULER_H
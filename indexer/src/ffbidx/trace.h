@@ -0,0 +1,182 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#ifndef FAST_FEEDBACK_TRACE_H
+#define FAST_FEEDBACK_TRACE_H
+
+// Low overhead event tracing with Chrome/Perfetto JSON export
+//
+// Every thread writes fixed size records into its private ring buffer without locks,
+// older records are overwritten. Tracing is off unless enabled with trace::enable()
+// or the FFBIDX_TRACE environment variable, which names the file the trace is written
+// to at process exit. Define FF_NO_TRACE to compile the trace macros away.
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace fast_feedback {
+    namespace trace {
+
+        constexpr unsigned ring_size = 1u << 14;            // records per thread ring buffer, power of two
+        constexpr std::uint64_t no_frame = ~std::uint64_t{0u}; // frame id for records without a frame
+
+        // Tracing active flag, reacts to changes dynamically
+        inline std::atomic<bool> active{false};
+
+        inline bool enabled () noexcept
+        {
+            return active.load(std::memory_order_relaxed);
+        }
+
+        // Parse the FFBIDX_TRACE environment variable
+        // If set to a file name, tracing is enabled and the trace is written to the file at exit.
+        void init_trace ();
+
+        inline void enable (bool on=true) noexcept
+        {
+            active.store(on, std::memory_order_relaxed);
+        }
+
+        // Event id for name, the same name always gives the same id
+        // This takes a lock, keep the id in a static variable
+        unsigned event_id (const char* name);
+
+        // Nanoseconds since the trace epoch
+        inline std::uint64_t now () noexcept
+        {
+            using clock = std::chrono::steady_clock;
+            static const clock::time_point epoch = clock::now();
+            return (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - epoch).count();
+        }
+
+        // Append record to the ring buffer of the calling thread
+        // duration = ~0 marks an instant event
+        void record (unsigned event, std::uint64_t frame, std::uint64_t payload, std::uint64_t start, std::uint64_t duration) noexcept;
+
+        // Frame id for spans of the calling thread that don't name one
+        inline thread_local std::uint64_t current_frame = no_frame;
+
+        // Set current_frame for the lifetime of the object
+        class frame_scope final {
+            std::uint64_t previous;
+          public:
+            inline explicit frame_scope (std::uint64_t frame) noexcept
+                : previous{current_frame}
+            {
+                current_frame = frame;
+            }
+
+            inline ~frame_scope ()
+            {
+                current_frame = previous;
+            }
+
+            frame_scope (const frame_scope&) = delete;
+            frame_scope& operator= (const frame_scope&) = delete;
+        };
+
+        // Record one complete event from construction to destruction
+        class span final {
+            std::uint64_t start = 0u;
+            std::uint64_t frame;
+            std::uint64_t payload;
+            unsigned event;
+            bool on;
+          public:
+            inline span (unsigned event_, std::uint64_t frame_, std::uint64_t payload_=0u) noexcept
+                : frame{frame_}, payload{payload_}, event{event_}, on{enabled()}
+            {
+                if (on)
+                    start = now();
+            }
+
+            inline ~span ()
+            {
+                if (on)
+                    record(event, frame, payload, start, now() - start);
+            }
+
+            // Change the payload, e.g. to a result only known at the end of the span
+            inline void set_payload (std::uint64_t payload_) noexcept
+            {
+                payload = payload_;
+            }
+
+            span (const span&) = delete;
+            span& operator= (const span&) = delete;
+        };
+
+        // Record an instant event
+        inline void event (unsigned event_, std::uint64_t frame, std::uint64_t payload=0u) noexcept
+        {
+            if (enabled())
+                record(event_, frame, payload, now(), ~std::uint64_t{0u});
+        }
+
+        // Write all records in Chrome trace event JSON format, readable by chrome://tracing and Perfetto
+        // Records written concurrently might be missing.
+        void dump (std::ostream& out);
+
+        // Write trace to file
+        void dump (const std::string& file_name);
+
+        // Number of records lost before they could be dumped, summed over all threads
+        // Records are lost if they are overwritten, or if the ring buffer of an exited thread is reused.
+        std::uint64_t dropped ();
+
+        // Number of allocated ring buffers, at most the number of threads that trace concurrently
+        std::size_t n_rings ();
+
+    } // namespace trace
+} // namespace fast_feedback
+
+#define FF_TRACE_CONCAT_(a, b) a ## b
+#define FF_TRACE_CONCAT(a, b) FF_TRACE_CONCAT_(a, b)
+
+#ifndef FF_NO_TRACE
+    // Trace the enclosing scope as event name with frame id and payload
+    #define FF_TRACE_SPAN(name, frame, payload) \
+        static const unsigned FF_TRACE_CONCAT(ff_trace_id_, __LINE__) = fast_feedback::trace::event_id(name); \
+        fast_feedback::trace::span FF_TRACE_CONCAT(ff_trace_span_, __LINE__){FF_TRACE_CONCAT(ff_trace_id_, __LINE__), (std::uint64_t)(frame), (std::uint64_t)(payload)}
+    // Trace instant event name with frame id and payload
+    #define FF_TRACE_EVENT(name, frame, payload) \
+        do { \
+            static const unsigned ff_trace_id = fast_feedback::trace::event_id(name); \
+            fast_feedback::trace::event(ff_trace_id, (std::uint64_t)(frame), (std::uint64_t)(payload)); \
+        } while (false)
+    // Set the frame id for spans in the enclosing scope of the calling thread
+    #define FF_TRACE_FRAME(frame) \
+        fast_feedback::trace::frame_scope FF_TRACE_CONCAT(ff_trace_frame_, __LINE__){(std::uint64_t)(frame)}
+#else
+    #define FF_TRACE_SPAN(name, frame, payload) do {} while (false)
+    #define FF_TRACE_EVENT(name, frame, payload) do {} while (false)
+    #define FF_TRACE_FRAME(frame) do {} while (false)
+#endif
+
+#endif // FAST_FEEDBACK_TRACE_H
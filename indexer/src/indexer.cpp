@@ -24,8 +24,12 @@ Author: hans-christian.stadler@psi.ch
 */
 
 #include "ffbidx/exception.h"
+#include "ffbidx/alloc_count.h"
 #include "ffbidx/indexer.h"
 #include "ffbidx/indexer_gpu.h"
+#include "ffbidx/metrics.h"
+#include "ffbidx/probes.h"
+#include "ffbidx/trace.h"
 
 namespace fast_feedback {
 
@@ -51,13 +55,21 @@ namespace fast_feedback {
     void indexer<float_type>::index_start(const input<float_type>& in, output<float_type>& out, const config_runtime<float_type>& conf_rt,
                                           void(*callback)(void*), void* data)
     {
+        static metrics::counter& spots_processed = metrics::get_counter("ffbidx_spots_processed_total", "Number of spots given to index_start");
+        FF_ALLOC_SCOPE("index_start");
+        FF_PROBE(index_start, trace::current_frame, in.n_spots, in.n_cells);
         gpu::index_start(*this, in, out, conf_rt, callback, data);
+        spots_processed.add(in.n_spots);
     }
 
     template <typename float_type>
     void indexer<float_type>::index_end (output<float_type>& out)
     {
+        static metrics::counter& frames_indexed = metrics::get_counter("ffbidx_frames_indexed_total", "Number of completed index_end calls");
+        FF_ALLOC_SCOPE("index_end");
         gpu::index_end(*this, out);
+        frames_indexed.add();
+        FF_PROBE(index_end, trace::current_frame, out.n_cells, probe::micro(out.n_cells > 0u ? out.score[0] : float_type{}));
     }
 
     void memory_pin::pin(void* ptr, std::size_t size)
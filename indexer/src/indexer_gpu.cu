@@ -36,11 +36,17 @@ Author: hans-christian.stadler@psi.ch
 #include <limits>
 #include "ffbidx/exception.h"
 #include "ffbidx/log.h"
+#include "ffbidx/trace.h"
+#include "ffbidx/metrics.h"
+#include "ffbidx/probes.h"
 #include "ffbidx/indexer_gpu.h"
+#include "ffbidx/cand_groups.h"
 #include "cuda_runtime.h"
 #include <cub/block/block_radix_sort.cuh>
 
 namespace logger = fast_feedback::logger;
+namespace trace = fast_feedback::trace;
+namespace metrics = fast_feedback::metrics;
 using logger::stanza;
 
 namespace {
@@ -454,8 +460,12 @@ namespace {
 
         // Timings
         gpu_event<cudaEventDefault> start;
+        gpu_event<cudaEventDefault> candidates_end;
+        gpu_event<cudaEventDefault> cells_end;
         gpu_event<cudaEventDefault> end;
         time_point start_time{};
+        float preparation_time = .0f;                       // host preparation time in ms
+        bool timed = false;                                 // GPU events are recorded
 
         // GPU device
         int device;
@@ -654,117 +664,6 @@ namespace {
         }
     };
 
-    // Calculate vector candidate groups
-    //   All input cell vectors are mapped to a candidate vector group that uniquely represents the length of the vector.
-    //   crt.length_threshold determines if two vectors are considered to have the same length.
-    // Input Args:
-    //   in        : indexing input
-    //   crt       : runtime configuration
-    //   n_cells_in: number of considered input cells
-    // Output Args:
-    //   cand_idx: input cell vector to candidate vector group mapping (preallocated size: 3 * n_cells_in)
-    //   cand_len: sorted candidate vector group length                (preallocated size: 3 * n_cells_in, initialized to: 0)
-    // Return:
-    //   number of candidate vector groups N ∈ [1 ... 3 * n_cells_in]
-    template <typename float_type>
-    unsigned calc_cand_groups(std::vector<unsigned>& cand_idx, std::vector<float_type>& cand_len,
-                              const fast_feedback::input<float_type>& in,
-                              const fast_feedback::config_runtime<float_type>& crt, const unsigned n_cells_in)
-    {
-        const unsigned n_vecs = 3u * n_cells_in;
-
-        if (cand_idx.size() < n_vecs)
-            throw FF_EXCEPTION("candidate index vector too small");
-        if (cand_len.size() < n_vecs)
-            throw FF_EXCEPTION("candidate length vector too small");
-        
-        // All vector lengths
-        for (unsigned i=0u; i<n_vecs; i++) {
-            const auto x = in.cell.x[i];
-            const auto y = in.cell.y[i];
-            const auto z = in.cell.z[i];
-            cand_len[i] = std::sqrt(x*x + y*y + z*z);
-        }
-
-        unsigned n_cand_groups{};
-        {   // Only keep elements that differ by more than length_threshold
-            std::sort(std::begin(cand_len), std::end(cand_len), std::greater<float_type>{});
-
-            const float_type l_threshold = crt.length_threshold;
-            LOG_START(logger::l_debug) {
-                logger::debug << stanza << "candidate_length =";
-                for (const auto& e : cand_len)
-                    logger::debug << ' ' << e;
-                logger::debug << ", threshold = " << l_threshold << '\n';                
-            } LOG_END;
-            
-            unsigned i=0, j=1;
-            do {
-                if ((cand_len[i] - cand_len[j]) < l_threshold) {
-                    LOG_START(logger::l_debug) {
-                        logger::debug << stanza << "  ignore " << cand_len[j] << '\n';
-                    } LOG_END;
-                } else if (++i != j) {
-                    cand_len[i] = cand_len[j];
-                }
-            } while(++j != n_vecs);
-            n_cand_groups = i + 1;
-            for (unsigned i=0u; i<n_vecs; i++) {
-                const auto x = in.cell.x[i];
-                const auto y = in.cell.y[i];
-                const auto z = in.cell.z[i];
-                float_type length = std::sqrt(x*x + y*y + z*z);
-                auto it = std::lower_bound(std::cbegin(cand_len), std::cbegin(cand_len) + n_cand_groups, length,
-                                        [l_threshold](const float_type& a, const float_type& l) -> bool {
-                                                return (a - l) >= l_threshold;
-                                        });
-                cand_idx[i] = it - std::cbegin(cand_len);
-            }
-        }
-        return n_cand_groups;
-    }
-
-    // Calculate a candidate vector for each cell
-    //   Chose a vector for every input cell. This vector will be used for the initial half-sphere brute force sampling step.
-    //   The algorithm relies on the decreasing order of the candidate group lengths and corresponding indices in cand_idx.
-    //   So a lower candidate vector group index in cand_idx means a longer vector.
-    // Input Args:
-    //   cand_idx: input cell vector to candidate vector group mapping (see ordering requirement above, size 3 * n_cells_in)
-    // Output Args:
-    //   cell_vec: cell to chosen input vector mapping (preallocated size: n_cells_in)
-    //   vec_cand: candidate groups of chosen input vectors (preallocated size: n_cells_in)
-    // Return:
-    //   Number of candidate groups for the chosen vectors
-    unsigned calc_cell_cand(std::vector<unsigned>& cell_vec, std::vector<unsigned>& vec_cand,
-                            const std::vector<unsigned>& cand_idx, const unsigned n_cells_in)
-    {
-        const unsigned n_vecs = 3u * n_cells_in;
-
-        if (cand_idx.size() < n_vecs)
-            throw FF_EXCEPTION("candidate index vector too small");
-        if (cell_vec.size() < n_cells_in)
-            throw FF_EXCEPTION("cell candidate vector too small");
-        if (vec_cand.size() < n_cells_in)
-            throw FF_EXCEPTION("candidate groups vector too small");
-
-        unsigned num_cand_grps = 0u;
-        unsigned vec = 0u;
-        for (unsigned cell=0u; cell<n_cells_in; cell++) {
-            unsigned cand = vec++;
-            for (unsigned v=1u; v<3u; vec++, v++) {
-                if (cand_idx[cand] > cand_idx[vec])
-                    cand = vec;
-            }
-            cell_vec[cell] = cand;
-            unsigned cand_grp = cand_idx[cand];
-            auto it = std::find(&vec_cand[0u], &vec_cand[num_cand_grps], cand_grp);
-            if (it == &vec_cand[num_cand_grps])
-                vec_cand[num_cand_grps++] = cand_grp;
-        }
-
-        return num_cand_grps;
-    }
-
     template<> std::mutex indexer_gpu_state<float>::state_update{};
     template<> indexer_gpu_state<float>::map_type indexer_gpu_state<float>::dev_ptr{};
 
@@ -1699,16 +1598,19 @@ namespace gpu {
         using gpu_state = indexer_gpu_state<float_type>;
         using clock = std::chrono::high_resolution_clock;
 
+        FF_TRACE_SPAN("index_start", trace::current_frame, in.n_spots);
         gpu_device::check_init();
         auto state_id = instance.state;
         auto& state = gpu_state::ref(state_id);
 
         gpu_device::set(state.device);
 
-        bool timing = logger::level_active<logger::l_info>();
-        if (timing) {
-            state.start_time = clock::now();
+        state.start_time = clock::now();    // for the indexing latency metric
+        state.timed = (out.time != nullptr) || logger::level_active<logger::l_info>();
+        if (state.timed) {
             state.start.init();
+            state.candidates_end.init();
+            state.cells_end.init();
             state.end.init();
         }
 
@@ -1769,8 +1671,13 @@ namespace gpu {
             gpu_state::copy_crt(state_id, conf_rt, stream);
             gpu_state::copy_in(state_id, instance.cpers, in, out, stream);
             gpu_state::init_cand(state_id, n_cand_groups, n_vec_cgrps, instance.cpers, candidate_length, candidate_idx, cell_candidate, vec_cgrps, stream);
-            state.start.record(stream);
+            if (state.timed) {
+                state.preparation_time = std::chrono::duration<float, std::milli>(clock::now() - state.start_time).count();
+                state.start.record(stream);
+            }
             gpu_find_candidates<float_type><<<n_blocks, n_threads, shared_sz, stream>>>(gpu_state::ptr(state_id).get());
+            if (state.timed)
+                state.candidates_end.record(stream);
         }
         {   // find cells
             const unsigned n_xblocks = (2.5 * std::sqrt(conf_rt.num_sample_points) + n_threads - 1.) / n_threads; // 2*pi*r^2 (half sphere) --> 2*pi*r (circumference)
@@ -1783,12 +1690,15 @@ namespace gpu {
             if (dbg_flag)
                 gpu_debug_out<float_type><<<1, 1, 0, stream>>>(gpu_state::ptr(state_id).get(), 0u);
             gpu_find_cells<float_type><<<n_blocks, n_threads, shared_sz, 0>>>(gpu_state::ptr(state_id).get());
+            if (state.timed)
+                state.cells_end.record(stream);
             if (dbg_flag)
                 gpu_debug_out<float_type><<<1, 1, 0, stream>>>(gpu_state::ptr(state_id).get(), 1u);
             gpu_expand_cells<float_type><<<1, n_cells_out, 0, stream>>>(gpu_state::ptr(state_id).get(), n_xblocks * n_threads);
             if (dbg_flag)
                 gpu_debug_out<float_type><<<1, 1, 0, stream>>>(gpu_state::ptr(state_id).get(), 2u);
-            state.end.record(stream);
+            if (state.timed)
+                state.end.record(stream);
         }
         if (host_callback != nullptr) {
             state.callback_mode = true;
@@ -1805,6 +1715,7 @@ namespace gpu {
         using duration = std::chrono::duration<double, std::milli>;
         using time_point = std::chrono::time_point<clock>;
 
+        FF_TRACE_SPAN("index_end", trace::current_frame, out.n_cells);
         auto state_id = instance.state;
         auto& state = gpu_state::ref(state_id);
 
@@ -1814,9 +1725,26 @@ namespace gpu {
             stream.sync();
         state.callback_mode = false;
 
+        time_point copy_start = clock::now();
         gpu_state::copy_out(state_id, out, stream); // synchronizes on stream
-        if (logger::level_active<logger::l_info>()) {
-            time_point end = clock::now();
+        time_point end = clock::now();
+        {
+            static metrics::histogram& index_seconds = metrics::get_histogram("ffbidx_index_seconds", "Indexing latency from index_start to the end of index_end");
+            index_seconds.record(end - state.start_time);
+        }
+        if (out.time != nullptr) {
+            timing& t = *out.time;
+            t = timing{};
+            if (state.timed) {
+                t.preparation = state.preparation_time;
+                t.candidates = gpu_timing(state.start, state.candidates_end);
+                t.cells = gpu_timing(state.candidates_end, state.cells_end);
+                t.expansion = gpu_timing(state.cells_end, state.end);
+            }
+            t.output = duration(end - copy_start).count();
+            t.total = duration(end - state.start_time).count();
+        }
+        if (state.timed && logger::level_active<logger::l_info>()) {
             duration elapsed = end - state.start_time;
             LOG_START(logger::l_info) {
                 logger::info << stanza << "indexing_time: " << elapsed.count() << "ms\n";
@@ -0,0 +1,393 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "ffbidx/metrics.h"
+#include "ffbidx/exception.h"
+
+namespace {
+
+    using namespace fast_feedback::metrics;
+
+    constexpr char FFBIDX_METRICS_FILE[] = "FFBIDX_METRICS_FILE";
+    constexpr char FFBIDX_METRICS_PORT[] = "FFBIDX_METRICS_PORT";
+
+    struct entry final {
+        std::string help;
+        std::unique_ptr<counter> cnt;
+        std::unique_ptr<histogram> hist;
+    };
+
+    // Registered metrics, never destroyed so metrics can be updated during process exit
+    struct registry final {
+        std::mutex lock;                    // protect metrics map
+        std::map<std::string, entry> metrics;
+    };
+
+    registry& reg ()
+    {
+        static registry* r = new registry{};
+        return *r;
+    }
+
+    // Name without labels
+    std::string base_name (const std::string& name)
+    {
+        return name.substr(0u, name.find('{'));
+    }
+
+    // Labels without braces, empty if there are none
+    std::string labels (const std::string& name)
+    {
+        const auto start = name.find('{');
+        if (start == std::string::npos)
+            return {};
+        const auto end = name.rfind('}');
+        if ((end == std::string::npos) || (end <= start))
+            return {};
+        return name.substr(start + 1u, end - start - 1u);
+    }
+
+    // Write labels plus an extra label
+    void write_labels (std::ostream& out, const std::string& lbl, const std::string& extra={})
+    {
+        if (lbl.empty() && extra.empty())
+            return;
+        out << '{' << lbl;
+        if (! lbl.empty() && ! extra.empty())
+            out << ',';
+        out << extra << '}';
+    }
+
+    // Periodic file writer and minimal HTTP server
+    struct exporter final {
+        std::string file_name;
+        int listen_fd = -1;
+        int wake_fd = -1;
+        std::chrono::milliseconds interval;
+        std::atomic<bool> stopped{false};
+        std::thread worker;
+
+        exporter (const std::string& fname, unsigned port, double interval_s)
+            : file_name{fname}, interval{std::max(std::int64_t{1}, (std::int64_t)(interval_s * 1000.))}
+        {
+            if (port != 0u) {
+                listen_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (listen_fd < 0)
+                    throw FF_EXCEPTION_OBJ << "unable to create metrics socket: " << std::strerror(errno);
+                int on = 1;
+                ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+                sockaddr_in addr{};
+                addr.sin_family = AF_INET;
+                addr.sin_port = htons((std::uint16_t)port);
+                addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                if ((::bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0) || (::listen(listen_fd, 8) != 0)) {
+                    const int err = errno;
+                    ::close(listen_fd);
+                    throw FF_EXCEPTION_OBJ << "unable to listen on metrics port " << port << ": " << std::strerror(err);
+                }
+            }
+            wake_fd = ::eventfd(0, EFD_CLOEXEC);
+            if (wake_fd < 0) {
+                if (listen_fd >= 0)
+                    ::close(listen_fd);
+                throw FF_EXCEPTION_OBJ << "unable to create metrics exporter eventfd: " << std::strerror(errno);
+            }
+            worker = std::thread{&exporter::run, this};
+        }
+
+        ~exporter ()
+        {
+            stopped.store(true);
+            std::uint64_t one = 1u;
+            [[maybe_unused]] auto res = ::write(wake_fd, &one, sizeof(one));
+            if (worker.joinable())
+                worker.join();
+            write_file();
+            if (listen_fd >= 0)
+                ::close(listen_fd);
+            ::close(wake_fd);
+        }
+
+        // Replace file content atomically
+        void write_file () noexcept
+        {
+            if (file_name.empty())
+                return;
+            try {
+                const std::string tmp_name = file_name + ".tmp";
+                {
+                    std::ofstream out(tmp_name);
+                    write_prometheus(out);
+                    if (! out)
+                        return;
+                }
+                std::rename(tmp_name.c_str(), file_name.c_str());
+            } catch (...) {
+                // ignore, try again next time
+            }
+        }
+
+        // Answer one HTTP request with the metrics
+        void serve () noexcept
+        {
+            const int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+            try {
+                timeval tv{1, 0};
+                ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+                std::array<char, 4096> request;
+                const auto n = ::recv(fd, request.data(), request.size() - 1u, 0);
+                std::ostringstream body;
+                std::string status = "200 OK";
+                if ((n < 4) || std::strncmp(request.data(), "GET ", 4u) != 0)
+                    status = "400 Bad Request";
+                else
+                    write_prometheus(body);
+                const std::string content = body.str();
+                std::ostringstream response;
+                response << "HTTP/1.0 " << status << "\r\n"
+                         << "Content-Type: text/plain; version=0.0.4\r\n"
+                         << "Content-Length: " << content.size() << "\r\n"
+                         << "Connection: close\r\n\r\n" << content;
+                const std::string data = response.str();
+                for (std::size_t sent=0u; sent<data.size();) {
+                    const auto m = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+                    if (m <= 0)
+                        break;
+                    sent += (std::size_t)m;
+                }
+            } catch (...) {
+                // ignore, the client will retry
+            }
+            ::close(fd);
+        }
+
+        void run () noexcept
+        {
+            using clock = std::chrono::steady_clock;
+            auto next = clock::now();
+            while (! stopped.load()) {
+                const auto now = clock::now();
+                if (now >= next) {
+                    write_file();
+                    next = now + interval;
+                }
+                pollfd fds[2] = {{wake_fd, POLLIN, 0}, {listen_fd, POLLIN, 0}};
+                const int timeout = (int)std::chrono::duration_cast<std::chrono::milliseconds>(next - clock::now()).count();
+                const int n = ::poll(fds, (listen_fd >= 0) ? 2 : 1, std::max(timeout, 0));
+                if ((n > 0) && (listen_fd >= 0) && (fds[1].revents & POLLIN))
+                    serve();
+            }
+        }
+    };
+
+    std::mutex exporter_lock;                   // protect the_exporter
+    exporter* the_exporter = nullptr;           // running exporter
+
+    [[maybe_unused]] const bool metrics_initialized = []() {
+        try {
+            init_metrics();
+        } catch (std::exception& ex) {
+            std::cerr << "Error: " << ex.what() << '\n';
+        }
+        return true;
+    }();
+
+} // namespace
+
+namespace fast_feedback {
+    namespace metrics {
+
+        histogram::snapshot_t histogram::snapshot () const
+        {
+            snapshot_t snap;
+            std::vector<std::uint64_t> counts(n_buckets, 0u);
+            std::uint64_t sum = 0u;
+            for (const auto& s : shards) {
+                for (unsigned i=0u; i<n_buckets; i++)
+                    counts[i] += s.counts[i].load(std::memory_order_relaxed);
+                sum += s.sum.load(std::memory_order_relaxed);
+            }
+            std::uint64_t cumulative = 0u;
+            for (unsigned i=0u; i<n_buckets; i++) {
+                cumulative += counts[i];
+                const double bound = (i + 1u < n_buckets) ? (double)(std::uint64_t{1u} << (low + i)) * scale_
+                                                          : std::numeric_limits<double>::infinity();
+                snap.buckets.emplace_back(bound, cumulative);
+            }
+            snap.count = cumulative;
+            snap.sum = (double)sum * scale_;
+            return snap;
+        }
+
+        counter& get_counter (const std::string& name, const std::string& help)
+        {
+            registry& r = reg();
+            std::lock_guard<std::mutex> guard{r.lock};
+            entry& e = r.metrics[name];
+            if (e.hist)
+                throw FF_EXCEPTION_OBJ << "metric " << name << " is a histogram";
+            if (! e.cnt) {
+                e.help = help;
+                e.cnt.reset(new counter{});
+            }
+            return *e.cnt;
+        }
+
+        histogram& get_histogram (const std::string& name, const std::string& help, double scale, unsigned low_bits, unsigned high_bits)
+        {
+            if ((high_bits < low_bits) || (high_bits - low_bits + 2u > histogram::max_buckets) || (high_bits > 63u))
+                throw FF_EXCEPTION_OBJ << "illegal bucket range [" << low_bits << ", " << high_bits << "] for metric " << name;
+            registry& r = reg();
+            std::lock_guard<std::mutex> guard{r.lock};
+            entry& e = r.metrics[name];
+            if (e.cnt)
+                throw FF_EXCEPTION_OBJ << "metric " << name << " is a counter";
+            if (! e.hist) {
+                e.help = help;
+                e.hist.reset(new histogram{scale, low_bits, high_bits});
+            } else if ((e.hist->scale() != scale) || (e.hist->low_bits() != low_bits) || (e.hist->high_bits() != high_bits)) {
+                throw FF_EXCEPTION_OBJ << "metric " << name << " registered with a different bucket layout";
+            }
+            return *e.hist;
+        }
+
+        std::vector<sample> collect ()
+        {
+            std::vector<sample> samples;
+            registry& r = reg();
+            std::lock_guard<std::mutex> guard{r.lock};
+            for (const auto& [name, e] : r.metrics) {
+                if (e.cnt)
+                    samples.push_back(sample{name, e.help, false, e.cnt->value(), {}});
+                else if (e.hist)
+                    samples.push_back(sample{name, e.help, true, 0u, e.hist->snapshot()});
+            }
+            return samples;
+        }
+
+        void write_prometheus (std::ostream& out)
+        {
+            std::map<std::string, std::vector<sample>> families;    // base name --> samples
+            for (auto& s : collect())
+                families[base_name(s.name)].push_back(std::move(s));
+
+            const auto flags = out.flags();
+            const auto precision = out.precision(12);
+            for (const auto& [base, samples] : families) {
+                out << "# HELP " << base << ' ' << samples.front().help << '\n'
+                    << "# TYPE " << base << ' ' << (samples.front().is_histogram ? "histogram" : "counter") << '\n';
+                for (const auto& s : samples) {
+                    const std::string lbl = labels(s.name);
+                    if (! s.is_histogram) {
+                        out << base;
+                        write_labels(out, lbl);
+                        out << ' ' << s.value << '\n';
+                        continue;
+                    }
+                    for (const auto& [bound, count] : s.hist.buckets) {
+                        std::ostringstream le;
+                        le.precision(12);
+                        le << "le=\"";
+                        if (bound == std::numeric_limits<double>::infinity())
+                            le << "+Inf";
+                        else
+                            le << bound;
+                        le << '"';
+                        out << base << "_bucket";
+                        write_labels(out, lbl, le.str());
+                        out << ' ' << count << '\n';
+                    }
+                    out << base << "_sum";
+                    write_labels(out, lbl);
+                    out << ' ' << s.hist.sum << '\n';
+                    out << base << "_count";
+                    write_labels(out, lbl);
+                    out << ' ' << s.hist.count << '\n';
+                }
+            }
+            out.precision(precision);
+            out.flags(flags);
+        }
+
+        void start_exporter (const std::string& file_name, unsigned port, double interval)
+        {
+            if (file_name.empty() && (port == 0u))
+                throw FF_EXCEPTION("metrics exporter needs a file name or a port");
+            if (! (interval > .0))
+                throw FF_EXCEPTION("nonpositive metrics exporter interval");
+            std::lock_guard<std::mutex> guard{exporter_lock};
+            delete the_exporter;
+            the_exporter = nullptr;
+            the_exporter = new exporter{file_name, port, interval};
+            static const bool stop_at_exit = (std::atexit(stop_exporter), true);
+            (void)stop_at_exit;
+        }
+
+        void stop_exporter ()
+        {
+            std::lock_guard<std::mutex> guard{exporter_lock};
+            delete the_exporter;
+            the_exporter = nullptr;
+        }
+
+        void init_metrics ()
+        {
+            const char* file_name = std::getenv(FFBIDX_METRICS_FILE);
+            const char* port_string = std::getenv(FFBIDX_METRICS_PORT);
+            unsigned port = 0u;
+            if ((port_string != nullptr) && (*port_string != '\0')) {
+                std::istringstream iss(port_string);
+                if (! (iss >> port) || ! iss.eof() || (port > 65535u))
+                    throw FF_EXCEPTION_OBJ << "illegal value for " << FFBIDX_METRICS_PORT << ": " << port_string;
+            }
+            const std::string fname = (file_name != nullptr) ? file_name : "";
+            if (fname.empty() && (port == 0u))
+                return;
+            start_exporter(fname, port);
+        }
+
+    } // namespace metrics
+} // namespace fast_feedback
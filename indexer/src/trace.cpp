@@ -0,0 +1,304 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "ffbidx/trace.h"
+#include "ffbidx/exception.h"
+
+namespace {
+
+    using namespace fast_feedback::trace;
+
+    constexpr char FFBIDX_TRACE[] = "FFBIDX_TRACE";
+    constexpr std::uint64_t ring_mask = ring_size - 1u;
+    constexpr std::uint64_t instant = ~std::uint64_t{0u};
+    static_assert((ring_size & ring_mask) == 0u, "ring size must be a power of two");
+
+    // Fixed size record ring buffer, written by one thread at a time
+    // Record words are relaxed atomics, so a concurrent dump reads them without data races.
+    struct ring final {
+        struct slot final {
+            std::atomic<std::uint64_t> start;
+            std::atomic<std::uint64_t> duration;
+            std::atomic<std::uint64_t> event;   // event id | thread id << 32
+            std::atomic<std::uint64_t> frame;
+            std::atomic<std::uint64_t> payload;
+        };
+
+        std::array<slot, ring_size> slots;
+        std::atomic<std::uint64_t> head{0u};    // number of records written so far
+        std::uint64_t dumped = 0u;              // head at the last dump, protected by the registry lock
+    };
+
+    struct record_t final {
+        std::uint64_t start;
+        std::uint64_t duration;
+        std::uint64_t event;
+        std::uint64_t frame;
+        std::uint64_t payload;
+    };
+
+    // Trace state, never destroyed so threads can trace during process exit
+    struct registry final {
+        std::mutex lock;                            // protect everything below
+        std::vector<std::unique_ptr<ring>> rings;   // all ring buffers
+        std::vector<ring*> unused;                  // ring buffers of exited threads
+        std::uint64_t recycled_drops = 0u;          // dropped records of reused ring buffers
+        std::vector<std::string> names;             // event id --> name
+        std::map<std::string, unsigned> ids;        // name --> event id
+        std::uint64_t n_threads = 0u;               // thread id source
+        std::string exit_file;                      // dump trace to this file at exit, if not empty
+    };
+
+    registry& reg ()
+    {
+        static registry* r = new registry{};
+        return *r;
+    }
+
+    // Ring buffer of the calling thread, handed over for reuse at thread exit
+    // Records of a reused ring buffer that haven't been dumped yet count as dropped.
+    struct thread_ring final {
+        ring* buf = nullptr;
+        std::uint64_t tid = 0u;
+
+        ~thread_ring ()
+        {
+            if (buf != nullptr) {
+                registry& r = reg();
+                std::lock_guard<std::mutex> guard{r.lock};
+                r.unused.push_back(buf);
+            }
+        }
+
+        // Get ring buffer, nullptr if it can't be allocated
+        inline ring* get () noexcept
+        {
+            if (buf == nullptr) {
+                try {
+                    registry& r = reg();
+                    std::lock_guard<std::mutex> guard{r.lock};
+                    if (! r.unused.empty()) {
+                        buf = r.unused.back();
+                        r.unused.pop_back();
+                        const std::uint64_t h = buf->head.load(std::memory_order_relaxed);
+                        const std::uint64_t overwritten = (h > ring_size) ? h - ring_size : 0u;
+                        r.recycled_drops += overwritten + h - std::max(overwritten, buf->dumped);   // plus undumped
+                        buf->head.store(0u, std::memory_order_relaxed);
+                        buf->dumped = 0u;
+                    } else {
+                        r.rings.emplace_back(new ring{});
+                        buf = r.rings.back().get();
+                    }
+                    tid = ++r.n_threads;
+                } catch (...) {
+                    buf = nullptr;
+                }
+            }
+            return buf;
+        }
+    };
+
+    thread_local thread_ring my_ring;
+
+    // Copy the valid records of ring buffer buf, registry lock held
+    void collect (ring& buf, std::vector<record_t>& records)
+    {
+        const std::uint64_t end = buf.head.load(std::memory_order_acquire);
+        buf.dumped = end;
+        const std::uint64_t begin = (end > ring_size) ? end - ring_size : 0u;
+        const std::size_t offset = records.size();
+        for (std::uint64_t i=begin; i<end; i++) {
+            const ring::slot& s = buf.slots[i & ring_mask];
+            records.push_back(record_t{s.start.load(std::memory_order_relaxed), s.duration.load(std::memory_order_relaxed),
+                                       s.event.load(std::memory_order_relaxed), s.frame.load(std::memory_order_relaxed),
+                                       s.payload.load(std::memory_order_relaxed)});
+        }
+        // drop records that might have been overwritten while copying
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const std::uint64_t now_end = buf.head.load(std::memory_order_relaxed);
+        const std::uint64_t valid = (now_end + 1u > ring_size) ? now_end + 1u - ring_size : 0u;    // slot of now_end might be in writing
+        if (valid > begin) {
+            const std::size_t n_invalid = std::min(valid - begin, end - begin);
+            records.erase(records.begin() + offset, records.begin() + offset + n_invalid);
+        }
+    }
+
+    // Write JSON string
+    void write_string (std::ostream& out, const std::string& str)
+    {
+        out << '"';
+        for (char c : str) {
+            if ((c == '"') || (c == '\\'))
+                out << '\\' << c;
+            else if ((unsigned char)c < 0x20u)
+                out << ' ';
+            else
+                out << c;
+        }
+        out << '"';
+    }
+
+    void dump_at_exit ()
+    {
+        try {
+            dump(reg().exit_file);
+        } catch (std::exception& ex) {
+            std::cerr << "Error: " << ex.what() << '\n';
+        }
+    }
+
+    [[maybe_unused]] const bool trace_initialized = (init_trace(), true);
+
+} // namespace
+
+namespace fast_feedback {
+    namespace trace {
+
+        void init_trace ()
+        {
+            const char* file_name = std::getenv(FFBIDX_TRACE);
+            if ((file_name == nullptr) || (*file_name == '\0'))
+                return;
+            registry& r = reg();
+            {
+                std::lock_guard<std::mutex> guard{r.lock};
+                if (! r.exit_file.empty())
+                    return;
+                r.exit_file = file_name;
+            }
+            std::atexit(dump_at_exit);
+            enable();
+        }
+
+        unsigned event_id (const char* name)
+        {
+            registry& r = reg();
+            std::lock_guard<std::mutex> guard{r.lock};
+            auto entry = r.ids.find(name);
+            if (entry != r.ids.end())
+                return entry->second;
+            const unsigned id = (unsigned)r.names.size();
+            r.names.emplace_back(name);
+            r.ids.emplace(name, id);
+            return id;
+        }
+
+        void record (unsigned event, std::uint64_t frame, std::uint64_t payload, std::uint64_t start, std::uint64_t duration) noexcept
+        {
+            ring* buf = my_ring.get();
+            if (buf == nullptr)
+                return;
+            const std::uint64_t h = buf->head.load(std::memory_order_relaxed);
+            ring::slot& s = buf->slots[h & ring_mask];
+            s.start.store(start, std::memory_order_relaxed);
+            s.duration.store(duration, std::memory_order_relaxed);
+            s.event.store(event | (my_ring.tid << 32u), std::memory_order_relaxed);
+            s.frame.store(frame, std::memory_order_relaxed);
+            s.payload.store(payload, std::memory_order_relaxed);
+            buf->head.store(h + 1u, std::memory_order_release);
+        }
+
+        void dump (std::ostream& out)
+        {
+            std::vector<record_t> records;
+            std::vector<std::string> names;
+            {
+                registry& r = reg();
+                std::lock_guard<std::mutex> guard{r.lock};
+                for (const auto& buf : r.rings)
+                    collect(*buf, records);
+                names = r.names;
+            }
+
+            const auto pid = ::getpid();
+            const auto flags = out.flags();
+            out << std::fixed << std::setprecision(3);
+            out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+            const char* sep = "\n";
+            for (const auto& rec : records) {
+                const unsigned id = (unsigned)(rec.event & 0xffffffffu);
+                const std::uint64_t tid = rec.event >> 32u;
+                out << sep << "{\"name\": ";
+                write_string(out, (id < names.size()) ? names[id] : std::string("unknown"));
+                out << ", \"cat\": \"ffbidx\", \"pid\": " << pid << ", \"tid\": " << tid
+                    << ", \"ts\": " << rec.start * 1e-3;
+                if (rec.duration == instant)
+                    out << ", \"ph\": \"i\", \"s\": \"t\"";
+                else
+                    out << ", \"ph\": \"X\", \"dur\": " << rec.duration * 1e-3;
+                out << ", \"args\": {";
+                if (rec.frame != no_frame)
+                    out << "\"frame\": " << rec.frame << ", ";
+                out << "\"payload\": " << rec.payload << "}}";
+                sep = ",\n";
+            }
+            out << "\n]}\n";
+            out.flags(flags);
+        }
+
+        void dump (const std::string& file_name)
+        {
+            std::ofstream out(file_name);
+            if (! out.is_open())
+                throw FF_EXCEPTION_OBJ << "unable to open trace file " << file_name;
+            dump(out);
+            if (! out)
+                throw FF_EXCEPTION_OBJ << "unable to write trace file " << file_name;
+        }
+
+        std::size_t n_rings ()
+        {
+            registry& r = reg();
+            std::lock_guard<std::mutex> guard{r.lock};
+            return r.rings.size();
+        }
+
+        std::uint64_t dropped ()
+        {
+            registry& r = reg();
+            std::lock_guard<std::mutex> guard{r.lock};
+            std::uint64_t n = r.recycled_drops;
+            for (const auto& buf : r.rings) {
+                const std::uint64_t h = buf->head.load(std::memory_order_acquire);
+                if (h > ring_size)
+                    n += h - ring_size;
+            }
+            return n;
+        }
+
+    } // namespace trace
+} // namespace fast_feedback
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+# Copyright 2022 Paul Scherrer Institute
+# BSD 3-Clause License, see LICENSE.md at the top level
+# Author: hans-christian.stadler@psi.ch
+
+"""Measure ffbidx.index throughput with several Python threads
+
+Every thread uses its own indexer handle. Since the GIL is released during
+indexing and refinement, throughput should scale with the number of threads
+until the GPU or the cpu cores are saturated.
+"""
+
+import argparse
+import sys
+import threading
+import time
+from pathlib import Path
+
+import numpy as np
+import ffbidx
+
+sys.path.insert(0, str(Path(__file__).resolve().parent.parent / "tests"))
+from common import random_frame  # noqa: E402, shared with the python module tests
+
+
+def run(n_threads, frames, args):
+    handles = [ffbidx.indexer(args.cells, 1, args.spots, args.cands) for _ in range(n_threads)]
+    barrier = threading.Barrier(n_threads + 1)
+
+    def work(handle, tid):
+        barrier.wait()
+        for i in range(tid, args.frames, n_threads):
+            spots, cell = frames[i % len(frames)]
+            ffbidx.index(handle, spots, cell, method=args.method, n_output_cells=args.cells)
+        barrier.wait()
+
+    threads = [threading.Thread(target=work, args=(h, t)) for t, h in enumerate(handles)]
+    for t in threads:
+        t.start()
+    barrier.wait()
+    t0 = time.perf_counter()
+    barrier.wait()
+    elapsed = time.perf_counter() - t0
+    for t in threads:
+        t.join()
+    for h in handles:
+        ffbidx.release(h)
+    return args.frames / elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--threads", default="1,2,4,8", help="comma separated thread counts")
+    parser.add_argument("--frames", type=int, default=400, help="frames per measurement")
+    parser.add_argument("--spots", type=int, default=200, help="spots per frame")
+    parser.add_argument("--cells", type=int, default=1, help="output cells")
+    parser.add_argument("--cands", type=int, default=32, help="candidate vectors")
+    parser.add_argument("--method", default="ifss", help="raw, ifss or ifse")
+    args = parser.parse_args()
+
+    rng = np.random.default_rng(42)
+    frames = [random_frame(rng, args.spots) for _ in range(16)]
+
+    base = None
+    print(f"{'threads':>8} {'frames/s':>12} {'speedup':>8}")
+    for n in (int(t) for t in args.threads.split(",")):
+        rate = run(n, frames, args)
+        base = base or rate
+        print(f"{n:>8} {rate:>12.1f} {rate / base:>8.2f}")
+
+
+if __name__ == "__main__":
+    main()
@@ -8,11 +8,27 @@
 #include <limits>
 #include <atomic>
 #include <map>
+#include <array>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
 #include <exception>
 #include <stdexcept>
 #include <string>
 #include <memory>
+#include <deque>
+#include <cstdint>
+#include <cerrno>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
 #include "ffbidx/refine.h"
+#include "ffbidx/metrics.h"
+#include "ffbidx/scheduler.h"
+#include "ffbidx/simple_data.h"
 
 namespace {
     using indexer_t = fast_feedback::indexer<float>;
@@ -23,9 +39,74 @@ namespace {
         indexer_t indexer;
         unsigned n_spots;
         unsigned n_input_cells;
+        std::atomic_bool in_use{false};     // handle is used by a call
     };
 
-    std::map<uint32_t, map_t> indexers{};
+    using entry_t = std::shared_ptr<map_t>;
+
+    // Handle table split into shards with their own lock
+    // Entries are shared pointers, so a released handle stays alive until calls using it are done
+    constexpr unsigned n_shards = 16u;
+
+    struct alignas(64) shard_t {
+        std::shared_mutex lock;                 // protect entries
+        std::map<uint32_t, entry_t> entries;    // handle --> indexer entry
+    };
+
+    std::array<shard_t, n_shards> indexers{};
+
+    inline shard_t& shard (uint32_t handle) noexcept
+    {
+        return indexers[handle % n_shards];
+    }
+
+    // Entry for handle, nullptr if the handle is invalid
+    entry_t find_entry (uint32_t handle)
+    {
+        shard_t& sh = shard(handle);
+        std::shared_lock<std::shared_mutex> lock{sh.lock};
+        auto it = sh.entries.find(handle);
+        if (it == sh.entries.end())
+            return entry_t{};
+        return it->second;
+    }
+
+    // Mark an entry as used for the lifetime of this object
+    // Python threads must not use the same handle concurrently
+    struct use_guard final {
+        map_t& entry;
+        bool acquired;
+
+        explicit inline use_guard(map_t& e) noexcept
+            : entry(e), acquired(! e.in_use.exchange(true))
+        {}
+
+        inline ~use_guard()
+        {
+            if (acquired)
+                entry.in_use.store(false);
+        }
+
+        use_guard(const use_guard&) = delete;
+        use_guard& operator=(const use_guard&) = delete;
+    };
+
+    // Release the GIL for the lifetime of this object
+    struct gil_release final {
+        PyThreadState* state;
+
+        inline gil_release() noexcept
+            : state(PyEval_SaveThread())
+        {}
+
+        inline ~gil_release()
+        {
+            PyEval_RestoreThread(state);
+        }
+
+        gil_release(const gil_release&) = delete;
+        gil_release& operator=(const gil_release&) = delete;
+    };
 
     PyObject* ffbidx_indexer_(PyObject *args, PyObject *kwds)
     {
@@ -58,9 +139,11 @@ namespace {
         uint32_t handle = (uint32_t)-1;
         try {
             handle = next_handle.fetch_add(1u);
-            if (indexers.count(handle) > 0)
+            entry_t entry{new map_t{indexer_t{cpers}, 0u, 0u}};
+            shard_t& sh = shard(handle);
+            std::unique_lock<std::shared_mutex> lock{sh.lock};
+            if (! sh.entries.emplace(handle, std::move(entry)).second)
                 throw std::runtime_error("unable to allocate handle: handle counter wraparound occurred");
-            indexers.emplace(handle, map_t{indexer_t{cpers}, 0u, 0u});
         } catch (std::exception& e) {
             PyErr_SetString(PyExc_RuntimeError, e.what());
             return nullptr;
@@ -69,100 +152,221 @@ namespace {
         return PyLong_FromLong((long)handle);
     }
 
-    PyObject* ffbidx_index_(PyObject *args, PyObject *kwds)
-    {
-        using std::numeric_limits;
-
-        constexpr const char* kw[] = {"handle",
-                                      "spots", "input_cells",
-                                      "method",
-                                      "length_threshold", "triml", "trimh", "delta",
-                                      "num_sample_points", "n_output_cells",
-                                      "contraction",
-                                      "min_spots", "n_iter",
-                                      nullptr};
-        long handle;
-        PyArrayObject* spots_ndarray = nullptr;
-        PyArrayObject* input_cells_ndarray = nullptr;
+    // Indexing and refinement parameters common to the index functions
+    struct index_params final {
         const char* method = "ifss";
         double length_threshold=1e-9, triml=.05, trimh=.15, delta=.1;
         long num_sample_points=32*1024, n_output_cells=1;
         double contraction=.8;
         long min_spots=6, n_iter=15;
-        if (PyArg_ParseTupleAndKeywords(args, kwds, "lO!O!|sddddlldll", (char**)kw,
-                                        &handle, &PyArray_Type, &spots_ndarray, &PyArray_Type, &input_cells_ndarray,
-                                        &method, &length_threshold, &triml, &trimh, &delta, &num_sample_points, &n_output_cells,
-                                        &contraction, &min_spots, &n_iter) == 0)
-            return nullptr;
+        std::string smethod{};
 
-        if (handle < 0 || handle > numeric_limits<unsigned>::max()) {
-            PyErr_SetString(PyExc_ValueError, "handle out of bounds for an unsigned integer");
-            return nullptr;
+        // Check parameter values, set python error and return false if they are invalid
+        bool check ()
+        {
+            using std::numeric_limits;
+
+            smethod = method;
+            if ((smethod != "raw") && (smethod != "ifss") && (smethod != "ifse")) {
+                PyErr_SetString(PyExc_ValueError, "method must be either raw, ifss, or ifse");
+                return false;
+            }
+
+            if (triml < .0) {
+                PyErr_SetString(PyExc_ValueError, "lower trim value < 0");
+                return false;
+            }
+
+            if (trimh > 0.5) {
+                PyErr_SetString(PyExc_ValueError, "higher trim value > 0.5");
+                return false;
+            }
+
+            if (triml > trimh) {
+                PyErr_SetString(PyExc_ValueError, "lower trim value > higher trim value");
+                return false;
+            }
+
+            if (delta + triml <= .0) {
+                PyErr_SetString(PyExc_ValueError, "delta + triml <= 0");
+                return false;
+            }
+
+            if (num_sample_points < 0 || num_sample_points > numeric_limits<unsigned>::max()) {
+                PyErr_SetString(PyExc_ValueError, "num_sample_points out of bounds for an unsigned integer");
+                return false;
+            }
+
+            if (n_output_cells < 0 || n_output_cells > numeric_limits<unsigned>::max()) {
+                PyErr_SetString(PyExc_ValueError, "n_output_cells out of bounds for an unsigned integer");
+                return false;
+            }
+
+            if (contraction <= .0) {
+                PyErr_SetString(PyExc_ValueError, "contraction parameter <= 0");
+                return false;
+            }
+
+            if (smethod == "ifss" && contraction >= 1.) {
+                PyErr_SetString(PyExc_ValueError, "contraction parameter >= 1");
+                return false;
+            }
+
+            if (min_spots < 4 || min_spots > numeric_limits<unsigned>::max()) {
+                PyErr_SetString(PyExc_ValueError, "min_spots outside of [4..max_uint]");
+                return false;
+            }
+
+            if (n_iter < 0 || n_iter > numeric_limits<unsigned>::max()) {
+                PyErr_SetString(PyExc_ValueError, "n_iter out of bounds for an unsigned integer");
+                return false;
+            }
+
+            return true;
         }
 
-        const std::string smethod{method};
-        if ((smethod != "raw") && (smethod != "ifss") && (smethod != "ifse")) {
-            PyErr_SetString(PyExc_ValueError, "method must be either raw, ifss, or ifse");
-            return nullptr;
+        // Runtime configuration, must be pinned for indexing
+        fast_feedback::config_runtime<float> config_runtime () const noexcept
+        {
+            return fast_feedback::config_runtime<float>{(float)length_threshold, (float)triml, (float)trimh, (float)delta, (unsigned)num_sample_points};
         }
 
-        if (triml < .0) {
-            PyErr_SetString(PyExc_ValueError, "lower trim value < 0");
-            return nullptr;
+        // Refine cells according to method, only cell block out of nblocks if given
+        template<typename MatX3, typename VecX>
+        void refine (const Eigen::Ref<Eigen::MatrixX3f>& spots, MatX3& cells, VecX& scores, unsigned block=0u, unsigned nblocks=1u) const
+        {
+            using namespace fast_feedback::refine;
+
+            if (smethod == "ifss") {
+                config_ifss<float> cifss{(float)contraction, (unsigned)min_spots, (unsigned)n_iter};
+                indexer_ifss<float>::refine(spots, cells, scores, cifss, block, nblocks);
+            } else if (smethod == "ifse") {
+                config_ifse<float> cifse{(float)contraction, (unsigned)min_spots, (unsigned)n_iter};
+                indexer_ifse<float>::refine(spots, cells, scores, cifse, block, nblocks);
+            }
         }
+    };
 
-        if (trimh > 0.5) {
-            PyErr_SetString(PyExc_ValueError, "higher trim value > 0.5");
-            return nullptr;
+    // Check handle value and get its entry marked as used, set python error and return false on failure
+    bool use_entry (long handle, entry_t& entry, std::unique_ptr<use_guard>& guard)
+    {
+        if (handle < 0 || handle > std::numeric_limits<unsigned>::max()) {
+            PyErr_SetString(PyExc_ValueError, "handle out of bounds for an unsigned integer");
+            return false;
         }
 
-        if (triml > trimh) {
-            PyErr_SetString(PyExc_ValueError, "lower trim value > higher trim value");
-            return nullptr;
+        entry = find_entry((uint32_t)handle);
+        if (! entry) {
+            PyErr_SetString(PyExc_RuntimeError, "invalid handle");
+            return false;
         }
 
-        if (delta + triml <= .0) {
-            PyErr_SetString(PyExc_ValueError, "delta + triml <= 0");
-            return nullptr;
+        guard.reset(new use_guard{*entry});
+        if (! guard->acquired) {
+            PyErr_SetString(PyExc_RuntimeError, "indexer handle is used concurrently by another thread");
+            return false;
         }
 
-        if (num_sample_points < 0 || num_sample_points > numeric_limits<unsigned>::max()) {
-            PyErr_SetString(PyExc_ValueError, "num_sample_points out of bounds for an unsigned integer");
-            return nullptr;
+        return true;
+    }
+
+    // Check 2 dimensional input cell array, set python error and return false if it is unsupported
+    bool check_input_cells (PyArrayObject* input_cells_ndarray, npy_intp& n_input_cells)
+    {
+        if (PyArray_NDIM(input_cells_ndarray) != 2) {
+            PyErr_SetString(PyExc_RuntimeError, "input cells array must be 2 dimensional");
+            return false;
         }
 
-        if (n_output_cells < 0 || n_output_cells > numeric_limits<unsigned>::max()) {
-            PyErr_SetString(PyExc_ValueError, "n_output_cells out of bounds for an unsigned integer");
-            return nullptr;
+        if (PyArray_TYPE(input_cells_ndarray) != NPY_FLOAT32) {
+            PyErr_SetString(PyExc_RuntimeError, "only float32 input cell data is supported");
+            return false;
         }
 
-        if (contraction <= .0) {
-            PyErr_SetString(PyExc_ValueError, "contraction parameter <= 0");
-            return nullptr;
+        auto* shape = PyArray_DIMS(input_cells_ndarray);
+
+        if (PyArray_ISCARRAY(input_cells_ndarray)) {
+            if (shape[0] != 3) {
+                PyErr_SetString(PyExc_RuntimeError, "only shape (3, -1) CARRAY input cell data is supported");
+                return false;
+            }
+            if (shape[1] % 3 != 0) {
+                PyErr_SetString(PyExc_RuntimeError, "incomplete CARRAY input cell data");
+                return false;
+            }
+            n_input_cells = shape[1] / 3;
+        } else if (PyArray_ISFARRAY(input_cells_ndarray)) {
+            if (shape[1] != 3) {
+                PyErr_SetString(PyExc_RuntimeError, "only shape (-1, 3) FARRAY input cell data is supported");
+                return false;
+            }
+            if (shape[0] % 3 != 0) {
+                PyErr_SetString(PyExc_RuntimeError, "incomplete FARRAY input cell data");
+                return false;
+            }
+            n_input_cells = shape[0] / 3;
+        } else {
+            PyErr_SetString(PyExc_RuntimeError, "only NPY_ARRAY_CARRAY or NPY_ARRAY_FARRAY data is supported");
+            return false;
         }
 
-        if (smethod == "ifss" && contraction >= 1.) {
-            PyErr_SetString(PyExc_ValueError, "contraction parameter >= 1");
-            return nullptr;
+        if (n_input_cells <= 0) {
+            PyErr_SetString(PyExc_RuntimeError, "no input cells");
+            return false;
         }
 
-        if (min_spots < 4 || min_spots > numeric_limits<unsigned>::max()) {
-            PyErr_SetString(PyExc_ValueError, "min_spots outside of [4..max_uint]");
+        return true;
+    }
+
+    // Timing as dict with values in milliseconds
+    PyObject* timing_dict (const fast_feedback::timing& t)
+    {
+        return Py_BuildValue("{sfsfsfsfsfsfsf}", "preparation", t.preparation, "candidates", t.candidates, "cells", t.cells,
+                             "expansion", t.expansion, "output", t.output, "total", t.total, "refine", t.refine);
+    }
+
+    // Pack result tuple (cells, scores) or (cells, scores, timing), consumes the array references
+    PyObject* result_tuple (PyArrayObject* result, PyArrayObject* score, const fast_feedback::timing* t)
+    {
+        PyObject* tuple;
+        if (t != nullptr)
+            tuple = Py_BuildValue("(NNN)", result, score, timing_dict(*t));
+        else
+            tuple = Py_BuildValue("(NN)", result, score);
+        if (tuple == nullptr)
+            PyErr_SetString(PyExc_RuntimeError, "unable to create result tuple");
+        return tuple;
+    }
+
+    PyObject* ffbidx_index_(PyObject *args, PyObject *kwds)
+    {
+        constexpr const char* kw[] = {"handle",
+                                      "spots", "input_cells",
+                                      "method",
+                                      "length_threshold", "triml", "trimh", "delta",
+                                      "num_sample_points", "n_output_cells",
+                                      "contraction",
+                                      "min_spots", "n_iter",
+                                      "timing",
+                                      nullptr};
+        long handle;
+        PyArrayObject* spots_ndarray = nullptr;
+        PyArrayObject* input_cells_ndarray = nullptr;
+        index_params p{};
+        int want_timing = false;
+        if (PyArg_ParseTupleAndKeywords(args, kwds, "lO!O!|sddddlldllp", (char**)kw,
+                                        &handle, &PyArray_Type, &spots_ndarray, &PyArray_Type, &input_cells_ndarray,
+                                        &p.method, &p.length_threshold, &p.triml, &p.trimh, &p.delta, &p.num_sample_points, &p.n_output_cells,
+                                        &p.contraction, &p.min_spots, &p.n_iter, &want_timing) == 0)
             return nullptr;
-        }
 
-        if (n_iter < 0 || n_iter > numeric_limits<unsigned>::max()) {
-            PyErr_SetString(PyExc_ValueError, "n_iter out of bounds for an unsigned integer");
+        if (! p.check())
             return nullptr;
-        }
 
-        map_t* entry = nullptr;
-        try {
-            entry = &indexers.at((unsigned)handle);
-        } catch (std::out_of_range&) {
-            PyErr_SetString(PyExc_RuntimeError, "invalid handle");
+        entry_t entry;
+        std::unique_ptr<use_guard> guard;
+        if (! use_entry(handle, entry, guard))
             return nullptr;
-        }
 
         npy_intp n_spots = 0;
 
@@ -204,51 +408,10 @@ namespace {
 
         npy_intp n_input_cells = 0;
 
-        if (PyArray_NDIM(input_cells_ndarray) != 2) {
-            PyErr_SetString(PyExc_RuntimeError, "input cells array must be 2 dimensional");
-            return nullptr;
-        }
-
-        if (PyArray_TYPE(input_cells_ndarray) != NPY_FLOAT32) {
-            PyErr_SetString(PyExc_RuntimeError, "only float32 input cell data is supported");
-            return nullptr;
-        }
-
-        {
-            auto* shape = PyArray_DIMS(input_cells_ndarray);
-
-            if (PyArray_ISCARRAY(input_cells_ndarray)) {
-                if (shape[0] != 3) {
-                    PyErr_SetString(PyExc_RuntimeError, "only shape (3, -1) CARRAY input cell data is supported");
-                    return nullptr;
-                }
-                if (shape[1] % 3 != 0) {
-                    PyErr_SetString(PyExc_RuntimeError, "incomplete CARRAY input cell data");
-                    return nullptr;
-                }
-                n_input_cells = shape[1] / 3;
-            } else if (PyArray_ISFARRAY(input_cells_ndarray)) {
-                if (shape[1] != 3) {
-                    PyErr_SetString(PyExc_RuntimeError, "only shape (-1, 3) FARRAY input cell data is supported");
-                    return nullptr;
-                }
-                if (shape[0] % 3 != 0) {
-                    PyErr_SetString(PyExc_RuntimeError, "incomplete FARRAY input cell data");
-                    return nullptr;
-                }
-                n_input_cells = shape[0] / 3;
-            } else {
-                PyErr_SetString(PyExc_RuntimeError, "only NPY_ARRAY_CARRAY or NPY_ARRAY_FARRAY data is supported");
-                return nullptr;
-            }
-        }
-
-        if (n_input_cells <= 0) {
-            PyErr_SetString(PyExc_RuntimeError, "no input cells");
+        if (! check_input_cells(input_cells_ndarray, n_input_cells))
             return nullptr;
-        }
 
-        unsigned n_out = std::min((unsigned)n_output_cells, entry->indexer.cpers.max_output_cells);
+        unsigned n_out = std::min((unsigned)p.n_output_cells, entry->indexer.cpers.max_output_cells);
 
         PyArrayObject* result;
         {
@@ -268,10 +431,12 @@ namespace {
         }
 
         if (score == nullptr) {
+            Py_DECREF(result);
             PyErr_SetString(PyExc_RuntimeError, "unable to create score array");
             return nullptr;
         }
 
+        fast_feedback::timing t{};
         try {
             float* spot_data = (float*)PyArray_DATA(spots_ndarray);
             npy_intp spot_bytes = PyArray_NBYTES(spots_ndarray);
@@ -285,7 +450,7 @@ namespace {
             float* score_data = (float*)PyArray_DATA(score);
             npy_intp score_bytes = PyArray_NBYTES(score);
 
-            fast_feedback::config_runtime<float> crt{(float)length_threshold, (float)triml, (float)trimh, (float)delta, (unsigned)num_sample_points};
+            fast_feedback::config_runtime<float> crt = p.config_runtime();
 
             fast_feedback::memory_pin pin_crt{fast_feedback::memory_pin::on(crt)};
             fast_feedback::memory_pin pin_score{score_data, (std::size_t)score_bytes};
@@ -299,113 +464,2291 @@ namespace {
                 (unsigned)n_input_cells, (unsigned)n_spots,
                 true, true
             };
-            fast_feedback::output<float> output{&out_data[0], &out_data[3*n_out], &out_data[6*n_out], &score_data[0], n_out};
+            fast_feedback::output<float> output{&out_data[0], &out_data[3*n_out], &out_data[6*n_out], &score_data[0], n_out, want_timing ? &t : nullptr};
+
+            gil_release nogil{};    // no python API calls from here on
 
             entry->indexer.index(input, output, crt);
 
             entry->n_spots = n_spots;
             entry->n_input_cells = n_input_cells;
 
-            if (smethod != "raw") {
+            if (p.smethod != "raw") {
                 using namespace Eigen;
-                using namespace fast_feedback::refine;
                 Map<MatrixX3f> spots{spot_data, n_spots, 3};
                 Map<MatrixX3f> cells{out_data, 3*n_out, 3};
                 Map<VectorXf> scores{score_data, n_out};
-
-                if (smethod == "ifss") {
-                    config_ifss<float> cifss{(float)contraction, (unsigned)min_spots, (unsigned)n_iter};
-                    indexer_ifss<float>::refine(spots, cells, scores, cifss);
-                } else { // ifse
-                    config_ifse<float> cifse{(float)contraction, (unsigned)min_spots, (unsigned)n_iter};
-                    indexer_ifse<float>::refine(spots, cells, scores, cifse);
-                }
+                const auto refine_start = std::chrono::steady_clock::now();
+                p.refine(spots, cells, scores);
+                t.refine = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - refine_start).count();
             }
 
         } catch (std::exception& ex) {
             entry->n_spots = 0u;
             entry->n_input_cells = 0u;
+            Py_DECREF(result);
+            Py_DECREF(score);
             PyErr_SetString(PyExc_RuntimeError, ex.what());
             return nullptr;
         }
 
-        PyObject* tuple = PyTuple_Pack(2, result, score);
-        if (tuple == nullptr)
-            PyErr_SetString(PyExc_RuntimeError, "unable to create result tuple");
-        return tuple;
+        return result_tuple(result, score, want_timing ? &t : nullptr);
     }
 
-    PyObject* ffbidx_release_(PyObject *args, PyObject *kwds)
+    // Convert optional integer array argument to a contiguous int64 array of size n
+    // Set python error and return nullptr on failure, the caller owns the returned reference
+    PyArrayObject* int64_array (PyObject* obj, npy_intp n, const char* name)
     {
-        using std::numeric_limits;
-
-        constexpr const char* kw[] = {"handle", nullptr};
-        long handle;
-        if (PyArg_ParseTupleAndKeywords(args, kwds, "l", (char**)kw, &handle) == 0)
+        PyArrayObject* arr = (PyArrayObject*)PyArray_FROMANY(obj, NPY_INT64, 1, 1, NPY_ARRAY_CARRAY_RO);
+        if (arr == nullptr)
             return nullptr;
-
-        if (handle < 0 || handle > numeric_limits<unsigned>::max()) {
-            PyErr_SetString(PyExc_ValueError, "handle out of bounds for an unsigned integer");
+        if (PyArray_DIMS(arr)[0] != n) {
+            Py_DECREF(arr);
+            PyErr_Format(PyExc_RuntimeError, "%s must have %ld elements", name, (long)n);
             return nullptr;
         }
+        return arr;
+    }
 
-        if (indexers.erase((unsigned)handle) != 1) {
-            PyErr_SetString(PyExc_ValueError, "invalid handle");
-            return nullptr;
-        }
+    // Per frame spot ranges of padded (n_frames, 3, max_spots) or ragged (3, total_spots) float32 spot data,
+    // the x coordinates of frame f are at data[first[f]], y and z coordinates follow with stride spot_stride
+    struct frame_spots final {
+        float* data = nullptr;
+        npy_intp n_frames = 0;
+        npy_intp spot_stride = 0;
+        std::vector<npy_intp> first;
+        std::vector<npy_intp> count;
+
+        // Set python error and return false if the spot data or frame ranges are unsupported
+        bool init (PyArrayObject* spots_ndarray, PyObject* n_spots_obj, PyObject* offsets_obj)
+        {
+            if (PyArray_TYPE(spots_ndarray) != NPY_FLOAT32) {
+                PyErr_SetString(PyExc_RuntimeError, "only float32 spot data is supported");
+                return false;
+            }
 
-        Py_RETURN_NONE;
-    }
+            if (! PyArray_ISCARRAY(spots_ndarray)) {
+                PyErr_SetString(PyExc_RuntimeError, "only NPY_ARRAY_CARRAY spot data is supported");
+                return false;
+            }
 
-    void ffbidx_free(void *)
-    {
-        indexers.clear();
-    }
+            if (PyArray_NDIM(spots_ndarray) == 3) {     // padded (n_frames, 3, max_spots)
+                auto* shape = PyArray_DIMS(spots_ndarray);
+                if (shape[1] != 3) {
+                    PyErr_SetString(PyExc_RuntimeError, "only shape (-1, 3, -1) padded spot data is supported");
+                    return false;
+                }
+                if (offsets_obj != Py_None) {
+                    PyErr_SetString(PyExc_RuntimeError, "offsets are only supported for ragged spot data");
+                    return false;
+                }
+                n_frames = shape[0];
+                spot_stride = shape[2];
+                first.resize(n_frames);
+                count.assign(n_frames, spot_stride);
+                for (npy_intp f=0; f<n_frames; f++)
+                    first[f] = f * 3 * spot_stride;
+                if (n_spots_obj != Py_None) {
+                    PyArrayObject* n_spots = int64_array(n_spots_obj, n_frames, "n_spots_per_frame");
+                    if (n_spots == nullptr)
+                        return false;
+                    const int64_t* n = (const int64_t*)PyArray_DATA(n_spots);
+                    for (npy_intp f=0; f<n_frames; f++)
+                        count[f] = std::min((npy_intp)n[f], spot_stride);
+                    Py_DECREF(n_spots);
+                }
+            } else if (PyArray_NDIM(spots_ndarray) == 2) {  // ragged (3, total_spots) with offsets
+                auto* shape = PyArray_DIMS(spots_ndarray);
+                if (shape[0] != 3) {
+                    PyErr_SetString(PyExc_RuntimeError, "only shape (3, -1) ragged spot data is supported");
+                    return false;
+                }
+                spot_stride = shape[1];
+                if ((offsets_obj == Py_None) == (n_spots_obj == Py_None)) {
+                    PyErr_SetString(PyExc_RuntimeError, "ragged spot data needs either offsets or n_spots_per_frame");
+                    return false;
+                }
+                PyArrayObject* arr = nullptr;
+                if (offsets_obj != Py_None) {
+                    arr = (PyArrayObject*)PyArray_FROMANY(offsets_obj, NPY_INT64, 1, 1, NPY_ARRAY_CARRAY_RO);
+                    if (arr == nullptr)
+                        return false;
+                    n_frames = PyArray_DIMS(arr)[0] - 1;
+                } else {
+                    arr = (PyArrayObject*)PyArray_FROMANY(n_spots_obj, NPY_INT64, 1, 1, NPY_ARRAY_CARRAY_RO);
+                    if (arr == nullptr)
+                        return false;
+                    n_frames = PyArray_DIMS(arr)[0];
+                }
+                const int64_t* a = (const int64_t*)PyArray_DATA(arr);
+                first.resize(std::max(n_frames, npy_intp{0}));
+                count.resize(std::max(n_frames, npy_intp{0}));
+                npy_intp start = 0;
+                for (npy_intp f=0; f<n_frames; f++) {
+                    if (offsets_obj != Py_None) {
+                        start = a[f];
+                        count[f] = a[f+1] - a[f];
+                    } else {
+                        count[f] = a[f];
+                    }
+                    first[f] = start;
+                    if ((start < 0) || (count[f] < 0) || (start + count[f] > spot_stride)) {
+                        Py_DECREF(arr);
+                        PyErr_Format(PyExc_RuntimeError, "spots of frame %ld out of bounds", (long)f);
+                        return false;
+                    }
+                    start += count[f];
+                }
+                Py_DECREF(arr);
+            } else {
+                PyErr_SetString(PyExc_RuntimeError, "spots array must be 3 dimensional (padded) or 2 dimensional (ragged)");
+                return false;
+            }
 
-} // namespace
+            if (n_frames <= 0) {
+                PyErr_SetString(PyExc_RuntimeError, "no frames");
+                return false;
+            }
 
-extern "C" {
+            for (npy_intp f=0; f<n_frames; f++) {
+                if (count[f] <= 0) {
+                    PyErr_Format(PyExc_RuntimeError, "no spots in frame %ld", (long)f);
+                    return false;
+                }
+            }
 
-    PyObject* ffbidx_indexer([[maybe_unused]] PyObject *self, PyObject *args, PyObject *kwds)
+            data = (float*)PyArray_DATA(spots_ndarray);
+            return true;
+        }
+
+        // Spots of frame f as (count, 3) matrix
+        inline Eigen::Map<Eigen::MatrixX3f, 0, Eigen::OuterStride<>> operator() (npy_intp f) const
+        {
+            return Eigen::Map<Eigen::MatrixX3f, 0, Eigen::OuterStride<>>{&data[first[f]], count[f], 3, Eigen::OuterStride<>{spot_stride}};
+        }
+    };
+
+    // Check n_threads argument, 0 means one thread per hardware thread, set python error and return false if invalid
+    bool check_n_threads (long n_threads)
     {
-        return ffbidx_indexer_(args, kwds);
+        if (n_threads < 0 || n_threads > 1024) {
+            PyErr_SetString(PyExc_ValueError, "n_threads outside of [0..1024]");
+            return false;
+        }
+        return true;
     }
 
-    PyObject* ffbidx_index([[maybe_unused]] PyObject *self, PyObject *args, PyObject *kwds)
+    // Number of threads for a valid n_threads argument
+    inline long thread_count (long n_threads)
     {
-        return ffbidx_index_(args, kwds);
+        return (n_threads == 0) ? (long)std::max(1u, std::thread::hardware_concurrency()) : n_threads;
     }
 
-    PyObject* ffbidx_release([[maybe_unused]] PyObject *self, PyObject *args, PyObject *kwds)
+    PyObject* ffbidx_index_batch_(PyObject *args, PyObject *kwds)
     {
-        return ffbidx_release_(args, kwds);
-    }
+        using std::numeric_limits;
 
-    PyMethodDef ffbidx_methods[] = {
-        {"indexer", (PyCFunction)(void*)ffbidx_indexer, METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Get an indexer handle")},
-        {"index", (PyCFunction)(void*)ffbidx_index, METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Call indexer")},
-        {"release", (PyCFunction)(void*)ffbidx_release, METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Release indexer handle")},
-        {NULL, NULL, 0, NULL}
-    };
+        constexpr const char* kw[] = {"handle",
+                                      "spots", "n_spots_per_frame", "input_cells",
+                                      "offsets",
+                                      "method",
+                                      "length_threshold", "triml", "trimh", "delta",
+                                      "num_sample_points", "n_output_cells",
+                                      "contraction",
+                                      "min_spots", "n_iter",
+                                      "n_threads",
+                                      nullptr};
+        long handle;
+        PyArrayObject* spots_ndarray = nullptr;
+        PyObject* n_spots_obj = Py_None;
+        PyArrayObject* input_cells_ndarray = nullptr;
+        PyObject* offsets_obj = Py_None;
+        index_params p{};
+        long n_threads = 2;
+        if (PyArg_ParseTupleAndKeywords(args, kwds, "lO!OO!|Osddddlldlll", (char**)kw,
+                                        &handle, &PyArray_Type, &spots_ndarray, &n_spots_obj, &PyArray_Type, &input_cells_ndarray,
+                                        &offsets_obj,
+                                        &p.method, &p.length_threshold, &p.triml, &p.trimh, &p.delta, &p.num_sample_points, &p.n_output_cells,
+                                        &p.contraction, &p.min_spots, &p.n_iter, &n_threads) == 0)
+            return nullptr;
 
-    PyModuleDef ffbidx_module = {
-        .m_base = PyModuleDef_HEAD_INIT,
-        .m_name = "ffbidx",
-        .m_doc = PyDoc_STR("Fast feedback indexer"),
-        .m_size = -1,
-        .m_methods = ffbidx_methods,
-        .m_slots = nullptr,
-        .m_traverse = nullptr,
-        .m_clear = nullptr,
-        .m_free = ffbidx_free
-    };
+        if (! p.check() || ! check_n_threads(n_threads))
+            return nullptr;
 
-    PyMODINIT_FUNC PyInit_ffbidx(void)
-    {
-        import_array();
-        if (PyErr_Occurred())
+        entry_t entry;
+        std::unique_ptr<use_guard> guard;
+        if (! use_entry(handle, entry, guard))
             return nullptr;
-        PyObject *m = PyModule_Create(&ffbidx_module);
+
+        frame_spots fs;
+        if (! fs.init(spots_ndarray, n_spots_obj, offsets_obj))
+            return nullptr;
+        const npy_intp n_frames = fs.n_frames;
+        const npy_intp spot_stride = fs.spot_stride;
+        const auto& first = fs.first;
+        const auto& count = fs.count;
+
+        // input cells shared by all frames (3, 3*n_input_cells), or per frame (n_frames, 3, 3*n_input_cells)
+        npy_intp n_input_cells = 0;
+        npy_intp input_cell_stride = 0;
+        bool input_cells_per_frame = false;
+
+        if (PyArray_NDIM(input_cells_ndarray) == 3) {
+            auto* shape = PyArray_DIMS(input_cells_ndarray);
+            if ((PyArray_TYPE(input_cells_ndarray) != NPY_FLOAT32) || ! PyArray_ISCARRAY(input_cells_ndarray)) {
+                PyErr_SetString(PyExc_RuntimeError, "only float32 NPY_ARRAY_CARRAY per frame input cell data is supported");
+                return nullptr;
+            }
+            if ((shape[0] != n_frames) || (shape[1] != 3) || (shape[2] % 3 != 0) || (shape[2] == 0)) {
+                PyErr_SetString(PyExc_RuntimeError, "only shape (n_frames, 3, 3*n_input_cells) per frame input cell data is supported");
+                return nullptr;
+            }
+            n_input_cells = shape[2] / 3;
+            input_cell_stride = 3 * shape[2];
+            input_cells_per_frame = true;
+        } else if (! check_input_cells(input_cells_ndarray, n_input_cells)) {
+            return nullptr;
+        }
+
+        unsigned n_out = std::min((unsigned)p.n_output_cells, entry->indexer.cpers.max_output_cells);
+
+        PyArrayObject* result;
+        {
+            npy_intp result_dims[] = { n_frames, 3, 3 * n_out };
+            result = (PyArrayObject*)PyArray_SimpleNew(3, result_dims, NPY_FLOAT32);
+        }
+
+        if (result == nullptr) {
+            PyErr_SetString(PyExc_RuntimeError, "unable to create result array");
+            return nullptr;
+        }
+
+        PyArrayObject* score;
+        {
+            npy_intp score_dims[] = { n_frames, n_out };
+            score = (PyArrayObject*)PyArray_SimpleNew(2, score_dims, NPY_FLOAT32);
+        }
+
+        if (score == nullptr) {
+            Py_DECREF(result);
+            PyErr_SetString(PyExc_RuntimeError, "unable to create score array");
+            return nullptr;
+        }
+
+        try {
+            float* spot_data = (float*)PyArray_DATA(spots_ndarray);
+            float* input_cell_data = (float*)PyArray_DATA(input_cells_ndarray);
+            float* out_data = (float*)PyArray_DATA(result);
+            float* score_data = (float*)PyArray_DATA(score);
+
+            fast_feedback::config_runtime<float> crt = p.config_runtime();
+
+            // one pin per array for the whole batch
+            fast_feedback::memory_pin pin_crt{fast_feedback::memory_pin::on(crt)};
+            fast_feedback::memory_pin pin_score{score_data, (std::size_t)PyArray_NBYTES(score)};
+            fast_feedback::memory_pin pin_out{out_data, (std::size_t)PyArray_NBYTES(result)};
+            fast_feedback::memory_pin pin_spots{spot_data, (std::size_t)PyArray_NBYTES(spots_ndarray)};
+            fast_feedback::memory_pin pin_input_cells{input_cell_data, (std::size_t)PyArray_NBYTES(input_cells_ndarray)};
+
+            gil_release nogil{};    // no python API calls from here on
+
+            // frame f output cells and scores
+            auto frame_cells = [&](npy_intp f) { return &out_data[f * 9 * n_out]; };
+            auto frame_scores = [&](npy_intp f) { return &score_data[f * n_out]; };
+
+            // refine frame f
+            auto refine_frame = [&](npy_intp f) {
+                using namespace Eigen;
+                auto spots = fs(f);
+                Map<MatrixX3f> cells{frame_cells(f), 3*n_out, 3};
+                Map<VectorXf> scores{frame_scores(f), n_out};
+                p.refine(spots, cells, scores);
+            };
+
+            // refinement threads refine frames in order as soon as they are indexed,
+            // the calling thread indexes and refines each frame itself if no refinement thread runs
+            const bool refine = (p.smethod != "raw");
+            const long n_refiners = std::min((npy_intp)thread_count(n_threads) - 1, n_frames);
+            std::atomic<npy_intp> next_refine{0};   // next frame to refine
+            npy_intp n_indexed = 0;                 // number of indexed frames, protected by lock
+            bool failed = false;                    // stop all threads, protected by lock
+            std::exception_ptr error;               // first error, protected by lock
+            std::mutex lock;
+            std::condition_variable indexed_cv;
+
+            auto fail = [&](std::exception_ptr ex) {
+                std::lock_guard<std::mutex> l{lock};
+                if (! error)
+                    error = ex;
+                failed = true;
+                indexed_cv.notify_all();
+            };
+
+            auto refiner = [&]() {
+                try {
+                    do {
+                        const npy_intp f = next_refine.fetch_add(1);
+                        if (f >= n_frames)
+                            break;
+                        {
+                            std::unique_lock<std::mutex> l{lock};
+                            indexed_cv.wait(l, [&]() { return failed || (n_indexed > f); });
+                            if (failed)
+                                break;
+                        }
+                        refine_frame(f);
+                    } while (true);
+                } catch (...) {
+                    fail(std::current_exception());
+                }
+            };
+
+            std::vector<std::thread> refiners;
+            if (refine) {
+                refiners.reserve(n_refiners);
+                for (long i=0; i<n_refiners; i++) {
+                    try {
+                        refiners.emplace_back(refiner);
+                    } catch (std::system_error&) {
+                        break;      // go on with fewer threads
+                    }
+                }
+            }
+            const bool refine_inline = refine && refiners.empty();
+
+            try {
+                for (npy_intp f=0; f<n_frames; f++) {
+                    const float* cell_data = &input_cell_data[input_cells_per_frame ? f * input_cell_stride : 0];
+                    const fast_feedback::input<float> input{
+                        {(float*)&cell_data[0], (float*)&cell_data[3*n_input_cells], (float*)&cell_data[6*n_input_cells]},
+                        {&spot_data[first[f]], &spot_data[first[f] + spot_stride], &spot_data[first[f] + 2*spot_stride]},
+                        (unsigned)n_input_cells, (unsigned)count[f],
+                        (f == 0) || input_cells_per_frame, true
+                    };
+                    float* cells = frame_cells(f);
+                    fast_feedback::output<float> output{&cells[0], &cells[3*n_out], &cells[6*n_out], frame_scores(f), n_out};
+
+                    entry->indexer.index(input, output, crt);
+
+                    if (refine_inline) {
+                        refine_frame(f);
+                    } else {
+                        std::lock_guard<std::mutex> l{lock};
+                        if (failed)
+                            break;
+                        n_indexed = f + 1;
+                        indexed_cv.notify_all();
+                    }
+                }
+            } catch (...) {
+                fail(std::current_exception());
+            }
+
+            for (auto& t : refiners)
+                t.join();
+
+            entry->n_spots = count[n_frames - 1];
+            entry->n_input_cells = n_input_cells;
+
+            if (error)
+                std::rethrow_exception(error);
+
+        } catch (std::exception& ex) {
+            entry->n_spots = 0u;
+            entry->n_input_cells = 0u;
+            Py_DECREF(result);
+            Py_DECREF(score);
+            PyErr_SetString(PyExc_RuntimeError, ex.what());
+            return nullptr;
+        }
+
+        PyObject* tuple = PyTuple_Pack(2, result, score);
+        Py_DECREF(result);  // the tuple holds the references now
+        Py_DECREF(score);
+        if (tuple == nullptr)
+            PyErr_SetString(PyExc_RuntimeError, "unable to create result tuple");
+        return tuple;
+    }
+
+    // Stacked float32 CARRAY cells of shape (n_frames, 3, 3*n_cells)
+    // Cells of frame f are a (3*n_cells, 3) column major matrix like the ffbidx.index result
+    struct frame_cells final {
+        float* data = nullptr;
+        npy_intp n_frames = 0;
+        npy_intp n_cells = 0;
+
+        // Set python error and return false if arr is not supported
+        bool init (PyArrayObject* arr, const char* name, bool writeable=false)
+        {
+            if ((PyArray_TYPE(arr) != NPY_FLOAT32) || ! PyArray_ISCARRAY_RO(arr)) {
+                PyErr_Format(PyExc_RuntimeError, "only float32 NPY_ARRAY_CARRAY %s data is supported", name);
+                return false;
+            }
+            if (writeable && ! PyArray_ISWRITEABLE(arr)) {
+                PyErr_Format(PyExc_RuntimeError, "%s array must be writeable", name);
+                return false;
+            }
+            const auto* shape = PyArray_DIMS(arr);
+            if ((PyArray_NDIM(arr) != 3) || (shape[1] != 3) || (shape[2] % 3 != 0) || (shape[2] == 0)) {
+                PyErr_Format(PyExc_RuntimeError, "only shape (n_frames, 3, 3*n_cells) %s data is supported", name);
+                return false;
+            }
+            data = (float*)PyArray_DATA(arr);
+            n_frames = shape[0];
+            n_cells = shape[2] / 3;
+            return true;
+        }
+
+        // Cells of frame f
+        inline Eigen::Map<Eigen::MatrixX3f> operator() (npy_intp f) const
+        {
+            return Eigen::Map<Eigen::MatrixX3f>{&data[f * 9 * n_cells], 3 * n_cells, 3};
+        }
+    };
+
+    // Check stacked float32 CARRAY scores of shape (n_frames, n_cells), set python error and return false if unsupported
+    bool check_frame_scores (PyArrayObject* arr, npy_intp n_frames, npy_intp n_cells, bool writeable)
+    {
+        if ((PyArray_TYPE(arr) != NPY_FLOAT32) || ! PyArray_ISCARRAY_RO(arr) || (writeable && ! PyArray_ISWRITEABLE(arr))) {
+            PyErr_SetString(PyExc_RuntimeError, writeable ? "only writeable float32 NPY_ARRAY_CARRAY score data is supported"
+                                                          : "only float32 NPY_ARRAY_CARRAY score data is supported");
+            return false;
+        }
+        if ((PyArray_NDIM(arr) != 2) || (PyArray_DIMS(arr)[0] != n_frames) || (PyArray_DIMS(arr)[1] != n_cells)) {
+            PyErr_Format(PyExc_RuntimeError, "scores must have shape (%ld, %ld)", (long)n_frames, (long)n_cells);
+            return false;
+        }
+        return true;
+    }
+
+    // Call fn(i) for i in [0..n[ on up to n_threads threads including the calling thread, rethrow the first exception
+    // No python API calls are allowed in fn
+    template<typename Fn>
+    void parallel_for (npy_intp n, long n_threads, Fn&& fn)
+    {
+        n_threads = (long)std::min((npy_intp)thread_count(n_threads), n);
+
+        std::atomic<npy_intp> next{0};
+        std::exception_ptr error;
+        std::mutex lock;    // protect error
+
+        auto worker = [&]() {
+            try {
+                for (npy_intp i; (i = next.fetch_add(1)) < n;)
+                    fn(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> l{lock};
+                if (! error)
+                    error = std::current_exception();
+                next.store(n);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (long i=1; i<n_threads; i++) {
+            try {
+                threads.emplace_back(worker);
+            } catch (std::system_error&) {
+                break;      // go on with fewer threads
+            }
+        }
+        worker();
+        for (auto& t : threads)
+            t.join();
+
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    // Parse and check the spots, n_spots_per_frame and offsets arguments for n_frames frames
+    bool parse_frame_spots (frame_spots& fs, PyArrayObject* spots_ndarray, PyObject* n_spots_obj, PyObject* offsets_obj, npy_intp n_frames)
+    {
+        if (! fs.init(spots_ndarray, n_spots_obj, offsets_obj))
+            return false;
+        if (fs.n_frames != n_frames) {
+            PyErr_Format(PyExc_RuntimeError, "spots for %ld frames, but cells for %ld frames", (long)fs.n_frames, (long)n_frames);
+            return false;
+        }
+        return true;
+    }
+
+    PyObject* ffbidx_refine_(PyObject *args, PyObject *kwds)
+    {
+        constexpr const char* kw[] = {"spots", "cells", "scores",
+                                      "n_spots_per_frame", "offsets",
+                                      "method", "contraction", "min_spots", "n_iter",
+                                      "n_threads",
+                                      nullptr};
+        PyArrayObject* spots_ndarray = nullptr;
+        PyArrayObject* cells_ndarray = nullptr;
+        PyArrayObject* scores_ndarray = nullptr;
+        PyObject* n_spots_obj = Py_None;
+        PyObject* offsets_obj = Py_None;
+        index_params p{};
+        long n_threads = 0;
+        if (PyArg_ParseTupleAndKeywords(args, kwds, "O!O!O!|OOsdlll", (char**)kw,
+                                        &PyArray_Type, &spots_ndarray, &PyArray_Type, &cells_ndarray, &PyArray_Type, &scores_ndarray,
+                                        &n_spots_obj, &offsets_obj,
+                                        &p.method, &p.contraction, &p.min_spots, &p.n_iter,
+                                        &n_threads) == 0)
+            return nullptr;
+
+        if (! p.check() || ! check_n_threads(n_threads))
+            return nullptr;
+
+        frame_cells cells;
+        frame_spots spots;
+        if (! cells.init(cells_ndarray, "cells", true) ||
+            ! parse_frame_spots(spots, spots_ndarray, n_spots_obj, offsets_obj, cells.n_frames) ||
+            ! check_frame_scores(scores_ndarray, cells.n_frames, cells.n_cells, true))
+            return nullptr;
+
+        float* score_data = (float*)PyArray_DATA(scores_ndarray);
+
+        try {
+            gil_release nogil{};    // no python API calls from here on
+
+            // split frames into cell blocks if there are fewer frames than threads
+            const npy_intp n_frames = cells.n_frames;
+            const long n_workers = thread_count(n_threads);
+            const unsigned nblocks = (unsigned)std::min(cells.n_cells, std::max(npy_intp{1}, (n_workers + n_frames - 1) / n_frames));
+
+            parallel_for(n_frames * nblocks, n_threads, [&](npy_intp i) {
+                const npy_intp f = i / nblocks;
+                auto cell_map = cells(f);
+                Eigen::Map<Eigen::VectorXf> scores{&score_data[f * cells.n_cells], cells.n_cells};
+                p.refine(spots(f), cell_map, scores, (unsigned)(i % nblocks), nblocks);
+            });
+
+        } catch (std::exception& ex) {
+            PyErr_SetString(PyExc_RuntimeError, ex.what());
+            return nullptr;
+        }
+
+        return PyTuple_Pack(2, cells_ndarray, scores_ndarray);
+    }
+
+    PyObject* ffbidx_is_viable_cell_(PyObject *args, PyObject *kwds)
+    {
+        constexpr const char* kw[] = {"cells", "spots",
+                                      "n_spots_per_frame", "offsets",
+                                      "threshold", "min_spots",
+                                      "n_threads",
+                                      nullptr};
+        PyArrayObject* cells_ndarray = nullptr;
+        PyArrayObject* spots_ndarray = nullptr;
+        PyObject* n_spots_obj = Py_None;
+        PyObject* offsets_obj = Py_None;
+        double threshold = .02;
+        long min_spots = 9, n_threads = 0;
+        if (PyArg_ParseTupleAndKeywords(args, kwds, "O!O!|OOdll", (char**)kw,
+                                        &PyArray_Type, &cells_ndarray, &PyArray_Type, &spots_ndarray,
+                                        &n_spots_obj, &offsets_obj,
+                                        &threshold, &min_spots, &n_threads) == 0)
+            return nullptr;
+
+        if (min_spots < 0 || min_spots > std::numeric_limits<unsigned>::max()) {
+            PyErr_SetString(PyExc_ValueError, "min_spots out of bounds for an unsigned integer");
+            return nullptr;
+        }
+        if (! check_n_threads(n_threads))
+            return nullptr;
+
+        frame_cells cells;
+        frame_spots spots;
+        if (! cells.init(cells_ndarray, "cells") ||
+            ! parse_frame_spots(spots, spots_ndarray, n_spots_obj, offsets_obj, cells.n_frames))
+            return nullptr;
+
+        npy_intp result_dims[] = { cells.n_frames, cells.n_cells };
+        PyArrayObject* result = (PyArrayObject*)PyArray_SimpleNew(2, result_dims, NPY_BOOL);
+        if (result == nullptr) {
+            PyErr_SetString(PyExc_RuntimeError, "unable to create result array");
+            return nullptr;
+        }
+        npy_bool* viable = (npy_bool*)PyArray_DATA(result);
+
+        try {
+            gil_release nogil{};    // no python API calls from here on
+
+            parallel_for(cells.n_frames, n_threads, [&](npy_intp f) {
+                const auto cell_map = cells(f);
+                const auto spot_map = spots(f);
+                for (npy_intp j=0; j<cells.n_cells; j++)
+                    viable[f * cells.n_cells + j] = fast_feedback::refine::is_viable_cell(cell_map.block(3 * j, 0, 3, 3), spot_map, (float)threshold, (unsigned)min_spots);
+            });
+
+        } catch (std::exception& ex) {
+            Py_DECREF(result);
+            PyErr_SetString(PyExc_RuntimeError, ex.what());
+            return nullptr;
+        }
+
+        return (PyObject*)result;
+    }
+
+    PyObject* ffbidx_compute_crystalls_(PyObject *args, PyObject *kwds)
+    {
+        constexpr const char* kw[] = {"cells", "spots", "scores",
+                                      "n_spots_per_frame", "offsets",
+                                      "threshold", "min_spots",
+                                      "n_threads",
+                                      nullptr};
+        PyArrayObject* cells_ndarray = nullptr;
+        PyArrayObject* spots_ndarray = nullptr;
+        PyArrayObject* scores_ndarray = nullptr;
+        PyObject* n_spots_obj = Py_None;
+        PyObject* offsets_obj = Py_None;
+        double threshold = .02;
+        long min_spots = 9, n_threads = 0;
+        if (PyArg_ParseTupleAndKeywords(args, kwds, "O!O!O!|OOdll", (char**)kw,
+                                        &PyArray_Type, &cells_ndarray, &PyArray_Type, &spots_ndarray, &PyArray_Type, &scores_ndarray,
+                                        &n_spots_obj, &offsets_obj,
+                                        &threshold, &min_spots, &n_threads) == 0)
+            return nullptr;
+
+        if (min_spots < 0 || min_spots > std::numeric_limits<unsigned>::max()) {
+            PyErr_SetString(PyExc_ValueError, "min_spots out of bounds for an unsigned integer");
+            return nullptr;
+        }
+        if (! check_n_threads(n_threads))
+            return nullptr;
+
+        frame_cells cells;
+        frame_spots spots;
+        if (! cells.init(cells_ndarray, "cells") ||
+            ! parse_frame_spots(spots, spots_ndarray, n_spots_obj, offsets_obj, cells.n_frames) ||
+            ! check_frame_scores(scores_ndarray, cells.n_frames, cells.n_cells, false))
+            return nullptr;
+
+        const float* score_data = (const float*)PyArray_DATA(scores_ndarray);
+        std::vector<std::vector<unsigned>> crystalls(cells.n_frames);
+
+        try {
+            gil_release nogil{};    // no python API calls from here on
+
+            parallel_for(cells.n_frames, n_threads, [&](npy_intp f) {
+                Eigen::Map<const Eigen::VectorXf> scores{&score_data[f * cells.n_cells], cells.n_cells};
+                crystalls[f] = fast_feedback::refine::compute_crystalls(cells(f), spots(f), scores, (float)threshold, (unsigned)min_spots);
+            });
+
+        } catch (std::exception& ex) {
+            PyErr_SetString(PyExc_RuntimeError, ex.what());
+            return nullptr;
+        }
+
+        PyObject* list = PyList_New(cells.n_frames);
+        if (list == nullptr)
+            return nullptr;
+        for (npy_intp f=0; f<cells.n_frames; f++) {
+            npy_intp dim = crystalls[f].size();
+            PyArrayObject* arr = (PyArrayObject*)PyArray_SimpleNew(1, &dim, NPY_INT64);
+            if (arr == nullptr) {
+                Py_DECREF(list);
+                return nullptr;
+            }
+            std::copy(crystalls[f].cbegin(), crystalls[f].cend(), (int64_t*)PyArray_DATA(arr));
+            PyList_SET_ITEM(list, f, (PyObject*)arr);   // steals the reference
+        }
+        return list;
+    }
+
+    PyObject* ffbidx_cell_similarity_(PyObject *args, PyObject *kwds)
+    {
+        constexpr const char* kw[] = {"cells", "reference", "threshold", "n_threads", nullptr};
+        PyArrayObject* cells_ndarray = nullptr;
+        PyArrayObject* reference_ndarray = nullptr;
+        double threshold = .02;
+        long n_threads = 0;
+        if (PyArg_ParseTupleAndKeywords(args, kwds, "O!O!|dl", (char**)kw,
+                                        &PyArray_Type, &cells_ndarray, &PyArray_Type, &reference_ndarray,
+                                        &threshold, &n_threads) == 0)
+            return nullptr;
+
+        if (! check_n_threads(n_threads))
+            return nullptr;
+
+        frame_cells cells;
+        if (! cells.init(cells_ndarray, "cells"))
+            return nullptr;
+
+        // reference cell shared by all frames (3, 3), or per frame (n_frames, 3, 3)
+        if ((PyArray_TYPE(reference_ndarray) != NPY_FLOAT32) || ! PyArray_ISCARRAY_RO(reference_ndarray)) {
+            PyErr_SetString(PyExc_RuntimeError, "only float32 NPY_ARRAY_CARRAY reference cell data is supported");
+            return nullptr;
+        }
+        const auto* shape = PyArray_DIMS(reference_ndarray);
+        const int ndim = PyArray_NDIM(reference_ndarray);
+        if (! (((ndim == 2) && (shape[0] == 3) && (shape[1] == 3)) ||
+               ((ndim == 3) && (shape[0] == cells.n_frames) && (shape[1] == 3) && (shape[2] == 3)))) {
+            PyErr_SetString(PyExc_RuntimeError, "only shape (3, 3) or (n_frames, 3, 3) reference cell data is supported");
+            return nullptr;
+        }
+        const float* reference_data = (const float*)PyArray_DATA(reference_ndarray);
+        const npy_intp reference_stride = (ndim == 3) ? 9 : 0;
+
+        npy_intp result_dims[] = { cells.n_frames, cells.n_cells };
+        PyArrayObject* result = (PyArrayObject*)PyArray_SimpleNew(2, result_dims, NPY_FLOAT32);
+        if (result == nullptr) {
+            PyErr_SetString(PyExc_RuntimeError, "unable to create result array");
+            return nullptr;
+        }
+        float* similarity = (float*)PyArray_DATA(result);
+
+        try {
+            gil_release nogil{};    // no python API calls from here on
+
+            parallel_for(cells.n_frames, n_threads, [&](npy_intp f) {
+                const auto cell_map = cells(f);
+                Eigen::Map<const Eigen::Matrix3f> reference{&reference_data[f * reference_stride]};
+                for (npy_intp j=0; j<cells.n_cells; j++)
+                    similarity[f * cells.n_cells + j] = fast_feedback::refine::cell_similarity(cell_map.block(3 * j, 0, 3, 3), reference, (float)threshold);
+            });
+
+        } catch (std::exception& ex) {
+            Py_DECREF(result);
+            PyErr_SetString(PyExc_RuntimeError, ex.what());
+            return nullptr;
+        }
+
+        return (PyObject*)result;
+    }
+
+    PyObject* ffbidx_best_cell_(PyObject *args, PyObject *kwds)
+    {
+        constexpr const char* kw[] = {"scores", nullptr};
+        PyArrayObject* scores_ndarray = nullptr;
+        if (PyArg_ParseTupleAndKeywords(args, kwds, "O!", (char**)kw, &PyArray_Type, &scores_ndarray) == 0)
+            return nullptr;
+
+        if ((PyArray_NDIM(scores_ndarray) != 2) || (PyArray_DIMS(scores_ndarray)[1] == 0)) {
+            PyErr_SetString(PyExc_RuntimeError, "only shape (n_frames, n_cells) score data with n_cells > 0 is supported");
+            return nullptr;
+        }
+        const npy_intp n_frames = PyArray_DIMS(scores_ndarray)[0];
+        const npy_intp n_cells = PyArray_DIMS(scores_ndarray)[1];
+        if (! check_frame_scores(scores_ndarray, n_frames, n_cells, false))
+            return nullptr;
+        const float* score_data = (const float*)PyArray_DATA(scores_ndarray);
+
+        npy_intp result_dim = n_frames;
+        PyArrayObject* result = (PyArrayObject*)PyArray_SimpleNew(1, &result_dim, NPY_INT64);
+        if (result == nullptr) {
+            PyErr_SetString(PyExc_RuntimeError, "unable to create result array");
+            return nullptr;
+        }
+        int64_t* best = (int64_t*)PyArray_DATA(result);
+
+        for (npy_intp f=0; f<n_frames; f++)
+            best[f] = fast_feedback::refine::best_cell(Eigen::Map<const Eigen::VectorXf>{&score_data[f * n_cells], n_cells});
+
+        return (PyObject*)result;
+    }
+
+    PyObject* ffbidx_release_(PyObject *args, PyObject *kwds)
+    {
+        using std::numeric_limits;
+
+        constexpr const char* kw[] = {"handle", nullptr};
+        long handle;
+        if (PyArg_ParseTupleAndKeywords(args, kwds, "l", (char**)kw, &handle) == 0)
+            return nullptr;
+
+        if (handle < 0 || handle > numeric_limits<unsigned>::max()) {
+            PyErr_SetString(PyExc_ValueError, "handle out of bounds for an unsigned integer");
+            return nullptr;
+        }
+
+        entry_t entry;  // drop the indexer outside of the shard lock
+        {
+            shard_t& sh = shard((uint32_t)handle);
+            std::unique_lock<std::shared_mutex> lock{sh.lock};
+            auto it = sh.entries.find((uint32_t)handle);
+            if (it == sh.entries.end()) {
+                PyErr_SetString(PyExc_ValueError, "invalid handle");
+                return nullptr;
+            }
+            entry = std::move(it->second);
+            sh.entries.erase(it);
+        }
+
+        Py_RETURN_NONE;
+    }
+
+    // Pinned float buffer
+    struct pinned_buffer final {
+        float* ptr;
+
+        explicit inline pinned_buffer(std::size_t n)
+            : ptr((float*)fast_feedback::alloc_pinned(n * sizeof(float)))
+        {}
+
+        inline ~pinned_buffer()
+        {
+            fast_feedback::dealloc_pinned(ptr);
+        }
+
+        pinned_buffer(const pinned_buffer&) = delete;
+        pinned_buffer& operator=(const pinned_buffer&) = delete;
+    };
+
+    // Pinned staging area of an Indexer object, reused for every call
+    // Coordinates are stored as x, y, z rows with a fixed leading dimension
+    struct staging_t final {
+        const npy_intp ld_spots;    // spot coordinate row length: max_spots
+        const npy_intp ld_cells;    // input cell coordinate row length: 3 * max_input_cells
+        pinned_buffer spots;        // (3, ld_spots)
+        pinned_buffer input_cells;  // (3, ld_cells)
+        pinned_buffer cells;        // output cells (3, 3 * n_out), n_out <= max_output_cells
+        pinned_buffer scores;       // output cell scores (max_output_cells)
+        fast_feedback::pinned_ptr<fast_feedback::config_runtime<float>> crt;
+
+        explicit inline staging_t(const fast_feedback::config_persistent<float>& cpers)
+            : ld_spots(cpers.max_spots), ld_cells(3 * cpers.max_input_cells),
+              spots(3 * ld_spots), input_cells(3 * ld_cells),
+              cells(9 * cpers.max_output_cells), scores(cpers.max_output_cells),
+              crt(fast_feedback::alloc_pinned<fast_feedback::config_runtime<float>>())
+        {}
+    };
+
+    // Strided view of a 2 dimensional coordinate array as (3, n) with coordinate rows
+    // Shape (3, n) has coordinate rows, shape (n, 3) coordinate columns,
+    // a (3, 3) array has coordinate columns only if it is fortran contiguous (as for ffbidx.index)
+    struct coords_view final {
+        char* data;             // first element
+        npy_intp n;             // number of coordinate tripples
+        npy_intp coord_stride;  // byte stride between x, y, z
+        npy_intp elem_stride;   // byte stride between tripples
+        int type;               // NPY_FLOAT32 or NPY_FLOAT64
+
+        // Set python error and return false if arr is not a supported coordinate array
+        bool init (PyArrayObject* arr, const char* name)
+        {
+            if (PyArray_NDIM(arr) != 2) {
+                PyErr_Format(PyExc_RuntimeError, "%s array must be 2 dimensional", name);
+                return false;
+            }
+            type = PyArray_TYPE(arr);
+            if ((type != NPY_FLOAT32) && (type != NPY_FLOAT64)) {
+                PyErr_Format(PyExc_RuntimeError, "only float32 or float64 %s data is supported", name);
+                return false;
+            }
+            const auto* shape = PyArray_DIMS(arr);
+            const auto* strides = PyArray_STRIDES(arr);
+            const bool rows = (shape[0] == 3) && ((shape[1] != 3) || ! PyArray_ISFARRAY(arr));
+            if (! rows && (shape[1] != 3)) {
+                PyErr_Format(PyExc_RuntimeError, "only shape (3, -1) or (-1, 3) %s data is supported", name);
+                return false;
+            }
+            data = (char*)PyArray_DATA(arr);
+            n = rows ? shape[1] : shape[0];
+            coord_stride = rows ? strides[0] : strides[1];
+            elem_stride = rows ? strides[1] : strides[0];
+            return true;
+        }
+
+        // Copy to (3, n) row major destination with leading dimension ld
+        template<typename T>
+        void copy_to (float* dst, npy_intp ld) const noexcept
+        {
+            using namespace Eigen;
+            using RowMat = Matrix<T, 3, Dynamic, RowMajor>;
+            const npy_intp sz = sizeof(T);
+            if ((coord_stride % sz == 0) && (elem_stride % sz == 0)) { // vectorized copy
+                Map<const RowMat, 0, Stride<Dynamic, Dynamic>> src{(const T*)data, 3, n, Stride<Dynamic, Dynamic>{coord_stride / sz, elem_stride / sz}};
+                Map<Matrix<float, 3, Dynamic, RowMajor>, 0, OuterStride<>> to{dst, 3, n, OuterStride<>{ld}};
+                to = src.template cast<float>();
+            } else {                                                    // unaligned strides
+                for (npy_intp c=0; c<3; c++)
+                    for (npy_intp i=0; i<n; i++)
+                        dst[c * ld + i] = (float)*(const T*)&data[c * coord_stride + i * elem_stride];
+            }
+        }
+
+        // Copy to (3, n) row major float destination with leading dimension ld
+        void copy_to (float* dst, npy_intp ld) const noexcept
+        {
+            if (type == NPY_FLOAT32)
+                copy_to<float>(dst, ld);
+            else
+                copy_to<double>(dst, ld);
+        }
+
+        // Copy from (3, n) row major float source with leading dimension ld, the view must be float32
+        void copy_from (const float* src, npy_intp ld) const noexcept
+        {
+            for (npy_intp c=0; c<3; c++)
+                for (npy_intp i=0; i<n; i++)
+                    *(float*)&data[c * coord_stride + i * elem_stride] = src[c * ld + i];
+        }
+    };
+
+    // State of an asynchronous Indexer.index_async call
+    //
+    // The indexer callback hands the call over to a completion thread, which finishes indexing,
+    // refines and signals the eventfd watched by the asyncio event loop. The event loop reader
+    // then resolves the future with the GIL held.
+    struct async_call final {
+        int efd;                            // eventfd, registered with the event loop while a call is in flight
+        index_params p;                     // call parameters
+        fast_feedback::output<float> out;   // output in the pinned staging area
+        unsigned n_spots = 0u;
+        PyObject* loop = nullptr;           // event loop of the call in flight
+        PyObject* future = nullptr;         // future of the call in flight
+        std::string error;                  // error message if the call failed
+        std::mutex lock;                    // protect finished
+        std::condition_variable finished_cv;
+        bool finished = true;               // indexer side of the call is done
+
+        inline async_call()
+            : efd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+        {
+            if (efd < 0)
+                throw std::runtime_error("unable to create eventfd");
+        }
+
+        inline ~async_call()
+        {
+            close(efd);
+        }
+
+        // Wait until the indexer side of the call is done, without the GIL
+        inline void wait_finished ()
+        {
+            std::unique_lock<std::mutex> guard{lock};
+            finished_cv.wait(guard, [this]{ return finished; });
+        }
+
+        async_call(const async_call&) = delete;
+        async_call& operator=(const async_call&) = delete;
+    };
+
+    // Python Indexer object
+    struct indexer_object final {
+        PyObject_HEAD
+        map_t* entry;           // indexer and in use flag
+        staging_t* staging;     // pinned staging area
+        async_call* call;       // asynchronous call state, created on first use
+    };
+
+    void indexer_object_clear (indexer_object* self) noexcept
+    {
+        delete self->call;
+        self->call = nullptr;
+        delete self->staging;
+        self->staging = nullptr;
+        delete self->entry;
+        self->entry = nullptr;
+    }
+
+    int indexer_object_init_ (indexer_object* self, PyObject *args, PyObject *kwds)
+    {
+        using std::numeric_limits;
+
+        constexpr const char* kw[] = {"max_output_cells", "max_input_cells", "max_spots", "num_candidate_vectors", "redundant_computations", nullptr};
+        long max_output_cells, max_input_cells, max_spots, num_candidate_vectors;
+        int redundant_computations=false;
+        if (PyArg_ParseTupleAndKeywords(args, kwds, "llll|p", (char**)kw, &max_output_cells, &max_input_cells, &max_spots, &num_candidate_vectors, &redundant_computations) == 0)
+            return -1;
+
+        if (max_output_cells <= 0 || max_output_cells > numeric_limits<unsigned>::max()) {
+            PyErr_SetString(PyExc_ValueError, "max_output_cells out of bounds for a positive unsigned integer");
+            return -1;
+        }
+        if (max_input_cells <= 0 || max_input_cells > numeric_limits<unsigned>::max()) {
+            PyErr_SetString(PyExc_ValueError, "max_input_cells out of bounds for a positive unsigned integer");
+            return -1;
+        }
+        if (max_spots <= 0 || max_spots > numeric_limits<unsigned>::max()) {
+            PyErr_SetString(PyExc_ValueError, "max_spots out of bounds for a positive unsigned integer");
+            return -1;
+        }
+        if (num_candidate_vectors < 0 || num_candidate_vectors > numeric_limits<unsigned>::max()) {
+            PyErr_SetString(PyExc_ValueError, "num_candidate_vectors out of bounds for an unsigned integer");
+            return -1;
+        }
+        const fast_feedback::config_persistent<float> cpers{(unsigned)max_output_cells, (unsigned)max_input_cells, (unsigned)max_spots, (unsigned)num_candidate_vectors, (bool)redundant_computations};
+
+        if ((self->entry != nullptr) && self->entry->in_use.load()) {
+            PyErr_SetString(PyExc_RuntimeError, "Indexer object is used concurrently by another thread");
+            return -1;
+        }
+
+        try {
+            indexer_object_clear(self);
+            self->entry = new map_t{indexer_t{cpers}, 0u, 0u};
+            self->staging = new staging_t{cpers};
+        } catch (std::exception& e) {
+            indexer_object_clear(self);
+            PyErr_SetString(PyExc_RuntimeError, e.what());
+            return -1;
+        }
+
+        return 0;
+    }
+
+    void indexer_object_dealloc_ (indexer_object* self)
+    {
+        if (self->call != nullptr) {    // the event loop might have been closed with a call in flight
+            gil_release nogil{};
+            self->call->wait_finished();
+        }
+        try {
+            indexer_object_clear(self);
+        } catch (...) {}    // ignore dealloc exception
+        PyTypeObject* type = Py_TYPE(self);
+        type->tp_free((PyObject*)self);
+        Py_DECREF(type);    // heap type instances own a type reference
+    }
+
+    // Check spots and input cell arrays, set python error and return false if they are unsupported
+    bool indexer_object_inputs (const indexer_object* self, PyArrayObject* spots_ndarray, PyArrayObject* input_cells_ndarray,
+                                coords_view& spots, coords_view& input_cells)
+    {
+        if (! spots.init(spots_ndarray, "spots"))
+            return false;
+        if ((spots.n <= 0) || (spots.n > (npy_intp)self->entry->indexer.cpers.max_spots)) {
+            PyErr_SetString(PyExc_RuntimeError, "number of spots outside of [1..max_spots]");
+            return false;
+        }
+
+        if (! input_cells.init(input_cells_ndarray, "input cells"))
+            return false;
+        if ((input_cells.n % 3 != 0) || (input_cells.n <= 0) || (input_cells.n > self->staging->ld_cells)) {
+            PyErr_SetString(PyExc_RuntimeError, "number of input cell vectors not a multiple of 3 in [3..3*max_input_cells]");
+            return false;
+        }
+
+        return true;
+    }
+
+    // Copy inputs and runtime configuration into the pinned staging area, set up indexer input and output for it
+    void indexer_object_stage (indexer_object* self, const coords_view& spots, const coords_view& input_cells, const index_params& p,
+                               unsigned n_out, fast_feedback::input<float>& input, fast_feedback::output<float>& output) noexcept
+    {
+        staging_t& staging = *self->staging;
+        float* spot_data = staging.spots.ptr;
+        float* input_cell_data = staging.input_cells.ptr;
+        float* out_data = staging.cells.ptr;
+
+        spots.copy_to(spot_data, staging.ld_spots);
+        input_cells.copy_to(input_cell_data, staging.ld_cells);
+        *staging.crt = p.config_runtime();
+
+        input = fast_feedback::input<float>{
+            {&input_cell_data[0], &input_cell_data[staging.ld_cells], &input_cell_data[2*staging.ld_cells]},
+            {&spot_data[0], &spot_data[staging.ld_spots], &spot_data[2*staging.ld_spots]},
+            (unsigned)(input_cells.n / 3), (unsigned)spots.n,
+            true, true
+        };
+        output = fast_feedback::output<float>{&out_data[0], &out_data[3*n_out], &out_data[6*n_out], staging.scores.ptr, n_out};
+    }
+
+    // Refine staged indexing result in place
+    void indexer_object_refine (indexer_object* self, const index_params& p, unsigned n_spots, unsigned n_out)
+    {
+        if (p.smethod == "raw")
+            return;
+        using namespace Eigen;
+        staging_t& staging = *self->staging;
+        Map<MatrixX3f, 0, OuterStride<>> spot_map{staging.spots.ptr, n_spots, 3, OuterStride<>{staging.ld_spots}};
+        Map<MatrixX3f> cells{staging.cells.ptr, 3*n_out, 3};
+        Map<VectorXf> scores{staging.scores.ptr, n_out};
+        p.refine(spot_map, cells, scores);
+    }
+
+    PyObject* indexer_object_index_ (indexer_object* self, PyObject *args, PyObject *kwds)
+    {
+        constexpr const char* kw[] = {"spots", "input_cells",
+                                      "method",
+                                      "length_threshold", "triml", "trimh", "delta",
+                                      "num_sample_points", "n_output_cells",
+                                      "contraction",
+                                      "min_spots", "n_iter",
+                                      "out", "scores_out",
+                                      "timing",
+                                      nullptr};
+        PyArrayObject* spots_ndarray = nullptr;
+        PyArrayObject* input_cells_ndarray = nullptr;
+        PyObject* out_obj = Py_None;
+        PyObject* scores_out_obj = Py_None;
+        index_params p{};
+        int want_timing = false;
+        if (PyArg_ParseTupleAndKeywords(args, kwds, "O!O!|sddddlldllOOp", (char**)kw,
+                                        &PyArray_Type, &spots_ndarray, &PyArray_Type, &input_cells_ndarray,
+                                        &p.method, &p.length_threshold, &p.triml, &p.trimh, &p.delta, &p.num_sample_points, &p.n_output_cells,
+                                        &p.contraction, &p.min_spots, &p.n_iter,
+                                        &out_obj, &scores_out_obj, &want_timing) == 0)
+            return nullptr;
+
+        if (self->entry == nullptr) {
+            PyErr_SetString(PyExc_RuntimeError, "uninitialized Indexer object");
+            return nullptr;
+        }
+
+        if (! p.check())
+            return nullptr;
+
+        use_guard guard{*self->entry};
+        if (! guard.acquired) {
+            PyErr_SetString(PyExc_RuntimeError, "Indexer object is used concurrently by another thread");
+            return nullptr;
+        }
+
+        map_t& entry = *self->entry;
+        staging_t& staging = *self->staging;
+        const auto& cpers = entry.indexer.cpers;
+
+        coords_view spots, input_cells;
+        if (! indexer_object_inputs(self, spots_ndarray, input_cells_ndarray, spots, input_cells))
+            return nullptr;
+
+        const unsigned n_out = std::min((unsigned)p.n_output_cells, cpers.max_output_cells);
+
+        // output arrays, given or new
+        PyArrayObject* result = nullptr;
+        PyArrayObject* score = nullptr;
+        coords_view out;
+
+        if (out_obj != Py_None) {
+            if (! PyArray_Check(out_obj)) {
+                PyErr_SetString(PyExc_TypeError, "out must be a numpy array");
+                return nullptr;
+            }
+            result = (PyArrayObject*)out_obj;
+            if ((PyArray_TYPE(result) != NPY_FLOAT32) || ! PyArray_ISWRITEABLE(result)) {
+                PyErr_SetString(PyExc_RuntimeError, "out must be a writeable float32 array");
+                return nullptr;
+            }
+            if (! out.init(result, "out"))
+                return nullptr;
+            if (out.n != 3 * n_out) {
+                PyErr_Format(PyExc_RuntimeError, "out must have shape (3, %u)", 3 * n_out);
+                return nullptr;
+            }
+            Py_INCREF(result);
+        } else {
+            npy_intp result_dims[] = { 3, 3 * n_out };
+            result = (PyArrayObject*)PyArray_SimpleNew(2, result_dims, NPY_FLOAT32);
+            if (result == nullptr) {
+                PyErr_SetString(PyExc_RuntimeError, "unable to create result array");
+                return nullptr;
+            }
+            out = coords_view{(char*)PyArray_DATA(result), 3 * n_out, PyArray_STRIDES(result)[0], PyArray_STRIDES(result)[1], NPY_FLOAT32};
+        }
+
+        if (scores_out_obj != Py_None) {
+            score = (PyArrayObject*)scores_out_obj;
+            if (! PyArray_Check(scores_out_obj) || (PyArray_TYPE(score) != NPY_FLOAT32) || ! PyArray_ISWRITEABLE(score) ||
+                (PyArray_NDIM(score) != 1) || (PyArray_DIMS(score)[0] != n_out)) {
+                Py_DECREF(result);
+                PyErr_Format(PyExc_RuntimeError, "scores_out must be a writeable float32 array of shape (%u,)", n_out);
+                return nullptr;
+            }
+            Py_INCREF(score);
+        } else {
+            npy_intp score_dim = n_out;
+            score = (PyArrayObject*)PyArray_SimpleNew(1, &score_dim, NPY_FLOAT32);
+            if (score == nullptr) {
+                Py_DECREF(result);
+                PyErr_SetString(PyExc_RuntimeError, "unable to create score array");
+                return nullptr;
+            }
+        }
+
+        fast_feedback::timing t{};
+        try {
+            gil_release nogil{};    // no python API calls from here on
+
+            const float* out_data = staging.cells.ptr;
+            const float* score_data = staging.scores.ptr;
+
+            fast_feedback::input<float> input;
+            fast_feedback::output<float> output;
+            indexer_object_stage(self, spots, input_cells, p, n_out, input, output);
+            if (want_timing)
+                output.time = &t;
+
+            entry.indexer.index(input, output, *staging.crt);
+
+            entry.n_spots = input.n_spots;
+            entry.n_input_cells = input.n_cells;
+
+            const auto refine_start = std::chrono::steady_clock::now();
+            indexer_object_refine(self, p, input.n_spots, n_out);
+            if (p.smethod != "raw")
+                t.refine = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - refine_start).count();
+
+            out.copy_from(out_data, 3 * n_out);
+            {
+                const npy_intp stride = PyArray_STRIDES(score)[0];
+                char* dst = (char*)PyArray_DATA(score);
+                for (unsigned i=0u; i<n_out; i++)
+                    *(float*)&dst[i * stride] = score_data[i];
+            }
+
+        } catch (std::exception& ex) {
+            entry.n_spots = 0u;
+            entry.n_input_cells = 0u;
+            Py_DECREF(result);
+            Py_DECREF(score);
+            PyErr_SetString(PyExc_RuntimeError, ex.what());
+            return nullptr;
+        }
+
+        return result_tuple(result, score, want_timing ? &t : nullptr);
+    }
+
+    // Completion threads for asynchronous calls
+    struct async_completer final {
+        std::mutex lock;                    // protect ready and stopped
+        std::condition_variable ready_cv;
+        std::deque<indexer_object*> ready;  // Indexer objects with a result ready for index_end()
+        std::vector<std::thread> threads;
+        bool stopped = false;
+
+        // Finish indexing, refine, and signal the event loop
+        static void complete (indexer_object* self) noexcept
+        {
+            async_call& call = *self->call;
+            try {
+                self->entry->indexer.index_end(call.out);
+                indexer_object_refine(self, call.p, call.n_spots, call.out.n_cells);
+            } catch (std::exception& ex) {
+                call.error = ex.what();
+            }
+            {
+                std::lock_guard<std::mutex> guard{call.lock};
+                call.finished = true;
+            }
+            call.finished_cv.notify_all();
+            const uint64_t one = 1u;
+            [[maybe_unused]] auto res = write(call.efd, &one, sizeof(one));
+        }
+
+        void run ()
+        {
+            std::unique_lock<std::mutex> guard{lock};
+            for (;;) {
+                ready_cv.wait(guard, [this]{ return stopped || ! ready.empty(); });
+                if (ready.empty())
+                    return;
+                indexer_object* self = ready.front();
+                ready.pop_front();
+                guard.unlock();
+                complete(self);
+                guard.lock();
+            }
+        }
+
+        // Start threads on first use, GIL held
+        void start ()
+        {
+            std::lock_guard<std::mutex> guard{lock};
+            if (! threads.empty())
+                return;
+            const unsigned n_threads = std::max(1u, std::min(4u, std::thread::hardware_concurrency()));
+            stopped = false;
+            for (unsigned i=0u; i<n_threads; i++)
+                threads.emplace_back(&async_completer::run, this);
+        }
+
+        void push (indexer_object* self)
+        {
+            {
+                std::lock_guard<std::mutex> guard{lock};
+                ready.push_back(self);
+            }
+            ready_cv.notify_one();
+        }
+
+        void stop ()
+        {
+            {
+                std::lock_guard<std::mutex> guard{lock};
+                stopped = true;
+            }
+            ready_cv.notify_all();
+            for (auto& t : threads)
+                t.join();
+            threads.clear();
+        }
+
+        inline ~async_completer()
+        {
+            stop();
+        }
+    };
+
+    async_completer completer;
+
+    // Asynchronous indexer callback
+    void async_result_ready (void* data)
+    {
+        completer.push((indexer_object*)data);
+    }
+
+    // Event loop reader for the eventfd of an Indexer object, resolves the future of the call
+    PyObject* indexer_object_async_ready_ (PyObject* obj, [[maybe_unused]] PyObject* unused)
+    {
+        indexer_object* self = (indexer_object*)obj;
+        async_call& call = *self->call;
+
+        uint64_t count;
+        if (read(call.efd, &count, sizeof(count)) < 0)
+            Py_RETURN_NONE;     // spurious wakeup
+        {
+            gil_release nogil{};
+            call.wait_finished();
+        }
+
+        Py_INCREF(obj);     // removing the reader drops its reference
+        PyObject* loop = call.loop;
+        PyObject* future = call.future;
+        call.loop = call.future = nullptr;
+        PyObject* res = PyObject_CallMethod(loop, "remove_reader", "i", call.efd);
+        Py_XDECREF(res);
+
+        PyObject* result = nullptr;
+        if (call.error.empty()) {
+            const unsigned n_out = call.out.n_cells;
+            npy_intp result_dims[] = { 3, 3 * n_out };
+            PyObject* cells = PyArray_SimpleNew(2, result_dims, NPY_FLOAT32);
+            npy_intp score_dim = n_out;
+            PyObject* scores = PyArray_SimpleNew(1, &score_dim, NPY_FLOAT32);
+            if ((cells != nullptr) && (scores != nullptr)) {
+                std::copy_n(self->staging->cells.ptr, 9 * n_out, (float*)PyArray_DATA((PyArrayObject*)cells));
+                std::copy_n(self->staging->scores.ptr, n_out, (float*)PyArray_DATA((PyArrayObject*)scores));
+                result = PyTuple_Pack(2, cells, scores);
+            }
+            Py_XDECREF(cells);
+            Py_XDECREF(scores);
+            self->entry->n_spots = call.n_spots;
+        } else {
+            self->entry->n_spots = 0u;
+        }
+        self->entry->in_use.store(false);
+
+        PyObject* done = PyObject_CallMethod(future, "done", nullptr);
+        if ((done != nullptr) && (done == Py_False)) {  // not cancelled
+            if (result != nullptr) {
+                res = PyObject_CallMethod(future, "set_result", "(O)", result);
+            } else {
+                PyObject* exc = PyObject_CallFunction(PyExc_RuntimeError, "s", call.error.empty() ? "unable to create result arrays" : call.error.c_str());
+                res = (exc != nullptr) ? PyObject_CallMethod(future, "set_exception", "(O)", exc) : nullptr;
+                Py_XDECREF(exc);
+            }
+            Py_XDECREF(res);
+        }
+        Py_XDECREF(done);
+        Py_XDECREF(result);
+        Py_DECREF(future);
+        Py_DECREF(loop);
+        Py_DECREF(obj);
+
+        if (PyErr_Occurred())
+            return nullptr;     // reported by the event loop
+        Py_RETURN_NONE;
+    }
+
+    PyMethodDef indexer_object_async_ready_def = {"_async_ready", (PyCFunction)indexer_object_async_ready_, METH_NOARGS, nullptr};
+
+    PyObject* indexer_object_index_async_ (indexer_object* self, PyObject *args, PyObject *kwds)
+    {
+        constexpr const char* kw[] = {"spots", "input_cells",
+                                      "method",
+                                      "length_threshold", "triml", "trimh", "delta",
+                                      "num_sample_points", "n_output_cells",
+                                      "contraction",
+                                      "min_spots", "n_iter",
+                                      nullptr};
+        PyArrayObject* spots_ndarray = nullptr;
+        PyArrayObject* input_cells_ndarray = nullptr;
+        index_params p{};
+        if (PyArg_ParseTupleAndKeywords(args, kwds, "O!O!|sddddlldll", (char**)kw,
+                                        &PyArray_Type, &spots_ndarray, &PyArray_Type, &input_cells_ndarray,
+                                        &p.method, &p.length_threshold, &p.triml, &p.trimh, &p.delta, &p.num_sample_points, &p.n_output_cells,
+                                        &p.contraction, &p.min_spots, &p.n_iter) == 0)
+            return nullptr;
+
+        if (self->entry == nullptr) {
+            PyErr_SetString(PyExc_RuntimeError, "uninitialized Indexer object");
+            return nullptr;
+        }
+
+        if (! p.check())
+            return nullptr;
+
+        coords_view spots, input_cells;
+        if (! indexer_object_inputs(self, spots_ndarray, input_cells_ndarray, spots, input_cells))
+            return nullptr;
+
+        PyObject* asyncio = PyImport_ImportModule("asyncio");
+        if (asyncio == nullptr)
+            return nullptr;
+        PyObject* loop = PyObject_CallMethod(asyncio, "get_running_loop", nullptr);
+        Py_DECREF(asyncio);
+        if (loop == nullptr)
+            return nullptr;
+
+        // the in use flag is reset by the event loop reader once the call is done
+        if (self->entry->in_use.exchange(true)) {
+            Py_DECREF(loop);
+            PyErr_SetString(PyExc_RuntimeError, "Indexer object is used concurrently by another thread or call");
+            return nullptr;
+        }
+
+        PyObject* future = nullptr;
+        auto fail = [self, loop, &future]() -> PyObject* {
+            self->entry->in_use.store(false);
+            Py_XDECREF(future);
+            Py_DECREF(loop);
+            return nullptr;
+        };
+
+        try {
+            if (self->call == nullptr) {
+                completer.start();
+                self->call = new async_call{};
+            }
+        } catch (std::exception& ex) {
+            PyErr_SetString(PyExc_RuntimeError, ex.what());
+            return fail();
+        }
+
+        async_call& call = *self->call;
+        {
+            gil_release nogil{};
+            call.wait_finished();   // the completion thread might not be completely done with the last call
+        }
+
+        future = PyObject_CallMethod(loop, "create_future", nullptr);
+        if (future == nullptr)
+            return fail();
+        PyObject* reader = PyCFunction_New(&indexer_object_async_ready_def, (PyObject*)self);
+        if (reader == nullptr)
+            return fail();
+        PyObject* res = PyObject_CallMethod(loop, "add_reader", "iO", call.efd, reader);
+        Py_DECREF(reader);
+        if (res == nullptr)
+            return fail();
+        Py_DECREF(res);
+
+        const unsigned n_out = std::min((unsigned)p.n_output_cells, self->entry->indexer.cpers.max_output_cells);
+        call.p = p;
+        call.error.clear();
+        call.finished = false;
+        try {
+            gil_release nogil{};    // no python API calls from here on
+            fast_feedback::input<float> input;
+            indexer_object_stage(self, spots, input_cells, p, n_out, input, call.out);
+            call.n_spots = input.n_spots;
+            self->entry->indexer.index_start(input, call.out, *self->staging->crt, async_result_ready, self);
+        } catch (std::exception& ex) {
+            call.finished = true;
+            res = PyObject_CallMethod(loop, "remove_reader", "i", call.efd);
+            Py_XDECREF(res);
+            PyErr_SetString(PyExc_RuntimeError, ex.what());
+            return fail();
+        }
+
+        Py_INCREF(future);
+        call.future = future;
+        call.loop = loop;   // takes over the loop reference
+        return future;
+    }
+
+    // Background pipeline behind ffbidx.stream
+    //
+    // Frames are pulled from the python source while the stream is advanced, so at most
+    // lookahead frames are in flight. Each frame occupies a slot with its own pinned staging area.
+    // Pipeline threads read the simple data file or copy the given arrays of a slot, run asynchronous
+    // indexing on one of several indexer objects, and refine the result. The python thread only
+    // waits for finished slots, with the GIL released.
+    struct stream_t final {
+        enum : unsigned { load, acquire, finish };  // slot states: pipeline stage to run next
+
+        struct slot_t final {
+            stream_t& stream;
+            const int id;
+            staging_t staging;
+            unsigned state = load;
+            npy_intp seq = 0;                       // position in source
+            std::string file;                       // simple data file name, empty for array input
+            PyObject* refs[2] = {nullptr, nullptr}; // input arrays referenced while in flight
+            coords_view spots{}, input_cells{};     // array input
+            int indexer = -1;                       // associated indexer object
+            fast_feedback::input<float> in{};
+            fast_feedback::output<float> out{};
+            std::string error;                      // error message if the frame failed
+            bool done = false;                      // finished, protected by stream lock
+
+            inline slot_t(stream_t& s, int i)
+                : stream(s), id(i), staging(s.cpers)
+            {}
+        };
+
+        const index_params p;
+        const fast_feedback::config_persistent<float> cpers;
+        const unsigned n_out;
+        const bool ordered;
+        fast_feedback::pinned_ptr<fast_feedback::config_runtime<float>> crt;
+        std::vector<std::unique_ptr<indexer_t>> indexers;
+        std::vector<std::unique_ptr<slot_t>> slots;
+        fast_feedback::scheduler::mpmc_queue<int> idle;     // idle indexer objects
+        fast_feedback::scheduler::mpmc_queue<int> waiting;  // slots waiting for an idle indexer
+        fast_feedback::scheduler::work_stealing sched;
+        std::vector<std::thread> threads;
+
+        std::mutex lock;                // protect done flags and completed
+        std::condition_variable done_cv;
+        std::deque<int> completed;      // finished slots in completion order
+
+        // python thread side, GIL held
+        std::deque<int> pending;        // slots in flight in submission order
+        std::vector<int> free_slots;
+        npy_intp next_seq = 0;
+
+        stream_t (const index_params& params, const fast_feedback::config_persistent<float>& c,
+                  unsigned n_indexers, unsigned n_threads, unsigned lookahead, bool in_order)
+            : p(params), cpers(c), n_out(std::min((unsigned)params.n_output_cells, c.max_output_cells)), ordered(in_order),
+              crt(fast_feedback::alloc_pinned<fast_feedback::config_runtime<float>>()),
+              idle(n_indexers), waiting(lookahead), sched(n_threads, lookahead)
+        {
+            *crt = p.config_runtime();
+            for (unsigned i=0u; i<n_indexers; i++) {
+                indexers.emplace_back(new indexer_t{cpers});
+                idle.push(i);
+            }
+            for (unsigned i=0u; i<lookahead; i++) {
+                slots.emplace_back(new slot_t{*this, (int)i});
+                free_slots.push_back(lookahead - 1u - i);
+            }
+            try {
+                for (unsigned i=0u; i<n_threads; i++)
+                    threads.emplace_back(&stream_t::run, this, i);
+            } catch (...) {
+                stop();
+                throw;
+            }
+        }
+
+        // Stop and join pipeline threads, slots in flight must be done
+        void stop ()
+        {
+            sched.stop();
+            for (auto& t : threads)
+                if (t.joinable())
+                    t.join();
+        }
+
+        ~stream_t ()
+        {
+            stop();
+        }
+
+        // Asynchronous indexer callback
+        static void result_ready (void* data)
+        {
+            slot_t* s = (slot_t*)data;
+            s->stream.sched.push(s->id);
+        }
+
+        // Let a slot waiting for an indexer progress
+        void wake_waiting ()
+        {
+            int id;
+            std::atomic_thread_fence(std::memory_order_seq_cst); // order idle push before wait pop, see acquire
+            if (waiting.try_pop(id))
+                sched.push(id);
+        }
+
+        void release_indexer (slot_t& s)
+        {
+            idle.push(s.indexer);
+            s.indexer = -1;
+            wake_waiting();
+        }
+
+        // Read file or copy arrays into pinned staging area
+        void load_slot (slot_t& s)
+        {
+            staging_t& st = s.staging;
+            float* spot_data = st.spots.ptr;
+            float* input_cell_data = st.input_cells.ptr;
+            unsigned n_spots, n_input_cells;
+
+            if (! s.file.empty()) {
+                simple_data::SimpleData<float, simple_data::raise> data{s.file};
+                n_spots = std::min(data.spots.size(), (std::size_t)cpers.max_spots);
+                for (unsigned i=0u; i<n_spots; i++) {
+                    spot_data[i] = data.spots[i].x;
+                    spot_data[st.ld_spots + i] = data.spots[i].y;
+                    spot_data[2 * st.ld_spots + i] = data.spots[i].z;
+                }
+                for (unsigned i=0u; i<3u; i++) {
+                    input_cell_data[i] = data.unit_cell[i].x;
+                    input_cell_data[st.ld_cells + i] = data.unit_cell[i].y;
+                    input_cell_data[2 * st.ld_cells + i] = data.unit_cell[i].z;
+                }
+                n_input_cells = 1u;
+            } else {
+                s.spots.copy_to(spot_data, st.ld_spots);
+                s.input_cells.copy_to(input_cell_data, st.ld_cells);
+                n_spots = s.spots.n;
+                n_input_cells = s.input_cells.n / 3;
+            }
+
+            if (n_spots == 0u)
+                throw std::runtime_error("no spots");
+
+            float* out_data = st.cells.ptr;
+            s.in = fast_feedback::input<float>{
+                {&input_cell_data[0], &input_cell_data[st.ld_cells], &input_cell_data[2*st.ld_cells]},
+                {&spot_data[0], &spot_data[st.ld_spots], &spot_data[2*st.ld_spots]},
+                n_input_cells, n_spots,
+                true, true
+            };
+            s.out = fast_feedback::output<float>{&out_data[0], &out_data[3*n_out], &out_data[6*n_out], st.scores.ptr, n_out};
+        }
+
+        // Refine indexing result in place
+        void refine_slot (slot_t& s) const
+        {
+            if (p.smethod == "raw")
+                return;
+            using namespace Eigen;
+            staging_t& st = s.staging;
+            Map<MatrixX3f, 0, OuterStride<>> spot_map{st.spots.ptr, s.in.n_spots, 3, OuterStride<>{st.ld_spots}};
+            Map<MatrixX3f> cells{st.cells.ptr, 3*n_out, 3};
+            Map<VectorXf> scores{st.scores.ptr, n_out};
+            p.refine(spot_map, cells, scores);
+        }
+
+        void complete (slot_t& s)
+        {
+            {
+                std::lock_guard<std::mutex> guard{lock};
+                s.done = true;
+                completed.push_back(s.id);
+            }
+            done_cv.notify_all();
+        }
+
+        // Pipeline thread
+        void run (unsigned worker)
+        {
+            using fast_feedback::scheduler::work_stealing;
+
+            for (int id; (id = sched.pop(worker)) != work_stealing::free;) {
+                slot_t& s = *slots[id];
+                try {
+                    switch (s.state) {
+                        case load:
+                            load_slot(s);
+                            s.state = acquire;
+                            [[fallthrough]];
+                        case acquire: {
+                                int idx;
+                                if (! idle.try_pop(idx)) {
+                                    waiting.push(id);
+                                    std::atomic_thread_fence(std::memory_order_seq_cst); // order wait push before idle pop, see wake_waiting
+                                    if (idle.try_pop(idx)) { // recheck, an indexer object might have become idle in between
+                                        idle.push(idx);
+                                        wake_waiting();
+                                    }
+                                    break;
+                                }
+                                s.indexer = idx;
+                                s.state = finish;
+                                indexers[idx]->index_start(s.in, s.out, *crt, result_ready, &s);
+                            } break;
+                        case finish:
+                            indexers[s.indexer]->index_end(s.out);
+                            release_indexer(s);
+                            refine_slot(s);
+                            complete(s);
+                            break;
+                    }
+                } catch (std::exception& ex) {
+                    s.error = ex.what();
+                    if (s.indexer >= 0)
+                        release_indexer(s);
+                    complete(s);
+                }
+            }
+        }
+
+        // Wait for the next finished slot, without the GIL
+        int wait_next ()
+        {
+            std::unique_lock<std::mutex> guard{lock};
+            int id;
+            if (ordered) {
+                id = pending.front();
+                done_cv.wait(guard, [this, id]{ return slots[id]->done; });
+            } else {
+                done_cv.wait(guard, [this]{ return ! completed.empty(); });
+                id = completed.front();
+            }
+            completed.erase(std::find(completed.begin(), completed.end(), id));
+            return id;
+        }
+
+        // Wait for all slots in flight, without the GIL
+        void drain ()
+        {
+            std::unique_lock<std::mutex> guard{lock};
+            for (int id : pending)
+                done_cv.wait(guard, [this, id]{ return slots[id]->done; });
+        }
+
+        // Make a finished slot reusable, GIL held
+        void recycle (slot_t& s)
+        {
+            for (auto& ref : s.refs) {
+                Py_XDECREF(ref);
+                ref = nullptr;
+            }
+            s.file.clear();
+            s.error.clear();
+            s.state = load;
+            s.done = false;
+            pending.erase(std::find(pending.begin(), pending.end(), s.id));
+            free_slots.push_back(s.id);
+        }
+    };
+
+    // Python stream iterator object
+    struct stream_object final {
+        PyObject_HEAD
+        PyObject* source;       // source iterator
+        PyObject* input_cells;  // input cells for plain spot arrays, or nullptr
+        stream_t* stream;       // pipeline
+        bool exhausted;         // source iterator is exhausted
+    };
+
+    PyObject* stream_type = nullptr;    // ffbidx.Stream type
+
+    // Submit frames from the source to free slots, set python error and return false on failure
+    bool stream_object_fill (stream_object* self)
+    {
+        stream_t& stream = *self->stream;
+
+        while (! self->exhausted && ! stream.free_slots.empty()) {
+            PyObject* item = PyIter_Next(self->source);
+            if (item == nullptr) {
+                if (PyErr_Occurred())
+                    return false;
+                self->exhausted = true;
+                break;
+            }
+
+            stream_t::slot_t& s = *stream.slots[stream.free_slots.back()];
+            PyObject* spots_obj = nullptr;
+            PyObject* cells_obj = nullptr;
+            if (PyTuple_Check(item)) {
+                if (! PyArg_ParseTuple(item, "O!O!;source tuple items must be (spots, input_cells) arrays", &PyArray_Type, &spots_obj, &PyArray_Type, &cells_obj)) {
+                    Py_DECREF(item);
+                    return false;
+                }
+            } else if (PyArray_Check(item)) {
+                spots_obj = item;
+                cells_obj = self->input_cells;
+                if (cells_obj == nullptr) {
+                    Py_DECREF(item);
+                    PyErr_SetString(PyExc_RuntimeError, "spot array source items need the input_cells argument");
+                    return false;
+                }
+            } else {
+                PyObject* fname = nullptr;
+                if (PyUnicode_FSConverter(item, &fname) == 0) {
+                    Py_DECREF(item);
+                    return false;
+                }
+                s.file = PyBytes_AS_STRING(fname);
+                Py_DECREF(fname);
+            }
+
+            if (spots_obj != nullptr) {
+                if (! s.spots.init((PyArrayObject*)spots_obj, "spots") || ! s.input_cells.init((PyArrayObject*)cells_obj, "input cells")) {
+                    Py_DECREF(item);
+                    return false;
+                }
+                if ((s.spots.n <= 0) || (s.spots.n > (npy_intp)stream.cpers.max_spots)) {
+                    Py_DECREF(item);
+                    PyErr_SetString(PyExc_RuntimeError, "number of spots outside of [1..max_spots]");
+                    return false;
+                }
+                if ((s.input_cells.n % 3 != 0) || (s.input_cells.n <= 0) || (s.input_cells.n > s.staging.ld_cells)) {
+                    Py_DECREF(item);
+                    PyErr_SetString(PyExc_RuntimeError, "number of input cell vectors not a multiple of 3 in [3..3*max_input_cells]");
+                    return false;
+                }
+                Py_INCREF(spots_obj);
+                Py_INCREF(cells_obj);
+                s.refs[0] = spots_obj;
+                s.refs[1] = cells_obj;
+            }
+            Py_DECREF(item);
+
+            s.seq = stream.next_seq++;
+            stream.free_slots.pop_back();
+            stream.pending.push_back(s.id);
+            stream.sched.push(s.id);
+        }
+
+        return true;
+    }
+
+    PyObject* stream_object_next_ (stream_object* self)
+    {
+        if (self->stream == nullptr) {
+            PyErr_SetString(PyExc_RuntimeError, "uninitialized Stream object, use ffbidx.stream()");
+            return nullptr;
+        }
+
+        stream_t& stream = *self->stream;
+        if (! stream_object_fill(self))
+            return nullptr;
+        if (stream.pending.empty())
+            return nullptr;     // StopIteration
+
+        int id;
+        {
+            gil_release nogil{};
+            id = stream.wait_next();
+        }
+        stream_t::slot_t& s = *stream.slots[id];
+        const npy_intp seq = s.seq;
+
+        if (! s.error.empty()) {
+            const std::string error = s.error;
+            stream.recycle(s);
+            PyErr_Format(PyExc_RuntimeError, "frame %zd: %s", (Py_ssize_t)seq, error.c_str());
+            return nullptr;
+        }
+
+        const unsigned n_out = stream.n_out;
+        npy_intp result_dims[] = { 3, 3 * n_out };
+        PyArrayObject* result = (PyArrayObject*)PyArray_SimpleNew(2, result_dims, NPY_FLOAT32);
+        npy_intp score_dim = n_out;
+        PyArrayObject* score = (PyArrayObject*)PyArray_SimpleNew(1, &score_dim, NPY_FLOAT32);
+        if ((result == nullptr) || (score == nullptr)) {
+            Py_XDECREF(result);
+            Py_XDECREF(score);
+            stream.recycle(s);
+            PyErr_SetString(PyExc_RuntimeError, "unable to create result arrays");
+            return nullptr;
+        }
+        std::copy_n(s.staging.cells.ptr, 9 * n_out, (float*)PyArray_DATA(result));
+        std::copy_n(s.staging.scores.ptr, n_out, (float*)PyArray_DATA(score));
+        stream.recycle(s);
+
+        PyObject* tuple = Py_BuildValue("nNN", (Py_ssize_t)seq, result, score);  // the tuple steals the array references
+        if (tuple == nullptr)
+            PyErr_SetString(PyExc_RuntimeError, "unable to create result tuple");
+        return tuple;
+    }
+
+    void stream_object_dealloc_ (stream_object* self)
+    {
+        if (self->stream != nullptr) {
+            stream_t& stream = *self->stream;
+            {
+                gil_release nogil{};
+                stream.drain();
+                stream.stop();
+            }
+            while (! stream.pending.empty())
+                stream.recycle(*stream.slots[stream.pending.front()]);
+            try {
+                delete self->stream;
+            } catch (...) {}    // ignore dealloc exception
+            self->stream = nullptr;
+        }
+        Py_XDECREF(self->source);
+        Py_XDECREF(self->input_cells);
+        PyTypeObject* type = Py_TYPE(self);
+        type->tp_free((PyObject*)self);
+        Py_DECREF(type);    // heap type instances own a type reference
+    }
+
+    PyObject* ffbidx_stream_ (PyObject *args, PyObject *kwds)
+    {
+        using std::numeric_limits;
+
+        constexpr const char* kw[] = {"source",
+                                      "max_output_cells", "max_input_cells", "max_spots", "num_candidate_vectors", "redundant_computations",
+                                      "input_cells",
+                                      "method",
+                                      "length_threshold", "triml", "trimh", "delta",
+                                      "num_sample_points", "n_output_cells",
+                                      "contraction",
+                                      "min_spots", "n_iter",
+                                      "n_indexers", "n_threads", "lookahead", "ordered",
+                                      nullptr};
+        PyObject* source = nullptr;
+        long max_output_cells=1, max_input_cells=1, max_spots=200, num_candidate_vectors=32;
+        int redundant_computations=false;
+        PyObject* input_cells_obj = Py_None;
+        index_params p{};
+        long n_indexers=2, n_threads=2, lookahead=8;
+        int ordered=true;
+        if (PyArg_ParseTupleAndKeywords(args, kwds, "O|$llllpOsddddlldlllllp", (char**)kw,
+                                        &source,
+                                        &max_output_cells, &max_input_cells, &max_spots, &num_candidate_vectors, &redundant_computations,
+                                        &input_cells_obj,
+                                        &p.method, &p.length_threshold, &p.triml, &p.trimh, &p.delta, &p.num_sample_points, &p.n_output_cells,
+                                        &p.contraction, &p.min_spots, &p.n_iter,
+                                        &n_indexers, &n_threads, &lookahead, &ordered) == 0)
+            return nullptr;
+
+        if (max_output_cells <= 0 || max_output_cells > numeric_limits<unsigned>::max()) {
+            PyErr_SetString(PyExc_ValueError, "max_output_cells out of bounds for a positive unsigned integer");
+            return nullptr;
+        }
+        if (max_input_cells <= 0 || max_input_cells > numeric_limits<unsigned>::max()) {
+            PyErr_SetString(PyExc_ValueError, "max_input_cells out of bounds for a positive unsigned integer");
+            return nullptr;
+        }
+        if (max_spots <= 0 || max_spots > numeric_limits<unsigned>::max()) {
+            PyErr_SetString(PyExc_ValueError, "max_spots out of bounds for a positive unsigned integer");
+            return nullptr;
+        }
+        if (num_candidate_vectors < 0 || num_candidate_vectors > numeric_limits<unsigned>::max()) {
+            PyErr_SetString(PyExc_ValueError, "num_candidate_vectors out of bounds for an unsigned integer");
+            return nullptr;
+        }
+        if (n_indexers <= 0 || n_indexers > 1024) {
+            PyErr_SetString(PyExc_ValueError, "n_indexers outside of [1..1024]");
+            return nullptr;
+        }
+        if (! check_n_threads(n_threads))
+            return nullptr;
+        if (lookahead <= 0 || lookahead > 1024) {
+            PyErr_SetString(PyExc_ValueError, "lookahead outside of [1..1024]");
+            return nullptr;
+        }
+        if (! p.check())
+            return nullptr;
+        const fast_feedback::config_persistent<float> cpers{(unsigned)max_output_cells, (unsigned)max_input_cells, (unsigned)max_spots, (unsigned)num_candidate_vectors, (bool)redundant_computations};
+
+        if ((input_cells_obj != Py_None) && ! PyArray_Check(input_cells_obj)) {
+            PyErr_SetString(PyExc_TypeError, "input_cells must be a numpy array");
+            return nullptr;
+        }
+
+        PyObject* iter = PyObject_GetIter(source);
+        if (iter == nullptr)
+            return nullptr;
+
+        PyTypeObject* type = (PyTypeObject*)stream_type;
+        stream_object* self = (stream_object*)type->tp_alloc(type, 0);
+        if (self == nullptr) {
+            Py_DECREF(iter);
+            return nullptr;
+        }
+        self->source = iter;
+        if (input_cells_obj != Py_None) {
+            Py_INCREF(input_cells_obj);
+            self->input_cells = input_cells_obj;
+        }
+
+        try {
+            self->stream = new stream_t{p, cpers, (unsigned)n_indexers, (unsigned)thread_count(n_threads), (unsigned)lookahead, (bool)ordered};
+        } catch (std::exception& ex) {
+            Py_DECREF(self);
+            PyErr_SetString(PyExc_RuntimeError, ex.what());
+            return nullptr;
+        }
+
+        return (PyObject*)self;
+    }
+
+    // Histogram snapshot as dict with count, sum and cumulative (upper bound, count) buckets
+    PyObject* histogram_dict(const fast_feedback::metrics::histogram::snapshot_t& hist)
+    {
+        PyObject* buckets = PyList_New((Py_ssize_t)hist.buckets.size());
+        if (buckets == nullptr)
+            return nullptr;
+        for (std::size_t i=0u; i<hist.buckets.size(); i++) {
+            PyObject* bucket = Py_BuildValue("(dK)", hist.buckets[i].first, (unsigned long long)hist.buckets[i].second);
+            if (bucket == nullptr) {
+                Py_DECREF(buckets);
+                return nullptr;
+            }
+            PyList_SET_ITEM(buckets, (Py_ssize_t)i, bucket);  // steals the bucket reference
+        }
+        return Py_BuildValue("{sKsdsN}", "count", (unsigned long long)hist.count, "sum", hist.sum, "buckets", buckets);
+    }
+
+    PyObject* ffbidx_metrics_()
+    {
+        std::vector<fast_feedback::metrics::sample> samples;
+        try {
+            samples = fast_feedback::metrics::collect();
+        } catch (std::exception& ex) {
+            PyErr_SetString(PyExc_RuntimeError, ex.what());
+            return nullptr;
+        }
+
+        PyObject* result = PyDict_New();
+        if (result == nullptr)
+            return nullptr;
+        for (const auto& sample : samples) {
+            PyObject* value = sample.is_histogram ? histogram_dict(sample.hist) : PyLong_FromUnsignedLongLong(sample.value);
+            if ((value == nullptr) || (PyDict_SetItemString(result, sample.name.c_str(), value) < 0)) {
+                Py_XDECREF(value);
+                Py_DECREF(result);
+                return nullptr;
+            }
+            Py_DECREF(value);
+        }
+        return result;
+    }
+
+    PyObject* ffbidx_metrics_text_()
+    {
+        std::ostringstream oss;
+        try {
+            fast_feedback::metrics::write_prometheus(oss);
+        } catch (std::exception& ex) {
+            PyErr_SetString(PyExc_RuntimeError, ex.what());
+            return nullptr;
+        }
+        const std::string text = oss.str();
+        return PyUnicode_FromStringAndSize(text.data(), (Py_ssize_t)text.size());
+    }
+
+    PyObject* ffbidx_metrics_exporter_(PyObject *args, PyObject *kwds)
+    {
+        constexpr const char* kw[] = {"file", "port", "interval", nullptr};
+        const char* file_name = nullptr;
+        long port = 0;
+        double interval = 10.;
+        if (PyArg_ParseTupleAndKeywords(args, kwds, "|$zld", (char**)kw, &file_name, &port, &interval) == 0)
+            return nullptr;
+
+        if ((port < 0) || (port > 65535)) {
+            PyErr_SetString(PyExc_ValueError, "port out of range");
+            return nullptr;
+        }
+
+        try {
+            const std::string fname = (file_name != nullptr) ? file_name : "";
+            if (fname.empty() && (port == 0)) {
+                gil_release nogil;
+                fast_feedback::metrics::stop_exporter();
+            } else {
+                gil_release nogil;
+                fast_feedback::metrics::start_exporter(fname, (unsigned)port, interval);
+            }
+        } catch (std::exception& ex) {
+            PyErr_SetString(PyExc_RuntimeError, ex.what());
+            return nullptr;
+        }
+
+        Py_RETURN_NONE;
+    }
+
+    void ffbidx_free(void *)
+    {
+        completer.stop();
+        for (auto& sh : indexers) {
+            std::unique_lock<std::shared_mutex> lock{sh.lock};
+            sh.entries.clear();
+        }
+    }
+
+} // namespace
+
+extern "C" {
+
+    PyObject* ffbidx_indexer([[maybe_unused]] PyObject *self, PyObject *args, PyObject *kwds)
+    {
+        return ffbidx_indexer_(args, kwds);
+    }
+
+    PyObject* ffbidx_index([[maybe_unused]] PyObject *self, PyObject *args, PyObject *kwds)
+    {
+        return ffbidx_index_(args, kwds);
+    }
+
+    PyObject* ffbidx_index_batch([[maybe_unused]] PyObject *self, PyObject *args, PyObject *kwds)
+    {
+        return ffbidx_index_batch_(args, kwds);
+    }
+
+    PyObject* ffbidx_refine([[maybe_unused]] PyObject *self, PyObject *args, PyObject *kwds)
+    {
+        return ffbidx_refine_(args, kwds);
+    }
+
+    PyObject* ffbidx_is_viable_cell([[maybe_unused]] PyObject *self, PyObject *args, PyObject *kwds)
+    {
+        return ffbidx_is_viable_cell_(args, kwds);
+    }
+
+    PyObject* ffbidx_compute_crystalls([[maybe_unused]] PyObject *self, PyObject *args, PyObject *kwds)
+    {
+        return ffbidx_compute_crystalls_(args, kwds);
+    }
+
+    PyObject* ffbidx_cell_similarity([[maybe_unused]] PyObject *self, PyObject *args, PyObject *kwds)
+    {
+        return ffbidx_cell_similarity_(args, kwds);
+    }
+
+    PyObject* ffbidx_best_cell([[maybe_unused]] PyObject *self, PyObject *args, PyObject *kwds)
+    {
+        return ffbidx_best_cell_(args, kwds);
+    }
+
+    PyObject* ffbidx_release([[maybe_unused]] PyObject *self, PyObject *args, PyObject *kwds)
+    {
+        return ffbidx_release_(args, kwds);
+    }
+
+    PyObject* ffbidx_stream([[maybe_unused]] PyObject *self, PyObject *args, PyObject *kwds)
+    {
+        return ffbidx_stream_(args, kwds);
+    }
+
+    PyObject* ffbidx_metrics([[maybe_unused]] PyObject *self, [[maybe_unused]] PyObject *args)
+    {
+        return ffbidx_metrics_();
+    }
+
+    PyObject* ffbidx_metrics_text([[maybe_unused]] PyObject *self, [[maybe_unused]] PyObject *args)
+    {
+        return ffbidx_metrics_text_();
+    }
+
+    PyObject* ffbidx_metrics_exporter([[maybe_unused]] PyObject *self, PyObject *args, PyObject *kwds)
+    {
+        return ffbidx_metrics_exporter_(args, kwds);
+    }
+
+    int indexer_object_init(PyObject *self, PyObject *args, PyObject *kwds)
+    {
+        return indexer_object_init_((indexer_object*)self, args, kwds);
+    }
+
+    void indexer_object_dealloc(PyObject *self)
+    {
+        indexer_object_dealloc_((indexer_object*)self);
+    }
+
+    PyObject* indexer_object_index(PyObject *self, PyObject *args, PyObject *kwds)
+    {
+        return indexer_object_index_((indexer_object*)self, args, kwds);
+    }
+
+    PyObject* indexer_object_index_async(PyObject *self, PyObject *args, PyObject *kwds)
+    {
+        return indexer_object_index_async_((indexer_object*)self, args, kwds);
+    }
+
+    PyMethodDef indexer_object_methods[] = {
+        {"index", (PyCFunction)(void*)indexer_object_index, METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Call indexer, optionally into given out and scores_out arrays")},
+        {"index_async", (PyCFunction)(void*)indexer_object_index_async, METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Start indexing, return an asyncio future for the result")},
+        {NULL, NULL, 0, NULL}
+    };
+
+    PyType_Slot indexer_object_slots[] = {
+        {Py_tp_dealloc, (void*)indexer_object_dealloc},
+        {Py_tp_doc, (void*)PyDoc_STR("Indexer object with pinned reusable buffers")},
+        {Py_tp_methods, (void*)indexer_object_methods},
+        {Py_tp_init, (void*)indexer_object_init},
+        {Py_tp_new, (void*)PyType_GenericNew},
+        {0, nullptr}
+    };
+
+    PyType_Spec indexer_object_spec = {
+        .name = "ffbidx.Indexer",
+        .basicsize = sizeof(indexer_object),
+        .itemsize = 0,
+        .flags = Py_TPFLAGS_DEFAULT,
+        .slots = indexer_object_slots
+    };
+
+    PyObject* stream_object_next(PyObject *self)
+    {
+        return stream_object_next_((stream_object*)self);
+    }
+
+    void stream_object_dealloc(PyObject *self)
+    {
+        stream_object_dealloc_((stream_object*)self);
+    }
+
+    PyType_Slot stream_object_slots[] = {
+        {Py_tp_dealloc, (void*)stream_object_dealloc},
+        {Py_tp_doc, (void*)PyDoc_STR("Iterator over (index, cells, scores) results of a background indexing pipeline")},
+        {Py_tp_iter, (void*)PyObject_SelfIter},
+        {Py_tp_iternext, (void*)stream_object_next},
+        {0, nullptr}
+    };
+
+    PyType_Spec stream_object_spec = {
+        .name = "ffbidx.Stream",
+        .basicsize = sizeof(stream_object),
+        .itemsize = 0,
+        .flags = Py_TPFLAGS_DEFAULT,
+        .slots = stream_object_slots
+    };
+
+    PyMethodDef ffbidx_methods[] = {
+        {"indexer", (PyCFunction)(void*)ffbidx_indexer, METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Get an indexer handle")},
+        {"index", (PyCFunction)(void*)ffbidx_index, METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Call indexer")},
+        {"index_batch", (PyCFunction)(void*)ffbidx_index_batch, METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Call indexer on a batch of frames")},
+        {"stream", (PyCFunction)(void*)ffbidx_stream, METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Index frames from source in background threads, iterate over the results")},
+        {"refine", (PyCFunction)(void*)ffbidx_refine, METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Refine stacked cells in place")},
+        {"is_viable_cell", (PyCFunction)(void*)ffbidx_is_viable_cell, METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Check stacked cells for viability")},
+        {"compute_crystalls", (PyCFunction)(void*)ffbidx_compute_crystalls, METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Get indices of cells representing crystalls per frame")},
+        {"cell_similarity", (PyCFunction)(void*)ffbidx_cell_similarity, METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Compute similarity of stacked cells to a reference cell")},
+        {"best_cell", (PyCFunction)(void*)ffbidx_best_cell, METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Get index of the best cell per frame")},
+        {"release", (PyCFunction)(void*)ffbidx_release, METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Release indexer handle")},
+        {"metrics", (PyCFunction)ffbidx_metrics, METH_NOARGS, PyDoc_STR("Get library metrics as a dict")},
+        {"metrics_text", (PyCFunction)ffbidx_metrics_text, METH_NOARGS, PyDoc_STR("Get library metrics in Prometheus text format")},
+        {"metrics_exporter", (PyCFunction)(void*)ffbidx_metrics_exporter, METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Start or stop the Prometheus metrics exporter")},
+        {NULL, NULL, 0, NULL}
+    };
+
+    PyModuleDef ffbidx_module = {
+        .m_base = PyModuleDef_HEAD_INIT,
+        .m_name = "ffbidx",
+        .m_doc = PyDoc_STR("Fast feedback indexer"),
+        .m_size = -1,
+        .m_methods = ffbidx_methods,
+        .m_slots = nullptr,
+        .m_traverse = nullptr,
+        .m_clear = nullptr,
+        .m_free = ffbidx_free
+    };
+
+    PyMODINIT_FUNC PyInit_ffbidx(void)
+    {
+        import_array();
+        if (PyErr_Occurred())
+            return nullptr;
+        PyObject *m = PyModule_Create(&ffbidx_module);
+        if (m == nullptr)
+            return nullptr;
+        PyObject *indexer_type = PyType_FromSpec(&indexer_object_spec);
+        if ((indexer_type == nullptr) || (PyModule_AddObject(m, "Indexer", indexer_type) < 0)) {
+            Py_XDECREF(indexer_type);
+            Py_DECREF(m);
+            return nullptr;
+        }
+        stream_type = PyType_FromSpec(&stream_object_spec);
+        if ((stream_type == nullptr) || (PyModule_AddObject(m, "Stream", stream_type) < 0)) {
+            Py_XDECREF(stream_type);
+            stream_type = nullptr;
+            Py_DECREF(m);
+            return nullptr;
+        }
         return m;
     }
     
@@ -0,0 +1,53 @@
+# Copyright 2022 Paul Scherrer Institute
+# BSD 3-Clause License, see LICENSE.md at the top level
+# Author: hans-christian.stadler@psi.ch
+
+"""Helpers shared by the python module tests and benchmarks
+
+Tests print "Test OK." on success, or "Test failed: <reason>" and exit with a
+nonzero status, like the C++ ctest tests.
+"""
+
+import sys
+
+import numpy as np
+
+INDEXER_ARGS = dict(max_output_cells=4, max_input_cells=1, max_spots=200, num_candidate_vectors=32)
+
+
+def failed(reason):
+    print(f"Test failed: {reason}", flush=True)
+    sys.exit(1)
+
+
+def ok():
+    print("Test OK.", flush=True)
+    sys.exit(0)
+
+
+def check(condition, reason):
+    if not condition:
+        failed(reason)
+
+
+def expect_error(error, reason, fn, *args, **kwargs):
+    """Fail unless fn(*args, **kwargs) raises error"""
+    try:
+        fn(*args, **kwargs)
+    except error:
+        return
+    failed(reason)
+
+
+def same(a, b):
+    """Results of equal inputs, allowing for reordered floating point sums"""
+    return a.shape == b.shape and np.allclose(a, b, rtol=1e-5, atol=1e-6)
+
+
+def random_frame(rng, n_spots, cell_length=10.):
+    """Spots of shape (3, n_spots) of a random cubic lattice with some noise, and the cubic input cell"""
+    cell = np.eye(3, dtype=np.float32) * cell_length
+    rot, _ = np.linalg.qr(rng.normal(size=(3, 3)))
+    hkl = rng.integers(-5, 6, size=(n_spots, 3))
+    spots = (hkl @ np.linalg.inv(cell @ rot).T + rng.normal(scale=.002, size=(n_spots, 3)))
+    return np.ascontiguousarray(spots.T, dtype=np.float32), np.ascontiguousarray(cell, dtype=np.float32)
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+# Copyright 2022 Paul Scherrer Institute
+# BSD 3-Clause License, see LICENSE.md at the top level
+# Author: hans-christian.stadler@psi.ch
+
+"""Check Indexer.index_async against Indexer.index
+
+Covers gathering calls on several Indexer objects, a second call on a busy
+Indexer, cancelled futures, invalid input, calls without a running event loop,
+and dropping an Indexer or closing the event loop while a call is in flight.
+"""
+
+import asyncio
+import gc
+
+import numpy as np
+import ffbidx
+
+from common import INDEXER_ARGS, check, expect_error, failed, ok, random_frame, same
+
+N_CELLS = 2
+KW = dict(method="ifss", n_output_cells=N_CELLS)
+
+
+async def reuse(indexer, spots, cell, timeout=10.):
+    """Start a call as soon as the Indexer is no longer busy"""
+    loop = asyncio.get_running_loop()
+    end = loop.time() + timeout
+    while True:
+        try:
+            return indexer.index_async(spots, cell, **KW)
+        except RuntimeError:
+            if loop.time() > end:
+                failed("Indexer still busy after a cancelled call")
+            await asyncio.sleep(.001)
+
+
+async def run(frames, reference):
+    def check_result(name, i, result):
+        check(same(result[0], reference[i][0]) and same(result[1], reference[i][1]), f"{name}: frame {i} differs from Indexer.index")
+
+    # several Indexer objects in flight
+    indexers = [ffbidx.Indexer(**INDEXER_ARGS) for _ in range(4)]
+    for start in range(0, len(frames), len(indexers)):
+        batch = list(enumerate(frames))[start:start + len(indexers)]
+        results = await asyncio.gather(*(ix.index_async(s, c, **KW) for ix, (_, (s, c)) in zip(indexers, batch)))
+        for (i, _), result in zip(batch, results):
+            check_result("gather", i, result)
+
+    # one call in flight per Indexer
+    indexer = indexers[0]
+    spots, cell = frames[0]
+    future = indexer.index_async(spots, cell, **KW)
+    expect_error(RuntimeError, "second index_async on a busy Indexer accepted", indexer.index_async, spots, cell, **KW)
+    expect_error(RuntimeError, "index on a busy Indexer accepted", indexer.index, spots, cell, **KW)
+    check_result("busy", 0, await future)
+
+    # a cancelled call still finishes, then the Indexer is reusable
+    future = indexer.index_async(spots, cell, **KW)
+    future.cancel()
+    try:
+        await future
+        failed("cancelled future returned a result")
+    except asyncio.CancelledError:
+        pass
+    check_result("after cancel", 1, await (await reuse(indexer, *frames[1])))
+
+    # invalid input raises at once and leaves the Indexer usable
+    too_many = np.zeros((3, INDEXER_ARGS["max_spots"] + 1), dtype=np.float32)
+    expect_error(RuntimeError, "too many spots accepted", indexer.index_async, too_many, cell, **KW)
+    expect_error(RuntimeError, "two input cell vectors accepted", indexer.index_async, spots, cell[:, :2], **KW)
+    expect_error(ValueError, "unknown method accepted", indexer.index_async, spots, cell, method="none")
+    expect_error(TypeError, "list spots accepted", indexer.index_async, spots.tolist(), cell, **KW)
+    check_result("after invalid input", 2, await indexer.index_async(*frames[2], **KW))
+
+    # dropping the Indexer with a call in flight keeps it alive until the call is done
+    dropped = ffbidx.Indexer(**INDEXER_ARGS)
+    future = dropped.index_async(*frames[3], **KW)
+    del dropped
+    gc.collect()
+    check_result("dropped Indexer", 3, await future)
+
+
+async def abandon(frames):
+    """Leave a call in flight when the event loop is closed"""
+    indexer = ffbidx.Indexer(**INDEXER_ARGS)
+    indexer.index_async(*frames[0], **KW)
+
+
+def main():
+    rng = np.random.default_rng(11)
+    frames = [random_frame(rng, n) for n in rng.integers(20, INDEXER_ARGS["max_spots"], size=10)]
+    indexer = ffbidx.Indexer(**INDEXER_ARGS)
+    reference = [indexer.index(spots, cell, **KW) for spots, cell in frames]
+    del indexer
+
+    spots, cell = frames[0]
+    expect_error(RuntimeError, "index_async without running event loop accepted",
+                 ffbidx.Indexer(**INDEXER_ARGS).index_async, spots, cell, **KW)
+
+    asyncio.run(run(frames, reference))
+    asyncio.run(abandon(frames))
+    gc.collect()
+    asyncio.run(run(frames, reference))     # the completion threads still work
+    ok()
+
+
+if __name__ == "__main__":
+    main()
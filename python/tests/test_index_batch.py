@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+# Copyright 2022 Paul Scherrer Institute
+# BSD 3-Clause License, see LICENSE.md at the top level
+# Author: hans-christian.stadler@psi.ch
+
+"""Check ffbidx.index_batch against ffbidx.index frame by frame
+
+Covers padded spots with and without n_spots_per_frame, ragged spots with
+n_spots_per_frame and with offsets, per frame input cells, and refinement in
+the calling thread and in refinement threads.
+"""
+
+import numpy as np
+import ffbidx
+
+from common import INDEXER_ARGS, check, expect_error, ok, random_frame, same
+
+N_CELLS = 2
+
+
+def check_batch(name, cells, scores, reference):
+    check(cells.shape == (len(reference), 3, 3 * N_CELLS), f"{name}: cells shape {cells.shape}")
+    check(scores.shape == (len(reference), N_CELLS), f"{name}: scores shape {scores.shape}")
+    for f, (ref_cells, ref_scores) in enumerate(reference):
+        check(same(cells[f], ref_cells) and same(scores[f], ref_scores), f"{name}: frame {f} differs from ffbidx.index")
+
+
+def main():
+    rng = np.random.default_rng(42)
+    counts = np.array([60, 120, 90, 150, 75])
+    frames = [random_frame(rng, n, cell_length=10. + f) for f, n in enumerate(counts)]   # every frame has its own cell
+    input_cell = frames[0][1]
+    handle = ffbidx.indexer(**INDEXER_ARGS)
+
+    padded = np.zeros((len(frames), 3, counts.max()), dtype=np.float32)
+    for f, (spots, _) in enumerate(frames):
+        padded[f, :, :counts[f]] = spots
+    ragged = np.ascontiguousarray(np.concatenate([spots for spots, _ in frames], axis=1))
+    offsets = np.concatenate([[0], np.cumsum(counts)])
+    per_frame_cells = np.ascontiguousarray(np.stack([cell for _, cell in frames]))
+
+    for method in ("raw", "ifss", "ifse"):
+        kw = dict(method=method, n_output_cells=N_CELLS)
+        reference = [ffbidx.index(handle, spots, input_cell, **kw) for spots, _ in frames]
+        own_reference = [ffbidx.index(handle, spots, cell, **kw) for spots, cell in frames]
+        for n_threads in (1, 2, 4, 0):
+            name = f"{method} n_threads={n_threads}"
+            check_batch(f"padded {name}", *ffbidx.index_batch(handle, padded, counts, input_cell, n_threads=n_threads, **kw), reference)
+            check_batch(f"ragged {name}", *ffbidx.index_batch(handle, ragged, counts, input_cell, n_threads=n_threads, **kw), reference)
+            check_batch(f"offsets {name}", *ffbidx.index_batch(handle, ragged, None, input_cell, offsets=offsets, n_threads=n_threads, **kw), reference)
+            check_batch(f"per frame cells {name}", *ffbidx.index_batch(handle, padded, counts, per_frame_cells, n_threads=n_threads, **kw), own_reference)
+
+        # padded spots without counts use all spots
+        full = np.ascontiguousarray(padded[:, :, :counts.min()])
+        reference = [ffbidx.index(handle, np.ascontiguousarray(spots[:, :counts.min()]), input_cell, **kw) for spots, _ in frames]
+        check_batch(f"padded {method} without n_spots_per_frame", *ffbidx.index_batch(handle, full, None, input_cell, **kw), reference)
+
+    expect_error(RuntimeError, "ragged spots without offsets accepted", ffbidx.index_batch, handle, ragged, None, input_cell)
+    expect_error(RuntimeError, "offsets beyond the spots accepted",
+                 ffbidx.index_batch, handle, ragged, None, input_cell, offsets=offsets + 1)
+    expect_error(RuntimeError, "offsets for padded spots accepted",
+                 ffbidx.index_batch, handle, padded, None, input_cell, offsets=offsets)
+    expect_error(ValueError, "negative n_threads accepted", ffbidx.index_batch, handle, padded, counts, input_cell, n_threads=-1)
+
+    ffbidx.release(handle)
+    ok()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+# Copyright 2022 Paul Scherrer Institute
+# BSD 3-Clause License, see LICENSE.md at the top level
+# Author: hans-christian.stadler@psi.ch
+
+"""Check Indexer.index input layouts and output arrays
+
+Strided, Fortran ordered, transposed and float64 spots and input cells must
+give the same result as contiguous float32 arrays, results must go into given
+out and scores_out arrays with any strides, and out arrays of the wrong shape,
+type or writeability must raise.
+"""
+
+import numpy as np
+import ffbidx
+
+from common import INDEXER_ARGS, check, expect_error, ok, random_frame, same
+
+N_CELLS = 2
+
+
+def main():
+    rng = np.random.default_rng(7)
+    spots, cell = random_frame(rng, 150)
+    indexer = ffbidx.Indexer(**INDEXER_ARGS)
+    handle = ffbidx.indexer(**INDEXER_ARGS)
+
+    for method in ("raw", "ifss", "ifse"):
+        kw = dict(method=method, n_output_cells=N_CELLS)
+        ref_cells, ref_scores = indexer.index(spots, cell, **kw)
+        check(same(ref_cells, ffbidx.index(handle, spots, cell, **kw)[0]), f"{method}: Indexer.index differs from ffbidx.index")
+
+        def check_same(name, result):
+            check(same(result[0], ref_cells) and same(result[1], ref_scores), f"{method}: {name} differs from contiguous input")
+
+        wide = np.zeros((3, 2 * spots.shape[1]), dtype=np.float32)
+        wide[:, ::2] = spots
+        check_same("strided spots", indexer.index(wide[:, ::2], cell, **kw))
+        check_same("fortran ordered (K, 3) spots", indexer.index(np.asfortranarray(spots.T), cell, **kw))
+        check_same("C ordered (K, 3) spots", indexer.index(np.ascontiguousarray(spots.T), cell, **kw))
+        check_same("fortran ordered (3, K) spots", indexer.index(np.asfortranarray(spots), cell, **kw))
+        check_same("float64 spots", indexer.index(spots.astype(np.float64), cell, **kw))
+        check_same("fortran ordered (3, 3) input cell", indexer.index(spots, np.asfortranarray(cell.T), **kw))
+        check_same("float64 strided input cell", indexer.index(spots, np.repeat(cell.astype(np.float64), 2, axis=1)[:, ::2], **kw))
+
+        out = np.full((3, 2 * 3 * N_CELLS), np.nan, dtype=np.float32)[:, 1::2]
+        scores_out = np.full(2 * N_CELLS, np.nan, dtype=np.float32)[::2]
+        result = indexer.index(spots, cell, out=out, scores_out=scores_out, **kw)
+        check((result[0] is out) and (result[1] is scores_out), f"{method}: result is not out and scores_out")
+        check_same("strided out", (out, scores_out))
+        out_f = np.zeros((3 * N_CELLS, 3), dtype=np.float32, order="F")
+        check_same("fortran ordered out", (indexer.index(spots, cell, out=out_f, **kw)[0].T, ref_scores))
+
+    kw = dict(n_output_cells=N_CELLS)
+    out = np.zeros((3, 3 * N_CELLS), dtype=np.float32)
+    expect_error(RuntimeError, "too wide out accepted", indexer.index, spots, cell, out=np.zeros((3, 3 * N_CELLS + 3), dtype=np.float32), **kw)
+    expect_error(RuntimeError, "too narrow out accepted", indexer.index, spots, cell, out=np.zeros((3, 3), dtype=np.float32), **kw)
+    expect_error(RuntimeError, "1D out accepted", indexer.index, spots, cell, out=np.zeros(9 * N_CELLS, dtype=np.float32), **kw)
+    expect_error(RuntimeError, "float64 out accepted", indexer.index, spots, cell, out=out.astype(np.float64), **kw)
+    read_only = out.copy()
+    read_only.flags.writeable = False
+    expect_error(RuntimeError, "read only out accepted", indexer.index, spots, cell, out=read_only, **kw)
+    expect_error(TypeError, "list out accepted", indexer.index, spots, cell, out=out.tolist(), **kw)
+    expect_error(RuntimeError, "wrong scores_out shape accepted", indexer.index, spots, cell, scores_out=np.zeros(N_CELLS + 1, dtype=np.float32), **kw)
+    expect_error(RuntimeError, "too many spots accepted", indexer.index, np.zeros((3, INDEXER_ARGS["max_spots"] + 1), dtype=np.float32), cell, **kw)
+    expect_error(RuntimeError, "integer spots accepted", indexer.index, spots.astype(np.int32), cell, **kw)
+
+    ffbidx.release(handle)
+    ok()
+
+
+if __name__ == "__main__":
+    main()
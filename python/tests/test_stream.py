@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+# Copyright 2022 Paul Scherrer Institute
+# BSD 3-Clause License, see LICENSE.md at the top level
+# Author: hans-christian.stadler@psi.ch
+
+"""Check ffbidx.stream against Indexer.index
+
+Usage: test_stream.py <simple data file>...
+
+Covers ordered and unordered results, simple data file, (spots, input_cells)
+tuple and plain spot array sources, a failing frame followed by further
+iteration, and deleting the iterator while frames are in flight.
+"""
+
+import gc
+import sys
+
+import numpy as np
+import ffbidx
+
+from common import INDEXER_ARGS, check, failed, ok, random_frame, same
+
+N_CELLS = 2
+STREAM_ARGS = dict(INDEXER_ARGS, method="ifss", n_output_cells=N_CELLS)
+
+
+def read_simple_data(file_name, max_spots):
+    """Spots of shape (3, K) and input cell of a simple data file, like the stream reads them"""
+    values = np.loadtxt(file_name, dtype=np.float32, ndmin=1, max_rows=1)
+    cell = np.ascontiguousarray(values.reshape(3, 3).T)
+    spots = np.loadtxt(file_name, dtype=np.float32, ndmin=2, skiprows=1)[:max_spots]
+    return np.ascontiguousarray(spots.T), cell
+
+
+def check_results(name, results, reference, ordered):
+    indices = [i for i, _, _ in results]
+    if ordered:
+        check(indices == list(range(len(reference))), f"{name}: results out of order {indices}")
+    else:
+        check(sorted(indices) == list(range(len(reference))), f"{name}: wrong result indices {indices}")
+    for i, cells, scores in results:
+        check(same(cells, reference[i][0]) and same(scores, reference[i][1]), f"{name}: frame {i} differs from Indexer.index")
+
+
+def main():
+    if len(sys.argv) < 2:
+        failed("usage: test_stream.py <simple data file>...")
+    rng = np.random.default_rng(3)
+    frames = [random_frame(rng, n) for n in rng.integers(20, INDEXER_ARGS["max_spots"], size=24)]
+    input_cell = frames[0][1]
+    files = sys.argv[1:]
+    indexer = ffbidx.Indexer(**INDEXER_ARGS)
+
+    def index(spots, cell):
+        return indexer.index(spots, cell, method="ifss", n_output_cells=N_CELLS)
+
+    reference = [index(spots, cell) for spots, cell in frames]
+    file_reference = [index(*read_simple_data(f, INDEXER_ARGS["max_spots"])) for f in files]
+
+    for ordered in (True, False):
+        for n_threads, n_indexers, lookahead in ((2, 2, 8), (1, 1, 1), (0, 3, 5)):
+            name = f"ordered={ordered} n_threads={n_threads} n_indexers={n_indexers} lookahead={lookahead}"
+            kw = dict(STREAM_ARGS, n_threads=n_threads, n_indexers=n_indexers, lookahead=lookahead, ordered=ordered)
+            check_results(f"tuples {name}", list(ffbidx.stream(iter(frames), **kw)), reference, ordered)
+            check_results(f"arrays {name}", list(ffbidx.stream((s for s, _ in frames), input_cells=input_cell, **kw)), reference, ordered)
+            check_results(f"files {name}", list(ffbidx.stream(files, **kw)), file_reference, ordered)
+
+    # mixed sources
+    mixed = [files[0], frames[0], frames[1][0]]
+    check_results("mixed", list(ffbidx.stream(mixed, input_cells=input_cell, **STREAM_ARGS)),
+                  [file_reference[0], reference[0], reference[1]], True)
+
+    # a failing frame raises when its result is due, iteration goes on after it
+    for ordered in (True, False):
+        source = [frames[0], frames[1], "/nonexistent/simple/data/file", frames[2], frames[3]]
+        it = ffbidx.stream(source, ordered=ordered, **STREAM_ARGS)
+        results, errors = [], []
+        while True:
+            try:
+                results.append(next(it))
+            except StopIteration:
+                break
+            except RuntimeError as ex:
+                errors.append(str(ex))
+        check(len(errors) == 1 and errors[0].startswith("frame 2:"), f"ordered={ordered}: errors {errors}")
+        if ordered:
+            check([i for i, _, _ in results] == [0, 1, 3, 4], f"ordered={ordered}: results {[i for i, _, _ in results]}")
+        for i, cells, scores in results:
+            ref = reference[i if i < 2 else i - 1]
+            check(same(cells, ref[0]) and same(scores, ref[1]), f"ordered={ordered}: frame {i} differs after an error")
+
+    # bad source items raise while filling the pipeline
+    it = ffbidx.stream([frames[0], (frames[0][0],)], **STREAM_ARGS)
+    try:
+        next(it)
+        failed("tuple without input cells accepted")
+    except TypeError:
+        pass
+    del it
+
+    # deleting the iterator with frames in flight waits for them and releases the source arrays
+    spots = frames[0][0]
+    refcount = sys.getrefcount(spots)
+    it = ffbidx.stream(((spots, input_cell) for _ in range(1000)), lookahead=16, **STREAM_ARGS)
+    for _ in range(3):
+        next(it)
+    check(sys.getrefcount(spots) > refcount, "frames in flight don't reference their arrays")
+    del it
+    gc.collect()
+    check(sys.getrefcount(spots) == refcount, f"{sys.getrefcount(spots) - refcount} array references leaked by deleting the stream")
+    check_results("after delete", list(ffbidx.stream(iter(frames), **STREAM_ARGS)), reference, True)
+
+    ok()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,234 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "ffbidx/mpmc_queue.h"
+
+namespace {
+
+    using clock = std::chrono::high_resolution_clock;
+    using duration = std::chrono::duration<double>;
+
+    // cyclic nonnegative integer queue, formerly used by the bulk indexer, kept for comparison
+    // writers ensure by external means there are never more than size items in the queue
+    // items are nonnegative integers
+    class CNIQ final {
+        constexpr static int invalid = 0;                       // invalid ticket
+        constexpr static int valid = 1;                         // valid ticket
+        std::vector<std::unique_ptr<std::atomic_int>> items;    // always at least one slot free
+        std::vector<std::unique_ptr<std::atomic_int>> tickets;  // ticket fore every slot
+        std::atomic_uint head;                                  // 1 before front
+        std::atomic_uint tail;                                  // end
+        unsigned cap;                                           // capacity
+
+      public:
+        constexpr static int free = -1;                         // free slot value
+
+        explicit CNIQ(unsigned size=0u)
+        {
+            reset(size);
+        }
+
+        void reset (unsigned size)
+        {
+            cap = size+1u;
+            items.resize(cap);
+            tickets.resize(cap);
+            for (auto& ptr: items)
+                ptr.reset(new std::atomic_int{free});
+            for (auto& ptr: tickets)
+                ptr.reset(new std::atomic_int{invalid});
+            head = 0u;
+            tail = 0u;
+        }
+
+        void push_front (int item) noexcept
+        {
+            int e;
+            unsigned h = head.load();
+            while (! head.compare_exchange_weak(h, (h + cap - 1u) % cap));
+            do {
+                e = free;
+            } while (! items[h]->compare_exchange_strong(e, item));
+        }
+
+        void push_back (int item) noexcept
+        {
+            int e;
+            unsigned t = tail.load();
+            while (! tail.compare_exchange_weak(t, (t + 1u) % cap));
+            t = (t + 1u) % cap;
+            do {
+                e = free;
+            } while (! items[t]->compare_exchange_strong(e, item));
+        }
+
+        int pop_back () noexcept
+        {
+            int e;
+            int ticket;
+            unsigned s;
+            unsigned t;
+            do {
+                t = tail.load();
+                if (head.load() == t)
+                    return free;
+                ticket = invalid;
+                if (! tickets[t]->compare_exchange_weak(ticket, valid))
+                    continue;
+                s = t;
+                e = items[t]->load();
+                if ((e != free) && tail.compare_exchange_strong(t, (t + cap - 1u) % cap))
+                    break;
+                tickets[s]->store(invalid);
+            } while (true);
+            items[s]->store(free);
+            tickets[s]->store(invalid);
+            return e;
+        }
+    }; // CNIQ
+
+    // Uniform queue access for the benchmark
+    struct cniq_adapter final {
+        CNIQ q;
+        explicit cniq_adapter (unsigned size) : q{size} {}
+        bool try_pop (int& item) { return (item = q.pop_back()) != CNIQ::free; }
+        void push (int item) { q.push_back(item); }
+        static constexpr const char* name = "CNIQ";
+    };
+
+    struct mpmc_adapter final {
+        fast_feedback::scheduler::mpmc_queue<int> q;
+        explicit mpmc_adapter (unsigned size) : q{size} {}
+        bool try_pop (int& item) { return q.try_pop(item); }
+        void push (int item) { q.push(item); }
+        static constexpr const char* name = "mpmc_queue";
+    };
+
+    // Let n_threads circulate n_items through the queue, like indexer objects through the idle queue
+    // Every thread pops an item (retrying while the queue is empty) and pushes it back ops_per_thread times
+    // Return pop+push pairs per second
+    template<typename queue_type>
+    double circulate (unsigned n_threads, unsigned ops_per_thread, unsigned n_items)
+    {
+        queue_type queue{n_items};
+        for (unsigned i=0u; i<n_items; i++)
+            queue.push((int)i);
+
+        std::atomic_uint ready{0u};
+        std::atomic_bool go{false};
+        std::atomic<long> sum{0};
+        std::vector<std::thread> threads;
+        for (unsigned t=0u; t<n_threads; t++) {
+            threads.emplace_back([&]() {
+                long local_sum = 0;
+                ready.fetch_add(1u);
+                while (! go.load());
+                for (unsigned i=0u; i<ops_per_thread; i++) {
+                    int item;
+                    while (! queue.try_pop(item))
+                        std::this_thread::yield();
+                    local_sum += item;
+                    queue.push(item);
+                }
+                sum.fetch_add(local_sum);
+            });
+        }
+        while (ready.load() < n_threads);
+        auto t0 = clock::now();
+        go.store(true);
+        for (auto& thread : threads)
+            thread.join();
+        auto t1 = clock::now();
+
+        long remaining = 0;
+        for (unsigned i=0u; i<n_items; i++) {
+            int item;
+            if (! queue.try_pop(item))
+                throw std::runtime_error(std::string{queue_type::name} + ": items lost");
+            remaining += item;
+        }
+        if (remaining != (long)n_items * (n_items - 1) / 2)
+            throw std::runtime_error(std::string{queue_type::name} + ": items corrupted");
+
+        return (double)n_threads * ops_per_thread / duration{t1 - t0}.count();
+    }
+
+    template<typename T>
+    void parse_arg (T& val, const char* arg, const char* name)
+    {
+        std::istringstream iss(arg);
+        iss >> val;
+        if (! iss || (val == 0))
+            throw std::invalid_argument(std::string{"invalid value for "} + name + ": " + arg);
+    }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+    try {
+        unsigned max_threads = 64u;         // sweep thread counts 1, 2, 4, .. up to this
+        unsigned ops_per_thread = 100000u;  // pop+push pairs per thread
+        unsigned n_items = 8u;              // circulating items
+
+        if (argc > 4)
+            throw std::invalid_argument("usage: queue_contention [max threads] [ops per thread] [items]");
+        if (argc > 1)
+            parse_arg(max_threads, argv[1], "max threads");
+        if (argc > 2)
+            parse_arg(ops_per_thread, argv[2], "ops per thread");
+        if (argc > 3)
+            parse_arg(n_items, argv[3], "items");
+
+        std::cout << "hardware threads=" << std::thread::hardware_concurrency() << ", ops per thread=" << ops_per_thread << ", items=" << n_items << '\n';
+        std::cout << std::setw(8) << "threads" << std::setw(16) << cniq_adapter::name << std::setw(16) << mpmc_adapter::name << std::setw(10) << "ratio" << "  [Mops/s]\n";
+        for (unsigned n=1u; ; n=std::min(2u * n, max_threads)) {
+            double cniq = circulate<cniq_adapter>(n, ops_per_thread, n_items);
+            double mpmc = circulate<mpmc_adapter>(n, ops_per_thread, n_items);
+            std::cout << std::setw(8) << n << std::fixed << std::setprecision(3)
+                      << std::setw(16) << cniq * 1e-6 << std::setw(16) << mpmc * 1e-6
+                      << std::setw(10) << mpmc / cniq << '\n';
+            if (n == max_threads)
+                break;
+        }
+
+    } catch (std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << '\n';
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,217 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#include <cstdlib>
+#include <cstdint>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "ffbidx/affinity.h"
+
+namespace {
+
+    constexpr struct success_type final {} success;
+    constexpr struct failure_type final {} failure;
+
+    template <typename stream>
+    [[noreturn]] stream& operator<< (stream& out, [[maybe_unused]] const success_type& data)
+    {
+        out.flush();
+        std::exit((EXIT_SUCCESS));
+    }
+
+    template <typename stream>
+    [[noreturn]] stream& operator<< (stream& out, [[maybe_unused]] const failure_type& data)
+    {
+        out.flush();
+        std::exit((EXIT_FAILURE));
+    }
+
+    namespace affinity = fast_feedback::affinity;
+
+    constexpr std::size_t n_pages = 16u;    // number of pages in test buffer
+
+    // Pages per node of the mapping starting at addr according to /proc/self/numa_maps
+    // Return false if the mapping isn't found
+    bool numa_maps_pages (const void* addr, std::vector<std::size_t>& pages)
+    {
+        std::ifstream maps("/proc/self/numa_maps");
+        std::string line;
+        while (std::getline(maps, line)) {
+            std::istringstream iss(line);
+            std::uintptr_t start;
+            if (! (iss >> std::hex >> start) || (start != (std::uintptr_t)addr))
+                continue;
+            std::string field;
+            while (iss >> field) {  // N<node>=<pages>
+                if ((field.size() < 4u) || (field[0] != 'N'))
+                    continue;
+                const auto eq = field.find('=');
+                if (eq == std::string::npos)
+                    continue;
+                const unsigned node = std::stoul(field.substr(1u, eq - 1u));
+                if (pages.size() <= node)
+                    pages.resize(node + 1u);
+                pages[node] = std::stoul(field.substr(eq + 1u));
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Buffer of n_pages between guard pages, first touched by the calling thread
+    // The guard pages with different protection keep the mapping separate in numa_maps
+    char* touched_buffer ()
+    {
+        const std::size_t page = sysconf(_SC_PAGESIZE);
+        char* mem = (char*)mmap(nullptr, (n_pages + 2u) * page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("mmap failed");
+        char* buf = mem + page;
+        if (mprotect(buf, n_pages * page, PROT_READ | PROT_WRITE) != 0)
+            throw std::runtime_error("mprotect failed");
+        for (std::size_t i=0u; i<n_pages; i++)  // first touch
+            buf[i * page] = 1;
+        return buf;
+    }
+
+    void free_buffer (char* buf)
+    {
+        const std::size_t page = sysconf(_SC_PAGESIZE);
+        munmap(buf - page, (n_pages + 2u) * page);
+    }
+
+    // Check that all pages of a touched buffer are on node
+    void check_placement (const char* buf, unsigned node)
+    {
+        const int addr_node = affinity::node_of(buf);
+        if ((addr_node >= 0) && ((unsigned)addr_node != node))
+            std::cerr << "Test failed: buffer touched on node " << node << " placed on node " << addr_node << '\n' << failure;
+
+        std::vector<std::size_t> pages;
+        if (numa_maps_pages(buf, pages)) {
+            for (unsigned n=0u; n<pages.size(); n++) {
+                if ((n != node) && (pages[n] != 0u))
+                    std::cerr << "Test failed: " << pages[n] << " pages on node " << n << " instead of " << node << '\n' << failure;
+            }
+            if ((pages.size() <= node) || (pages[node] != n_pages))
+                std::cerr << "Test failed: not all pages on node " << node << '\n' << failure;
+        } else {
+            std::cout << "numa_maps not available for node " << node << '\n';
+        }
+    }
+
+    // Create buffers with first_touch, one worker pinned to every node, check placement and creating threads
+    void check_first_touch (const affinity::topology& topo)
+    {
+        const auto nodes = topo.cpu_nodes();
+        std::vector<std::vector<unsigned>> worker_cpus;
+        for (unsigned node : nodes)
+            worker_cpus.push_back(topo.node_cpus[node]);
+        const unsigned n_workers = worker_cpus.size();
+        const std::size_t n_items = 2u * n_workers;
+        auto home = [n_workers](std::size_t i) { return (unsigned)(i % n_workers); };
+
+        std::vector<char*> bufs(n_items, nullptr);
+        std::vector<int> cpus(n_items, -1);
+        affinity::first_touch(worker_cpus, n_items, home, [&bufs, &cpus](std::size_t i) {
+            cpus[i] = sched_getcpu();
+            bufs[i] = touched_buffer();
+        });
+        for (std::size_t i=0u; i<n_items; i++) {
+            const auto& allowed = worker_cpus[home(i)];
+            if (std::find(std::begin(allowed), std::end(allowed), (unsigned)cpus[i]) == std::end(allowed))
+                std::cerr << "Test failed: item " << i << " created on cpu " << cpus[i] << " outside its home worker cpus\n" << failure;
+            check_placement(bufs[i], nodes[home(i)]);
+            free_buffer(bufs[i]);
+        }
+
+        // without pinned workers, items are created on the calling thread
+        const std::vector<std::vector<unsigned>> unpinned(n_workers);
+        std::vector<std::thread::id> ids(n_items);
+        affinity::first_touch(unpinned, n_items, home, [&ids](std::size_t i) { ids[i] = std::this_thread::get_id(); });
+        for (std::size_t i=0u; i<n_items; i++) {
+            if (ids[i] != std::this_thread::get_id())
+                std::cerr << "Test failed: unpinned item " << i << " not created on the calling thread\n" << failure;
+        }
+
+        // exceptions of the creating threads reach the caller
+        bool caught = false;
+        try {
+            affinity::first_touch(worker_cpus, n_items, home, [](std::size_t i) {
+                if (i == 1u)
+                    throw std::runtime_error("create failed");
+            });
+        } catch (std::runtime_error& ex) {
+            caught = (std::string{ex.what()} == "create failed");
+        }
+        if (! caught)
+            std::cerr << "Test failed: exception of a creating thread not rethrown\n" << failure;
+
+        // so do pinning errors
+        const unsigned bad_cpu = CPU_SETSIZE - 1u;
+        const auto allowed = affinity::allowed_cpus();
+        if (std::find(std::begin(allowed), std::end(allowed), bad_cpu) == std::end(allowed)) {
+            caught = false;
+            try {
+                affinity::first_touch({{bad_cpu}}, n_items, [](std::size_t) { return 0u; }, [](std::size_t) {});
+            } catch (std::exception&) {
+                caught = true;
+            }
+            if (! caught)
+                std::cerr << "Test failed: pinning error of a creating thread not rethrown\n" << failure;
+        }
+    }
+
+} // namespace
+
+int main (int, char**)
+{
+    try {
+        const auto list = affinity::parse_list("0-2,5,7-8");
+        if (list != std::vector<unsigned>{0u, 1u, 2u, 5u, 7u, 8u})
+            std::cerr << "Test failed: cpu list parsing\n" << failure;
+
+        const auto topo = affinity::topology::get();
+        const auto nodes = topo.cpu_nodes();
+        if (nodes.empty() || topo.cpus().empty())
+            std::cerr << "Test failed: no cpus in topology\n" << failure;
+        std::cout << topo.n_nodes() << " nodes, " << topo.cpus().size() << " cpus\n";
+
+        check_first_touch(topo);
+
+    } catch (std::exception& ex) {
+        std::cerr << "Test failed: " << ex.what() << '\n' << failure;
+    }
+
+    std::cout << "Test OK.\n" << success;
+}
@@ -0,0 +1,187 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+// Allocation accounting and per frame allocation budgets of steady state indexing
+// Needs the library built with FFBIDX_ALLOC_COUNT
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ffbidx/simple_data.h"
+#include "ffbidx/refine.h"
+#include "ffbidx/alloc_count.h"
+
+namespace {
+
+    constexpr struct success_type final {} success;
+    constexpr struct failure_type final {} failure;
+
+    template <typename stream>
+    [[noreturn]] stream& operator<< (stream& out, [[maybe_unused]] const success_type& data)
+    {
+        out.flush();
+        std::exit((EXIT_SUCCESS));
+    }
+
+    template <typename stream>
+    [[noreturn]] stream& operator<< (stream& out, [[maybe_unused]] const failure_type& data)
+    {
+        out.flush();
+        std::exit((EXIT_FAILURE));
+    }
+
+    namespace alloc_count = fast_feedback::alloc_count;
+
+    constexpr unsigned n_cells = 8u;            // output cells
+    constexpr unsigned warmup_frames = 3u;      // frames before steady state
+    constexpr unsigned n_frames = 20u;          // measured steady state frames
+
+    // Steady state allocation budget per frame for a tag
+    // Lower these as allocations get removed from the hot paths
+    struct budget final {
+        const char* tag;
+        double allocations;
+    };
+
+    constexpr budget budgets[] = {
+        { "index_start", 16. },                 // host side candidate group vectors
+        { "index_end", 8. },
+        { "refine_ifss", 200. * n_cells },      // Eigen temporaries
+    };
+
+    // Counts of tag name in counts
+    alloc_count::tag_counts find (const std::vector<alloc_count::tag_counts>& counts, const std::string& name)
+    {
+        for (const auto& c : counts) {
+            if (name == c.name)
+                return c;
+        }
+        return {name.c_str(), 0u, 0u};
+    }
+
+#if defined(__GLIBC__)
+    constexpr unsigned c_allocs = 1u;           // malloc is counted with glibc only
+#else
+    constexpr unsigned c_allocs = 0u;
+#endif
+
+    // Allocations in a scope are counted for its tag, nested scopes win, other threads are not affected
+    void check_scopes ()
+    {
+        const auto start = alloc_count::snapshot();
+        {
+            FF_ALLOC_SCOPE("test_outer");
+            std::unique_ptr<int> p{new int{1}};
+            {
+                FF_ALLOC_SCOPE("test_inner");
+                std::vector<std::unique_ptr<int>> v;
+                v.reserve(10u);
+                for (unsigned i=0u; i<10u; i++)
+                    v.emplace_back(new int{(int)i});
+                void* volatile m = std::malloc(1000u);  // volatile, or the compiler may drop the allocation
+                std::free(m);
+            }
+            std::unique_ptr<double> q{new double{2.}};
+            std::thread([]() {
+                std::unique_ptr<int> r{new int{3}};
+            }).join();
+        }
+        const auto diff = alloc_count::difference(alloc_count::snapshot(), start);
+        const auto outer = find(diff, "test_outer");
+        const auto inner = find(diff, "test_inner");
+        std::cout << "test_outer: " << outer.allocations << " allocations " << outer.bytes << " bytes, "
+                  << "test_inner: " << inner.allocations << " allocations " << inner.bytes << " bytes\n";
+        if (inner.allocations < 11u + c_allocs || inner.bytes < 10u * sizeof(int) + c_allocs * 1000u)
+            std::cerr << "Test failed: inner scope allocations not counted\n" << failure;
+        if (inner.allocations > 11u + c_allocs)
+            std::cerr << "Test failed: too many inner scope allocations\n" << failure;
+        if (outer.allocations < 2u || outer.bytes < sizeof(int) + sizeof(double))
+            std::cerr << "Test failed: outer scope allocations not counted\n" << failure;
+        if (outer.allocations - 2u > 4u)    // thread creation may allocate a few times, the thread itself is in "other"
+            std::cerr << "Test failed: too many outer scope allocations\n" << failure;
+    }
+
+} // namespace
+
+int main (int argc, char *argv[])
+{
+    using namespace simple_data;
+    namespace refine = fast_feedback::refine;
+
+    try {
+        if (argc <= 1)
+            throw std::runtime_error("missing file argument");
+        if (! alloc_count::enabled())
+            throw std::runtime_error("library built without FFBIDX_ALLOC_COUNT");
+
+        check_scopes();
+
+        SimpleData<float, raise> data(argv[1]);         // read simple data file
+        const unsigned n_spots = data.spots.size();
+
+        fast_feedback::config_persistent<float> cpers{};
+        cpers.max_output_cells = n_cells;
+        cpers.max_spots = n_spots;
+        refine::indexer_ifss<float> indexer{cpers, fast_feedback::config_runtime<float>{}, refine::config_ifss<float>{}};
+
+        for (unsigned i=0u; i<3u; i++) {
+            indexer.iCellX(0u, i) = data.unit_cell[i].x;
+            indexer.iCellY(0u, i) = data.unit_cell[i].y;
+            indexer.iCellZ(0u, i) = data.unit_cell[i].z;
+        }
+        for (unsigned i=0u; i<n_spots; i++) {
+            indexer.spotX(i) = data.spots[i].x;
+            indexer.spotY(i) = data.spots[i].y;
+            indexer.spotZ(i) = data.spots[i].z;
+        }
+
+        for (unsigned f=0u; f<warmup_frames; f++)
+            indexer.index(1u, n_spots);
+
+        const auto start = alloc_count::snapshot();
+        for (unsigned f=0u; f<n_frames; f++)
+            indexer.index(1u, n_spots);
+        const auto diff = alloc_count::difference(alloc_count::snapshot(), start);
+
+        alloc_count::report(std::cout, diff, n_frames);
+        for (const auto& b : budgets) {
+            const double per_frame = (double)find(diff, b.tag).allocations / n_frames;
+            std::cout << b.tag << ": " << per_frame << " allocations per frame, budget " << b.allocations << '\n';
+            if (per_frame > b.allocations)
+                std::cerr << "Test failed: " << b.tag << " allocations per frame above budget\n" << failure;
+        }
+        if (find(diff, "refine_ifss").allocations == 0u)
+            std::cerr << "Test failed: refinement allocations not counted\n" << failure;
+
+    } catch (std::exception& ex) {
+        std::cerr << "Test failed: " << ex.what() << '\n' << failure;
+    }
+
+    std::cout << "Test OK.\n" << success;
+}
@@ -0,0 +1,107 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#include <cstdlib>
+#include <iostream>
+#include <chrono>
+#include "ffbidx/histogram.h"
+
+namespace {
+
+    constexpr struct success_type final {} success;
+    constexpr struct failure_type final {} failure;
+
+    template <typename stream>
+    [[noreturn]] stream& operator<< (stream& out, [[maybe_unused]] const success_type& data)
+    {
+        out.flush();
+        std::exit((EXIT_SUCCESS));
+    }
+
+    template <typename stream>
+    [[noreturn]] stream& operator<< (stream& out, [[maybe_unused]] const failure_type& data)
+    {
+        out.flush();
+        std::exit((EXIT_FAILURE));
+    }
+
+    using histogram_t = fast_feedback::histogram::log_linear<5u>;
+
+    constexpr std::uint64_t n_values = 100000u; // number of recorded values
+    constexpr double max_error = 1. / 32.;      // maximum relative error for 5 sub bucket bits
+
+    // check that the reported value v is within relative error of the exact value
+    bool close (std::uint64_t v, std::uint64_t exact)
+    {
+        return (v >= exact) && ((double)(v - exact) <= max_error * (double)exact);
+    }
+
+} // namespace
+
+int main (int, char**)
+{
+    try {
+        for (std::size_t i=0u; i+1u<histogram_t::n_buckets; i++) {  // buckets are contiguous
+            if ((histogram_t::upper_bound(i) + 1u != histogram_t::lower_bound(i + 1u)) ||
+                (histogram_t::bucket(histogram_t::lower_bound(i)) != i) ||
+                (histogram_t::bucket(histogram_t::upper_bound(i)) != i))
+                std::cerr << "Test failed: bucket " << i << " bounds inconsistent\n" << failure;
+        }
+        if (histogram_t::bucket(~std::uint64_t{0u}) != histogram_t::n_buckets - 1u)
+            std::cerr << "Test failed: largest value not in last bucket\n" << failure;
+
+        histogram_t low, high;  // values 1..n_values split in two histograms
+        for (std::uint64_t v=1u; v<=n_values; v++) {
+            if (v % 2u)
+                low.record(v);
+            else
+                high.record(std::chrono::nanoseconds(v));
+        }
+        low.merge(high);
+
+        if (low.count() != n_values)
+            std::cerr << "Test failed: count " << low.count() << " instead of " << n_values << '\n' << failure;
+        if ((low.min() != 1u) || (low.max() != n_values))
+            std::cerr << "Test failed: min/max " << low.min() << '/' << low.max() << '\n' << failure;
+        if (low.sum() != (double)(n_values * (n_values + 1u) / 2u))
+            std::cerr << "Test failed: sum " << low.sum() << '\n' << failure;
+
+        for (double p : {1., 50., 90., 99., 99.9, 100.}) {
+            const auto exact = (std::uint64_t)(p / 100. * n_values + .5);
+            const auto v = low.percentile(p);
+            if (! close(v, exact))
+                std::cerr << "Test failed: percentile " << p << " is " << v << ", expected about " << exact << '\n' << failure;
+        }
+
+        low.clear();
+        if ((low.count() != 0u) || (low.percentile(50.) != 0u))
+            std::cerr << "Test failed: histogram not empty after clear\n" << failure;
+
+    } catch (std::exception& ex) {
+        std::cerr << "Test failed: " << ex.what() << '\n' << failure;
+    }
+
+    std::cout << "Test OK.\n" << success;
+}
@@ -27,7 +27,10 @@ Author: hans-christian.stadler@psi.ch
 #include <iostream>
 #include <stdexcept>
 #include <map>
+#include <string>
+#include <Eigen/Dense>
 #include "ffbidx/indexer.h"
+#include "ffbidx/refine.h"
 
 namespace {
 
@@ -48,6 +51,80 @@ namespace {
         std::exit((EXIT_FAILURE));
     }
 
+    namespace refine = fast_feedback::refine;
+
+    // Input cell and reciprocal lattice spots of it
+    template <typename refine_indexer>
+    unsigned fill_frame (refine_indexer& idx)
+    {
+        Eigen::Matrix3<float> cell;         // col vectors
+        cell << 40.f, 1.f, -2.f,
+                .5f, 52.f, 3.f,
+                -1.f, 2.f, 61.f;
+        for (unsigned j=0u; j<3u; j++) {
+            idx.iCellX(0u, j) = cell(0u, j);
+            idx.iCellY(0u, j) = cell(1u, j);
+            idx.iCellZ(0u, j) = cell(2u, j);
+        }
+        const Eigen::Matrix3<float> rcell = cell.inverse();
+        const unsigned max_spots = idx.conf_persistent().max_spots;
+        unsigned n = 0u;
+        for (int h=-3; h<=3; h++) {
+            for (int k=-3; k<=3; k++) {
+                for (int l=-3; (l<=3) && (n<max_spots); l++) {
+                    if ((h == 0) && (k == 0) && (l == 0))
+                        continue;
+                    const Eigen::RowVector3<float> spot = Eigen::RowVector3<float>{(float)h, (float)k, (float)l} * rcell;
+                    idx.spotX(n) = spot(0u);
+                    idx.spotY(n) = spot(1u);
+                    idx.spotZ(n) = spot(2u);
+                    n++;
+                }
+            }
+        }
+        return n;
+    }
+
+    bool operator== (const fast_feedback::timing& a, const fast_feedback::timing& b)
+    {
+        return (a.preparation == b.preparation) && (a.candidates == b.candidates) && (a.cells == b.cells) &&
+               (a.expansion == b.expansion) && (a.output == b.output) && (a.total == b.total) && (a.refine == b.refine);
+    }
+
+    // Check per call timing of a refinement indexer, refined is true if it measures refinement
+    template <typename refine_indexer>
+    void check_timing (refine_indexer& idx, const std::string& name, bool refined)
+    {
+        const unsigned n_spots = fill_frame(idx);
+        if (idx.last_timing() != nullptr)
+            std::cerr << "Test failed: " << name << " timing without enable_timing\n" << failure;
+        idx.enable_timing();
+        idx.index(1u, n_spots);
+        if (idx.last_timing() == nullptr)
+            std::cerr << "Test failed: " << name << " no timing after enable_timing\n" << failure;
+        const fast_feedback::timing t = *idx.last_timing();
+        std::cout << name << " timing: preparation " << t.preparation << ", candidates " << t.candidates << ", cells " << t.cells
+                  << ", expansion " << t.expansion << ", output " << t.output << ", total " << t.total << ", refine " << t.refine << '\n';
+        if ((t.preparation < .0f) || (t.candidates < .0f) || (t.cells < .0f) || (t.expansion < .0f) ||
+            (t.output < .0f) || (t.total < .0f) || (t.refine < .0f))
+            std::cerr << "Test failed: " << name << " negative phase time\n" << failure;
+        if (t.total < t.candidates + t.cells + t.expansion)
+            std::cerr << "Test failed: " << name << " total time below the sum of the GPU phases\n" << failure;
+        if (refined && (t.refine <= .0f))
+            std::cerr << "Test failed: " << name << " refinement time not measured\n" << failure;
+        if (! refined && (t.refine != .0f))
+            std::cerr << "Test failed: " << name << " refinement time without refinement\n" << failure;
+
+        // an untimed call leaves the timing of the last timed call untouched
+        idx.enable_timing(false);
+        if (idx.last_timing() != nullptr)
+            std::cerr << "Test failed: " << name << " timing after disabling it\n" << failure;
+        idx.index(1u, n_spots);
+        idx.enable_timing();
+        if (! (*idx.last_timing() == t))
+            std::cerr << "Test failed: " << name << " untimed call changed the timing\n" << failure;
+    }
+
 } // namespace
 
 int main (int, char**)
@@ -91,6 +168,17 @@ int main (int, char**)
                 std::cerr << "Test failed: no map entry was deleted\n" << failure;
         }
 
+        {
+            const fast_feedback::config_persistent<float> cpers{};
+            const fast_feedback::config_runtime<float> crt{};
+            refine::indexer<float> raw{cpers, crt};
+            check_timing(raw, "raw", false);
+            refine::indexer_ifss<float> ifss{cpers, crt, refine::config_ifss<float>{}};
+            check_timing(ifss, "ifss", true);
+            refine::indexer_ifse<float> ifse{cpers, crt, refine::config_ifse<float>{}};
+            check_timing(ifse, "ifse", true);
+        }
+
     } catch (std::exception& ex) {
         std::cerr << "Test failed: " << ex.what() << '\n' << failure;
     }
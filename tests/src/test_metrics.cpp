@@ -0,0 +1,123 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ffbidx/metrics.h"
+
+namespace {
+
+    constexpr struct success_type final {} success;
+    constexpr struct failure_type final {} failure;
+
+    template <typename stream>
+    [[noreturn]] stream& operator<< (stream& out, [[maybe_unused]] const success_type& data)
+    {
+        out.flush();
+        std::exit((EXIT_SUCCESS));
+    }
+
+    template <typename stream>
+    [[noreturn]] stream& operator<< (stream& out, [[maybe_unused]] const failure_type& data)
+    {
+        out.flush();
+        std::exit((EXIT_FAILURE));
+    }
+
+    namespace metrics = fast_feedback::metrics;
+
+    constexpr unsigned n_threads = 8u;          // number of updating threads
+    constexpr unsigned n_updates = 64u * 1024u; // updates per thread, multiple of the 64 recorded values
+
+} // namespace
+
+int main (int, char**)
+{
+    try {
+        metrics::counter& cnt = metrics::get_counter("test_updates_total{kind=\"a\"}", "Test counter");
+        if (&cnt != &metrics::get_counter("test_updates_total{kind=\"a\"}", "other help"))
+            std::cerr << "Test failed: counter registered twice\n" << failure;
+        metrics::histogram& hist = metrics::get_histogram("test_values", "Test histogram", 1., 2u, 5u);
+
+        bool thrown = false;
+        try {
+            metrics::get_histogram("test_updates_total{kind=\"a\"}", "wrong type");
+        } catch (std::exception&) {
+            thrown = true;
+        }
+        if (! thrown)
+            std::cerr << "Test failed: counter registered as histogram\n" << failure;
+
+        std::vector<std::thread> threads;
+        for (unsigned t=0u; t<n_threads; t++) {
+            threads.emplace_back([&cnt, &hist]() {
+                for (unsigned i=0u; i<n_updates; i++) {
+                    cnt.add();
+                    hist.record(i % 64u);
+                }
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+
+        if (cnt.value() != n_threads * n_updates)
+            std::cerr << "Test failed: counter " << cnt.value() << " instead of " << n_threads * n_updates << '\n' << failure;
+
+        const auto snap = hist.snapshot();  // buckets: <4, <8, <16, <32, rest
+        const std::uint64_t per_value = n_threads * n_updates / 64u;
+        const std::uint64_t expected[] = {4u, 8u, 16u, 32u, 64u};
+        if (snap.buckets.size() != 5u)
+            std::cerr << "Test failed: " << snap.buckets.size() << " buckets instead of 5\n" << failure;
+        for (unsigned i=0u; i<5u; i++) {
+            if (snap.buckets[i].second != expected[i] * per_value)
+                std::cerr << "Test failed: bucket " << i << " count " << snap.buckets[i].second << '\n' << failure;
+        }
+        if ((snap.count != n_threads * n_updates) || (snap.sum != (double)(per_value * 63u * 64u / 2u)))
+            std::cerr << "Test failed: histogram count " << snap.count << ", sum " << snap.sum << '\n' << failure;
+
+        std::ostringstream oss;
+        metrics::write_prometheus(oss);
+        const std::string text = oss.str();
+        const std::string total = std::to_string(n_threads * n_updates);
+        for (const std::string& line : std::vector<std::string>{"# TYPE test_updates_total counter\n",
+                                                                "test_updates_total{kind=\"a\"} " + total + '\n',
+                                                                "# TYPE test_values histogram\n",
+                                                                "test_values_bucket{le=\"4\"} " + std::to_string(4u * per_value) + '\n',
+                                                                "test_values_bucket{le=\"+Inf\"} " + total + '\n',
+                                                                "test_values_count " + total + '\n'}) {
+            if (text.find(line) == std::string::npos)
+                std::cerr << "Test failed: missing Prometheus line " << line << failure;
+        }
+
+    } catch (std::exception& ex) {
+        std::cerr << "Test failed: " << ex.what() << '\n' << failure;
+    }
+
+    std::cout << "Test OK.\n" << success;
+}
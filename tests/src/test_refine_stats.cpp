@@ -0,0 +1,235 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <Eigen/Dense>
+#include "ffbidx/metrics.h"
+#include "ffbidx/refine.h"
+
+namespace {
+
+    constexpr struct success_type final {} success;
+    constexpr struct failure_type final {} failure;
+
+    template <typename stream>
+    [[noreturn]] stream& operator<< (stream& out, [[maybe_unused]] const success_type& data)
+    {
+        out.flush();
+        std::exit((EXIT_SUCCESS));
+    }
+
+    template <typename stream>
+    [[noreturn]] stream& operator<< (stream& out, [[maybe_unused]] const failure_type& data)
+    {
+        out.flush();
+        std::exit((EXIT_FAILURE));
+    }
+
+    namespace refine = fast_feedback::refine;
+    namespace metrics = fast_feedback::metrics;
+    using refine::refine_exit;
+    using refine::refine_stats;
+
+    constexpr unsigned n_spots = 200u;      // lattice spots per frame
+    constexpr unsigned n_outliers = 20u;    // spots off the lattice
+    constexpr unsigned n_cells = 4u;        // cells to refine per frame
+    constexpr float noise = .01f;           // miller index noise standard deviation
+
+    struct frame final {
+        Eigen::MatrixX3<float> spots;
+        Eigen::MatrixX3<float> cells;       // distorted true cell, row vectors, for every refined cell
+    };
+
+    // Synthetic frame: noisy lattice spots plus outliers, and distorted copies of the true cell
+    frame make_frame (std::mt19937& gen)
+    {
+        std::normal_distribution<float> err{.0f, noise};
+        std::uniform_int_distribution<int> hkl{-8, 8};
+        std::uniform_real_distribution<float> off{.2f, .8f};
+        std::uniform_real_distribution<float> distortion{-.002f, .002f};
+        Eigen::Matrix3<float> cell;         // col vectors
+        cell << 40.f, 1.f, -2.f,
+                .5f, 52.f, 3.f,
+                -1.f, 2.f, 61.f;
+        const Eigen::Matrix3<float> rcell = cell.inverse();
+        frame f;
+        f.spots.resize(n_spots, 3u);
+        for (unsigned i=0u; i<n_spots; i++) {
+            Eigen::RowVector3<float> h;
+            for (unsigned k=0u; k<3u; k++)
+                h(k) = (i < n_outliers) ? (float)hkl(gen) + off(gen) : (float)hkl(gen) + err(gen);
+            f.spots.row(i) = h * rcell;
+        }
+        f.cells.resize(3u * n_cells, 3u);
+        for (unsigned j=0u; j<n_cells; j++) {
+            Eigen::Matrix3<float> d = Eigen::Matrix3<float>::Identity();
+            for (unsigned k=0u; k<9u; k++)
+                d(k / 3u, k % 3u) += distortion(gen);
+            f.cells.block(3u * j, 0u, 3u, 3u) = (cell * d).transpose();
+        }
+        return f;
+    }
+
+    // Scores encoding the initial refinement threshold, see indexer::score_parts
+    Eigen::VectorX<float> make_scores (float threshold)
+    {
+        return Eigen::VectorX<float>::Constant(n_cells, -(float)n_spots + threshold);
+    }
+
+    // Spots within threshold for the cell at block j of cells, computed like the refinement loop
+    unsigned count_below (const Eigen::MatrixX3<float>& spots, const Eigen::MatrixX3<float>& cells, unsigned j, float threshold)
+    {
+        const Eigen::Matrix3<float> cell = cells.block(3u * j, 0u, 3u, 3u).transpose();
+        Eigen::MatrixX3<float> resid = spots * cell;
+        const Eigen::MatrixX3<float> miller = round(resid.array());
+        resid -= miller;
+        Eigen::VectorX<bool> below = (resid.rowwise().norm().array() < threshold);
+        return below.count();
+    }
+
+    // Threshold after n contractions, computed like the refinement loop
+    float contracted (float threshold, float contraction, unsigned n)
+    {
+        for (unsigned i=0u; i<n; i++)
+            threshold *= contraction;
+        return threshold;
+    }
+
+    template <typename refiner, typename config>
+    struct refine_run final {
+        Eigen::MatrixX3<float> cells;
+        Eigen::VectorX<float> scores;
+        refine_stats<float> stats[n_cells];
+        unsigned long long iterations;      // increase of the refinement iterations counter
+
+        refine_run (frame& f, float threshold, const config& cfg, const std::string& method, unsigned nblocks=1u)
+            : cells{f.cells}, scores{make_scores(threshold)}
+        {
+            metrics::counter& counter = metrics::get_counter("ffbidx_refine_iterations_total{method=\"" + method + "\"}", "");
+            const unsigned long long before = counter.value();
+            for (unsigned block=0u; block<nblocks; block++)
+                refiner::refine(f.spots, cells, scores, cfg, block, nblocks, stats);
+            iterations = counter.value() - before;
+        }
+    };
+
+    template <typename refiner, typename config>
+    void check_method (frame& f, const std::string& method)
+    {
+        constexpr float t0 = .3125f;    // initial threshold, exact as sub score of -n_spots + t0
+        config cfg{};
+
+        // iteration budget used up
+        cfg.threshold_contraction = .8f;
+        cfg.min_spots = 6u;
+        cfg.max_iter = 5u;
+        config before_last = cfg;
+        before_last.max_iter = cfg.max_iter - 1u;
+        {
+            refine_run<refiner, config> run{f, t0, cfg, method, 2u};
+            refine_run<refiner, config> prev{f, t0, before_last, method};
+            unsigned long long sum = 0u;
+            for (unsigned j=0u; j<n_cells; j++) {
+                const refine_stats<float>& s = run.stats[j];
+                if (s.exit != refine_exit::max_iter) {
+                    std::cerr << "Test failed: " << method << " cell " << j << ": exit " << refine::to_string(s.exit) << ", expected max_iter\n" << failure;
+                }
+                if (s.iterations != cfg.max_iter) {
+                    std::cerr << "Test failed: " << method << " cell " << j << ": " << s.iterations << " iterations, expected " << cfg.max_iter << '\n' << failure;
+                }
+                if (s.threshold != contracted(t0, cfg.threshold_contraction, cfg.max_iter - 1u)) {
+                    std::cerr << "Test failed: " << method << " cell " << j << ": threshold " << s.threshold << " is not the one of the last check\n" << failure;
+                }
+                const unsigned n = count_below(f.spots, prev.cells, j, s.threshold);
+                if (s.inliers != n) {
+                    std::cerr << "Test failed: " << method << " cell " << j << ": " << s.inliers << " inliers, last check had " << n << '\n' << failure;
+                }
+                sum += s.iterations;
+            }
+            if (run.iterations != sum) {
+                std::cerr << "Test failed: " << method << ": iterations counter increased by " << run.iterations << ", stats sum up to " << sum << '\n' << failure;
+            }
+        }
+
+        // too few spots within the contracting threshold
+        cfg.threshold_contraction = .7f;
+        cfg.min_spots = 150u;
+        cfg.max_iter = 30u;
+        {
+            refine_run<refiner, config> run{f, t0, cfg, method};
+            unsigned long long sum = 0u;
+            for (unsigned j=0u; j<n_cells; j++) {
+                const refine_stats<float>& s = run.stats[j];
+                if (s.exit != refine_exit::min_spots) {
+                    std::cerr << "Test failed: " << method << " cell " << j << ": exit " << refine::to_string(s.exit) << ", expected min_spots\n" << failure;
+                }
+                if ((s.iterations == 0u) || (s.iterations >= cfg.max_iter)) {
+                    std::cerr << "Test failed: " << method << " cell " << j << ": " << s.iterations << " iterations, expected 0 < iterations < " << cfg.max_iter << '\n' << failure;
+                }
+                if (s.threshold != contracted(t0, cfg.threshold_contraction, s.iterations)) {
+                    std::cerr << "Test failed: " << method << " cell " << j << ": threshold " << s.threshold << " is not the one of the last check\n" << failure;
+                }
+                const unsigned n = count_below(f.spots, run.cells, j, s.threshold);
+                if ((s.inliers >= cfg.min_spots) || (s.inliers != n)) {
+                    std::cerr << "Test failed: " << method << " cell " << j << ": " << s.inliers << " inliers, last check had " << n << ", min_spots " << cfg.min_spots << '\n' << failure;
+                }
+                sum += s.iterations;
+            }
+            if (run.iterations != sum) {
+                std::cerr << "Test failed: " << method << ": iterations counter increased by " << run.iterations << ", stats sum up to " << sum << '\n' << failure;
+            }
+        }
+
+        // no stats gives the same cells and scores
+        {
+            refine_run<refiner, config> run{f, t0, cfg, method};
+            Eigen::MatrixX3<float> cells = f.cells;
+            Eigen::VectorX<float> scores = make_scores(t0);
+            refiner::refine(f.spots, cells, scores, cfg);
+            if ((cells != run.cells) || (scores != run.scores)) {
+                std::cerr << "Test failed: " << method << ": refinement without stats differs\n" << failure;
+            }
+        }
+    }
+
+} // namespace
+
+int main (int, char**)
+{
+    try {
+        std::mt19937 gen{42u};
+        frame f = make_frame(gen);
+        check_method<refine::indexer_ifss<float>, refine::config_ifss<float>>(f, "ifss");
+        check_method<refine::indexer_ifse<float>, refine::config_ifse<float>>(f, "ifse");
+    } catch (std::exception& ex) {
+        std::cerr << "Test failed: " << ex.what() << '\n' << failure;
+    }
+
+    std::cout << "Test OK.\n" << success;
+}
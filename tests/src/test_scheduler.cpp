@@ -0,0 +1,143 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "ffbidx/scheduler.h"
+
+namespace {
+
+    constexpr struct success_type final {} success;
+    constexpr struct failure_type final {} failure;
+
+    template <typename stream>
+    [[noreturn]] stream& operator<< (stream& out, [[maybe_unused]] const success_type& data)
+    {
+        out.flush();
+        std::exit((EXIT_SUCCESS));
+    }
+
+    template <typename stream>
+    [[noreturn]] stream& operator<< (stream& out, [[maybe_unused]] const failure_type& data)
+    {
+        out.flush();
+        std::exit((EXIT_FAILURE));
+    }
+
+    using scheduler_t = fast_feedback::scheduler::work_stealing;
+
+    constexpr unsigned n_workers = 4u;      // number of worker threads
+    constexpr unsigned n_items = 1000u;     // number of work items
+    constexpr unsigned n_steps = 5u;        // number of steps per work item
+
+} // namespace
+
+int main (int, char**)
+{
+    try {
+        {   // urgent items first, earliest deadline first, then in push order
+            scheduler_t s{1u};
+            const auto now = scheduler_t::clock::now();
+            s.push(0, 0u);
+            s.push(1);
+            s.push_urgent(2);
+            s.push_urgent(3, now + std::chrono::milliseconds(20));
+            s.push_urgent(4, now + std::chrono::milliseconds(10));
+            s.push_urgent(5);
+            for (int expected : {4, 3, 2, 5, 0, 1}) {
+                int item = s.try_pop(0u);
+                if (item != expected)
+                    std::cerr << "Test failed: urgent order, got item " << item << " instead of " << expected << '\n' << failure;
+            }
+        }
+
+        scheduler_t sched{n_workers};
+        std::vector<std::atomic_uint> steps(n_items);   // steps done per work item
+        std::atomic_uint finished{0u};                  // number of finished work items
+        std::atomic_uint unparked{0u};                  // number of workers that returned from pop()
+
+        for (auto& s : steps)
+            s.store(0u);
+
+        std::vector<std::thread> workers;
+        for (unsigned id=0u; id<n_workers; id++) {
+            workers.emplace_back([&, id]() {
+                do {
+                    int item = sched.pop(id);
+                    if (item == scheduler_t::free)
+                        break;
+                    if (steps[item].fetch_add(1u) + 1u < n_steps) {
+                        if (item % 7 == 0)
+                            sched.push_urgent(item);// continue before other items
+                        else if (item % 2)
+                            sched.push(item, id);   // continue on this worker
+                        else
+                            sched.push(item);       // continue on any worker
+                    } else if (finished.fetch_add(1u) + 1u == n_items) {
+                        sched.stop();
+                    }
+                } while (true);
+                unparked.fetch_add(1u);
+            });
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50)); // workers park
+        if (unparked.load() != 0u)
+            std::cerr << "Test failed: worker returned without items\n" << failure;
+
+        for (unsigned i=0u; i<n_items; i++) {
+            if (i % 3)
+                sched.push(i, i % n_workers);
+            else
+                sched.push(i);
+        }
+
+        for (auto& t : workers)
+            t.join();
+
+        if (finished.load() != n_items)
+            std::cerr << "Test failed: finished " << finished.load() << " out of " << n_items << " items\n" << failure;
+        for (unsigned i=0u; i<n_items; i++) {
+            if (steps[i].load() != n_steps)
+                std::cerr << "Test failed: item " << i << " progressed " << steps[i].load() << " steps instead of " << n_steps << '\n' << failure;
+        }
+        if (sched.try_pop(0u) != scheduler_t::free)
+            std::cerr << "Test failed: items left in scheduler\n" << failure;
+        for (unsigned id=0u; id<n_workers; id++) {
+            if ((sched.parks(id) == 0u) || (sched.parked(id) <= scheduler_t::clock::duration::zero()))
+                std::cerr << "Test failed: worker " << id << " parked " << sched.parks(id) << " times for "
+                          << std::chrono::duration<double>{sched.parked(id)}.count() << "s\n" << failure;
+        }
+
+    } catch (std::exception& ex) {
+        std::cerr << "Test failed: " << ex.what() << '\n' << failure;
+    }
+
+    std::cout << "Test OK.\n" << success;
+}
@@ -0,0 +1,167 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#include <cstdlib>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include "ffbidx/simple_data_generator.h"
+
+namespace {
+
+    constexpr struct success_type final {} success;
+    constexpr struct failure_type final {} failure;
+
+    template <typename stream>
+    [[noreturn]] stream& operator<< (stream& out, [[maybe_unused]] const success_type& data)
+    {
+        out.flush();
+        std::exit((EXIT_SUCCESS));
+    }
+
+    template <typename stream>
+    [[noreturn]] stream& operator<< (stream& out, [[maybe_unused]] const failure_type& data)
+    {
+        out.flush();
+        std::exit((EXIT_FAILURE));
+    }
+
+    using float_type = float;
+    using frame_type = simple_data::generated_frame<float_type, simple_data::raise>;
+
+    // distance of the spot to the closest lattice point in miller index units
+    float_type lattice_distance (const Coord<float_type>& s, const std::array<Coord<float_type>, 3>& cell)
+    {
+        float_type d2 = .0f;
+        for (const auto& v : cell) {
+            const float_type h = s.x * v.x + s.y * v.y + s.z * v.z;
+            d2 += (h - std::round(h)) * (h - std::round(h));
+        }
+        return std::sqrt(d2);
+    }
+
+    float_type length (const Coord<float_type>& s)
+    {
+        return std::sqrt(s.x * s.x + s.y * s.y + s.z * s.z);
+    }
+
+} // namespace
+
+int main ()
+{
+    try {
+        simple_data::generator_config<float_type> conf{};
+        conf.cell = {Coord<float_type>{30.f, .0f, .0f}, Coord<float_type>{.0f, 40.f, .0f}, Coord<float_type>{5.f, .0f, 50.f}};
+        conf.n_spots = 1000u;
+        conf.resolution = 2.f;
+        conf.outliers = .2f;
+        conf.n_lattices = 3u;
+        conf.missing = .3f;
+        conf.seed = 7u;
+
+        const frame_type frame = simple_data::generate<float_type, simple_data::raise>(conf);
+
+        if ((frame.data.spots.size() != conf.n_spots) || (frame.spot_lattice.size() != conf.n_spots))
+            std::cerr << "Test failed: " << frame.data.spots.size() << " spots instead of " << conf.n_spots << '\n' << failure;
+        if ((frame.lattices.size() != conf.n_lattices) || (frame.rotations.size() != conf.n_lattices))
+            std::cerr << "Test failed: wrong number of lattices\n" << failure;
+
+        unsigned n_outliers = 0u;
+        for (unsigned i=0u; i<frame.data.spots.size(); i++) {
+            const auto& s = frame.data.spots[i];
+            const int l = frame.spot_lattice[i];
+            if (length(s) > 1.f / conf.resolution + 1e-5f)
+                std::cerr << "Test failed: spot " << i << " beyond resolution limit\n" << failure;
+            if (l < 0) {
+                n_outliers++;
+            } else if (lattice_distance(s, frame.lattices[l]) > 1e-3f) {
+                std::cerr << "Test failed: spot " << i << " is not on lattice " << l << '\n' << failure;
+            }
+        }
+        if (n_outliers != 200u)
+            std::cerr << "Test failed: " << n_outliers << " outliers instead of 200\n" << failure;
+
+        for (unsigned l=0u; l<conf.n_lattices; l++) {  // lattice = rotation * cell
+            const auto& r = frame.rotations[l];
+            for (unsigned i=0u; i<3u; i++) {
+                const auto& c = conf.cell[i];
+                const auto& v = frame.lattices[l][i];
+                const float_type d = std::abs(r[0]*c.x + r[1]*c.y + r[2]*c.z - v.x) +
+                                     std::abs(r[3]*c.x + r[4]*c.y + r[5]*c.z - v.y) +
+                                     std::abs(r[6]*c.x + r[7]*c.y + r[8]*c.z - v.z);
+                if (d > 1e-3f)
+                    std::cerr << "Test failed: lattice " << l << " vector " << i << " is not the rotated cell vector\n" << failure;
+            }
+        }
+
+        {   // same seed, same frame
+            const frame_type again = simple_data::generate<float_type, simple_data::raise>(conf);
+            for (unsigned i=0u; i<frame.data.spots.size(); i++) {
+                const auto& a = frame.data.spots[i];
+                const auto& b = again.data.spots[i];
+                if ((a.x != b.x) || (a.y != b.y) || (a.z != b.z))
+                    std::cerr << "Test failed: frame not reproducible from seed\n" << failure;
+            }
+        }
+
+        {   // all lattice points, fewer with missing reflections
+            conf.n_spots = 0u;
+            conf.n_lattices = 1u;
+            conf.missing = .0f;
+            const std::size_t n_all = simple_data::generate<float_type, simple_data::raise>(conf).data.spots.size();
+            conf.missing = .5f;
+            const std::size_t n_half = simple_data::generate<float_type, simple_data::raise>(conf).data.spots.size();
+            if ((n_all == 0u) || (n_half < .4 * n_all) || (n_half > .6 * n_all))
+                std::cerr << "Test failed: " << n_half << " of " << n_all << " lattice points with half missing\n" << failure;
+        }
+
+        {   // simple data format
+            std::ostringstream out;
+            simple_data::write(out, frame.data);
+            std::istringstream in{out.str()};
+            std::string line;
+            unsigned n_lines = 0u;
+            while (std::getline(in, line))
+                n_lines++;
+            if (n_lines != 1u + frame.data.spots.size())
+                std::cerr << "Test failed: " << n_lines << " lines written\n" << failure;
+        }
+
+        bool raised = false;
+        try {
+            conf.resolution = .0f;
+            simple_data::generate<float_type, simple_data::raise>(conf);
+        } catch (std::invalid_argument&) {
+            raised = true;
+        }
+        if (! raised)
+            std::cerr << "Test failed: no error for zero resolution\n" << failure;
+
+    } catch (std::exception& ex) {
+        std::cerr << "Test failed: " << ex.what() << '\n' << failure;
+    }
+
+    std::cout << "Test OK.\n" << success;
+}
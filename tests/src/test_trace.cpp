@@ -0,0 +1,160 @@
+/*
+Copyright 2022 Paul Scherrer Institute
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+
+------------------------
+
+Author: hans-christian.stadler@psi.ch
+*/
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ffbidx/trace.h"
+
+namespace {
+
+    constexpr struct success_type final {} success;
+    constexpr struct failure_type final {} failure;
+
+    template <typename stream>
+    [[noreturn]] stream& operator<< (stream& out, [[maybe_unused]] const success_type& data)
+    {
+        out.flush();
+        std::exit((EXIT_SUCCESS));
+    }
+
+    template <typename stream>
+    [[noreturn]] stream& operator<< (stream& out, [[maybe_unused]] const failure_type& data)
+    {
+        out.flush();
+        std::exit((EXIT_FAILURE));
+    }
+
+    namespace trace = fast_feedback::trace;
+
+    constexpr unsigned n_threads = 4u;                  // number of tracing threads
+    constexpr unsigned n_spans = trace::ring_size;      // spans per thread, overflows the ring buffer with the events
+    constexpr unsigned n_kept = trace::ring_size - 1u;  // dumped records of a full ring buffer, the slot at head might be in writing
+    constexpr unsigned n_short = 1000u;                 // number of short lived tracing threads
+
+    // count occurrences of pattern in str
+    std::size_t count (const std::string& str, const std::string& pattern)
+    {
+        std::size_t n = 0u;
+        for (auto pos = str.find(pattern); pos != std::string::npos; pos = str.find(pattern, pos + pattern.size()))
+            n++;
+        return n;
+    }
+
+} // namespace
+
+int main (int, char**)
+{
+    try {
+        if (trace::event_id("test_span") != trace::event_id("test_span"))
+            std::cerr << "Test failed: event id not unique\n" << failure;
+
+        {   // nothing is recorded while tracing is off
+            FF_TRACE_SPAN("test_off", 0u, 0u);
+        }
+
+        trace::enable();
+        std::atomic<unsigned> started{0u};
+        std::vector<std::thread> threads;
+        for (unsigned t=0u; t<n_threads; t++) {
+            threads.emplace_back([t, &started]() {
+                for (unsigned i=0u; i<n_spans; i++) {
+                    {
+                        FF_TRACE_FRAME(i);
+                        FF_TRACE_SPAN("test_span", trace::current_frame, t);
+                        FF_TRACE_EVENT("test_event", i, t);
+                    }
+                    if (i == 0u) {  // all threads own a ring buffer before the first one exits
+                        started.fetch_add(1u);
+                        while (started.load() < n_threads)
+                            std::this_thread::yield();
+                    }
+                }
+            });
+        }
+        std::ostringstream concurrent;
+        trace::dump(concurrent);    // dump while the threads are writing
+        for (auto& thread : threads)
+            thread.join();
+        trace::enable(false);
+
+        std::ostringstream oss;
+        trace::dump(oss);
+        const std::string json = oss.str();
+
+        if ((json.find("{\"displayTimeUnit\"") != 0u) || (json.find("\n]}\n") == std::string::npos))
+            std::cerr << "Test failed: trace is not a JSON object\n" << failure;
+        if (count(json, "\"name\": \"test_off\"") != 0u)
+            std::cerr << "Test failed: span recorded while tracing was off\n" << failure;
+        const auto n_records = count(json, "\"name\": \"test_");
+        if (n_records != n_threads * n_kept)
+            std::cerr << "Test failed: " << n_records << " records instead of " << n_threads * n_kept << '\n' << failure;
+        if (trace::dropped() != n_threads * (2u * n_spans - trace::ring_size))
+            std::cerr << "Test failed: " << trace::dropped() << " dropped records\n" << failure;
+        if (count(json, "\"ph\": \"X\"") != count(json, "\"ph\": \"i\"") + n_threads)  // the oldest record, an event, isn't dumped
+            std::cerr << "Test failed: wrong number of spans and events\n" << failure;
+        if (count(json, "\"args\": {\"frame\": " + std::to_string(n_spans - 1u) + ", ") != 2u * n_threads)
+            std::cerr << "Test failed: missing latest records\n" << failure;
+
+        {   // a new thread reuses a dumped ring buffer without changing the number of dropped records
+            const auto n_dropped = trace::dropped();
+            trace::enable();
+            std::thread([]() { FF_TRACE_EVENT("test_reuse", 0u, 0u); }).join();
+            trace::enable(false);
+            std::ostringstream reuse;
+            trace::dump(reuse);
+            if (trace::dropped() != n_dropped)
+                std::cerr << "Test failed: " << trace::dropped() << " dropped records after ring buffer reuse instead of " << n_dropped << '\n' << failure;
+            if (count(reuse.str(), "\"name\": \"test_") != (n_threads - 1u) * n_kept + 1u)
+                std::cerr << "Test failed: wrong number of records after ring buffer reuse\n" << failure;
+        }
+
+        {   // short lived threads reuse ring buffers, undumped records of reused ones count as dropped
+            const auto n_rings = trace::n_rings();
+            const auto n_dropped = trace::dropped();
+            trace::enable();
+            for (unsigned t=0u; t<n_short; t++)
+                std::thread([]() { FF_TRACE_EVENT("test_short", 0u, 0u); }).join();
+            trace::enable(false);
+            if (trace::n_rings() != n_rings)
+                std::cerr << "Test failed: " << trace::n_rings() << " ring buffers after " << n_short << " short lived threads instead of " << n_rings << '\n' << failure;
+            if (trace::dropped() != n_dropped + n_short - 1u)
+                std::cerr << "Test failed: " << trace::dropped() - n_dropped << " records of short lived threads dropped instead of " << n_short - 1u << '\n' << failure;
+            std::ostringstream short_lived;
+            trace::dump(short_lived);
+            if (count(short_lived.str(), "\"name\": \"test_short\"") != 1u)
+                std::cerr << "Test failed: not just the record of the last short lived thread dumped\n" << failure;
+        }
+
+    } catch (std::exception& ex) {
+        std::cerr << "Test failed: " << ex.what() << '\n' << failure;
+    }
+
+    std::cout << "Test OK.\n" << success;
+}